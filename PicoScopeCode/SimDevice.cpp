@@ -0,0 +1,2098 @@
+/*
+Simulated ps2000a device backend for the muon lifetime DAQ in Source.cpp
+
+Implements the subset of the ps2000a API the program uses so that it can be
+built and benchmarked without a physical 2206B attached. The simulated scope
+synthesizes scintillator/PMT pulses with Poisson arrival times, exponentially
+distributed muon decay delays, narrow noise spikes, Gaussian noise and an
+8-bit ADC, and holds each
+ps2000aGetValues call for a configurable USB transfer time. Every random draw
+is made from a seeded generator when a capture is armed, so the same seed
+always produces the same sequence of waveforms regardless of timing.
+With channel B enabled it stands for a second paddle stacked under the first:
+muons go through both, a decay shows up in one of them, and noise spikes and
+background singles only ever hit one, so an A AND B trigger ignores them.
+Streaming mode generates the same kind of signal continuously, paced by the
+wall clock; samples the program doesn't fetch before the overview buffer
+fills up are dropped and counted.
+
+Only compiled in when PS2000A_SIMULATED is defined, e.g. on Linux:
+	g++ -std=c++17 -O2 -pthread -DPS2000A_SIMULATED -I<dir with ps2000aApi.h> Source.cpp SimDevice.cpp
+or by adding PS2000A_SIMULATED to the preprocessor definitions of the Visual
+Studio project (and dropping ps2000a.lib from the linker inputs).
+
+The simulation is configured through environment variables (defaults in
+brackets):
+	PS2000A_SIM_SEED				seed for the random number generator [1]
+	PS2000A_SIM_RATE_HZ				rate of pulses crossing the bar [100]
+	PS2000A_SIM_DECAY_FRACTION		fraction of pulses followed by a decay pulse [0.1]
+	PS2000A_SIM_LIFETIME_NS			mean delay of the decay pulse [2197]
+	PS2000A_SIM_AMPLITUDE_MV		median height of a muon pulse [600]
+	PS2000A_SIM_DECAY_AMPLITUDE_MV	median height of a decay pulse [350]
+	PS2000A_SIM_AMPLITUDE_SPREAD	log-normal spread of the pulse heights [0.35]
+	PS2000A_SIM_POLARITY			-1 for downward (PMT) pulses, 1 for upward [-1]
+	PS2000A_SIM_RISE_NS				pulse rise time constant [4]
+	PS2000A_SIM_FALL_NS				pulse fall time constant [20]
+	PS2000A_SIM_NOISE_MV			RMS of the Gaussian noise [8]
+	PS2000A_SIM_SPIKE_RATE_HZ		rate of short noise spikes (pickup, PMT afterpulsing) [0]
+	PS2000A_SIM_SPIKE_AMPLITUDE_MV	median height of a noise spike [500]
+	PS2000A_SIM_SPIKE_NS			fall time constant of a noise spike, its rise is
+									4 times faster [2]
+	PS2000A_SIM_SINGLES_RATE_HZ		rate of full size pulses that only hit one paddle
+									(gammas, PMT dark counts) [0]
+	PS2000A_SIM_USB_LATENCY_US		fixed cost of every data transfer [150]
+	PS2000A_SIM_USB_MBPS			USB throughput in MB/s [25]
+	PS2000A_SIM_REALTIME			1 to wait out the Poisson arrival times, 0 to
+									trigger back-to-back (maximum load) [1]
+	PS2000A_SIM_UNITS				number of simulated scopes attached [1]
+*/
+#ifdef PS2000A_SIMULATED
+
+#ifdef _WIN32
+#define _USRDLL // define the API functions here rather than importing them from ps2000a.dll
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <cmath>
+#include <limits>
+#include <random>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include "ps2000aApi.h" // device-specific header, the simulation provides its functions
+#ifndef PICO_STATUS
+#include "PicoStatus.h"
+#endif
+
+#define		SIM_MAX_UNITS			8 // most simulated scopes that can be attached at once
+#define		SIM_CHANNELS			2 // the 2206B is a two channel scope
+#define		SIM_MEMORY_SAMPLES		33554432 // 2^25 samples of capture memory, shared by the enabled channels and segments
+#define		SIM_MAX_SEGMENTS		32768 // most memory segments ps2000aMemorySegments will accept
+#define		SIM_RATIO_MODES			4 // NONE, AGGREGATE, DECIMATE, AVERAGE each get their own buffer registration
+#define		SIM_ADC_STEP			256 // 8-bit ADC, so the 16-bit counts returned move in steps of 256
+#define		SIM_NOISE_TABLE_SIZE	65536 // precomputed unit-variance noise, must be a power of 2
+#define		SIM_PULSE_LENGTH		12.0 // fall time constants after which a pulse is treated as over
+
+#define		SIM_STATE_IDLE			0 // nothing running
+#define		SIM_STATE_ARMED			1 // waiting for triggers/ capturing
+#define		SIM_STATE_READY			2 // captures complete, data available
+#define		SIM_STATE_STREAMING		3 // ps2000aRunStreaming called, handing out data as it is requested
+
+typedef int32_t SIM_BOOL;
+
+// voltage ranges in mV, indexed by PS2000A_RANGE (same table as inputRanges in Source.cpp)
+static const uint16_t simInputRanges[PS2000A_MAX_RANGES] = { 10, 20, 50, 100, 200, 500, 1000, 2000, 5000, 10000, 20000, 50000 };
+
+typedef struct tSimConfig
+{
+	uint64_t seed;
+	double rateHz;
+	double decayFraction;
+	double lifetimeNs;
+	double amplitudeMv;
+	double decayAmplitudeMv;
+	double amplitudeSpread;
+	int32_t polarity;
+	double riseNs;
+	double fallNs;
+	double noiseMv;
+	double spikeRateHz;
+	double spikeAmplitudeMv;
+	double spikeRiseNs;
+	double spikeFallNs;
+	double singlesRateHz;
+	double usbLatencyUs;
+	double usbMBps;
+	SIM_BOOL realtime;
+	int16_t units;
+}SIM_CONFIG;
+
+typedef struct tSimPulse
+{
+	double onsetNs; // start of the pulse relative to the trigger point
+	double amplitudeMv; // height of the pulse, sign given by the configured polarity
+	int16_t channel;
+	SIM_BOOL spike; // a narrow noise spike rather than a scintillator pulse
+}SIM_PULSE;
+
+typedef struct tSimCapture
+{
+	std::vector<SIM_PULSE> pulses; // every pulse that falls inside the capture window
+	double waitNs; // time between arming (or the previous capture) and this trigger
+	double phaseNs; // position of the threshold crossing between two samples
+	uint32_t noiseOffset; // where in the noise table this capture starts
+	SIM_BOOL decay; // whether the triggering muon decays inside the bar
+	SIM_BOOL valid; // capture complete and ready to be read
+}SIM_CAPTURE;
+
+typedef struct tSimBuffer
+{
+	int16_t* bufferMax; // non-aggregated values, or the maxima when aggregating
+	int16_t* bufferMin; // minima when aggregating
+	int32_t bufferLth;
+}SIM_BUFFER;
+
+typedef struct tSimUnit
+{
+	int16_t handle;
+	SIM_BOOL open;
+	char serial[16];
+	SIM_CONFIG config;
+	std::mt19937_64 rng;
+	std::vector<float> noise; // unit variance Gaussian noise table
+	std::vector<float> scratch; // full resolution render target for GetValues
+
+	// channel and trigger setup
+	int16_t enabled[SIM_CHANNELS];
+	int16_t range[SIM_CHANNELS];
+	std::vector<PS2000A_TRIGGER_CHANNEL_PROPERTIES> triggerProperties;
+	std::vector<PS2000A_TRIGGER_CONDITIONS> triggerConditions;
+	PS2000A_THRESHOLD_DIRECTION triggerDirections[SIM_CHANNELS];
+	int32_t autoTriggerMs;
+	std::vector<PS2000A_PWQ_CONDITIONS> pwqConditions; // empty if the pulse width qualifier is off
+	uint32_t pwqLower; // in sample periods
+	uint32_t pwqUpper;
+	PS2000A_PULSE_WIDTH_TYPE pwqType;
+
+	// memory layout and registered buffers
+	uint32_t nSegments;
+	uint32_t nCaptures;
+	std::vector<SIM_CAPTURE> captures; // one per segment
+	std::vector<SIM_BUFFER> buffers[SIM_CHANNELS][SIM_RATIO_MODES]; // [channel][ratio mode][segment]
+
+	// run state, shared with the worker thread
+	std::mutex lock;
+	std::condition_variable cv;
+	std::thread worker;
+	int32_t state;
+	SIM_BOOL cancel;
+	SIM_BOOL quit;
+	SIM_BOOL inCallback;
+	uint32_t timebase;
+	int32_t preTrigger;
+	int32_t postTrigger;
+	uint32_t firstSegment;
+	uint32_t runCaptures;
+	uint32_t capturesDone;
+	ps2000aBlockReady lpReady;
+	void* pParameter;
+
+	// streaming, pulse times are counted from the start of streaming
+	uint32_t overviewSize; // most samples handed out per ps2000aGetStreamingLatestValues call
+	uint32_t streamWrite; // where the next chunk goes in the registered buffers
+	uint64_t streamSamples; // samples generated so far (delivered or dropped)
+	double streamNextNs; // arrival time of the next pulse
+	std::vector<SIM_PULSE> streamPulses; // pulses that still reach into samples not generated yet
+	SIM_CAPTURE streamChunk; // the pulses of the chunk being rendered, relative to its first sample
+	std::chrono::steady_clock::time_point streamStart;
+
+	// statistics reported when the unit is closed
+	uint64_t statCaptures;
+	uint64_t statDecays;
+	uint64_t statBytes;
+	uint64_t statStreamed;
+	uint64_t statDropped;
+	uint64_t statRejected; // triggers the pulse width qualifier turned down
+	uint64_t statSingles; // pulses past the threshold on only some of the channels an AND trigger needs
+	std::chrono::steady_clock::time_point openTime;
+}SIM_UNIT;
+
+static std::mutex g_simlock; // guards g_simunits while units are opened/ closed
+static SIM_UNIT* g_simunits[SIM_MAX_UNITS] = { NULL }; // index is handle - 1
+
+/****************************************************************************
+* SimGetEnv
+*
+* - Reads a numeric setting from the environment, falling back to a default
+*
+* Parameters
+* - name : name of the environment variable
+* - fallback : value to use if the variable isn't set or isn't a number
+*
+* Returns
+* - double : the value of the setting
+****************************************************************************/
+static double SimGetEnv(const char* name, double fallback)
+{
+	double value = fallback;
+	char* end = NULL;
+#ifdef _WIN32
+	char* text = NULL;
+	size_t length = 0;
+
+	if (_dupenv_s(&text, &length, name) == 0 && text != NULL)
+	{
+		value = strtod(text, &end);
+		if (end == text)
+		{
+			value = fallback;
+		}
+		free(text);
+	}
+#else
+	const char* text = getenv(name);
+
+	if (text != NULL)
+	{
+		value = strtod(text, &end);
+		if (end == text)
+		{
+			value = fallback;
+		}
+	}
+#endif
+	return value;
+}
+
+/****************************************************************************
+* SimConfigLoad
+*
+* - Fills a SIM_CONFIG struct from the PS2000A_SIM_* environment variables
+* (see the top of this file for the list and their defaults)
+*
+* Parameters
+* - config : pointer to the SIM_CONFIG struct to fill
+*
+* Returns
+* - none
+****************************************************************************/
+static void SimConfigLoad(SIM_CONFIG* config)
+{
+	config->seed = (uint64_t)SimGetEnv("PS2000A_SIM_SEED", 1);
+	config->rateHz = SimGetEnv("PS2000A_SIM_RATE_HZ", 100.0);
+	config->decayFraction = SimGetEnv("PS2000A_SIM_DECAY_FRACTION", 0.1);
+	config->lifetimeNs = SimGetEnv("PS2000A_SIM_LIFETIME_NS", 2197.0);
+	config->amplitudeMv = SimGetEnv("PS2000A_SIM_AMPLITUDE_MV", 600.0);
+	config->decayAmplitudeMv = SimGetEnv("PS2000A_SIM_DECAY_AMPLITUDE_MV", 350.0);
+	config->amplitudeSpread = SimGetEnv("PS2000A_SIM_AMPLITUDE_SPREAD", 0.35);
+	config->polarity = (SimGetEnv("PS2000A_SIM_POLARITY", -1) < 0) ? -1 : 1;
+	config->riseNs = SimGetEnv("PS2000A_SIM_RISE_NS", 4.0);
+	config->fallNs = SimGetEnv("PS2000A_SIM_FALL_NS", 20.0);
+	config->noiseMv = SimGetEnv("PS2000A_SIM_NOISE_MV", 8.0);
+	config->spikeRateHz = SimGetEnv("PS2000A_SIM_SPIKE_RATE_HZ", 0.0);
+	config->spikeAmplitudeMv = SimGetEnv("PS2000A_SIM_SPIKE_AMPLITUDE_MV", 500.0);
+	config->spikeFallNs = SimGetEnv("PS2000A_SIM_SPIKE_NS", 2.0);
+	config->singlesRateHz = SimGetEnv("PS2000A_SIM_SINGLES_RATE_HZ", 0.0);
+	config->usbLatencyUs = SimGetEnv("PS2000A_SIM_USB_LATENCY_US", 150.0);
+	config->usbMBps = SimGetEnv("PS2000A_SIM_USB_MBPS", 25.0);
+	config->realtime = (SimGetEnv("PS2000A_SIM_REALTIME", 1) != 0);
+	config->units = (int16_t)SimGetEnv("PS2000A_SIM_UNITS", 1);
+
+	// keep the pulse shape well defined (rise has to be faster than the fall)
+	if (config->riseNs <= 0.0)
+	{
+		config->riseNs = 0.5;
+	}
+	if (config->fallNs <= config->riseNs)
+	{
+		config->fallNs = 2.0 * config->riseNs;
+	}
+	if (config->spikeFallNs <= 0.0)
+	{
+		config->spikeFallNs = 2.0;
+	}
+	config->spikeRiseNs = config->spikeFallNs / 4.0;
+	if (config->spikeRateHz < 0.0)
+	{
+		config->spikeRateHz = 0.0;
+	}
+	if (config->singlesRateHz < 0.0)
+	{
+		config->singlesRateHz = 0.0;
+	}
+	if (config->units < 1 || config->units > SIM_MAX_UNITS)
+	{
+		config->units = 1;
+	}
+}
+
+/****************************************************************************
+* SimGetUnit
+*
+* - Looks up the simulated unit belonging to a handle
+*
+* Parameters
+* - handle : device identifier returned by ps2000aOpenUnit
+*
+* Returns
+* - SIM_UNIT* : the unit, or NULL if the handle isn't open
+****************************************************************************/
+static SIM_UNIT* SimGetUnit(int16_t handle)
+{
+	std::lock_guard<std::mutex> guard(g_simlock);
+
+	if (handle < 1 || handle > SIM_MAX_UNITS || g_simunits[handle - 1] == NULL || !g_simunits[handle - 1]->open)
+	{
+		return NULL;
+	}
+	return g_simunits[handle - 1];
+}
+
+/****************************************************************************
+* SimIntervalNs
+*
+* - Sample interval of a timebase on a 500 MS/s 2000 series scope (see the
+* timebase section of the programmer's guide)
+*
+* Parameters
+* - timebase : timebase index
+*
+* Returns
+* - double : sample interval in ns
+****************************************************************************/
+static double SimIntervalNs(uint32_t timebase)
+{
+	if (timebase < 3)
+	{
+		return 2.0 * (double)(1 << timebase);
+	}
+	return 16.0 * (double)(timebase - 2);
+}
+
+/****************************************************************************
+* SimEnabledChannels
+*
+* - Counts the channels enabled by ps2000aSetChannel
+*
+* Parameters
+* - unit : the simulated unit
+*
+* Returns
+* - int16_t : number of enabled channels
+****************************************************************************/
+static int16_t SimEnabledChannels(SIM_UNIT* unit)
+{
+	int16_t count = 0;
+
+	for (int16_t i = 0; i < SIM_CHANNELS; i++)
+	{
+		count += unit->enabled[i] ? 1 : 0;
+	}
+	return count;
+}
+
+/****************************************************************************
+* SimMaxSamples
+*
+* - Samples available to each enabled channel in one memory segment
+*
+* Parameters
+* - unit : the simulated unit
+*
+* Returns
+* - int32_t : samples per channel per segment
+****************************************************************************/
+static int32_t SimMaxSamples(SIM_UNIT* unit)
+{
+	int16_t channels = SimEnabledChannels(unit);
+
+	return (int32_t)(SIM_MEMORY_SAMPLES / unit->nSegments / ((channels > 1) ? channels : 1));
+}
+
+/****************************************************************************
+* SimRatioSlot
+*
+* - Maps a PS2000A_RATIO_MODE onto the index of its buffer registrations
+*
+* Parameters
+* - mode : downsampling mode
+*
+* Returns
+* - int32_t : slot index, -1 if the mode isn't supported
+****************************************************************************/
+static int32_t SimRatioSlot(PS2000A_RATIO_MODE mode)
+{
+	switch (mode)
+	{
+	case PS2000A_RATIO_MODE_NONE:
+		return 0;
+	case PS2000A_RATIO_MODE_AGGREGATE:
+		return 1;
+	case PS2000A_RATIO_MODE_DECIMATE:
+		return 2;
+	case PS2000A_RATIO_MODE_AVERAGE:
+		return 3;
+	default:
+		return -1;
+	}
+}
+
+/****************************************************************************
+* SimPulseShape
+*
+* - Normalized scintillator/PMT pulse: difference of two exponentials with a
+* peak height of 1
+*
+* Parameters
+* - config : simulation settings holding the rise and fall time constants
+* - spike : use the (much shorter) time constants of a noise spike instead
+* - t : time since the pulse onset in ns
+*
+* Returns
+* - double : pulse height at time t, between 0 and 1
+****************************************************************************/
+static double SimPulseShape(const SIM_CONFIG* config, SIM_BOOL spike, double t)
+{
+	double rise = spike ? config->spikeRiseNs : config->riseNs;
+	double fall = spike ? config->spikeFallNs : config->fallNs;
+	double peak = std::log(fall / rise) * fall * rise / (fall - rise); // time of the maximum
+	double norm = std::exp(-peak / fall) - std::exp(-peak / rise);
+
+	if (t <= 0.0)
+	{
+		return 0.0;
+	}
+	return (std::exp(-t / fall) - std::exp(-t / rise)) / norm;
+}
+
+/****************************************************************************
+* SimCrossingTime
+*
+* - Finds how long after its onset a pulse crosses the trigger threshold on
+* its leading edge, or crosses back on its trailing edge
+*
+* Parameters
+* - config : simulation settings
+* - spike : whether the pulse is a noise spike
+* - amplitudeMv : pulse height (magnitude)
+* - thresholdMv : trigger threshold (magnitude)
+* - trailing : find the crossing on the trailing edge instead
+*
+* Returns
+* - double : time after the onset in ns, negative if the pulse never crosses
+****************************************************************************/
+static double SimCrossingTime(const SIM_CONFIG* config, SIM_BOOL spike, double amplitudeMv, double thresholdMv, SIM_BOOL trailing)
+{
+	double rise = spike ? config->spikeRiseNs : config->riseNs;
+	double fall = spike ? config->spikeFallNs : config->fallNs;
+	double peak = std::log(fall / rise) * fall * rise / (fall - rise);
+	double low = trailing ? peak : 0.0; // low is always on the side of the edge below the threshold...
+	double high = trailing ? SIM_PULSE_LENGTH * fall : peak; // ...and high on the side above it
+
+	if (amplitudeMv < thresholdMv)
+	{
+		return -1.0;
+	}
+	for (int32_t i = 0; i < 40; i++) // bisection on the (monotonic) edge
+	{
+		double mid = 0.5 * (low + high);
+		if ((amplitudeMv * SimPulseShape(config, spike, mid) < thresholdMv) != (trailing != 0))
+		{
+			low = mid;
+		}
+		else
+		{
+			high = mid;
+		}
+	}
+	return trailing ? low : high;
+}
+
+/****************************************************************************
+* SimPwqUsed
+*
+* - Checks whether the trigger goes through the pulse width qualifier: it
+* has to be set up and the trigger conditions have to ask for it
+*
+* Parameters
+* - unit : the simulated unit
+*
+* Returns
+* - SIM_BOOL : 1 if the qualifier is in use, 0 if not
+****************************************************************************/
+static SIM_BOOL SimPwqUsed(SIM_UNIT* unit)
+{
+	SIM_BOOL used = 0;
+
+	for (size_t c = 0; c < unit->triggerConditions.size(); c++)
+	{
+		used |= (unit->triggerConditions[c].pulseWidthQualifier == PS2000A_CONDITION_TRUE);
+	}
+	return used && !unit->pwqConditions.empty();
+}
+
+/****************************************************************************
+* SimPwqPasses
+*
+* - Checks a pulse against the pulse width qualifier
+* - The width is how long the pulse stays past the threshold, which is also
+* what the scope's pulse width counter measures
+*
+* Parameters
+* - unit : the simulated unit
+* - widthNs : width of the pulse past the threshold
+*
+* Returns
+* - SIM_BOOL : 1 if the pulse qualifies, 0 if not
+****************************************************************************/
+static SIM_BOOL SimPwqPasses(SIM_UNIT* unit, double widthNs)
+{
+	double samples = widthNs / SimIntervalNs(unit->timebase);
+
+	switch (unit->pwqType)
+	{
+	case PS2000A_PW_TYPE_LESS_THAN: return samples < unit->pwqLower;
+	case PS2000A_PW_TYPE_GREATER_THAN: return samples > unit->pwqLower;
+	case PS2000A_PW_TYPE_IN_RANGE: return samples > unit->pwqLower && samples < unit->pwqUpper;
+	case PS2000A_PW_TYPE_OUT_OF_RANGE: return samples < unit->pwqLower || samples > unit->pwqUpper;
+	default: return 1;
+	}
+}
+
+/****************************************************************************
+* SimDrawAmplitude
+*
+* - Draws a log-normally distributed pulse height
+*
+* Parameters
+* - unit : the simulated unit (for its generator and spread)
+* - medianMv : median pulse height
+*
+* Returns
+* - double : pulse height in mV (magnitude)
+****************************************************************************/
+static double SimDrawAmplitude(SIM_UNIT* unit, double medianMv)
+{
+	std::normal_distribution<double> gauss(0.0, 1.0);
+
+	return medianMv * std::exp(unit->config.amplitudeSpread * gauss(unit->rng));
+}
+
+/****************************************************************************
+* SimTriggerSource
+*
+* - Works out which channels the trigger conditions fire on and at what
+* level: every channel set to TRUE in the first condition that has any (the
+* conditions inside one struct are ANDed together)
+*
+* Parameters
+* - unit : the simulated unit
+* - thresholdMv : on exit, magnitude of each channel's trigger threshold in mV
+*
+* Returns
+* - int16_t : the trigger channels, bit 0 for channel A, 0 if triggering is
+* switched off
+****************************************************************************/
+static int16_t SimTriggerSource(SIM_UNIT* unit, double thresholdMv[SIM_CHANNELS])
+{
+	for (size_t c = 0; c < unit->triggerConditions.size(); c++)
+	{
+		const PS2000A_TRIGGER_CONDITIONS* condition = &unit->triggerConditions[c];
+		int16_t channels = ((condition->channelA == PS2000A_CONDITION_TRUE) ? (1 << PS2000A_CHANNEL_A) : 0) |
+			((condition->channelB == PS2000A_CONDITION_TRUE) ? (1 << PS2000A_CHANNEL_B) : 0);
+
+		if (channels == 0)
+		{
+			continue;
+		}
+		for (int16_t channel = 0; channel < SIM_CHANNELS; channel++)
+		{
+			thresholdMv[channel] = 0.0;
+			for (size_t p = 0; p < unit->triggerProperties.size(); p++)
+			{
+				if (unit->triggerProperties[p].channel == channel)
+				{
+					double adc = (unit->config.polarity < 0) ? unit->triggerProperties[p].thresholdLower : unit->triggerProperties[p].thresholdUpper;
+					// the trigger compares ADC counts, so the signal has to get far enough for the ADC to read
+					// the first step at or past the threshold
+					double steps = std::ceil(std::fabs(adc) / SIM_ADC_STEP);
+					thresholdMv[channel] = (steps - 0.5) * SIM_ADC_STEP * simInputRanges[unit->range[channel]] / PS2000A_MAX_VALUE;
+				}
+			}
+		}
+		return channels;
+	}
+	return 0;
+}
+
+/****************************************************************************
+* SimPickChannel
+*
+* - Picks the paddle a pulse that only hits one of them lands in: channel A,
+* or either one with equal odds if channel B is enabled too
+*
+* Parameters
+* - unit : the simulated unit
+*
+* Returns
+* - int16_t : the channel
+****************************************************************************/
+static int16_t SimPickChannel(SIM_UNIT* unit)
+{
+	std::uniform_int_distribution<int16_t> pick(PS2000A_CHANNEL_A, PS2000A_CHANNEL_B);
+
+	// no draw with channel B off, so single channel runs see the same sequence as before it existed
+	return unit->enabled[PS2000A_CHANNEL_B] ? pick(unit->rng) : (int16_t)PS2000A_CHANNEL_A;
+}
+
+/****************************************************************************
+* SimPlanCapture
+*
+* - Draws everything about the next capture: the wait until a pulse crosses
+* the trigger threshold, the triggering pulse, an optional decay pulse, any
+* accidental pulses inside the window and where the noise starts
+*
+* Parameters
+* - unit : the simulated unit
+* - capture : the capture to fill in
+*
+* Returns
+* - none
+****************************************************************************/
+static void SimPlanCapture(SIM_UNIT* unit, SIM_CAPTURE* capture)
+{
+	const SIM_CONFIG* config = &unit->config;
+	std::uniform_real_distribution<double> uniform(0.0, 1.0);
+	double intervalNs = SimIntervalNs(unit->timebase);
+	double windowStartNs = -unit->preTrigger * intervalNs;
+	double windowNs = (unit->preTrigger + unit->postTrigger) * intervalNs;
+	double thresholdMv[SIM_CHANNELS] = { 0.0 };
+	int16_t sources = SimTriggerSource(unit, thresholdMv);
+	int16_t first = (sources & (1 << PS2000A_CHANNEL_B)) && !(sources & (1 << PS2000A_CHANNEL_A)) ? PS2000A_CHANNEL_B : PS2000A_CHANNEL_A; // the pulse width qualifier watches this one
+	int16_t paddles = (1 << PS2000A_CHANNEL_A) | (unit->enabled[PS2000A_CHANNEL_B] ? (1 << PS2000A_CHANNEL_B) : 0); // a muon goes through all of them
+	double totalHz = config->rateHz + config->spikeRateHz + config->singlesRateHz; // muons, noise spikes and singles all arrive at random
+	double meanGapNs = (totalHz > 0.0) ? 1e9 / totalHz : 0.0;
+	double autoNs = (unit->autoTriggerMs > 0) ? unit->autoTriggerMs * 1e6 : 0.0;
+	SIM_PULSE pulse;
+
+	pulse.spike = 0;
+	capture->pulses.clear();
+	capture->waitNs = 0.0;
+	capture->phaseNs = uniform(unit->rng) * intervalNs;
+	capture->noiseOffset = (uint32_t)(unit->rng() & (SIM_NOISE_TABLE_SIZE - 1));
+	capture->decay = 0;
+	capture->valid = 0;
+
+	// wait for a pulse big enough to trigger, smaller ones go by unseen
+	if (sources != 0 && meanGapNs > 0.0)
+	{
+		for (;;)
+		{
+			double amplitude[SIM_CHANNELS] = { 0.0 };
+			double crossing = 0.0;
+			double trailing;
+			double kind;
+			int16_t hit; // channels the pulse shows up on
+			int16_t crossed = 0; // trigger channels it gets past the threshold on
+			int16_t only;
+			SIM_BOOL spike;
+			SIM_BOOL single;
+
+			capture->waitNs += -meanGapNs * std::log(1.0 - uniform(unit->rng));
+			kind = (config->spikeRateHz > 0.0 || config->singlesRateHz > 0.0) ? uniform(unit->rng) * totalHz : totalHz;
+			spike = (kind < config->spikeRateHz);
+			single = (!spike && kind < config->spikeRateHz + config->singlesRateHz);
+			only = (spike || single) ? SimPickChannel(unit) : -1; // muons go through every paddle, the rest only hit one
+			for (int16_t channel = 0; channel < SIM_CHANNELS; channel++)
+			{
+				if ((only < 0) ? !(paddles & (1 << channel)) : (channel != only))
+				{
+					continue;
+				}
+				amplitude[channel] = SimDrawAmplitude(unit, spike ? config->spikeAmplitudeMv : config->amplitudeMv);
+			}
+			if (autoNs > 0.0 && capture->waitNs > autoNs) // auto trigger fires first, nothing in the window
+			{
+				capture->waitNs = autoNs;
+				break;
+			}
+			// an AND trigger goes off once the last of its channels gets past the threshold
+			hit = 0;
+			for (int16_t channel = 0; channel < SIM_CHANNELS; channel++)
+			{
+				double time = (amplitude[channel] > 0.0) ? SimCrossingTime(config, spike, amplitude[channel], thresholdMv[channel], 0) : -1.0;
+
+				hit |= (amplitude[channel] > 0.0) ? (1 << channel) : 0;
+				if ((sources & (1 << channel)) && time >= 0.0)
+				{
+					crossed |= (1 << channel);
+					crossing = (std::max)(crossing, time);
+				}
+			}
+			if (crossed != sources)
+			{
+				unit->statSingles += (crossed != 0) ? 1 : 0;
+				continue;
+			}
+			pulse.onsetNs = -crossing; // crossing lands on the trigger point
+			if (SimPwqUsed(unit))
+			{
+				// with a pulse width qualifier the scope only triggers once the pulse is over, and only
+				// if it was the right width
+				trailing = SimCrossingTime(config, spike, amplitude[first], thresholdMv[first], 1);
+				if (!SimPwqPasses(unit, trailing - SimCrossingTime(config, spike, amplitude[first], thresholdMv[first], 0)))
+				{
+					unit->statRejected++;
+					continue;
+				}
+				pulse.onsetNs = -trailing;
+			}
+			pulse.spike = spike;
+			for (int16_t channel = 0; channel < SIM_CHANNELS; channel++)
+			{
+				if (hit & (1 << channel))
+				{
+					pulse.amplitudeMv = amplitude[channel];
+					pulse.channel = channel;
+					capture->pulses.push_back(pulse);
+				}
+			}
+			if (spike || single) // nothing follows a noise spike or a background pulse
+			{
+				break;
+			}
+			pulse.spike = 0;
+			if (uniform(unit->rng) < config->decayFraction) // stopped in the bar, decay follows
+			{
+				pulse.onsetNs = -crossing - config->lifetimeNs * std::log(1.0 - uniform(unit->rng));
+				pulse.amplitudeMv = SimDrawAmplitude(unit, config->decayAmplitudeMv);
+				pulse.channel = SimPickChannel(unit); // in whichever paddle the muon stopped in
+				capture->pulses.push_back(pulse);
+				capture->decay = 1;
+			}
+			break;
+		}
+	}
+	else if (autoNs > 0.0)
+	{
+		capture->waitNs = autoNs;
+	}
+
+	// uncorrelated pulses that happen to land inside the capture window
+	pulse.spike = 0;
+	if (config->rateHz > 0.0)
+	{
+		std::poisson_distribution<int32_t> accidentals(config->rateHz * windowNs * 1e-9);
+		int32_t count = accidentals(unit->rng);
+
+		for (int32_t i = 0; i < count; i++)
+		{
+			pulse.onsetNs = windowStartNs + uniform(unit->rng) * windowNs;
+			for (int16_t channel = 0; channel < SIM_CHANNELS; channel++)
+			{
+				if (paddles & (1 << channel))
+				{
+					pulse.amplitudeMv = SimDrawAmplitude(unit, config->amplitudeMv);
+					pulse.channel = channel;
+					capture->pulses.push_back(pulse);
+				}
+			}
+		}
+	}
+	if (config->singlesRateHz > 0.0)
+	{
+		std::poisson_distribution<int32_t> singles(config->singlesRateHz * windowNs * 1e-9);
+		int32_t count = singles(unit->rng);
+
+		for (int32_t i = 0; i < count; i++)
+		{
+			pulse.onsetNs = windowStartNs + uniform(unit->rng) * windowNs;
+			pulse.amplitudeMv = SimDrawAmplitude(unit, config->amplitudeMv);
+			pulse.channel = SimPickChannel(unit);
+			capture->pulses.push_back(pulse);
+		}
+	}
+	if (config->spikeRateHz > 0.0)
+	{
+		std::poisson_distribution<int32_t> spikes(config->spikeRateHz * windowNs * 1e-9);
+		int32_t count = spikes(unit->rng);
+
+		pulse.spike = 1;
+		for (int32_t i = 0; i < count; i++)
+		{
+			pulse.onsetNs = windowStartNs + uniform(unit->rng) * windowNs;
+			pulse.amplitudeMv = SimDrawAmplitude(unit, config->spikeAmplitudeMv);
+			pulse.channel = SimPickChannel(unit);
+			capture->pulses.push_back(pulse);
+		}
+	}
+}
+
+/****************************************************************************
+* SimRender
+*
+* - Synthesizes samples [start, start + count) of one channel of a capture
+* (in mV, before the ADC) into unit->scratch
+*
+* Parameters
+* - unit : the simulated unit
+* - capture : the capture to render
+* - channel : which channel to render
+* - start : index of the first sample
+* - count : number of samples
+*
+* Returns
+* - none
+****************************************************************************/
+static void SimRender(SIM_UNIT* unit, const SIM_CAPTURE* capture, int16_t channel, uint32_t start, uint32_t count)
+{
+	const SIM_CONFIG* config = &unit->config;
+	double intervalNs = SimIntervalNs(unit->timebase);
+	// time of sample i relative to the trigger point is (i - preTrigger) * intervalNs + phase
+	double firstNs = ((double)start - unit->preTrigger) * intervalNs + capture->phaseNs;
+	float* out;
+	const float* noise = unit->noise.data();
+	uint32_t offset = capture->noiseOffset + start + (uint32_t)channel * (SIM_NOISE_TABLE_SIZE / 2);
+	float sigma = (float)config->noiseMv;
+
+	if (unit->scratch.size() < count)
+	{
+		unit->scratch.resize(count);
+	}
+	out = unit->scratch.data();
+
+	for (uint32_t i = 0; i < count; i++)
+	{
+		out[i] = sigma * noise[(offset + i) & (SIM_NOISE_TABLE_SIZE - 1)];
+	}
+
+	for (size_t p = 0; p < capture->pulses.size(); p++)
+	{
+		const SIM_PULSE* pulse = &capture->pulses[p];
+		double from = std::ceil((pulse->onsetNs - firstNs) / intervalNs);
+		double to = std::ceil((pulse->onsetNs + SIM_PULSE_LENGTH * (pulse->spike ? config->spikeFallNs : config->fallNs) - firstNs) / intervalNs);
+
+		if (pulse->channel != channel || to <= 0.0 || from >= (double)count)
+		{
+			continue;
+		}
+		if (from < 0.0)
+		{
+			from = 0.0;
+		}
+		if (to > (double)count)
+		{
+			to = (double)count;
+		}
+		for (uint32_t i = (uint32_t)from; i < (uint32_t)to; i++)
+		{
+			double t = firstNs + i * intervalNs - pulse->onsetNs;
+			out[i] += (float)(config->polarity * pulse->amplitudeMv * SimPulseShape(config, pulse->spike, t));
+		}
+	}
+}
+
+/****************************************************************************
+* SimToAdc
+*
+* - Runs a rendered voltage through the (8-bit) ADC
+*
+* Parameters
+* - mv : input voltage in mV
+* - rangeMv : full scale of the channel's range in mV
+* - overflow : set to 1 if the input was clipped
+*
+* Returns
+* - int16_t : ADC count scaled to +/-PS2000A_MAX_VALUE
+****************************************************************************/
+static inline int16_t SimToAdc(float mv, float rangeMv, int16_t* overflow)
+{
+	float steps = std::floor(mv / rangeMv * (PS2000A_MAX_VALUE / SIM_ADC_STEP) + 0.5f);
+	int32_t count = (int32_t)steps * SIM_ADC_STEP;
+
+	if (count > PS2000A_MAX_VALUE)
+	{
+		*overflow = 1;
+		return PS2000A_MAX_VALUE;
+	}
+	if (count < PS2000A_MIN_VALUE)
+	{
+		*overflow = 1;
+		return PS2000A_MIN_VALUE;
+	}
+	return (int16_t)count;
+}
+
+/****************************************************************************
+* SimTransfer
+*
+* - Copies (and downsamples, if asked) one capture into the buffers
+* registered for it
+*
+* Parameters
+* - unit : the simulated unit
+* - segment : memory segment holding the capture
+* - startIndex : first raw sample to return
+* - noOfSamples : on entry the number of (downsampled) values wanted, on exit
+*	the number written
+* - ratio : downsampling ratio
+* - mode : downsampling mode
+* - overflow : on exit, over-range flags with bit 0 for channel A
+*
+* Returns
+* - PICO_STATUS : to indicate success, or why nothing was returned
+****************************************************************************/
+static PICO_STATUS SimTransfer(SIM_UNIT* unit, uint32_t segment, uint32_t startIndex, uint32_t* noOfSamples, uint32_t ratio, PS2000A_RATIO_MODE mode, int16_t* overflow)
+{
+	uint32_t total = (uint32_t)(unit->preTrigger + unit->postTrigger);
+	int32_t slot = SimRatioSlot(mode);
+	uint32_t available;
+	uint32_t wanted = *noOfSamples;
+	SIM_BOOL anyBuffer = 0;
+
+	if (overflow != NULL)
+	{
+		*overflow = 0;
+	}
+	if (slot < 0)
+	{
+		return PICO_RATIO_MODE_NOT_SUPPORTED;
+	}
+	if (mode == PS2000A_RATIO_MODE_NONE || ratio == 0)
+	{
+		ratio = 1;
+	}
+	if (segment >= unit->nSegments)
+	{
+		return PICO_SEGMENT_OUT_OF_RANGE;
+	}
+	if (!unit->captures[segment].valid)
+	{
+		return PICO_NO_SAMPLES_AVAILABLE;
+	}
+	if (startIndex >= total)
+	{
+		return PICO_STARTINDEX_INVALID;
+	}
+
+	available = (total - startIndex) / ratio;
+	*noOfSamples = 0;
+	for (int16_t channel = 0; channel < SIM_CHANNELS; channel++)
+	{
+		SIM_BUFFER* buffer;
+		uint32_t count = (wanted < available) ? wanted : available;
+		int16_t clipped = 0;
+		float rangeMv;
+
+		if (!unit->enabled[channel] || unit->buffers[channel][slot].size() <= segment)
+		{
+			continue;
+		}
+		buffer = &unit->buffers[channel][slot][segment];
+		if (buffer->bufferMax == NULL && buffer->bufferMin == NULL)
+		{
+			continue;
+		}
+		anyBuffer = 1;
+		if ((int32_t)count > buffer->bufferLth)
+		{
+			count = (uint32_t)buffer->bufferLth;
+		}
+
+		SimRender(unit, &unit->captures[segment], channel, startIndex, count * ratio);
+		rangeMv = (float)simInputRanges[unit->range[channel]];
+		for (uint32_t i = 0; i < count; i++)
+		{
+			const float* raw = &unit->scratch[(size_t)i * ratio];
+			int16_t high = (std::numeric_limits<int16_t>::min)();
+			int16_t low = (std::numeric_limits<int16_t>::max)();
+			int32_t sum = 0;
+
+			for (uint32_t j = 0; j < ratio; j++)
+			{
+				int16_t value = SimToAdc(raw[j], rangeMv, &clipped);
+				high = (value > high) ? value : high;
+				low = (value < low) ? value : low;
+				sum += value;
+			}
+			switch (mode)
+			{
+			case PS2000A_RATIO_MODE_AGGREGATE:
+				if (buffer->bufferMax != NULL)
+				{
+					buffer->bufferMax[i] = high;
+				}
+				if (buffer->bufferMin != NULL)
+				{
+					buffer->bufferMin[i] = low;
+				}
+				break;
+			case PS2000A_RATIO_MODE_AVERAGE:
+				(buffer->bufferMax != NULL ? buffer->bufferMax : buffer->bufferMin)[i] = (int16_t)(sum / (int32_t)ratio);
+				break;
+			default: // NONE and DECIMATE both keep the first sample of each block
+				(buffer->bufferMax != NULL ? buffer->bufferMax : buffer->bufferMin)[i] = SimToAdc(raw[0], rangeMv, &clipped);
+				break;
+			}
+		}
+		if (clipped && overflow != NULL)
+		{
+			*overflow |= (int16_t)(1 << channel);
+		}
+		unit->statBytes += (uint64_t)count * sizeof(int16_t) * ((mode == PS2000A_RATIO_MODE_AGGREGATE) ? 2 : 1);
+		*noOfSamples = count;
+	}
+
+	return anyBuffer ? PICO_OK : PICO_BUFFERS_NOT_SET;
+}
+
+/****************************************************************************
+* SimUsbWait
+*
+* - Holds the caller for the time the transfer would take over USB (fixed
+* latency plus bytes / throughput), counted from when the call started
+*
+* Parameters
+* - unit : the simulated unit
+* - start : when the API call started
+* - bytes : number of bytes transferred
+*
+* Returns
+* - none
+****************************************************************************/
+static void SimUsbWait(SIM_UNIT* unit, std::chrono::steady_clock::time_point start, uint64_t bytes)
+{
+	double us = unit->config.usbLatencyUs;
+
+	if (unit->config.usbMBps > 0.0)
+	{
+		us += (double)bytes / unit->config.usbMBps;
+	}
+	std::this_thread::sleep_until(start + std::chrono::microseconds((int64_t)us));
+}
+
+/****************************************************************************
+* SimStreamPlan
+*
+* - Draws the pulses of the streaming signal up to a given time: Poisson
+* arrivals of every size (there is no trigger to get past), some of them
+* followed by a decay pulse
+*
+* Parameters
+* - unit : the simulated unit
+* - endNs : time (since streaming started) to draw pulse arrivals up to
+*
+* Returns
+* - none
+****************************************************************************/
+static void SimStreamPlan(SIM_UNIT* unit, double endNs)
+{
+	const SIM_CONFIG* config = &unit->config;
+	std::uniform_real_distribution<double> uniform(0.0, 1.0);
+	double totalHz = config->rateHz + config->spikeRateHz + config->singlesRateHz;
+	double meanGapNs = (totalHz > 0.0) ? 1e9 / totalHz : 0.0;
+	SIM_PULSE pulse;
+
+	if (meanGapNs <= 0.0)
+	{
+		return;
+	}
+	while (unit->streamNextNs < endNs)
+	{
+		double kind = (config->spikeRateHz > 0.0 || config->singlesRateHz > 0.0) ? uniform(unit->rng) * totalHz : totalHz;
+		SIM_BOOL single = (kind >= config->spikeRateHz && kind < config->spikeRateHz + config->singlesRateHz);
+
+		int16_t only;
+
+		pulse.spike = (kind < config->spikeRateHz);
+		pulse.onsetNs = unit->streamNextNs;
+		only = (pulse.spike || single) ? SimPickChannel(unit) : -1; // muons go through every paddle, the rest only hit one
+		for (int16_t channel = 0; channel < SIM_CHANNELS; channel++)
+		{
+			if ((only < 0) ? (channel != PS2000A_CHANNEL_A && !unit->enabled[channel]) : (channel != only))
+			{
+				continue;
+			}
+			pulse.amplitudeMv = SimDrawAmplitude(unit, pulse.spike ? config->spikeAmplitudeMv : config->amplitudeMv);
+			pulse.channel = channel;
+			unit->streamPulses.push_back(pulse);
+		}
+		if (!pulse.spike && !single && uniform(unit->rng) < config->decayFraction) // stopped in the bar, decay follows
+		{
+			pulse.onsetNs = unit->streamNextNs - config->lifetimeNs * std::log(1.0 - uniform(unit->rng));
+			pulse.amplitudeMv = SimDrawAmplitude(unit, config->decayAmplitudeMv);
+			pulse.channel = SimPickChannel(unit);
+			unit->streamPulses.push_back(pulse);
+			unit->statDecays++;
+		}
+		unit->streamNextNs += -meanGapNs * std::log(1.0 - uniform(unit->rng));
+	}
+}
+
+/****************************************************************************
+* SimStreamRender
+*
+* - Generates the next count samples of the streaming signal into the
+* registered (non-downsampled) buffers, starting at index streamWrite
+*
+* Parameters
+* - unit : the simulated unit
+* - count : number of samples to generate
+* - overflow : on exit, over-range flags with bit 0 for channel A
+*
+* Returns
+* - none
+****************************************************************************/
+static void SimStreamRender(SIM_UNIT* unit, uint32_t count, int16_t* overflow)
+{
+	double intervalNs = SimIntervalNs(unit->timebase);
+	double firstNs = (double)unit->streamSamples * intervalNs;
+	double endNs = firstNs + count * intervalNs;
+	double lengthNs = SIM_PULSE_LENGTH * unit->config.fallNs;
+	size_t kept = 0;
+
+	SimStreamPlan(unit, endNs);
+
+	// SimRender works on a capture with the trigger point at sample 0, so shift the pulses to the chunk
+	unit->streamChunk.pulses.clear();
+	for (size_t p = 0; p < unit->streamPulses.size(); p++)
+	{
+		SIM_PULSE pulse = unit->streamPulses[p];
+		if (pulse.onsetNs + lengthNs > firstNs && pulse.onsetNs < endNs)
+		{
+			pulse.onsetNs -= firstNs;
+			unit->streamChunk.pulses.push_back(pulse);
+		}
+	}
+	unit->streamChunk.phaseNs = 0.0;
+	unit->streamChunk.noiseOffset = (uint32_t)(unit->streamSamples & (SIM_NOISE_TABLE_SIZE - 1));
+
+	*overflow = 0;
+	for (int16_t channel = 0; channel < SIM_CHANNELS; channel++)
+	{
+		SIM_BUFFER* buffer;
+		int16_t clipped = 0;
+		float rangeMv = (float)simInputRanges[unit->range[channel]];
+
+		if (!unit->enabled[channel] || unit->buffers[channel][0].empty() || unit->buffers[channel][0][0].bufferMax == NULL)
+		{
+			continue;
+		}
+		buffer = &unit->buffers[channel][0][0];
+		SimRender(unit, &unit->streamChunk, channel, 0, count);
+		for (uint32_t i = 0; i < count; i++)
+		{
+			buffer->bufferMax[unit->streamWrite + i] = SimToAdc(unit->scratch[i], rangeMv, &clipped);
+		}
+		if (clipped)
+		{
+			*overflow |= (int16_t)(1 << channel);
+		}
+		unit->statBytes += (uint64_t)count * sizeof(int16_t);
+	}
+
+	// forget the pulses that are over, decays further out are kept
+	for (size_t p = 0; p < unit->streamPulses.size(); p++)
+	{
+		if (unit->streamPulses[p].onsetNs + lengthNs > endNs)
+		{
+			unit->streamPulses[kept++] = unit->streamPulses[p];
+		}
+	}
+	unit->streamPulses.resize(kept);
+}
+
+/****************************************************************************
+* SimWorker
+*
+* - Thread standing in for the scope: waits for each armed capture's trigger
+* and acquisition time, then calls the block ready callback (from this
+* thread, like the real driver does)
+*
+* Parameters
+* - unit : the simulated unit
+*
+* Returns
+* - none
+****************************************************************************/
+static void SimWorker(SIM_UNIT* unit)
+{
+	std::unique_lock<std::mutex> lk(unit->lock);
+
+	for (;;)
+	{
+		PICO_STATUS status = PICO_OK;
+		ps2000aBlockReady lpReady;
+		void* pParameter;
+
+		unit->cv.wait(lk, [unit] { return unit->quit || unit->state == SIM_STATE_ARMED; });
+		if (unit->quit)
+		{
+			break;
+		}
+
+		while (unit->capturesDone < unit->runCaptures)
+		{
+			uint32_t segment = (unit->firstSegment + unit->capturesDone) % unit->nSegments;
+			SIM_CAPTURE* capture = &unit->captures[segment];
+			double waitNs = (unit->config.realtime ? capture->waitNs : 0.0) + unit->postTrigger * SimIntervalNs(unit->timebase);
+			std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::nanoseconds((int64_t)waitNs);
+
+			if (unit->cv.wait_until(lk, deadline, [unit] { return unit->cancel || unit->quit; }))
+			{
+				break;
+			}
+			capture->valid = 1;
+			unit->capturesDone++;
+			unit->statCaptures++;
+			unit->statDecays += capture->decay ? 1 : 0;
+		}
+
+		status = (unit->cancel || unit->quit) ? PICO_CANCELLED : PICO_OK;
+		unit->state = (status == PICO_OK) ? SIM_STATE_READY : SIM_STATE_IDLE;
+		lpReady = unit->lpReady;
+		pParameter = unit->pParameter;
+		unit->inCallback = 1;
+		lk.unlock();
+		if (lpReady != NULL)
+		{
+			lpReady(unit->handle, status, pParameter);
+		}
+		lk.lock();
+		unit->inCallback = 0;
+		unit->cv.notify_all();
+	}
+}
+
+/****************************************************************************
+* SimStop
+*
+* - Cancels a running capture and waits for the worker to finish its
+* callback. Must be called with unit->lock held (through lk)
+*
+* Parameters
+* - unit : the simulated unit
+* - lk : lock on unit->lock
+*
+* Returns
+* - none
+****************************************************************************/
+static void SimStop(SIM_UNIT* unit, std::unique_lock<std::mutex>& lk)
+{
+	if (unit->state == SIM_STATE_STREAMING) // no worker involved, just stop handing out data
+	{
+		unit->state = SIM_STATE_IDLE;
+	}
+	if (unit->state == SIM_STATE_ARMED)
+	{
+		unit->cancel = 1;
+		unit->cv.notify_all();
+	}
+	unit->cv.wait(lk, [unit] { return unit->state != SIM_STATE_ARMED && !unit->inCallback; });
+	unit->cancel = 0;
+}
+
+PREF0 PREF1 PICO_STATUS PREF2 PREF3(ps2000aOpenUnit)(int16_t* handle, int8_t* serial)
+{
+	SIM_CONFIG config;
+	SIM_UNIT* unit = NULL;
+
+	if (handle == NULL)
+	{
+		return PICO_NULL_PARAMETER;
+	}
+	*handle = 0;
+	SimConfigLoad(&config);
+
+	{
+		std::lock_guard<std::mutex> guard(g_simlock);
+
+		for (int16_t i = 0; i < config.units; i++)
+		{
+			char name[16];
+			snprintf(name, sizeof(name), "SIM%02d/%03d", (int)i, (int)(config.seed % 1000));
+			if ((g_simunits[i] != NULL && g_simunits[i]->open) || (serial != NULL && strcmp((const char*)serial, name) != 0))
+			{
+				continue;
+			}
+			if (g_simunits[i] == NULL)
+			{
+				g_simunits[i] = new SIM_UNIT();
+			}
+			unit = g_simunits[i];
+			unit->handle = i + 1;
+			memcpy(unit->serial, name, sizeof(name));
+			break;
+		}
+	}
+	if (unit == NULL)
+	{
+		return PICO_NOT_FOUND;
+	}
+
+	unit->config = config;
+	unit->rng.seed(config.seed * 0x9E3779B97F4A7C15ULL + (uint64_t)unit->handle);
+	unit->noise.resize(SIM_NOISE_TABLE_SIZE);
+	{
+		std::normal_distribution<float> gauss(0.0f, 1.0f);
+		for (uint32_t i = 0; i < SIM_NOISE_TABLE_SIZE; i++)
+		{
+			unit->noise[i] = gauss(unit->rng);
+		}
+	}
+	for (int16_t i = 0; i < SIM_CHANNELS; i++)
+	{
+		unit->enabled[i] = 1;
+		unit->range[i] = PS2000A_5V;
+		unit->triggerDirections[i] = PS2000A_NONE;
+		for (int32_t j = 0; j < SIM_RATIO_MODES; j++)
+		{
+			unit->buffers[i][j].clear();
+		}
+	}
+	unit->triggerProperties.clear();
+	unit->triggerConditions.clear();
+	unit->autoTriggerMs = 0;
+	unit->nSegments = 1;
+	unit->nCaptures = 1;
+	unit->captures.assign(1, SIM_CAPTURE());
+	unit->state = SIM_STATE_IDLE;
+	unit->cancel = 0;
+	unit->quit = 0;
+	unit->inCallback = 0;
+	unit->timebase = 0;
+	unit->preTrigger = 0;
+	unit->postTrigger = 0;
+	unit->capturesDone = 0;
+	unit->runCaptures = 0;
+	unit->statCaptures = 0;
+	unit->statDecays = 0;
+	unit->statBytes = 0;
+	unit->statStreamed = 0;
+	unit->statDropped = 0;
+	unit->statRejected = 0;
+	unit->statSingles = 0;
+	unit->pwqConditions.clear();
+	unit->openTime = std::chrono::steady_clock::now();
+	unit->worker = std::thread(SimWorker, unit);
+	unit->open = 1;
+
+	*handle = unit->handle;
+	printf("[simulated ps2000a] unit %s opened (seed %llu, %.1f Hz, decay fraction %.3f)\n",
+		unit->serial, (unsigned long long)config.seed, config.rateHz, config.decayFraction);
+	return PICO_OK;
+}
+
+PREF0 PREF1 PICO_STATUS PREF2 PREF3(ps2000aEnumerateUnits)(int16_t* count, int8_t* serials, int16_t* serialLth)
+{
+	SIM_CONFIG config;
+	std::string text;
+
+	if (count == NULL)
+	{
+		return PICO_NULL_PARAMETER;
+	}
+	SimConfigLoad(&config);
+
+	// like the driver, only the units that aren't already open are listed
+	*count = 0;
+	{
+		std::lock_guard<std::mutex> guard(g_simlock);
+
+		for (int16_t i = 0; i < config.units; i++)
+		{
+			char name[16];
+			if (g_simunits[i] != NULL && g_simunits[i]->open)
+			{
+				continue;
+			}
+			snprintf(name, sizeof(name), "SIM%02d/%03d", (int)i, (int)(config.seed % 1000));
+			text += (*count > 0) ? "," : "";
+			text += name;
+			(*count)++;
+		}
+	}
+	if (serials != NULL && serialLth != NULL && *serialLth > 0)
+	{
+		size_t length = ((size_t)*serialLth - 1 < text.size()) ? (size_t)*serialLth - 1 : text.size();
+		memcpy(serials, text.c_str(), length);
+		serials[length] = 0;
+	}
+	if (serialLth != NULL)
+	{
+		*serialLth = (int16_t)text.size();
+	}
+	return PICO_OK;
+}
+
+PREF0 PREF1 PICO_STATUS PREF2 PREF3(ps2000aCloseUnit)(int16_t handle)
+{
+	SIM_UNIT* unit = SimGetUnit(handle);
+	double seconds;
+
+	if (unit == NULL)
+	{
+		return PICO_INVALID_HANDLE;
+	}
+	{
+		std::unique_lock<std::mutex> lk(unit->lock);
+		SimStop(unit, lk);
+		unit->quit = 1;
+		unit->cv.notify_all();
+	}
+	unit->worker.join();
+
+	seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - unit->openTime).count();
+	printf("[simulated ps2000a] unit %s closed: %llu captures (%llu with a decay) in %.1f s, %.1f captures/s, %.1f MB transferred\n",
+		unit->serial, (unsigned long long)unit->statCaptures, (unsigned long long)unit->statDecays, seconds,
+		(seconds > 0.0) ? unit->statCaptures / seconds : 0.0, unit->statBytes / 1e6);
+	if (unit->statRejected > 0)
+	{
+		printf("[simulated ps2000a] unit %s: the pulse width qualifier rejected %llu triggers before they were captured\n",
+			unit->serial, (unsigned long long)unit->statRejected);
+	}
+	if (unit->statSingles > 0)
+	{
+		printf("[simulated ps2000a] unit %s: the coincidence trigger ignored %llu pulses that only hit one channel\n",
+			unit->serial, (unsigned long long)unit->statSingles);
+	}
+	if (unit->statStreamed > 0 || unit->statDropped > 0)
+	{
+		printf("[simulated ps2000a] unit %s streamed %llu samples, dropped %llu the program didn't fetch in time\n",
+			unit->serial, (unsigned long long)unit->statStreamed, (unsigned long long)unit->statDropped);
+	}
+
+	std::lock_guard<std::mutex> guard(g_simlock);
+	unit->open = 0;
+	return PICO_OK;
+}
+
+PREF0 PREF1 PICO_STATUS PREF2 PREF3(ps2000aGetUnitInfo)(int16_t handle, int8_t* string, int16_t stringLength, int16_t* requiredSize, PICO_INFO info)
+{
+	SIM_UNIT* unit = SimGetUnit(handle);
+	std::string text;
+
+	if (unit == NULL)
+	{
+		return PICO_INVALID_HANDLE;
+	}
+	switch (info)
+	{
+	case PICO_DRIVER_VERSION: text = "2.1.0.0 (simulated)"; break;
+	case PICO_USB_VERSION: text = "2.0"; break;
+	case PICO_HARDWARE_VERSION: text = "1"; break;
+	case PICO_VARIANT_INFO: text = "2206B"; break;
+	case PICO_BATCH_AND_SERIAL: text = unit->serial; break;
+	case PICO_CAL_DATE: text = "01Jan20"; break;
+	case PICO_KERNEL_VERSION: text = "1.0"; break;
+	case PICO_DIGITAL_HARDWARE_VERSION: text = "1"; break;
+	case PICO_ANALOGUE_HARDWARE_VERSION: text = "1"; break;
+	case PICO_FIRMWARE_VERSION_1: text = "1.0.0.0"; break;
+	case PICO_FIRMWARE_VERSION_2: text = "1.0.0.0"; break;
+	default: return PICO_INVALID_INFO;
+	}
+	if (requiredSize != NULL)
+	{
+		*requiredSize = (int16_t)(text.size() + 1);
+	}
+	if (string != NULL && stringLength > 0)
+	{
+		size_t count = ((size_t)stringLength - 1 < text.size()) ? (size_t)stringLength - 1 : text.size();
+		memcpy(string, text.c_str(), count);
+		string[count] = 0;
+	}
+	return PICO_OK;
+}
+
+PREF0 PREF1 PICO_STATUS PREF2 PREF3(ps2000aMaximumValue)(int16_t handle, int16_t* value)
+{
+	if (SimGetUnit(handle) == NULL)
+	{
+		return PICO_INVALID_HANDLE;
+	}
+	if (value == NULL)
+	{
+		return PICO_NULL_PARAMETER;
+	}
+	*value = PS2000A_MAX_VALUE;
+	return PICO_OK;
+}
+
+PREF0 PREF1 PICO_STATUS PREF2 PREF3(ps2000aPingUnit)(int16_t handle)
+{
+	SIM_UNIT* unit = SimGetUnit(handle);
+
+	if (unit == NULL)
+	{
+		return PICO_INVALID_HANDLE;
+	}
+	SimUsbWait(unit, std::chrono::steady_clock::now(), 0); // a round trip over USB
+	return PICO_OK;
+}
+
+PREF0 PREF1 PICO_STATUS PREF2 PREF3(ps2000aSetChannel)(int16_t handle, PS2000A_CHANNEL channel, int16_t enabled, PS2000A_COUPLING type, PS2000A_RANGE range, float analogOffset)
+{
+	SIM_UNIT* unit = SimGetUnit(handle);
+
+	if (unit == NULL)
+	{
+		return PICO_INVALID_HANDLE;
+	}
+	if (channel < PS2000A_CHANNEL_A || channel >= SIM_CHANNELS)
+	{
+		return PICO_INVALID_CHANNEL;
+	}
+	if (range < PS2000A_20MV || range > PS2000A_20V)
+	{
+		return PICO_INVALID_VOLTAGE_RANGE;
+	}
+	std::lock_guard<std::mutex> guard(unit->lock);
+	unit->enabled[channel] = enabled ? 1 : 0;
+	unit->range[channel] = (int16_t)range;
+	return PICO_OK;
+}
+
+PREF0 PREF1 PICO_STATUS PREF2 PREF3(ps2000aSetEts)(int16_t handle, PS2000A_ETS_MODE mode, int16_t etsCycles, int16_t etsInterleave, int32_t* sampleTimePicoseconds)
+{
+	if (SimGetUnit(handle) == NULL)
+	{
+		return PICO_INVALID_HANDLE;
+	}
+	return (mode == PS2000A_ETS_OFF) ? PICO_OK : PICO_ETS_NOT_SUPPORTED;
+}
+
+PREF0 PREF1 PICO_STATUS PREF2 PREF3(ps2000aSetTriggerChannelProperties)(int16_t handle, PS2000A_TRIGGER_CHANNEL_PROPERTIES* channelProperties, int16_t nChannelProperties, int16_t auxOutputEnable, int32_t autoTriggerMilliseconds)
+{
+	SIM_UNIT* unit = SimGetUnit(handle);
+
+	if (unit == NULL)
+	{
+		return PICO_INVALID_HANDLE;
+	}
+	if (nChannelProperties > 0 && channelProperties == NULL)
+	{
+		return PICO_NULL_PARAMETER;
+	}
+	std::lock_guard<std::mutex> guard(unit->lock);
+	unit->triggerProperties.assign(channelProperties, channelProperties + ((nChannelProperties > 0) ? nChannelProperties : 0));
+	unit->autoTriggerMs = autoTriggerMilliseconds;
+	return PICO_OK;
+}
+
+PREF0 PREF1 PICO_STATUS PREF2 PREF3(ps2000aSetTriggerChannelConditions)(int16_t handle, PS2000A_TRIGGER_CONDITIONS* conditions, int16_t nConditions)
+{
+	SIM_UNIT* unit = SimGetUnit(handle);
+
+	if (unit == NULL)
+	{
+		return PICO_INVALID_HANDLE;
+	}
+	if (nConditions > 0 && conditions == NULL)
+	{
+		return PICO_NULL_PARAMETER;
+	}
+	std::lock_guard<std::mutex> guard(unit->lock);
+	unit->triggerConditions.assign(conditions, conditions + ((nConditions > 0) ? nConditions : 0));
+	return PICO_OK;
+}
+
+PREF0 PREF1 PICO_STATUS PREF2 PREF3(ps2000aSetTriggerChannelDirections)(int16_t handle, PS2000A_THRESHOLD_DIRECTION channelA, PS2000A_THRESHOLD_DIRECTION channelB, PS2000A_THRESHOLD_DIRECTION channelC, PS2000A_THRESHOLD_DIRECTION channelD, PS2000A_THRESHOLD_DIRECTION ext, PS2000A_THRESHOLD_DIRECTION aux)
+{
+	SIM_UNIT* unit = SimGetUnit(handle);
+
+	if (unit == NULL)
+	{
+		return PICO_INVALID_HANDLE;
+	}
+	std::lock_guard<std::mutex> guard(unit->lock);
+	unit->triggerDirections[PS2000A_CHANNEL_A] = channelA;
+	unit->triggerDirections[PS2000A_CHANNEL_B] = channelB;
+	return PICO_OK;
+}
+
+PREF0 PREF1 PICO_STATUS PREF2 PREF3(ps2000aSetTriggerDelay)(int16_t handle, uint32_t delay)
+{
+	return (SimGetUnit(handle) != NULL) ? PICO_OK : PICO_INVALID_HANDLE;
+}
+
+PREF0 PREF1 PICO_STATUS PREF2 PREF3(ps2000aSetPulseWidthQualifier)(int16_t handle, PS2000A_PWQ_CONDITIONS* conditions, int16_t nConditions, PS2000A_THRESHOLD_DIRECTION direction, uint32_t lower, uint32_t upper, PS2000A_PULSE_WIDTH_TYPE type)
+{
+	SIM_UNIT* unit = SimGetUnit(handle);
+
+	if (unit == NULL)
+	{
+		return PICO_INVALID_HANDLE;
+	}
+	if (nConditions > 0 && conditions == NULL)
+	{
+		return PICO_NULL_PARAMETER;
+	}
+	// the direction isn't checked, the simulated pulses only ever go one way
+	std::lock_guard<std::mutex> guard(unit->lock);
+	unit->pwqConditions.assign(conditions, conditions + ((nConditions > 0) ? nConditions : 0));
+	unit->pwqLower = lower;
+	unit->pwqUpper = upper;
+	unit->pwqType = type;
+	return PICO_OK;
+}
+
+PREF0 PREF1 PICO_STATUS PREF2 PREF3(ps2000aSetDataBuffers)(int16_t handle, int32_t channelOrPort, int16_t* bufferMax, int16_t* bufferMin, int32_t bufferLth, uint32_t segmentIndex, PS2000A_RATIO_MODE mode)
+{
+	SIM_UNIT* unit = SimGetUnit(handle);
+	int32_t slot = SimRatioSlot(mode);
+	SIM_BUFFER buffer = { bufferMax, bufferMin, bufferLth };
+
+	if (unit == NULL)
+	{
+		return PICO_INVALID_HANDLE;
+	}
+	if (channelOrPort < PS2000A_CHANNEL_A || channelOrPort >= SIM_CHANNELS)
+	{
+		return PICO_INVALID_CHANNEL;
+	}
+	if (slot < 0)
+	{
+		return PICO_RATIO_MODE_NOT_SUPPORTED;
+	}
+	std::lock_guard<std::mutex> guard(unit->lock);
+	if (segmentIndex >= unit->nSegments)
+	{
+		return PICO_SEGMENT_OUT_OF_RANGE;
+	}
+	if (unit->buffers[channelOrPort][slot].size() <= segmentIndex)
+	{
+		unit->buffers[channelOrPort][slot].resize((size_t)segmentIndex + 1, SIM_BUFFER{ NULL, NULL, 0 });
+	}
+	unit->buffers[channelOrPort][slot][segmentIndex] = buffer;
+	return PICO_OK;
+}
+
+PREF0 PREF1 PICO_STATUS PREF2 PREF3(ps2000aSetDataBuffer)(int16_t handle, int32_t channelOrPort, int16_t* buffer, int32_t bufferLth, uint32_t segmentIndex, PS2000A_RATIO_MODE mode)
+{
+	if (mode == PS2000A_RATIO_MODE_AGGREGATE && buffer != NULL)
+	{
+		return PICO_RATIO_MODE_NOT_SUPPORTED; // aggregation needs the max/min pair from ps2000aSetDataBuffers
+	}
+	return ps2000aSetDataBuffers(handle, channelOrPort, buffer, NULL, bufferLth, segmentIndex, mode);
+}
+
+PREF0 PREF1 PICO_STATUS PREF2 PREF3(ps2000aMemorySegments)(int16_t handle, uint32_t nSegments, int32_t* nMaxSamples)
+{
+	SIM_UNIT* unit = SimGetUnit(handle);
+
+	if (unit == NULL)
+	{
+		return PICO_INVALID_HANDLE;
+	}
+	if (nSegments < 1 || nSegments > SIM_MAX_SEGMENTS)
+	{
+		return PICO_TOO_MANY_SEGMENTS;
+	}
+	std::unique_lock<std::mutex> lk(unit->lock);
+	SimStop(unit, lk);
+	unit->nSegments = nSegments;
+	unit->captures.assign(nSegments, SIM_CAPTURE());
+	for (int16_t i = 0; i < SIM_CHANNELS; i++)
+	{
+		for (int32_t j = 0; j < SIM_RATIO_MODES; j++)
+		{
+			if (unit->buffers[i][j].size() > nSegments)
+			{
+				unit->buffers[i][j].resize(nSegments);
+			}
+		}
+	}
+	if (nMaxSamples != NULL)
+	{
+		*nMaxSamples = (int32_t)(SIM_MEMORY_SAMPLES / nSegments); // total over all channels, like the real driver
+	}
+	return PICO_OK;
+}
+
+PREF0 PREF1 PICO_STATUS PREF2 PREF3(ps2000aGetMaxSegments)(int16_t handle, uint32_t* maxsegments)
+{
+	if (SimGetUnit(handle) == NULL)
+	{
+		return PICO_INVALID_HANDLE;
+	}
+	if (maxsegments == NULL)
+	{
+		return PICO_NULL_PARAMETER;
+	}
+	*maxsegments = SIM_MAX_SEGMENTS;
+	return PICO_OK;
+}
+
+PREF0 PREF1 PICO_STATUS PREF2 PREF3(ps2000aSetNoOfCaptures)(int16_t handle, uint32_t nCaptures)
+{
+	SIM_UNIT* unit = SimGetUnit(handle);
+
+	if (unit == NULL)
+	{
+		return PICO_INVALID_HANDLE;
+	}
+	if (nCaptures < 1)
+	{
+		return PICO_INVALID_PARAMETER;
+	}
+	std::lock_guard<std::mutex> guard(unit->lock);
+	unit->nCaptures = nCaptures;
+	return PICO_OK;
+}
+
+PREF0 PREF1 PICO_STATUS PREF2 PREF3(ps2000aGetNoOfCaptures)(int16_t handle, uint32_t* nCaptures)
+{
+	SIM_UNIT* unit = SimGetUnit(handle);
+
+	if (unit == NULL)
+	{
+		return PICO_INVALID_HANDLE;
+	}
+	if (nCaptures == NULL)
+	{
+		return PICO_NULL_PARAMETER;
+	}
+	std::lock_guard<std::mutex> guard(unit->lock);
+	*nCaptures = unit->capturesDone;
+	return PICO_OK;
+}
+
+PREF0 PREF1 PICO_STATUS PREF2 PREF3(ps2000aGetTimebase)(int16_t handle, uint32_t timebase, int32_t noSamples, int32_t* timeIntervalNanoseconds, int16_t oversample, int32_t* maxSamples, uint32_t segmentIndex)
+{
+	SIM_UNIT* unit = SimGetUnit(handle);
+	int32_t available;
+
+	if (unit == NULL)
+	{
+		return PICO_INVALID_HANDLE;
+	}
+	std::lock_guard<std::mutex> guard(unit->lock);
+	if (segmentIndex >= unit->nSegments)
+	{
+		return PICO_SEGMENT_OUT_OF_RANGE;
+	}
+	if (timebase == 0 && SimEnabledChannels(unit) > 1) // 2 ns is only available with a single channel
+	{
+		return PICO_INVALID_TIMEBASE;
+	}
+	available = SimMaxSamples(unit);
+	if (noSamples > available)
+	{
+		return PICO_TOO_MANY_SAMPLES;
+	}
+	if (timeIntervalNanoseconds != NULL)
+	{
+		*timeIntervalNanoseconds = (int32_t)SimIntervalNs(timebase);
+	}
+	if (maxSamples != NULL)
+	{
+		*maxSamples = available;
+	}
+	return PICO_OK;
+}
+
+PREF0 PREF1 PICO_STATUS PREF2 PREF3(ps2000aRunBlock)(int16_t handle, int32_t noOfPreTriggerSamples, int32_t noOfPostTriggerSamples, uint32_t timebase, int16_t oversample, int32_t* timeIndisposedMs, uint32_t segmentIndex, ps2000aBlockReady lpReady, void* pParameter)
+{
+	SIM_UNIT* unit = SimGetUnit(handle);
+
+	if (unit == NULL)
+	{
+		return PICO_INVALID_HANDLE;
+	}
+	std::unique_lock<std::mutex> lk(unit->lock);
+	SimStop(unit, lk); // starting a new run abandons whatever was running
+
+	if (segmentIndex >= unit->nSegments)
+	{
+		return PICO_SEGMENT_OUT_OF_RANGE;
+	}
+	if (unit->nCaptures > unit->nSegments)
+	{
+		return PICO_NOT_ENOUGH_SEGMENTS;
+	}
+	if (timebase == 0 && SimEnabledChannels(unit) > 1)
+	{
+		return PICO_INVALID_TIMEBASE;
+	}
+	if (noOfPreTriggerSamples < 0 || noOfPostTriggerSamples < 0 || noOfPreTriggerSamples + noOfPostTriggerSamples > SimMaxSamples(unit))
+	{
+		return PICO_TOO_MANY_SAMPLES;
+	}
+
+	unit->timebase = timebase;
+	unit->preTrigger = noOfPreTriggerSamples;
+	unit->postTrigger = noOfPostTriggerSamples;
+	unit->firstSegment = segmentIndex;
+	unit->runCaptures = unit->nCaptures;
+	unit->capturesDone = 0;
+	unit->lpReady = lpReady;
+	unit->pParameter = pParameter;
+	for (uint32_t i = 0; i < unit->runCaptures; i++) // all the randomness is drawn here so it doesn't depend on timing
+	{
+		SimPlanCapture(unit, &unit->captures[(segmentIndex + i) % unit->nSegments]);
+	}
+	if (timeIndisposedMs != NULL)
+	{
+		*timeIndisposedMs = (int32_t)((noOfPreTriggerSamples + noOfPostTriggerSamples) * SimIntervalNs(timebase) * unit->runCaptures / 1e6);
+	}
+	unit->state = SIM_STATE_ARMED;
+	unit->cv.notify_all();
+	return PICO_OK;
+}
+
+PREF0 PREF1 PICO_STATUS PREF2 PREF3(ps2000aRunStreaming)(int16_t handle, uint32_t* sampleInterval, PS2000A_TIME_UNITS sampleIntervalTimeUnits, uint32_t maxPreTriggerSamples, uint32_t maxPostTriggerSamples, int16_t autoStop, uint32_t downSampleRatio, PS2000A_RATIO_MODE downSampleRatioMode, uint32_t overviewBufferSize)
+{
+	SIM_UNIT* unit = SimGetUnit(handle);
+	std::uniform_real_distribution<double> uniform(0.0, 1.0);
+	double scale = 1.0; // ns per sampleIntervalTimeUnits
+	double requestedNs;
+	uint32_t timebase;
+	SIM_BOOL anyBuffer = 0;
+
+	if (unit == NULL)
+	{
+		return PICO_INVALID_HANDLE;
+	}
+	if (sampleInterval == NULL)
+	{
+		return PICO_NULL_PARAMETER;
+	}
+	if (downSampleRatioMode != PS2000A_RATIO_MODE_NONE) // only raw data is simulated in streaming mode
+	{
+		return PICO_RATIO_MODE_NOT_SUPPORTED;
+	}
+	if (overviewBufferSize == 0 || sampleIntervalTimeUnits > PS2000A_S)
+	{
+		return PICO_INVALID_PARAMETER;
+	}
+	for (int32_t i = (int32_t)sampleIntervalTimeUnits; i < PS2000A_NS; i++)
+	{
+		scale /= 1000.0;
+	}
+	for (int32_t i = PS2000A_NS; i < (int32_t)sampleIntervalTimeUnits; i++)
+	{
+		scale *= 1000.0;
+	}
+
+	// streaming runs on the 16 ns timebases or slower, rounded up to the next one available
+	requestedNs = *sampleInterval * scale;
+	timebase = (requestedNs <= 16.0) ? 3 : (uint32_t)std::ceil(requestedNs / 16.0) + 2;
+
+	std::unique_lock<std::mutex> lk(unit->lock);
+	SimStop(unit, lk);
+	for (int16_t channel = 0; channel < SIM_CHANNELS; channel++)
+	{
+		if (unit->enabled[channel] && !unit->buffers[channel][0].empty() && unit->buffers[channel][0][0].bufferMax != NULL)
+		{
+			if ((uint32_t)unit->buffers[channel][0][0].bufferLth < overviewBufferSize)
+			{
+				return PICO_INVALID_BUFFER;
+			}
+			anyBuffer = 1;
+		}
+	}
+	if (!anyBuffer)
+	{
+		return PICO_INVALID_BUFFER;
+	}
+
+	*sampleInterval = (uint32_t)(SimIntervalNs(timebase) / scale + 0.5);
+	unit->timebase = timebase;
+	unit->preTrigger = 0;
+	unit->postTrigger = 0;
+	unit->overviewSize = overviewBufferSize;
+	unit->streamWrite = 0;
+	unit->streamSamples = 0;
+	unit->streamPulses.clear();
+	unit->streamNextNs = (unit->config.rateHz > 0.0) ? -1e9 / unit->config.rateHz * std::log(1.0 - uniform(unit->rng)) : 0.0;
+	unit->streamStart = std::chrono::steady_clock::now();
+	unit->state = SIM_STATE_STREAMING;
+	return PICO_OK;
+}
+
+PREF0 PREF1 PICO_STATUS PREF2 PREF3(ps2000aGetStreamingLatestValues)(int16_t handle, ps2000aStreamingReady lpPs2000aReady, void* pParameter)
+{
+	SIM_UNIT* unit = SimGetUnit(handle);
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	uint64_t due; // samples the scope has taken by now
+	uint32_t count;
+	uint32_t startIndex;
+	int16_t overflow = 0;
+	uint64_t bytes;
+
+	if (unit == NULL)
+	{
+		return PICO_INVALID_HANDLE;
+	}
+	std::unique_lock<std::mutex> lk(unit->lock);
+	if (unit->state != SIM_STATE_STREAMING)
+	{
+		return PICO_INVALID_CALL;
+	}
+
+	if (unit->config.realtime)
+	{
+		due = (uint64_t)(std::chrono::duration<double, std::nano>(start - unit->streamStart).count() / SimIntervalNs(unit->timebase));
+	}
+	else // as fast as the program can take it
+	{
+		due = unit->streamSamples + unit->overviewSize;
+	}
+	if (due <= unit->streamSamples) // nothing new since the last call
+	{
+		lk.unlock();
+		SimUsbWait(unit, start, 0);
+		return PICO_OK;
+	}
+	if (due - unit->streamSamples > unit->overviewSize) // the overview buffer overflowed, the oldest data is lost
+	{
+		uint64_t dropped = due - unit->streamSamples - unit->overviewSize;
+		unit->streamSamples += dropped;
+		unit->statDropped += dropped;
+	}
+
+	// chunks don't wrap around the end of the buffer, the rest comes with the next call
+	if (unit->streamWrite >= unit->overviewSize)
+	{
+		unit->streamWrite = 0;
+	}
+	count = (uint32_t)(due - unit->streamSamples);
+	if (count > unit->overviewSize - unit->streamWrite)
+	{
+		count = unit->overviewSize - unit->streamWrite;
+	}
+
+	bytes = unit->statBytes;
+	SimStreamRender(unit, count, &overflow);
+	bytes = unit->statBytes - bytes;
+	startIndex = unit->streamWrite;
+	unit->streamWrite += count;
+	unit->streamSamples += count;
+	unit->statStreamed += count;
+	lk.unlock();
+
+	SimUsbWait(unit, start, bytes);
+	if (lpPs2000aReady != NULL) // triggers and autoStop aren't simulated in streaming mode
+	{
+		lpPs2000aReady(handle, (int32_t)count, startIndex, overflow, 0, 0, 0, pParameter);
+	}
+	return PICO_OK;
+}
+
+PREF0 PREF1 PICO_STATUS PREF2 PREF3(ps2000aIsReady)(int16_t handle, int16_t* ready)
+{
+	SIM_UNIT* unit = SimGetUnit(handle);
+
+	if (unit == NULL)
+	{
+		return PICO_INVALID_HANDLE;
+	}
+	if (ready == NULL)
+	{
+		return PICO_NULL_PARAMETER;
+	}
+	std::lock_guard<std::mutex> guard(unit->lock);
+	*ready = (unit->state == SIM_STATE_READY) ? 1 : 0;
+	return PICO_OK;
+}
+
+PREF0 PREF1 PICO_STATUS PREF2 PREF3(ps2000aGetValues)(int16_t handle, uint32_t startIndex, uint32_t* noOfSamples, uint32_t downSampleRatio, PS2000A_RATIO_MODE downSampleRatioMode, uint32_t segmentIndex, int16_t* overflow)
+{
+	SIM_UNIT* unit = SimGetUnit(handle);
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	uint64_t bytes;
+	PICO_STATUS status;
+
+	if (unit == NULL)
+	{
+		return PICO_INVALID_HANDLE;
+	}
+	if (noOfSamples == NULL)
+	{
+		return PICO_NULL_PARAMETER;
+	}
+	std::unique_lock<std::mutex> lk(unit->lock);
+	if (unit->state == SIM_STATE_ARMED && segmentIndex < unit->nSegments && !unit->captures[segmentIndex].valid)
+	{
+		return PICO_DEVICE_SAMPLING;
+	}
+	bytes = unit->statBytes;
+	status = SimTransfer(unit, segmentIndex, startIndex, noOfSamples, downSampleRatio, downSampleRatioMode, overflow);
+	bytes = unit->statBytes - bytes;
+	lk.unlock();
+
+	SimUsbWait(unit, start, bytes);
+	return status;
+}
+
+PREF0 PREF1 PICO_STATUS PREF2 PREF3(ps2000aGetTriggerTimeOffset64)(int16_t handle, int64_t* time, PS2000A_TIME_UNITS* timeUnits, uint32_t segmentIndex)
+{
+	SIM_UNIT* unit = SimGetUnit(handle);
+
+	if (unit == NULL)
+	{
+		return PICO_INVALID_HANDLE;
+	}
+	if (time == NULL || timeUnits == NULL)
+	{
+		return PICO_NULL_PARAMETER;
+	}
+	std::lock_guard<std::mutex> guard(unit->lock);
+	if (unit->state == SIM_STATE_STREAMING)
+	{
+		return PICO_NOT_USED_IN_THIS_CAPTURE_MODE;
+	}
+	if (segmentIndex >= unit->nSegments)
+	{
+		return PICO_SEGMENT_OUT_OF_RANGE;
+	}
+	if (!unit->captures[segmentIndex].valid)
+	{
+		return (unit->state == SIM_STATE_ARMED) ? PICO_DEVICE_SAMPLING : PICO_NO_SAMPLES_AVAILABLE;
+	}
+	// the trigger sample comes phaseNs after the threshold crossing
+	*time = -(int64_t)(unit->captures[segmentIndex].phaseNs * 1000.0);
+	*timeUnits = PS2000A_PS;
+	return PICO_OK;
+}
+
+PREF0 PREF1 PICO_STATUS PREF2 PREF3(ps2000aGetValuesBulk)(int16_t handle, uint32_t* noOfSamples, uint32_t fromSegmentIndex, uint32_t toSegmentIndex, uint32_t downSampleRatio, PS2000A_RATIO_MODE downSampleRatioMode, int16_t* overflow)
+{
+	SIM_UNIT* unit = SimGetUnit(handle);
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	uint32_t wanted;
+	uint32_t fewest;
+	uint32_t count;
+	uint64_t bytes;
+	PICO_STATUS status = PICO_OK;
+
+	if (unit == NULL)
+	{
+		return PICO_INVALID_HANDLE;
+	}
+	if (noOfSamples == NULL)
+	{
+		return PICO_NULL_PARAMETER;
+	}
+	std::unique_lock<std::mutex> lk(unit->lock);
+	if (fromSegmentIndex >= unit->nSegments || toSegmentIndex >= unit->nSegments)
+	{
+		return PICO_SEGMENT_OUT_OF_RANGE;
+	}
+	wanted = *noOfSamples;
+	fewest = wanted;
+	count = (toSegmentIndex + unit->nSegments - fromSegmentIndex) % unit->nSegments + 1; // segment numbers wrap around
+	bytes = unit->statBytes;
+	for (uint32_t i = 0; i < count && status == PICO_OK; i++)
+	{
+		uint32_t samples = wanted;
+		status = SimTransfer(unit, (fromSegmentIndex + i) % unit->nSegments, 0, &samples, downSampleRatio, downSampleRatioMode, (overflow != NULL) ? &overflow[i] : NULL);
+		fewest = (samples < fewest) ? samples : fewest;
+	}
+	bytes = unit->statBytes - bytes;
+	lk.unlock();
+
+	*noOfSamples = fewest;
+	SimUsbWait(unit, start, bytes); // one transfer for the whole batch
+	return status;
+}
+
+PREF0 PREF1 PICO_STATUS PREF2 PREF3(ps2000aStop)(int16_t handle)
+{
+	SIM_UNIT* unit = SimGetUnit(handle);
+
+	if (unit == NULL)
+	{
+		return PICO_INVALID_HANDLE;
+	}
+	std::unique_lock<std::mutex> lk(unit->lock);
+	SimStop(unit, lk);
+	return PICO_OK;
+}
+
+#endif // PS2000A_SIMULATED
@@ -8,12 +8,19 @@ https://github.com/picotech/picosdk-c-examples/blob/master/ps2000a/ps2000aCon/ps
 #include <string> // string manipulation for file naming
 #include <stdio.h> // input/output stuff
 #include <iostream> // input/output stuff 
-#include <conio.h>
-#include <io.h>
+#include <cmath> // std::pow, float_t
+#include <cinttypes> // PRId64 and friends, %I64d is Windows-only
+#include <chrono> // timing the collection loop
 #include <fcntl.h>
 #include "ps2000aApi.h" // device-specific header
 #include <thread>
 #include <mutex>
+#include <condition_variable> // blocking until the driver's callback fires
+#include <atomic>
+#include <algorithm> // std::nth_element and std::sort for the robust baselines
+#include <random> // simulated waveforms for DetectorBenchmark
+#include <complex> // the matched filter's FFTs
+#include <vector> // the matched filter's per-thread FFT work space
 //#include <pthreads>
 //#include <semaphore.h>
 #include <semaphore>
@@ -22,15 +29,150 @@ https://github.com/picotech/picosdk-c-examples/blob/master/ps2000a/ps2000aCon/ps
 #ifdef _WIN32
 #include "windows.h"
 #include <conio.h>
+#include <io.h>
 #include "ps2000aApi.h" //device specific header
 #else
 #include <sys/types.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <time.h>
+#include <signal.h>
 #include <termios.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <errno.h>
+
+/*
+* Stand-ins for the handful of Windows API/ CRT calls used throughout the
+* program so it also builds on Linux (e.g. against the simulated device
+* backend in SimDevice.cpp), same idea as the #else branch in the author's
+* ps2000aCon.c example
+*/
+#define Sleep(a) usleep(1000 * (a))
+#define __stdcall
+#define _strcmpi strcasecmp
+#define sprintf_s(a, ...) snprintf(a, sizeof(a), __VA_ARGS__)
+
+typedef int32_t BOOL;
+typedef int16_t SHORT;
+
+typedef struct
+{
+	uint16_t wYear;
+	uint16_t wMonth;
+	uint16_t wDayOfWeek;
+	uint16_t wDay;
+	uint16_t wHour;
+	uint16_t wMinute;
+	uint16_t wSecond;
+	uint16_t wMilliseconds;
+}SYSTEMTIME;
+
+inline void GetLocalTime(SYSTEMTIME* st)
+{
+	struct timespec ts;
+	struct tm tmv;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	localtime_r(&ts.tv_sec, &tmv);
+	st->wYear = (uint16_t)(tmv.tm_year + 1900);
+	st->wMonth = (uint16_t)(tmv.tm_mon + 1);
+	st->wDayOfWeek = (uint16_t)tmv.tm_wday;
+	st->wDay = (uint16_t)tmv.tm_mday;
+	st->wHour = (uint16_t)tmv.tm_hour;
+	st->wMinute = (uint16_t)tmv.tm_min;
+	st->wSecond = (uint16_t)tmv.tm_sec;
+	st->wMilliseconds = (uint16_t)(ts.tv_nsec / 1000000);
+}
+
+inline int32_t fopen_s(FILE** a, const char* b, const char* c)
+{
+	*a = fopen(b, c);
+	return (*a != NULL) ? 0 : -1;
+}
+
+inline char* strtok_s(char* str, const char* delim, char** context)
+{
+	return strtok_r(str, delim, context);
+}
+
+// number of bytes waiting on stdin, works for terminals (after Enter) and pipes
+inline int32_t _kbhit()
+{
+	int32_t bytesWaiting = 0;
+	ioctl(STDIN_FILENO, FIONREAD, &bytesWaiting);
+	return bytesWaiting;
+}
+
+// read a single key press without waiting for Enter (falls back to getchar() when stdin isn't a terminal)
+inline int32_t _getch()
+{
+	struct termios oldt, newt;
+	int32_t ch;
+	BOOL isterminal = (tcgetattr(STDIN_FILENO, &oldt) == 0);
+
+	if (isterminal)
+	{
+		newt = oldt;
+		newt.c_lflag &= ~(ICANON | ECHO);
+		tcsetattr(STDIN_FILENO, TCSANOW, &newt);
+	}
+	ch = getchar();
+	if (isterminal)
+	{
+		tcsetattr(STDIN_FILENO, TCSANOW, &oldt);
+	}
+	return ch;
+}
+
+/*
+* There's no asynchronous key state on Linux, and reading keys off stdin would
+* steal the answers meant for the std::cin prompts. Instead Ctrl+C stands in
+* for the 'Q' key: every SIGINT (or SIGTERM) flips the low-order "toggled"
+* bit that _kbhitinit/_kbhitpoll look at
+*/
+static volatile sig_atomic_t g_sigintcount = 0;
+
+inline void SigintHandler(int32_t signum)
+{
+	g_sigintcount = g_sigintcount + 1;
+}
+
+inline SHORT GetAsyncKeyState(int32_t key)
+{
+	static BOOL installed = 0;
+
+	if (!installed)
+	{
+		signal(SIGINT, SigintHandler);
+		signal(SIGTERM, SigintHandler); // so it can be stopped the usual way when run headless
+		installed = 1;
+	}
+	return (SHORT)(g_sigintcount & 0x0001);
+}
+#endif
+
+/*
+* The moving average and the threshold prescan have SSE2 and AVX2 versions
+* on x86-64 (see MovingAverageFiveBuffer and ThresholdPrescan), the AVX2
+* ones only run if the CPU has it.
+* GCC/ Clang need the AVX2 function marked before they'll compile its
+* intrinsics without -mavx2, MSVC doesn't
+*/
+#if defined(_M_X64) || defined(__x86_64__)
+#include <immintrin.h>
+#define SIMD_X86
+#ifdef _MSC_VER
+#include <intrin.h> // __cpuidex, _xgetbv
+#define TARGET_AVX2
+#else
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
 #endif
 
 #include <ps2000aApi.h>
@@ -54,6 +196,28 @@ typedef enum class tMode
 	MIXED
 }MODE;
 
+/*
+* How BlockPeakFinding works out the baseline the peaks are measured from,
+* see BaselineEstimate
+*/
+typedef enum class tBaselineMode
+{
+	FULL, // mean of the whole waveform, the original method
+	MEAN, // mean of the pre-trigger samples
+	TRIMMED, // mean of the pre-trigger samples left after the highest and lowest are dropped
+	MEDIAN // median of the pre-trigger samples
+}BASELINE_MODE;
+
+/*
+* Which way the PMT pulses go, picked by the sign of the peak detection
+* threshold, see PeakSearch
+*/
+typedef enum class tPolarity
+{
+	NEGATIVE, // downward pulses, the usual PMT base
+	POSITIVE // upward pulses, from a base wired the other way up (or an inverting amplifier)
+}POLARITY;
+
 typedef struct
 {
 	int16_t DCcoupled;
@@ -81,6 +245,106 @@ typedef struct tPwq
 	PS2000A_PULSE_WIDTH_TYPE type;
 }PWQ;
 
+#define		UNIT_SERIAL_LENGTH	32 // room for a unit's batch/ serial number, used by UNIT below
+#define		MATCHED_FILTER_MAX_TAPS	256 // longest pulse template the matched filter detector correlates with, used by PEAK_DETECTOR below
+
+/*
+* Where in a unit's waveforms the baseline comes from, and each channel's
+* baseline carried over from one event to the next. start and samples are
+* set before the analysis workers start, the averages are updated under lock by
+* whichever analysis worker finishes an event
+*/
+typedef struct tBaselineState
+{
+	uint32_t start; // first pre-trigger sample the baseline is taken from
+	uint32_t samples; // number of them, 0 if there's no pre-trigger window to take it from
+	BOOL primed[PS2000A_MAX_CHANNELS]; // FALSE until the channel's first estimate
+	float_t average[PS2000A_MAX_CHANNELS]; // exponentially weighted moving average of the estimates
+	std::mutex lock; // the analysis workers fold their estimates into average one at a time
+}BASELINE_STATE;
+
+/*
+* What a thread is for, which decides where ThreadPlace puts it
+*/
+typedef enum class tThreadRole
+{
+	ACQUISITION, // a unit's acquisition thread, arming the scope and reading it out
+	WORKER // everything else: analysis workers, search threads, the watchdog
+}THREAD_ROLE;
+
+/*
+* The peak detectors BlockPeakFinding can run, see DetectorSelect
+*/
+typedef enum class tDetectorKind
+{
+	MOVING_AVERAGE, // 5-point moving average and threshold, the original search (PeakSearch)
+	DERIVATIVE, // turning points of the smoothed signal, with hysteresis (DerivativeDetector)
+	MATCHED_FILTER, // correlation with the expected pulse shape (MatchedFilterDetector)
+	AUTO // not a detector, DetectorBenchmark picks one of the others
+}DETECTOR_KIND;
+
+/*
+* Runs a configured detector on one waveform, see PEAK_DETECTOR
+*/
+typedef uint16_t(*PEAK_DETECTOR_RUN)(const struct tPeakDetector* detector, const int16_t* dataBuffer, uint32_t sampleCount, float_t baseline, uint32_t* indices, uint16_t maxnumpeaks);
+
+/*
+* A peak detector: DetectorConfigure fills it in once, then run is called on
+* each waveform and writes the peaks it finds into the caller's indices
+* array, laid out like BlockPeakFinding's. Read-only once DetectorConfigure
+* has written it, so the analysis workers share it
+*/
+typedef struct tPeakDetector
+{
+	DETECTOR_KIND kind;
+	const char* name; // for the prints
+	PEAK_DETECTOR_RUN run; // the detector itself, instantiated for polarity
+	POLARITY polarity; // which way the pulses go
+	int32_t thresh; // g_peakthresh in ADC counts
+	int32_t hysteresis; // how far the derivative detector's signal has to turn back before it counts as a turning point, ADC counts
+	uint32_t taps; // length of the matched filter's template, in samples
+	uint32_t lag; // where in the template the pulse peaks, added to the matched filter's peak indices
+	float_t weightsum; // sum of the weights, for taking the baseline back out
+	float_t weights[MATCHED_FILTER_MAX_TAPS]; // the template, scaled so a pulse that matches it comes out at its own height
+	uint32_t fftsize; // size of the matched filter's overlap-save FFTs, 0 to correlate directly (short templates)
+	std::complex<float_t>* spectrum; // FFT of the time reversed template, scaled for the inverse FFT, fftsize entries
+	std::complex<float_t>* twiddles; // e^(-2 pi i k / fftsize) for k < fftsize / 2
+}PEAK_DETECTOR;
+
+/*
+* Threads that share out the moving average detector's search of long
+* waveforms, see SearchPoolRun. Runs one job at a time, split into chunks
+* that the threads (and the one that posted the job) take in turn
+*/
+typedef struct tSearchPool
+{
+	std::mutex lock; // guards everything below but nextchunk
+	std::mutex job; // held by the thread whose job the pool is running
+	std::condition_variable wake; // a job was posted
+	std::condition_variable idle; // a thread is done with the job
+	uint32_t numthreads; // 0 on a single core machine, the searches then aren't split
+	uint64_t generation; // bumped for each job, so the threads can tell a new one from the one they just did
+	uint32_t busy; // threads that haven't finished the job yet
+	void (*work)(void* context, uint32_t chunk); // searches one chunk
+	void* context;
+	uint32_t numchunks;
+	std::atomic<uint32_t> nextchunk; // the next chunk to take
+}SEARCH_POOL;
+
+/*
+* A waveform split into chunks for ParallelPeakSearch, and each chunk's peaks
+*/
+typedef struct tSearchChunks
+{
+	const int16_t* dataBuffer;
+	uint32_t sampleCount;
+	uint32_t chunkSamples; // samples per chunk, the last one can be shorter
+	int32_t thresh; // ADC counts
+	float_t baseline; // ADC counts
+	uint16_t maxnumpeaks;
+	uint32_t* results; // maxnumpeaks + 1 entries per chunk, each laid out like BlockPeakFinding's
+}SEARCH_CHUNKS;
+
 typedef struct
 {
 	int16_t					handle;
@@ -94,14 +358,40 @@ typedef struct
 	int16_t					digitalPorts;
 	int16_t					awgBufferSize;
 	double					awgDACFrequency;
+	int8_t					serial[UNIT_SERIAL_LENGTH]; // batch/ serial number the unit was opened by, tells the units' events apart in the peak file
+	BASELINE_STATE			baseline; // pre-trigger baseline tracking for the peak finding
+	PEAK_DETECTOR			detector; // the block modes' peak detector, set up by DetectorConfigure
 }UNIT;
 
-typedef struct tBufferInfo
+/*
+* When an event happened, written to the peak file with it: a monotonic host
+* timestamp plus the driver's estimate of where the trigger threshold was
+* crossed relative to the trigger sample
+*/
+typedef struct tEventTime
 {
-	UNIT* unit; // unit struct where the handle is stored
-	MODE mode; // ANALOGUE, DIGITAL, etc. 
-	int16_t* driverBuffer; // pointer to the buffer where the device dumps its data after a run
-} BUFFER_INFO;
+	int64_t hostns; // ns since g_collectionstart
+	int64_t triggeroffsetps; // ps from the trigger sample to the threshold crossing (ps2000aGetTriggerTimeOffset64), 0 without a trigger
+} EVENT_TIME;
+
+/*
+* Keeps the device health check and the 'Q' key polling off the acquisition
+* loop, which used to ping the device and poll the key before every single
+* capture: the watchdog thread does both at a low rate and raises the stop
+* token, the loop and the data handlers just check it
+*/
+typedef struct tWatchdog
+{
+	std::thread thread;
+	std::mutex lock;
+	std::condition_variable cv; // wakes the watchdog thread up early when it's told to quit
+	BOOL quit; // guarded by lock, tells the watchdog thread to exit
+	std::atomic<BOOL> stop; // the stop token, raised once the collection should wind down
+	std::atomic<PICO_STATUS> devicestatus; // PICO_OK until a ping fails
+	UNIT* units; // the units to keep an eye on
+	int16_t numunits;
+	SHORT qinit; // initial state of the 'Q' key
+} WATCHDOG;
 
 uint16_t inputRanges[PS2000A_MAX_RANGES] = {
 	10,
@@ -140,113 +430,384 @@ typedef struct tGlobalPointers
 #define		REG_POINTER		0
 #define		FILE_POINTER	1
 
-#define		MULTI_THREAD	0 // whether ot not to multithread the program, 0 for no, 1 for yes
-#define		NUM_THREADS		3 // number of threads to use, if multithreading the program
+#define		ANALYSIS_MAX_THREADS	6 // most analysis workers a unit's block mode pipeline runs, fewer on machines without the cores for them
+#define		BLOCK_MAX_PEAKS		9 // most peaks looked for in a block mode waveform, same as BlockPeakFinding's default
+#define		NUM_DRIVER_BUFFERS	(ANALYSIS_MAX_THREADS + 2) // driver buffers rotated through in block mode, one being filled, one per worker and one to absorb the odd slow disk write
+#define		CACHE_LINE_BYTES	64 // sample buffers and buffer pool blocks start on a cache line of their own
+#define		POOL_BLOCK_BYTES	128 // size of the buffer pool's blocks, room for both channels' peak indices in coincidence mode
+#define		POOL_BLOCKS			(MAX_UNITS * (NUM_DRIVER_BUFFERS + 2)) // buffer pool blocks, enough for peak indices on every unit's buffers at once
+#define		READY_WAIT_MS	250 // how long to block waiting on the driver before checking the stop token
+#define		CAPTURE_RING_SIZE	16 // completed captures the callback can queue up before the acquisition thread takes them off
+#define		WATCHDOG_KEY_MS		50 // how often the watchdog checks for the 'Q' key
+#define		WATCHDOG_PING_MS	1000 // how often the watchdog checks the device is still connected
+
+#define		ADAPTIVE_MIN_EVENTS		500 // two-peak events needed before the adaptive capture window will shrink
+#define		ADAPTIVE_BINS			100 // decay time histogram bins, spread over the post-trigger window asked for
+#define		ADAPTIVE_TAIL_FRACTION	0.01 // fraction of the two-peak events the adaptive capture window may cut off (accidental coincidences fill the tail evenly)
+#define		ADAPTIVE_MARGIN			1.25 // the adaptive capture window is kept this much longer than the cutoff
+#define		ADAPTIVE_SLACK_SAMPLES	64 // extra samples the adaptive capture window keeps for the first peak landing after the trigger
+
+#define		BASELINE_GUARD_SAMPLES	8 // pre-trigger samples right before the trigger left out of the baseline, the pulse is already rising there
+#define		BASELINE_MAX_SAMPLES	1024 // most pre-trigger samples the baseline is taken from (the ones closest to the trigger)
+#define		BASELINE_TRIM_FRACTION	0.2 // fraction of the highest and of the lowest pre-trigger samples the trimmed mean drops
+#define		BASELINE_EWMA_WEIGHT	0.1 // weight of each event's own estimate in the baseline carried across events (1 to not carry it over)
+#define		PEAK_TILE_SAMPLES	64 // samples BlockPeakFinding smooths at a time, also the most it smooths past a candidate region when there's no peak there
+#define		PULSE_RISE_NS		4.0 // rise time constant of the PMT pulses, for the matched filter's template
+#define		PULSE_FALL_NS		20.0 // fall time constant of the PMT pulses
+#define		MATCHED_FILTER_LENGTH	5.0 // fall time constants the matched filter's template covers
+#define		MATCHED_FILTER_FFT_TAPS	32 // templates at least this long are correlated with overlap-save FFTs instead of directly
+#define		MATCHED_FILTER_FFT_FACTOR	8 // the overlap-save FFTs are at least this many times the template length
+#define		PARALLEL_SEARCH_SAMPLES	1048576 // waveforms at least this long are split between the search threads (the device holds up to 2^25 samples)
+#define		PARALLEL_CHUNK_SAMPLES	65536 // samples per chunk of a split waveform, 128 kB fits in the L2 cache
+#define		SEARCH_MAX_THREADS	16 // most threads the searches are split between, besides the one doing the analysis
+#define		DERIVATIVE_HYSTERESIS	0.5 // fraction of the peak threshold the derivative detector's signal has to turn back by
+#define		MUON_LIFETIME_NS	2197.0 // for the decays DetectorBenchmark simulates
+#define		DETECTOR_BENCH_WAVEFORMS	200 // simulated waveforms DetectorBenchmark runs each detector on
+#define		DETECTOR_BENCH_TOLERANCE_NS	24 // how far off the true peak a detected one can be and still count
+#define		DETECTOR_MIN_EFFICIENCY	0.95 // fraction of the simulated decays a detector has to find for DetectorBenchmark to pick it
+
+#define		AGGREGATE_RATIO	64 // samples per min/max pair in the first stage of the two-stage readout
+#define		MAX_REGIONS		8 // most regions the two-stage readout reads at full resolution before it just reads everything
+
+#define		STREAM_BUFFER_SAMPLES	1048576 // size of the driver's (overview) buffer in streaming mode, several ms worth of data even at the fastest streaming rates
+#define		STREAM_BASELINE_SAMPLES	50100 // number of recent samples the streaming baseline is averaged over, the length of a block mode waveform
+#define		STREAM_PRE_SAMPLES		100 // samples before the first peak written out with a streamed waveform, same as block mode's pretrigger
+#define		STREAM_MAX_PEAKS		9 // most peaks recorded per streamed event, same as BlockPeakFinding's default
+
+#define		MAX_UNITS			8 // most scopes driven at once, each on its own acquisition thread
+
+#define		PWQ_REFERENCE_NS	8 // with the pulse width qualifier off, trigger pulses narrower than this are still counted as noise
+#define		TRIGGER_JITTER_SAMPLES	2 // how far from the trigger point to look for the trigger pulse
+
+#define		DEADTIME_BINS		24 // dead time histogram bins, bin k counts re-arms that took [2^k, 2^(k+1)) us (bin 0 anything under 2 us)
+#define		TIMING_REPORT_MS	10000 // how often the watchdog prints the live time and stage latencies
+
+#define		MAX_CORES			1024 // most cores ThreadPlace can pick from, CPU_SETSIZE on Linux (a Windows processor group has 64)
+#define		REALTIME_PRIORITY	40 // SCHED_FIFO priority of pinned acquisition threads, under the kernel's interrupt threads (50) so the USB interrupts still get serviced
+
+/*
+* The cores the process is allowed to run on (its affinity mask, which
+* taskset or a cpuset can narrow down), see ThreadCoresInit
+*/
+typedef struct tCoreSet
+{
+	uint32_t count; // number of allowed cores
+	uint32_t cores[MAX_CORES]; // their numbers, lowest first
+}CORE_SET;
+
+/*
+* Bounded lock-free queue of driver buffer indices: each cell's sequence
+* number says whether it's free to be pushed into or holds a value to be
+* popped on the current lap round the ring, so pushing and popping threads
+* only ever race each other on one compare-exchange
+*/
+typedef struct tBufferQueue
+{
+	std::atomic<uint64_t> sequence[NUM_DRIVER_BUFFERS];
+	uint32_t value[NUM_DRIVER_BUFFERS];
+	std::atomic<uint64_t> head; // next cell to pop
+	std::atomic<uint64_t> tail; // next cell to push into
+}BUFFER_QUEUE;
+
+/*
+* Preallocated pool of small per-event buffers (the peak indices), so the
+* acquisition and analysis don't go to the heap once they're running
+* - the free blocks are a lock-free stack, head holds the top block in its
+* low half and a count of pops in its high half, so a pop can't be fooled by
+* the block it read being popped and pushed back in between
+*/
+typedef struct tBufferPool
+{
+	alignas(CACHE_LINE_BYTES) uint8_t blocks[POOL_BLOCKS][POOL_BLOCK_BYTES];
+	std::atomic<uint32_t> next[POOL_BLOCKS]; // the block under each one on the stack, POOL_BLOCKS at the bottom
+	std::atomic<uint64_t> head; // see above
+	std::atomic<uint64_t> misses; // times the pool ran dry (or the buffer was too big for it) and the heap was used
+}BUFFER_POOL;
+
+/*
+* A completed capture, as the driver's callback reported it
+*/
+typedef struct tCaptureDescriptor
+{
+	uint64_t arm; // which arming of the scope (counting from 1) the capture came from
+	uint32_t segmentIndex; // first memory segment the capture filled
+	uint32_t numSegments; // how many segments the run was set up to fill
+	uint32_t sampleCount; // samples per segment the run was set up for
+	int64_t readyns; // host time the callback fired (ns since g_collectionstart), as close to the capture as the host gets
+	PICO_STATUS status; // what the driver passed the callback
+}CAPTURE_DESCRIPTOR;
 
-/*struct tThreadBuffers
+/*
+* Replaces the plain BOOL ready flag the callback used to set while the
+* acquisition loop spun on it with Sleep(0): a single-producer/ single-consumer
+* ring of CAPTURE_DESCRIPTORs from the driver's callback (the only producer)
+* to the unit's acquisition thread (the only consumer)
+* - the callback's push is wait-free, it fills the slot at tail and publishes
+* it by moving tail on, or counts the capture in dropped if the ring is full
+* - the acquisition thread takes whatever has come in off the ring at once,
+* so captures that completed while it was busy aren't lost or mixed up with
+* the one it's waiting for
+* - head and tail sit on cache lines of their own so the two threads aren't
+* passing one line back and forth
+* - the lock is only for parking the acquisition thread while the ring is
+* empty, the callback only touches it if the thread has said it's parked
+*/
+typedef struct tCaptureRing
 {
+	CAPTURE_DESCRIPTOR slots[CAPTURE_RING_SIZE];
+	alignas(CACHE_LINE_BYTES) std::atomic<uint64_t> tail; // next slot the callback fills, only moved by the callback
+	alignas(CACHE_LINE_BYTES) std::atomic<uint64_t> head; // next slot to be taken off, only moved by the acquisition thread
+	alignas(CACHE_LINE_BYTES) std::atomic<uint64_t> arm; // the arming the callback's next capture belongs to, see CaptureRingArm
+	std::atomic<uint32_t> armsegment; // what that run was set up for, copied into its descriptor
+	std::atomic<uint32_t> armsegments;
+	std::atomic<uint32_t> armsamples;
+	std::atomic<BOOL> parked; // whether the acquisition thread is waiting on cv
+	std::atomic<uint64_t> dropped; // captures the callback couldn't queue up, the ring was full
+	std::atomic<uint64_t> stale; // captures taken off the ring after the run they belonged to was given up on
 	std::mutex lock;
-	std::counting_semaphore<NUM_THREADS> sem; // semaphore to make sure we still have buffers to hand out
-	uint32_t numThreads; // number of threads the struct holds buffers for
-	int16_t** workBuffers; // work buffers for the smooth buffer (peak detection algorithm)
-	int16_t** driverBuffers; // device buffers for the s
-	BOOL* inUse; // tracks whether workBuffer[i] and driverBuffer[i] are currently in use
-};*/
+	std::condition_variable cv;
+}CAPTURE_RING;
+
+/*
+* Block mode pipeline: the scope fills one driver buffer while the buffers it
+* filled before are analysed by a fixed pool of workers, so the scope can be
+* re-armed as soon as the data is off of it rather than after the analysis
+* and file writing are done
+* - filled buffers go to the workers and analysed ones come back to the
+* acquisition thread through lock-free queues, the lock is only for parking
+* a thread that has nothing to do
+* - the workers find peaks in whatever order they get to them, the peak
+* records are written out in the order the buffers were captured
+*/
+typedef struct tAnalysisPipeline
+{
+	std::mutex lock; // for parking on the condition variables
+	std::condition_variable workready; // signalled when a buffer is queued up and a worker is parked
+	std::condition_variable bufferfree; // signalled when a buffer is recycled and the acquisition thread is parked
+	std::atomic<uint32_t> parkedworkers; // workers waiting on workready
+	std::atomic<BOOL> acquirerparked; // whether the acquisition thread is waiting on bufferfree
+	std::thread workers[ANALYSIS_MAX_THREADS];
+	uint32_t numworkers;
+	UNIT* unit;
+	int16_t* buffers[NUM_DRIVER_BUFFERS]; // the driver buffers, all sampleCount long
+	BUFFER_QUEUE filled; // buffers waiting on a worker, oldest first
+	BUFFER_QUEUE recycled; // buffers the driver can be given
+	uint64_t sequence[NUM_DRIVER_BUFFERS]; // order each buffer's waveform was captured in
+	uint32_t sampleCounts[NUM_DRIVER_BUFFERS]; // number of samples the driver put in each buffer
+	EVENT_TIME times[NUM_DRIVER_BUFFERS]; // when each buffer's event happened
+	uint64_t submitns[NUM_DRIVER_BUFFERS]; // host time each buffer was submitted, for the queue stage's latency
+	uint32_t* indices[NUM_DRIVER_BUFFERS]; // each buffer's peak finding results until they're recorded
+	std::atomic<uint32_t> analysed[NUM_DRIVER_BUFFERS]; // by capture order modulo NUM_DRIVER_BUFFERS, 1 + the buffer whose analysis is done, 0 if it isn't yet
+	std::atomic<BOOL> recording; // held by whichever worker is writing records out
+	std::atomic<uint64_t> nextrecord; // capture order of the next buffer to be recorded
+	uint64_t nextsubmit; // capture order of the next buffer submitted, acquisition thread only
+	uint32_t bufferSamples; // samples each channel has room for in a driver buffer, channel B's start this far in
+	uint32_t numChannels; // channels in each driver buffer, 2 in coincidence mode
+	int32_t timeIntervalNanoseconds;
+	uint32_t downsampleratio;
+	std::atomic<BOOL> running; // FALSE once the workers have been told to finish up
+} ANALYSIS_PIPELINE;
+
+/*
+* Streaming mode: the driver writes each chunk into driverBuffer at the
+* startIndex it reports to the callback, the callback copies it over to
+* appBuffer and the data is processed once ps2000aGetStreamingLatestValues
+* returns
+*/
+typedef struct tStreamBuffer
+{
+	int16_t* driverBuffer; // buffer registered with the driver, STREAM_BUFFER_SAMPLES long
+	int16_t* appBuffer; // chunks copied out of driverBuffer by the callback, STREAM_BUFFER_SAMPLES long
+	uint32_t appSamples; // number of samples waiting in appBuffer
+	int16_t overflow; // over-range flags of the chunks in appBuffer, bit 0 for channel A
+	uint64_t totalSamples; // samples streamed since the start
+	uint32_t sampleInterval; // ns per sample, as set by the driver
+	BOOL running; // TRUE between ps2000aRunStreaming and ps2000aStop
+} STREAM_BUFFER;
+
+/*
+* Streaming mode version of everything BlockPeakFinding keeps in local
+* variables for a single waveform. The stream arrives in chunks of whatever
+* size the driver had ready, so the smoothing window, the baseline and any
+* peak or event in progress all carry over from one chunk to the next
+*/
+typedef struct tStreamPeakState
+{
+	UNIT* unit;
+	int16_t window[5]; // the most recent raw samples, for the 5-point moving average
+	uint32_t windowPos; // where the next sample goes in window
+	uint64_t sampleIndex; // index (since streaming started) of the next raw sample
+	float_t baseline; // average of the most recent STREAM_BASELINE_SAMPLES samples (approximately)
+	uint64_t baselineWeight; // number of samples in the baseline average
+	int16_t thresh; // g_peakthresh in ADC counts
+	int16_t trigger; // g_trigthresh in ADC counts, a peak has to pass it to start a new event
+	uint32_t sampleInterval; // ns per sample
+	BOOL triggered; // the raw signal passed the trigger level during the current dip below the baseline
+	BOOL closedmidpulse; // the last event took the peak of a pulse still in progress, the rest of it is skipped until the baseline
+	int64_t peakIndex; // sample index of the lowest point of the peak in progress, -1 if none
+	int64_t chunkns; // host time the chunk being processed arrived (ns since g_collectionstart)
+	uint64_t chunkEnd; // sample index just past the end of the chunk being processed
+	int16_t peakValue; // smoothed value at peakIndex
+	uint16_t numpeaks; // peaks found so far in the event in progress, 0 if none in progress
+	uint64_t peaks[STREAM_MAX_PEAKS]; // their sample indices
+	uint64_t eventSamples; // how many samples after the first peak later peaks still belong to the same event
+	int16_t* history; // ring buffer of the most recent raw samples, for writing out waveforms
+	uint64_t historyMask; // history holds historyMask + 1 samples (a power of 2)
+	int16_t* eventBuffer; // an event's waveform, copied out of history in order
+	uint32_t* indices; // eventBuffer relative peak indices, laid out like BlockPeakFinding's return value
+} STREAM_PEAK_STATE;
+
+/*
+* Decay time distribution the adaptive capture window is based on, written
+* by whichever thread records the events and read by the acquisition loop
+*/
+typedef struct tAdaptiveWindow
+{
+	std::atomic<uint64_t> events; // number of two-peak events recorded
+	std::atomic<uint64_t> histogram[ADAPTIVE_BINS]; // time between the two peaks, bins are g_posttriggerns / ADAPTIVE_BINS wide
+} ADAPTIVE_WINDOW;
+
+/*
+* The stages of an acquisition cycle, timed separately so it's clear where
+* the dead time goes. Arm through handoff run on the acquisition thread
+* between one trigger and the scope being armed for the next, analysis and
+* record run wherever the peak finding does (the analysis workers in block
+* mode, inline in rapid block mode)
+*/
+typedef enum tStage
+{
+	STAGE_ARM, // ps2000aRunBlock
+	STAGE_WAKE, // callback firing to the acquisition thread waking up
+	STAGE_READOUT, // ps2000aGetValues/ ps2000aGetValuesBulk (the whole two-stage readout when it's on)
+	STAGE_STOP, // ps2000aStop
+	STAGE_HANDOFF, // trigger width check, passing the buffer to the analysis workers and registering the next one
+	STAGE_QUEUE, // buffer being passed to the analysis workers to one of them picking it up
+	STAGE_ANALYSIS, // BlockPeaktoPeak/ CoincidencePeakFinding
+	STAGE_RECORD, // RecordPeakInfo, writing the peak file and any waveforms
+	NUM_STAGES
+} STAGE;
+
+/*
+* Live and dead time accounting for block and rapid block mode, written by
+* the acquisition and analysis threads of every unit, read by the watchdog's
+* periodic report and the summary at the end. Live time runs from the scope
+* being armed to its callback firing, dead time from the callback to the
+* scope being armed again
+*/
+typedef struct tTiming
+{
+	std::atomic<uint64_t> cycles; // number of re-arms (the dead time histogram's entries)
+	std::atomic<uint64_t> livens; // time spent armed, waiting on triggers
+	std::atomic<uint64_t> deadns; // time spent between a capture and the next re-arm
+	std::atomic<uint64_t> deadmaxns; // longest single re-arm
+	std::atomic<uint64_t> deadhistogram[DEADTIME_BINS]; // dead time per re-arm, see DEADTIME_BINS
+	std::atomic<uint64_t> stagecount[NUM_STAGES]; // times each stage has run
+	std::atomic<uint64_t> stagens[NUM_STAGES]; // total time spent in each stage
+	std::atomic<uint64_t> stagemaxns[NUM_STAGES]; // longest run of each stage
+} TIMING;
+
+/*
+* Plain copy of the TIMING totals, for working out what happened since the
+* last periodic report
+*/
+typedef struct tTimingSnapshot
+{
+	uint64_t cycles;
+	uint64_t livens;
+	uint64_t deadns;
+	uint64_t stagecount[NUM_STAGES];
+	uint64_t stagens[NUM_STAGES];
+} TIMING_SNAPSHOT;
+
+const char* stageNames[NUM_STAGES] = {
+	"arm",
+	"wake",
+	"readout",
+	"stop",
+	"handoff",
+	"queue",
+	"analysis",
+	"record" };
+
+/*
+* Everything one scope needs to acquire on its own: its buffers, the ready
+* event its callback signals (CallBackBlock gets this struct as pParameter),
+* the settings its data handler works out on the first run, and the thread
+* it runs on. The peak file and the counters are shared by all of them
+*/
+typedef struct tBufferInfo
+{
+	UNIT* unit; // unit struct where the handle is stored
+	MODE mode; // ANALOGUE, DIGITAL, etc. 
+	int16_t* driverBuffer; // pointer to the buffer where the device dumps its data after a run
+	uint32_t numSegments; // number of memory segments (waveforms) driverBuffer holds, back to back, 1 in regular block mode
+	uint32_t numChannels; // channels read out per waveform, 2 in coincidence mode (channel B's samples follow channel A's)
+	int16_t* aggregateBuffer; // maxima followed by minima of the two-stage readout's summary
+	int16_t* overflow; // over-range flags of the rapid block mode segments, one per segment
+	uint32_t aggregatebins; // number of bins aggregateBuffer was registered with, the minima start this far in
+	CAPTURE_RING captures; // the callback's completed captures
+	ANALYSIS_PIPELINE pipeline; // hands filled driver buffers over to this unit's analysis workers in block mode
+	STREAM_BUFFER stream; // driver and application buffers for streaming mode
+	STREAM_PEAK_STATE streamPeaks; // peak finding state carried from one streamed chunk to the next
+	BOOL firstRun; // TRUE until the data handler has set the unit up
+	int32_t timeIntervalNanoseconds; // set on the first run, along with the rest of these
+	int32_t pretriggersampleCount;
+	int32_t posttriggersampleCount;
+	int32_t sampleCount; // pretriggersampleCount + posttriggersampleCount
+	int32_t segmentSamples; // rapid block mode, samples from the start of one segment to the next
+	int32_t maxSamples;
+	uint32_t currentbuffer; // which of the pipeline's buffers is registered with the driver
+	BOOL windowshrunk; // whether the adaptive capture window has been shrunk for this unit
+	uint64_t numtriggers; // waveforms read out in full, whose trigger pulse width got checked
+	uint64_t numnarrowtriggers; // how many of them had a trigger pulse narrower than the pulse width qualifier
+	int64_t armedns; // HostTimeNs() when ps2000aRunBlock last returned, the start of the live time
+	int64_t lastreadyns; // when the previous capture's callback fired, the start of the dead time (-1 before the first capture)
+	std::thread thread; // the unit's acquisition thread
+} BUFFER_INFO;
 
 // Some global variables (author's)
 uint32_t			g_timebase = 0; // originally set to 8 by author, we'll just go with 0 (fastest sampling rate)
 int16_t				g_oversample = 1; // not used by the two system calls that take in this variable
 BOOL				g_scaleVoltages = TRUE; // indicating for print statements whether to print values in terms of ADC counts (FALSE) or in mV (TRUE)
-BOOL     			g_ready = FALSE; // global ready flag set by the callback
+WATCHDOG			g_watchdog; // device health check and 'Q' key polling, off the acquisition loop
+ADAPTIVE_WINDOW		g_adaptive; // decay times seen so far (by all units), for the adaptive capture window
+TIMING				g_timing; // live/ dead time and stage latencies (of all units)
+BUFFER_POOL			g_bufferpool; // the per-event buffers, see BufferPoolGet
 
 // Some global variables (mine)
-BOOL				g_firstRun = TRUE; // keep track if this is the first time the scope collects data so we can avoid some redundant prints and such
+std::chrono::steady_clock::time_point g_collectionstart = std::chrono::steady_clock::now(); // when the data collection loop started, event times count from here
 SHORT				g_qinit = -1; // initialization variable for 'Q' key state for global quit, using the "SHORT" type (as opposed to int16_t) because that's what the microsoft api function returns for the key state, and I just wanted them to explicitly match up
 int16_t				g_trigthresh; // threshold value for our initial trigger in mV
 int32_t				g_peakthresh; // threshold for our peak finding alg in mV
 int64_t				g_numwavestosaved = 0; // number of waveforms to save in a given session
-uint64_t			g_nummultipeakevents = 0; // how many multi-peak events we've recorded so far (just peak info)
+std::atomic<uint64_t>	g_nummultipeakevents(0); // how many multi-peak events we've recorded so far (just peak info)
+std::atomic<uint64_t>	g_numwaveforms(0); // how many waveforms have been run through the peak detection so far
+std::mutex			g_recordlock; // one unit at a time writing to the peak file/ waveform files
+uint32_t			g_numsegments = 1; // number of memory segments the scope's memory is split into, i.e. waveforms captured per run in rapid block mode
+uint32_t			g_streaminterval = 32; // requested sample interval in streaming mode (ns)
+uint32_t			g_pretriggerns = 200; // capture window before the trigger in block modes (ns), originally a hard-coded 100 samples at 2 ns
+uint32_t			g_posttriggerns = 100000; // capture window after the trigger in block modes (ns), originally a hard-coded 50000 samples at 2 ns
+BOOL				g_adaptivewindow = FALSE; // whether the capture window after the trigger shrinks to fit the decay times seen
+uint32_t			g_pwqns = 0; // how long the signal has to stay past the trigger threshold for the scope to trigger (ns), 0 for a plain level trigger
+BOOL				g_coincidence = FALSE; // whether the block modes trigger on channels A and B together (stacked paddles) rather than A alone
+BOOL				g_twostagereadout = FALSE; // whether block mode reads a min/max summary first and then only the candidate peak regions
+BASELINE_MODE		g_baselinemode = BASELINE_MODE::FULL; // how the block modes' peak finding works out the baseline
+POLARITY			g_polarity = POLARITY::NEGATIVE; // which way the pulses go, positive peak detection thresholds look for upward ones
+DETECTOR_KIND		g_detectorkind = DETECTOR_KIND::MOVING_AVERAGE; // which peak detector the block modes' full readout uses
+BOOL				g_realtime = FALSE; // whether the acquisition threads get cores to themselves at real-time priority, see ThreadPlace
+CORE_SET			g_cores; // the cores ThreadPlace shares out, filled in by ThreadCoresInit
+uint32_t			g_eventwindow = 100000; // how long after the first peak later peaks still belong to the same event in streaming mode (ns)
 FILE* g_peakfp = NULL; // file to hold peak info, making this global so it doesn't have to be passed to every function
 FILE* g_errorfp = NULL; // file to hold error log, making this global so it doesn't have to be passed to every function
-tBufferInfo			g_BufferInfo; // holds info about the buffer, most importantly a pointer to the buffer
-int16_t* g_workBuffer = NULL; // pointer to global buffer for the peak finding algorithm to work with, optional
+BUFFER_INFO			g_BufferInfo[MAX_UNITS]; // one per unit, holds its buffers and acquisition state
+int16_t				g_numunits = 0; // number of units in use
 //GLOBAL_POINTERS*	g_pointers = NULL; // struct to hold global pointers to make freeing stuff at the end cleaner
-//tThreadBuffers		g_threadBuffers;
 
 // Prefixes for file names for raw waveform data, peak to peak info, and error logging
 std::string wavefilename = "RAW_WAVEFORM_";
 std::string peakfilename = "PEAK_INFO_";
 std::string errorfilename = "ERROR_LOG_";
 
-/****************************************************************************
-* tThreadBuffersInit
-*
-* - Initializes a tThreadBuffers struct
-*
-* Parameters
-* - gpointers : points to GLOBAL_POINTERS struct where we want to add the
-* pointer newpointer to
-*
-* Returns
-* - BOOL - indicates whether the routine encountered any errors while
-* initializing the struct (FALSE) or everything went fine (TRUE)
-****************************************************************************/
-/*BOOL tThreadBuffersInit(tThreadBuffers* s, uint32_t nThreads, uint64_t bufferSize)
-{
-	s->lock.lock();
-	s->numThreads = nThreads;
-	s->driverBuffers = (int16_t**)malloc(nThreads * sizeof(int16_t*));
-	s->workBuffers = (int16_t**)malloc(nThreads * sizeof(int16_t*));
-	s->inUse = (BOOL*)malloc(nThreads * sizeof(BOOL));
-
-	for (uint32_t i = 0; i < nThreads; i++)
-	{
-		s->driverBuffers[i] = (int16_t*)malloc(bufferSize * sizeof(int16_t));
-		s->workBuffers[i] = (int16_t*)malloc(bufferSize * sizeof(int16_t));
-		s->inUse[i] = FALSE;
-	}
-	s->lock.unlock();
-	if (s->inUse && s->workBuffers && s->driverBuffers)
-	{
-		for (uint32_t i = 0; i < nThreads; i++)
-		{
-			if (s->driverBuffers[i] == NULL || s->workBuffers[i] == NULL)
-			{
-				return FALSE;
-			}
-		}
-	}
-	return TRUE;
-}*/
-
-// add comment header
-/*uint32_t tThreadBuffersUseNextFree(tThreadBuffers* s)
-{
-	uint32_t nextfree = 0;
-
-	s->lock.lock(); // possibility of deadlock?-> not if we don't require the lock for releasing
-	s->sem.acquire();
-	while (s->inUse[nextfree] == TRUE)
-	{
-		nextfree += 1 % s->numThreads;
-	}
-	s->inUse[nextfree] = TRUE;
-	s->lock.unlock();
-
-	return nextfree;
-
-}*/
-
-// add comment header
-/*void tThreadBuffersFreeBuffer(tThreadBuffers* s, int32_t buffernum)
-{
-	// questionable not locking the struct up here, but if we
-	// do that makes deadlock possible...I think this should be ok
-	s->sem.release();
-	s->inUse[buffernum] = FALSE;
-	return;
-}*/
-
 /****************************************************************************
 * tGlobalPointersFreePointers
 *
@@ -2262,11 +2823,15 @@ inline void timeUnitsPrint(PS2000A_TIME_UNITS timeUnits)
 		* use _setmode to change the mode. If you do not flush the code, you might get unexpected
 		* behavior. If you have not written data to the stream, you do not have to flush the code."
 		*/
+#ifdef _WIN32
 		fflush(stdout); // ^ what the microsoft documentation said
 		_setmode(_fileno(stdout), _O_U16TEXT); // change console output to unicode WCHAR mode or whatever the terminology is
 		wprintf(L"%lcs", (wint_t)0x03BC); // all that, for a single μ?
 		fflush(stdout); // ^ what the microsoft documentation said
 		_setmode(_fileno(stdout), _O_TEXT); // change it back to default so we can use printf and such
+#else
+		printf("\u03BCs"); // Linux terminals are UTF-8 already
+#endif
 		break;
 
 	case PS2000A_MS: // milliseconds
@@ -2506,508 +3071,4332 @@ PICO_STATUS SetDefaults(UNIT* unit)
 }
 
 /****************************************************************************
-* Callback
+* CaptureRingArm
 *
-* - Used by ps2000a data block collection calls, on receipt of data.
-*	- used by ps2000aRunBlock in this case
-*	- used to set global flags etc checked by user routines
+* - Tells a CAPTURE_RING a new run is about to be started, so the callback
+* tags its capture with it and any capture still to come from an earlier
+* run can be told apart
+* - Called by the acquisition thread just before ps2000aRunBlock
 *
 * Parameters
-* - handle : handle used to refer to the pico device being used (not  needed
-*			 here for our application)
-* - status : PICO_STATUS indicating whether or not there's an issue with the
-*	device
-* - pParameter : pointer passed from ps2000aRunBlock so that this function
-*	can pass back arbitrary data to the calling space
-*		- not used in this case, NULL pointer passed
+* - ring : pointer to the unit's CAPTURE_RING
+* - segmentIndex : first memory segment the run fills
+* - numSegments : how many segments it fills
+* - sampleCount : samples per segment
 *
 * Returns
-* - none
+* - uint64_t : the run's arming, which CaptureRingWait waits for
 ****************************************************************************/
-void __stdcall CallBackBlock(int16_t handle, PICO_STATUS status, void* pParameter)
+uint64_t CaptureRingArm(CAPTURE_RING* ring, uint32_t segmentIndex, uint32_t numSegments, uint32_t sampleCount)
 {
-	if (status != PICO_CANCELLED)
-	{
-		g_ready = TRUE;
-	}
-	return;
+	ring->armsegment.store(segmentIndex, std::memory_order_relaxed);
+	ring->armsegments.store(numSegments, std::memory_order_relaxed);
+	ring->armsamples.store(sampleCount, std::memory_order_relaxed);
+	return ring->arm.fetch_add(1, std::memory_order_release) + 1;
 }
 
 /****************************************************************************
-* MovingAverage :
+* CaptureRingPush
 *
-* - Used for data processing with the peak finding routines
-* - returns the average of the 5 inputted int16_t's
+* - Queues up a completed capture, wait-free: one slot write and one store
+* to publish it, never waits on the acquisition thread
+* - the lock is only taken to wake the acquisition thread if it's parked,
+* by then it has nothing else to do
+* - Called from the driver's thread (through the callback), the ring's only
+* producer
 *
 * Parameters
-* - a,b,c,d,e : int32_t values to be averaged, values passed will be of type
-* int16_t, the resulting conversions to int32_t will eliminate the need for
-* some casting here in the function
+* - ring : pointer to the unit's CAPTURE_RING
+* - status : what the driver passed the callback
+* - readyns : HostTimeNs() when the callback fired
 *
 * Returns
-* - int16_t : contains the average of the 5 values passed as arguments
+* - BOOL : FALSE if the ring was full and the capture was dropped
 ****************************************************************************/
-inline int16_t MovingAverageFive(int32_t a, int32_t b, int32_t c, int32_t d, int32_t e)
+BOOL CaptureRingPush(CAPTURE_RING* ring, PICO_STATUS status, int64_t readyns)
 {
-	return (int16_t)((a + b + c + d + e) / (float_t)5.0);
+	uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+	CAPTURE_DESCRIPTOR* capture;
+
+	if (tail - ring->head.load(std::memory_order_acquire) >= CAPTURE_RING_SIZE)
+	{
+		ring->dropped.fetch_add(1, std::memory_order_relaxed);
+		return FALSE;
+	}
+
+	capture = &ring->slots[tail % CAPTURE_RING_SIZE];
+	capture->arm = ring->arm.load(std::memory_order_acquire);
+	capture->segmentIndex = ring->armsegment.load(std::memory_order_relaxed);
+	capture->numSegments = ring->armsegments.load(std::memory_order_relaxed);
+	capture->sampleCount = ring->armsamples.load(std::memory_order_relaxed);
+	capture->readyns = readyns;
+	capture->status = status;
+	ring->tail.store(tail + 1, std::memory_order_release);
+
+	std::atomic_thread_fence(std::memory_order_seq_cst); // either the acquisition thread sees the capture or this sees it parked
+	if (ring->parked.load(std::memory_order_relaxed))
+	{
+		{
+			std::lock_guard<std::mutex> guard(ring->lock); // it's either still checking the ring or already asleep
+		}
+		ring->cv.notify_one();
+	}
+	return TRUE;
 }
 
 /****************************************************************************
-* ArrayAvg :
+* CaptureRingDrain
 *
-* - Used for data processing with the peak finding routines
-* - returns the average of all the points in the buffer of int16_t's as a
-* float_t
+* - Takes every capture that has come in off a CAPTURE_RING in one go (up
+* to max), parking the calling thread until one does if it's empty
+* - Called by the acquisition thread, the ring's only consumer
 *
 * Parameters
-* - buffer : pointer to the start of the the buffer/array of int16_t's to
-* be averaged
-* - sampleCount : the number of entries in the buffer
+* - ring : pointer to the unit's CAPTURE_RING
+* - captures : on exit, the captures oldest first
+* - max : room in captures
+* - timeoutMs : the longest to wait (in ms) if the ring is empty
 *
 * Returns
-* - float_t : contains the average of the first sampleCount entries in the
-* buffer
+* - uint32_t : the number of captures taken off, 0 if the wait timed out
 ****************************************************************************/
-// something something use a template?
-float_t ArrayAvg(int16_t* buffer, uint32_t sampleCount)
+uint32_t CaptureRingDrain(CAPTURE_RING* ring, CAPTURE_DESCRIPTOR* captures, uint32_t max, uint32_t timeoutMs)
 {
-	int32_t accumulator = 0;
+	uint64_t head = ring->head.load(std::memory_order_relaxed);
+	uint64_t tail = ring->tail.load(std::memory_order_acquire);
+	uint32_t count;
 
-	for (uint32_t i = 0; i < sampleCount; i++)
+	if (tail == head)
 	{
-		accumulator += (int32_t)buffer[i]; // casting to a wider type to avoid potential overflows
+		std::unique_lock<std::mutex> lk(ring->lock);
+
+		ring->parked.store(TRUE, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		ring->cv.wait_for(lk, std::chrono::milliseconds(timeoutMs), [ring, head, &tail]
+			{
+				tail = ring->tail.load(std::memory_order_acquire);
+				return tail != head;
+			});
+		ring->parked.store(FALSE, std::memory_order_relaxed);
 	}
 
-	return (float_t)accumulator / (float_t)sampleCount;
+	count = (uint32_t)(std::min)(tail - head, (uint64_t)max);
+	for (uint32_t i = 0; i < count; i++)
+	{
+		captures[i] = ring->slots[(head + i) % CAPTURE_RING_SIZE];
+	}
+	ring->head.store(head + count, std::memory_order_release); // the callback can have the slots back
+	return count;
 }
 
 /****************************************************************************
-* BlockPeakFinding
+* CaptureRingWait
 *
-* - smooths the input signal using a 5-point moving average technique, then
-* finds and returns the indices of the found peaks in the buffer array
-* - moving average ignored for first and last few points
-* - ONLY WORKS FOR DOWNWARD PEAKS (concave up)
-* - Would have to write a similar (but ultimately separate) routine for
-* upward (concave down) peak finding
-*	-unless you just flipped the data but whatever same difference
-* - Based off of a combination of the smoothing algorithm and multiple peak
-* finding algorithm from https://www.baeldung.com/cs/signal-peak-detection
+* - Waits for the capture of the run that was last armed, taking whatever
+* else has come in off the ring along with it
+* - captures of runs that were given up on (stopped before their callback
+* fired) are counted in ring->stale and skipped, a failed capture is logged
 *
 * Parameters
-* - unit : pointer to the UNIT structure, where the handle is stored
-* - databuffer : the buffer array where the device stores its data
-* - workBuffer : optional buffer to supply to the routine. If an allocated
-*	buffer is supplied, the peak finding algorithm will use it, otherwise
-*	it will allocate its own buffer and free it after its work is done
-* - sampleCount : the number of samples in the buffer
-* - globalBuffer : indicates whether or not the workBuffer is to be used
-*		- TRUE indicates use, FALSE indicates not to use
-* - maxnumpeaks : the maximum number of peaks the function will search for
-* before stopping the search and returning, default at 9 arbitrarily
+* - ring : pointer to the unit's CAPTURE_RING
+* - arm : the run's arming, from CaptureRingArm
+* - capture : on exit, the run's capture if it came in
+* - timeoutMs : the longest to wait (in ms)
 *
 * Returns
-* - uint32_t* : pointer to buffer with 10 uint32_t's. The first entry in the
-* buffer contains the number of peaks found by the algorithm (1,2,3,...)
-* The remaining entries either contain the index of the detected peak
-* (peak 1's index is stored in buffer[1], the second peak in buffer[2], etc.)
-* or are left blank
+* - BOOL : TRUE if the run's capture came in, FALSE if the wait timed out
 ****************************************************************************/
-uint32_t* BlockPeakFinding(UNIT* unit, int16_t* dataBuffer, int16_t* workBuffer, uint32_t sampleCount, BOOL globalBuffer, uint16_t maxnumpeaks = 9)
+BOOL CaptureRingWait(CAPTURE_RING* ring, uint64_t arm, CAPTURE_DESCRIPTOR* capture, uint32_t timeoutMs)
 {
-	uint32_t* indices = NULL;
-	indices = (uint32_t*)calloc((size_t)maxnumpeaks + 1, sizeof(uint32_t)); // first entry gets numpeaks, subsequent ones get index (in the buffer) of the peak from the waveform
-	int16_t peakValue = std::numeric_limits<int16_t>::infinity();
-	int16_t thresh = mv_to_adc(g_peakthresh, unit->channelSettings[PS2000A_CHANNEL_A].range, unit); // g_peakthresh needed to filter out some of the noise, a bit of a duct tape solution but it works
+	CAPTURE_DESCRIPTOR batch[CAPTURE_RING_SIZE];
+	uint32_t count = CaptureRingDrain(ring, batch, CAPTURE_RING_SIZE, timeoutMs);
+	BOOL found = FALSE;
+
+	for (uint32_t i = 0; i < count; i++)
+	{
+		if (batch[i].arm != arm)
+		{
+			ring->stale.fetch_add(1, std::memory_order_relaxed);
+			continue;
+		}
+		if (batch[i].status != PICO_OK)
+		{
+			picoerrorLog(g_errorfp, batch[i].status, __LINE__, __func__, "CallBackBlock");
+		}
+		*capture = batch[i];
+		found = TRUE;
+	}
+	return found;
+}
+
+/****************************************************************************
+* HostTimeNs
+*
+* - Monotonic host timestamp, unaffected by changes to the wall clock
+*
+* Parameters
+* - none
+*
+* Returns
+* - int64_t : ns since g_collectionstart
+****************************************************************************/
+inline int64_t HostTimeNs()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - g_collectionstart).count();
+}
+
+/****************************************************************************
+* TimingStage
+*
+* - Adds one run of an acquisition cycle stage to its latency totals
+*
+* Parameters
+* - timing : pointer to the TIMING struct
+* - stage : the stage that ran
+* - startns, endns : HostTimeNs() when the stage started and finished
+*
+* Returns
+* - none
+****************************************************************************/
+void TimingStage(TIMING* timing, STAGE stage, int64_t startns, int64_t endns)
+{
+	uint64_t ns = (endns > startns) ? (uint64_t)(endns - startns) : 0;
+	uint64_t maxns = timing->stagemaxns[stage].load(std::memory_order_relaxed);
+
+	timing->stagecount[stage].fetch_add(1, std::memory_order_relaxed);
+	timing->stagens[stage].fetch_add(ns, std::memory_order_relaxed);
+	while (ns > maxns && !timing->stagemaxns[stage].compare_exchange_weak(maxns, ns, std::memory_order_relaxed));
+}
+
+/****************************************************************************
+* TimingRearm
+*
+* - Accounts for the scope being armed again: the dead time since the
+* previous capture goes into the histogram, then the live time starts
+*
+* Parameters
+* - timing : pointer to the TIMING struct
+* - info : pointer to the unit's BUFFER_INFO, whose lastreadyns and armedns
+*	are used and updated
+* - armedns : HostTimeNs() after ps2000aRunBlock returned
+*
+* Returns
+* - none
+****************************************************************************/
+void TimingRearm(TIMING* timing, BUFFER_INFO* info, int64_t armedns)
+{
+	if (info->lastreadyns >= 0) // nothing to count before the first capture, that's setup time
+	{
+		uint64_t ns = (armedns > info->lastreadyns) ? (uint64_t)(armedns - info->lastreadyns) : 0;
+		uint64_t us = ns / 1000;
+		uint64_t maxns = timing->deadmaxns.load(std::memory_order_relaxed);
+		uint32_t bin = 0;
+
+		while (us >= 2 && bin < DEADTIME_BINS - 1)
+		{
+			us >>= 1;
+			bin++;
+		}
+		timing->cycles.fetch_add(1, std::memory_order_relaxed);
+		timing->deadns.fetch_add(ns, std::memory_order_relaxed);
+		timing->deadhistogram[bin].fetch_add(1, std::memory_order_relaxed);
+		while (ns > maxns && !timing->deadmaxns.compare_exchange_weak(maxns, ns, std::memory_order_relaxed));
+	}
+	info->armedns = armedns;
+}
+
+/****************************************************************************
+* TimingCapture
+*
+* - Accounts for the end of the live time, when the callback fired (or the
+* run was stopped without it), the dead time starts from here
+*
+* Parameters
+* - timing : pointer to the TIMING struct
+* - info : pointer to the unit's BUFFER_INFO, whose armedns is used and
+*	lastreadyns updated
+* - readyns : HostTimeNs() when the callback fired
+*
+* Returns
+* - none
+****************************************************************************/
+void TimingCapture(TIMING* timing, BUFFER_INFO* info, int64_t readyns)
+{
+	timing->livens.fetch_add((readyns > info->armedns) ? (uint64_t)(readyns - info->armedns) : 0, std::memory_order_relaxed);
+	info->lastreadyns = readyns;
+}
+
+/****************************************************************************
+* TimingSnapshotTake
+*
+* - Copies the TIMING totals
+*
+* Parameters
+* - timing : pointer to the TIMING struct
+* - snapshot : on exit, holds the totals so far
+*
+* Returns
+* - none
+****************************************************************************/
+void TimingSnapshotTake(TIMING* timing, TIMING_SNAPSHOT* snapshot)
+{
+	snapshot->cycles = timing->cycles.load(std::memory_order_relaxed);
+	snapshot->livens = timing->livens.load(std::memory_order_relaxed);
+	snapshot->deadns = timing->deadns.load(std::memory_order_relaxed);
+	for (int16_t i = 0; i < NUM_STAGES; i++)
+	{
+		snapshot->stagecount[i] = timing->stagecount[i].load(std::memory_order_relaxed);
+		snapshot->stagens[i] = timing->stagens[i].load(std::memory_order_relaxed);
+	}
+}
+
+/****************************************************************************
+* TimingReport
+*
+* - Prints the live fraction and mean stage latencies since the last report,
+* nothing if the scopes haven't been re-armed since
+*
+* Parameters
+* - timing : pointer to the TIMING struct
+* - last : the totals at the last report, updated on exit
+*
+* Returns
+* - none
+****************************************************************************/
+void TimingReport(TIMING* timing, TIMING_SNAPSHOT* last)
+{
+	TIMING_SNAPSHOT now;
+	uint64_t cycles, livens, deadns;
+
+	TimingSnapshotTake(timing, &now);
+	cycles = now.cycles - last->cycles;
+	livens = now.livens - last->livens;
+	deadns = now.deadns - last->deadns;
+	if (cycles > 0 && livens + deadns > 0)
+	{
+		printf("\n[%.0f s] %.1f%% live, %" PRIu64 " re-arms, %.3f ms dead time each (ms per stage:", HostTimeNs() * 1e-9,
+			100.0 * livens / (livens + deadns), cycles, deadns * 1e-6 / cycles);
+		for (int16_t i = 0; i < NUM_STAGES; i++)
+		{
+			if (now.stagecount[i] > last->stagecount[i])
+			{
+				printf(" %s %.3f", stageNames[i], (now.stagens[i] - last->stagens[i]) * 1e-6 / (now.stagecount[i] - last->stagecount[i]));
+			}
+		}
+		printf(")\n");
+	}
+	*last = now;
+}
+
+/****************************************************************************
+* TimingSummary
+*
+* - Prints the live time over the whole collection, the trigger rate
+* corrected for the dead time, each stage's latency and the dead time
+* histogram
+*
+* Parameters
+* - timing : pointer to the TIMING struct
+* - numwaveforms : waveforms captured over the collection
+* - numunits : the number of units that were collecting
+*
+* Returns
+* - none
+****************************************************************************/
+void TimingSummary(TIMING* timing, uint64_t numwaveforms, int16_t numunits)
+{
+	TIMING_SNAPSHOT total;
+	double liveseconds, deadseconds;
+
+	TimingSnapshotTake(timing, &total);
+	liveseconds = total.livens * 1e-9;
+	deadseconds = total.deadns * 1e-9;
+	if (liveseconds + deadseconds <= 0.0)
+	{
+		return;
+	}
+
+	// the units are live at the same time, so the corrected rate uses each one's share of the live time
+	printf("Live %.2f s, dead %.2f s (%.1f%% live), %.1f waveforms/s corrected for dead time\n", liveseconds, deadseconds,
+		100.0 * liveseconds / (liveseconds + deadseconds), (liveseconds > 0.0) ? numwaveforms * numunits / liveseconds : 0.0);
+
+	printf("Stage        count    mean ms     max ms\n");
+	for (int16_t i = 0; i < NUM_STAGES; i++)
+	{
+		if (total.stagecount[i] > 0)
+		{
+			printf("%-9s %8" PRIu64 " %10.3f %10.3f\n", stageNames[i], total.stagecount[i], total.stagens[i] * 1e-6 / total.stagecount[i],
+				timing->stagemaxns[i].load(std::memory_order_relaxed) * 1e-6);
+		}
+	}
+
+	if (total.cycles > 0)
+	{
+		printf("Dead time per re-arm (%" PRIu64 " re-arms, %.3f ms mean, %.3f ms max):\n", total.cycles, total.deadns * 1e-6 / total.cycles,
+			timing->deadmaxns.load(std::memory_order_relaxed) * 1e-6);
+		for (uint32_t bin = 0; bin < DEADTIME_BINS; bin++)
+		{
+			uint64_t count = timing->deadhistogram[bin].load(std::memory_order_relaxed);
+			char range[32];
+
+			if (count == 0)
+			{
+				continue;
+			}
+			if (bin == 0)
+			{
+				sprintf_s(range, "< 2");
+			}
+			else if (bin == DEADTIME_BINS - 1)
+			{
+				sprintf_s(range, ">= %u", 1u << bin);
+			}
+			else
+			{
+				sprintf_s(range, "%u - %u", 1u << bin, 1u << (bin + 1));
+			}
+			printf("%20s us %10" PRIu64 "\n", range, count);
+		}
+	}
+}
+
+/****************************************************************************
+* TriggerTimeOffsetPs
+*
+* - Gets the sub-sample trigger time offset of a captured waveform from the
+* driver, converted to ps
+*
+* Parameters
+* - unit : pointer to the UNIT structure, where the handle is stored
+* - segmentIndex : the memory segment the waveform was captured in
+* - offsetps : on exit, the time from the trigger sample to the threshold
+*	crossing (in ps), 0 if the driver didn't have one
+*
+* Returns
+* - PICO_STATUS : to indicate success, or if an error occurred
+****************************************************************************/
+PICO_STATUS TriggerTimeOffsetPs(UNIT* unit, uint32_t segmentIndex, int64_t* offsetps)
+{
+	PICO_STATUS status;
+	int64_t time = 0;
+	PS2000A_TIME_UNITS timeUnits = PS2000A_PS;
+	int64_t unitspersecond;
+
+	*offsetps = 0;
+	if ((status = ps2000aGetTriggerTimeOffset64(unit->handle, &time, &timeUnits, segmentIndex)) != PICO_OK)
+	{
+		picoerrorLog(g_errorfp, status, __LINE__, __func__, "ps2000aGetTriggerTimeOffset64");
+		return status;
+	}
+
+	// timeUnitsToValue gives units per second, 10^12 for ps
+	unitspersecond = (int64_t)timeUnitsToValue(timeUnits);
+	if (unitspersecond > 1000000000000)
+	{
+		*offsetps = time / (unitspersecond / 1000000000000);
+	}
+	else if (unitspersecond > 0)
+	{
+		*offsetps = time * (1000000000000 / unitspersecond);
+	}
+	return status;
+}
+
+/****************************************************************************
+* ThreadCoresInit
+*
+* - Lists the cores the process is allowed to run on, from its affinity mask
+* rather than the number of cores in the machine, which under taskset or a
+* cpuset can include cores it can't use
+* - has to be called before the collection threads start, they narrow their
+* own masks down and the ones they start inherit that
+* - falls back to every core if the mask can't be read
+*
+* Parameters
+* - set : the CORE_SET to fill in
+*
+* Returns
+* - uint32_t : the number of allowed cores
+****************************************************************************/
+uint32_t ThreadCoresInit(CORE_SET* set)
+{
+	set->count = 0;
+#ifdef _WIN32
+	DWORD_PTR processMask;
+	DWORD_PTR systemMask;
+
+	if (GetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask))
+	{
+		for (uint32_t core = 0; core < 8 * sizeof(DWORD_PTR); core++)
+		{
+			if (processMask & ((DWORD_PTR)1 << core))
+			{
+				set->cores[set->count++] = core;
+			}
+		}
+	}
+#else
+	cpu_set_t mask;
+
+	if (sched_getaffinity(0, sizeof(mask), &mask) == 0)
+	{
+		for (uint32_t core = 0; core < CPU_SETSIZE && core < MAX_CORES; core++)
+		{
+			if (CPU_ISSET(core, &mask))
+			{
+				set->cores[set->count++] = core;
+			}
+		}
+	}
+#endif
+
+	if (set->count == 0)
+	{
+		set->count = (std::min)(std::thread::hardware_concurrency(), (uint32_t)MAX_CORES);
+		for (uint32_t core = 0; core < set->count; core++)
+		{
+			set->cores[core] = core;
+		}
+	}
+	return set->count;
+}
+
+/****************************************************************************
+* ThreadPlace
+*
+* - Called by each collection thread as it starts. With g_realtime set, a
+* unit's acquisition thread is pinned to a core of its own at the top end
+* of g_cores (the last unit gets the last allowed core) and raised to
+* real-time priority, and every other thread is kept to the allowed cores
+* below them, so neither the OS nor the analysis, peak file writes and
+* console reports can hold up a re-arm
+* - Best with the top cores isolated from the scheduler (isolcpus= on
+* Linux). Does nothing if there aren't more allowed cores than units, and
+* only warns if the OS won't allow it (SCHED_FIFO needs root or
+* CAP_SYS_NICE)
+*
+* Parameters
+* - role : what the calling thread is for
+* - unitIndex : which unit the thread belongs to, only used for ACQUISITION
+*
+* Returns
+* - none
+****************************************************************************/
+void ThreadPlace(THREAD_ROLE role, int16_t unitIndex)
+{
+	uint32_t shared = g_cores.count - g_numunits; // allowed cores left over for everything but the acquisition threads
+	const char* call = NULL; // what failed, if anything
+	int error = 0;
+
+	if (!g_realtime || g_cores.count <= (uint32_t)g_numunits)
+	{
+		return;
+	}
+
+#ifdef _WIN32
+	DWORD_PTR mask = 0;
+
+	if (role == THREAD_ROLE::ACQUISITION)
+	{
+		mask = (DWORD_PTR)1 << g_cores.cores[shared + unitIndex];
+	}
+	else
+	{
+		for (uint32_t i = 0; i < shared; i++)
+		{
+			mask |= (DWORD_PTR)1 << g_cores.cores[i];
+		}
+	}
+	if (SetThreadAffinityMask(GetCurrentThread(), mask) == 0)
+	{
+		call = "SetThreadAffinityMask";
+		error = (int)GetLastError();
+	}
+	else if (role == THREAD_ROLE::ACQUISITION && !SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL))
+	{
+		call = "SetThreadPriority";
+		error = (int)GetLastError();
+	}
+#else
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	if (role == THREAD_ROLE::ACQUISITION)
+	{
+		CPU_SET(g_cores.cores[shared + unitIndex], &set);
+	}
+	else
+	{
+		for (uint32_t i = 0; i < shared; i++)
+		{
+			CPU_SET(g_cores.cores[i], &set);
+		}
+	}
+	if ((error = pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) != 0)
+	{
+		call = "pthread_setaffinity_np";
+	}
+	else if (role == THREAD_ROLE::ACQUISITION)
+	{
+		sched_param param;
+
+		param.sched_priority = REALTIME_PRIORITY;
+		if ((error = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param)) != 0)
+		{
+			call = "pthread_setschedparam";
+		}
+	}
+#endif
+
+	if (call != NULL)
+	{
+		printf("%s\n[%d] %s::%s ------ THREAD PLACEMENT ERROR (non-pico): %d\n\n", timeInfotoString().c_str(), __LINE__, __func__, call, error);
+		if (g_errorfp != NULL)
+		{
+			fprintf(g_errorfp, "%s\n[%d] %s::%s ------ THREAD PLACEMENT ERROR (non-pico): %d\n\n", timeInfotoString().c_str(), __LINE__, __func__, call, error);
+		}
+	}
+}
+
+/****************************************************************************
+* WatchdogThread
+*
+* - Runs on its own thread for the length of the collection loop so the
+* loop itself doesn't have to: checks for the 'Q' key (Ctrl+C or a SIGTERM
+* on Linux) every WATCHDOG_KEY_MS and pings the device every
+* WATCHDOG_PING_MS, raising the stop token if either calls for it
+* - prints the live time report every TIMING_REPORT_MS
+*
+* Parameters
+* - watchdog : pointer to the WATCHDOG struct
+*
+* Returns
+* - none
+****************************************************************************/
+void WatchdogThread(WATCHDOG* watchdog)
+{
+	PICO_STATUS status;
+	std::chrono::steady_clock::time_point nextping = std::chrono::steady_clock::now() + std::chrono::milliseconds(WATCHDOG_PING_MS);
+	std::chrono::steady_clock::time_point nextreport = std::chrono::steady_clock::now() + std::chrono::milliseconds(TIMING_REPORT_MS);
+	TIMING_SNAPSHOT lastreport;
+
+	ThreadPlace(THREAD_ROLE::WORKER, 0); // before taking the lock, the placement might print
+	std::unique_lock<std::mutex> lk(watchdog->lock);
+
+	TimingSnapshotTake(&g_timing, &lastreport);
+
+	while (!watchdog->quit)
+	{
+		if (_kbhitpoll(watchdog->qinit))
+		{
+			watchdog->stop.store(TRUE, std::memory_order_release);
+		}
+
+		// make sure the devices are still connected, no need for a USB round trip every event
+		if (std::chrono::steady_clock::now() >= nextping)
+		{
+			for (int16_t i = 0; i < watchdog->numunits; i++)
+			{
+				if ((status = ps2000aPingUnit(watchdog->units[i].handle)) != PICO_OK)
+				{
+					printf("Issue with USB connection to device %s!\n", (char*)watchdog->units[i].serial);
+					picoerrorLog(g_errorfp, status, __LINE__, __func__, "ps2000aPingUnit");
+					watchdog->devicestatus.store(status, std::memory_order_relaxed);
+					watchdog->stop.store(TRUE, std::memory_order_release);
+				}
+			}
+			nextping += std::chrono::milliseconds(WATCHDOG_PING_MS);
+		}
+
+		if (std::chrono::steady_clock::now() >= nextreport)
+		{
+			TimingReport(&g_timing, &lastreport);
+			nextreport += std::chrono::milliseconds(TIMING_REPORT_MS);
+		}
+
+		watchdog->cv.wait_for(lk, std::chrono::milliseconds(WATCHDOG_KEY_MS), [watchdog] { return watchdog->quit; });
+	}
+}
+
+/****************************************************************************
+* WatchdogStart
+*
+* - Lowers the stop token and starts the watchdog thread
+*
+* Parameters
+* - watchdog : pointer to the WATCHDOG struct
+* - units : array of the UNIT structures in use
+* - numunits : the number of units in units
+* - qinit : the initial state of the 'Q' key (from _kbhitinit)
+*
+* Returns
+* - none
+****************************************************************************/
+void WatchdogStart(WATCHDOG* watchdog, UNIT* units, int16_t numunits, SHORT qinit)
+{
+	watchdog->units = units;
+	watchdog->numunits = numunits;
+	watchdog->qinit = qinit;
+	watchdog->quit = FALSE;
+	watchdog->stop.store(FALSE, std::memory_order_relaxed);
+	watchdog->devicestatus.store(PICO_OK, std::memory_order_relaxed);
+	watchdog->thread = std::thread(WatchdogThread, watchdog);
+}
+
+/****************************************************************************
+* WatchdogStop
+*
+* - Tells the watchdog thread to exit and waits for it, safe to call when
+* it was never started
+*
+* Parameters
+* - watchdog : pointer to the WATCHDOG struct
+*
+* Returns
+* - PICO_STATUS : PICO_OK, or the status of the ping that found the device
+* missing
+****************************************************************************/
+PICO_STATUS WatchdogStop(WATCHDOG* watchdog)
+{
+	if (watchdog->thread.joinable())
+	{
+		{
+			std::lock_guard<std::mutex> lk(watchdog->lock);
+			watchdog->quit = TRUE;
+		}
+		watchdog->cv.notify_one();
+		watchdog->thread.join();
+	}
+	return watchdog->devicestatus.load(std::memory_order_relaxed);
+}
+
+/****************************************************************************
+* StopRequested
+*
+* - Checks the stop token, cheap enough to call from the acquisition loop
+*
+* Parameters
+* - watchdog : pointer to the WATCHDOG struct
+*
+* Returns
+* - BOOL : TRUE once the collection should wind down, FALSE otherwise
+****************************************************************************/
+inline BOOL StopRequested(WATCHDOG* watchdog)
+{
+	return watchdog->stop.load(std::memory_order_acquire);
+}
+
+/****************************************************************************
+* AlignedAlloc
+*
+* - Allocates a sample buffer starting on a cache line, so buffers handed
+* between threads never share a line and the SIMD loads line up
+* - clears it once, which also gets the pages faulted in now instead of
+* on the first capture
+*
+* Parameters
+* - bytes : the size of the buffer
+*
+* Returns
+* - void* : the buffer, NULL if it couldn't be allocated. Freed with
+* AlignedFree
+****************************************************************************/
+void* AlignedAlloc(size_t bytes)
+{
+	size_t rounded = (bytes + CACHE_LINE_BYTES - 1) / CACHE_LINE_BYTES * CACHE_LINE_BYTES; // aligned_alloc wants a whole number of lines
+	void* buffer;
+
+#ifdef _WIN32
+	buffer = _aligned_malloc(rounded, CACHE_LINE_BYTES);
+#else
+	buffer = aligned_alloc(CACHE_LINE_BYTES, rounded);
+#endif
+	if (buffer != NULL)
+	{
+		memset(buffer, 0, rounded);
+	}
+	return buffer;
+}
+
+/****************************************************************************
+* AlignedFree
+*
+* - Frees a buffer from AlignedAlloc, does nothing with NULL
+*
+* Parameters
+* - buffer : the buffer
+*
+* Returns
+* - none
+****************************************************************************/
+void AlignedFree(void* buffer)
+{
+#ifdef _WIN32
+	_aligned_free(buffer);
+#else
+	free(buffer);
+#endif
+}
+
+/****************************************************************************
+* BufferPoolInit
+*
+* - Puts all of a BUFFER_POOL's blocks on its free stack
+*
+* Parameters
+* - pool : the pool
+*
+* Returns
+* - none
+****************************************************************************/
+void BufferPoolInit(BUFFER_POOL* pool)
+{
+	for (uint32_t i = 0; i < POOL_BLOCKS; i++)
+	{
+		pool->next[i].store(i + 1, std::memory_order_relaxed);
+	}
+	pool->misses.store(0, std::memory_order_relaxed);
+	pool->head.store(0, std::memory_order_release);
+}
+
+/****************************************************************************
+* BufferPoolGet
+*
+* - Stand-in for calloc for the buffers every event needs: pops a block off
+* the pool's free stack without taking a lock, safe from any thread
+* - only falls back on calloc if the pool has run dry or the buffer is
+* bigger than a block, which is counted in pool->misses
+* - clears just the count * size bytes asked for, like calloc would
+*
+* Parameters
+* - pool : the pool
+* - count : number of elements
+* - size : size of each element
+*
+* Returns
+* - void* : the buffer, NULL if it couldn't be allocated. Given back with
+* BufferPoolPut
+****************************************************************************/
+void* BufferPoolGet(BUFFER_POOL* pool, size_t count, size_t size)
+{
+	uint64_t head = pool->head.load(std::memory_order_acquire);
+	size_t bytes = count * size;
+
+	while (bytes <= POOL_BLOCK_BYTES && (uint32_t)head < POOL_BLOCKS)
+	{
+		uint32_t block = (uint32_t)head;
+		uint64_t popped = (((head >> 32) + 1) << 32) | pool->next[block].load(std::memory_order_relaxed);
+
+		if (pool->head.compare_exchange_weak(head, popped, std::memory_order_acquire, std::memory_order_acquire))
+		{
+			memset(pool->blocks[block], 0, bytes);
+			return pool->blocks[block];
+		}
+	}
+
+	pool->misses++;
+	return calloc(count, size);
+}
+
+/****************************************************************************
+* BufferPoolPut
+*
+* - Stand-in for free for the buffers from BufferPoolGet: pushes a pool block
+* back on the free stack without taking a lock, frees anything else
+*
+* Parameters
+* - pool : the pool
+* - buffer : the buffer, may be NULL
+*
+* Returns
+* - none
+****************************************************************************/
+void BufferPoolPut(BUFFER_POOL* pool, void* buffer)
+{
+	uint8_t* bytes = (uint8_t*)buffer;
+	uint32_t block;
+	uint64_t head;
+
+	if (bytes < pool->blocks[0] || bytes >= pool->blocks[POOL_BLOCKS - 1] + POOL_BLOCK_BYTES)
+	{
+		free(buffer);
+		return;
+	}
+
+	block = (uint32_t)((bytes - pool->blocks[0]) / POOL_BLOCK_BYTES);
+	head = pool->head.load(std::memory_order_relaxed);
+	do
+	{
+		pool->next[block].store((uint32_t)head, std::memory_order_relaxed);
+	} while (!pool->head.compare_exchange_weak(head, (head & 0xFFFFFFFF00000000ull) | block, std::memory_order_release, std::memory_order_relaxed));
+}
+
+/****************************************************************************
+* Callback
+*
+* - Used by ps2000a data block collection calls, on receipt of data.
+*	- used by ps2000aRunBlock in this case
+*	- pushes the capture onto the unit's CAPTURE_RING, which the user
+*	routines wait on
+*
+* Parameters
+* - handle : handle used to refer to the pico device being used (not  needed
+*			 here for our application)
+* - status : PICO_STATUS indicating whether or not there's an issue with the
+*	device
+* - pParameter : pointer passed from ps2000aRunBlock so that this function
+*	can pass back arbitrary data to the calling space
+*		- the unit's BUFFER_INFO, so it pushes onto the right unit's ring
+*
+* Returns
+* - none
+****************************************************************************/
+void __stdcall CallBackBlock(int16_t handle, PICO_STATUS status, void* pParameter)
+{
+	BUFFER_INFO* info = (BUFFER_INFO*)pParameter;
+
+	if (status != PICO_CANCELLED)
+	{
+		CaptureRingPush(&info->captures, status, HostTimeNs()); // as close to the capture as the host gets
+	}
+	return;
+}
+
+/****************************************************************************
+* CallBackStreaming
+*
+* - Used by ps2000aGetStreamingLatestValues, on receipt of data
+* - per the programmer's guide it should only copy the data, so it copies
+* the new chunk out of the driver's buffer and leaves the processing to
+* the caller of ps2000aGetStreamingLatestValues
+*
+* Parameters
+* - handle : handle used to refer to the pico device being used
+* - noOfSamples : the number of new samples
+* - startIndex : where the new samples start in the driver's buffer
+* - overflow : over-range flags, bit 0 for channel A
+* - triggerAt, triggered : trigger position/ flag, not used here
+* - autoStop : whether streaming stopped by itself, not used here
+* - pParameter : points to the unit's STREAM_BUFFER to copy the data into
+*
+* Returns
+* - none
+****************************************************************************/
+void __stdcall CallBackStreaming(int16_t handle, int32_t noOfSamples, uint32_t startIndex, int16_t overflow, uint32_t triggerAt, int16_t triggered, int16_t autoStop, void* pParameter)
+{
+	STREAM_BUFFER* stream = (STREAM_BUFFER*)pParameter;
+	uint32_t count = (uint32_t)noOfSamples;
+
+	if (stream == NULL || noOfSamples <= 0)
+	{
+		return;
+	}
+	if (count > STREAM_BUFFER_SAMPLES - stream->appSamples) // shouldn't happen, appBuffer is emptied after every call
+	{
+		count = STREAM_BUFFER_SAMPLES - stream->appSamples;
+	}
+	memcpy(stream->appBuffer + stream->appSamples, stream->driverBuffer + startIndex, (size_t)count * sizeof(int16_t));
+	stream->appSamples += count;
+	stream->overflow |= overflow;
+	return;
+}
+
+/****************************************************************************
+* MovingAverage :
+*
+* - Used for data processing with the peak finding routines
+* - returns the average of the 5 inputted int16_t's
+*
+* Parameters
+* - a,b,c,d,e : int32_t values to be averaged, values passed will be of type
+* int16_t, the resulting conversions to int32_t will eliminate the need for
+* some casting here in the function
+*
+* Returns
+* - int16_t : contains the average of the 5 values passed as arguments
+****************************************************************************/
+inline int16_t MovingAverageFive(int32_t a, int32_t b, int32_t c, int32_t d, int32_t e)
+{
+	return (int16_t)((a + b + c + d + e) / (float_t)5.0);
+}
+
+/*
+* Smooths dataBuffer[start, end) into smoothBuffer, see MovingAverageFiveBuffer
+*/
+typedef void (*MOVING_AVERAGE_KERNEL)(const int16_t* dataBuffer, int16_t* smoothBuffer, uint32_t start, uint32_t end);
+
+/****************************************************************************
+* MovingAverageFiveScalar
+*
+* - Plain C++ version of MovingAverageFiveBuffer, for CPUs without SSE2/
+* AVX2 and for the samples left over at the end by the SIMD versions
+* - keeps a running sum of the five samples instead of adding them up
+* again for every point, and divides it as an integer, which the compiler
+* turns into a multiply
+*
+* Parameters
+* - dataBuffer : the samples to smooth, dataBuffer[start - 2] to
+*	dataBuffer[end + 1] are read
+* - smoothBuffer : on exit, smoothBuffer[start, end) holds the averages
+* - start, end : the range of points to average, start must be at least 2
+*
+* Returns
+* - none
+****************************************************************************/
+void MovingAverageFiveScalar(const int16_t* dataBuffer, int16_t* smoothBuffer, uint32_t start, uint32_t end)
+{
+	int32_t sum;
+
+	if (start >= end)
+	{
+		return;
+	}
+	sum = dataBuffer[start - 2] + dataBuffer[start - 1] + dataBuffer[start] + dataBuffer[start + 1];
+	for (uint32_t i = start; i < end; i++)
+	{
+		sum += dataBuffer[i + 2];
+		smoothBuffer[i] = (int16_t)(sum / 5); // rounds towards zero like MovingAverageFive's float division, which is exact for sums this small
+		sum -= dataBuffer[i - 2];
+	}
+}
+
+#ifdef SIMD_X86
+/****************************************************************************
+* MovingAverageFiveSse2
+*
+* - SSE2 version of MovingAverageFiveBuffer, 8 points at a time
+* - the sums are taken in 32 bits and divided as floats, the same
+* operations MovingAverageFive does, so the results match it exactly
+*
+* Parameters
+* - same as MovingAverageFiveScalar
+*
+* Returns
+* - none
+****************************************************************************/
+void MovingAverageFiveSse2(const int16_t* dataBuffer, int16_t* smoothBuffer, uint32_t start, uint32_t end)
+{
+	const __m128 five = _mm_set1_ps(5.0f);
+	uint32_t i = start;
+
+	for (; i + 8 <= end; i += 8)
+	{
+		__m128i sumLo = _mm_setzero_si128();
+		__m128i sumHi = _mm_setzero_si128();
+
+		for (int32_t k = -2; k <= 2; k++)
+		{
+			__m128i x = _mm_loadu_si128((const __m128i*)(dataBuffer + i + k));
+
+			// sign extend to 32 bits: each sample ends up in the top half of a lane, then gets shifted down
+			sumLo = _mm_add_epi32(sumLo, _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16));
+			sumHi = _mm_add_epi32(sumHi, _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16));
+		}
+		sumLo = _mm_cvttps_epi32(_mm_div_ps(_mm_cvtepi32_ps(sumLo), five));
+		sumHi = _mm_cvttps_epi32(_mm_div_ps(_mm_cvtepi32_ps(sumHi), five));
+		_mm_storeu_si128((__m128i*)(smoothBuffer + i), _mm_packs_epi32(sumLo, sumHi));
+	}
+	MovingAverageFiveScalar(dataBuffer, smoothBuffer, i, end);
+}
+
+/****************************************************************************
+* MovingAverageFiveAvx2
+*
+* - AVX2 version of MovingAverageFiveBuffer, 16 points at a time
+* - the sums are divided by 5 with a fixed point multiply (the high half of
+* sum * 0x66666667, halved, rounded towards zero), which is exact for any
+* 32-bit sum, so the results match MovingAverageFive's float division
+*
+* Parameters
+* - same as MovingAverageFiveScalar
+*
+* Returns
+* - none
+****************************************************************************/
+TARGET_AVX2 void MovingAverageFiveAvx2(const int16_t* dataBuffer, int16_t* smoothBuffer, uint32_t start, uint32_t end)
+{
+	const __m256i magic = _mm256_set1_epi32(0x66666667);
+	uint32_t i = start;
+
+	for (; i + 16 <= end; i += 16)
+	{
+		__m256i sum[2] = { _mm256_setzero_si256(), _mm256_setzero_si256() };
+
+		for (int32_t k = -2; k <= 2; k++)
+		{
+			sum[0] = _mm256_add_epi32(sum[0], _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(dataBuffer + i + k))));
+			sum[1] = _mm256_add_epi32(sum[1], _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(dataBuffer + i + k + 8))));
+		}
+		for (int32_t h = 0; h < 2; h++)
+		{
+			// _mm256_mul_epi32 only multiplies the even lanes, so the odd ones get shifted down and done separately
+			__m256i even = _mm256_srli_epi64(_mm256_mul_epi32(sum[h], magic), 32);
+			__m256i odd = _mm256_mul_epi32(_mm256_srli_epi64(sum[h], 32), magic);
+			__m256i high = _mm256_blend_epi32(even, odd, 0xAA);
+
+			// subtracting the sign bit (-1) rounds the negative sums towards zero instead of down
+			sum[h] = _mm256_sub_epi32(_mm256_srai_epi32(high, 1), _mm256_srai_epi32(sum[h], 31));
+		}
+		// packing works within each 128-bit half, the permute puts the 16 results back in order
+		_mm256_storeu_si256((__m256i*)(smoothBuffer + i), _mm256_permute4x64_epi64(_mm256_packs_epi32(sum[0], sum[1]), 0xD8));
+	}
+	MovingAverageFiveScalar(dataBuffer, smoothBuffer, i, end);
+}
+
+/****************************************************************************
+* CpuHasAvx2
+*
+* - Checks whether the CPU (and the OS, which has to save the wider
+* registers) supports AVX2
+*
+* Parameters
+* - none
+*
+* Returns
+* - BOOL : TRUE if the AVX2 kernels can be used
+****************************************************************************/
+BOOL CpuHasAvx2()
+{
+#ifdef _MSC_VER
+	int regs[4];
+
+	__cpuid(regs, 0);
+	if (regs[0] < 7)
+	{
+		return FALSE;
+	}
+	__cpuid(regs, 1);
+	if (!(regs[2] & (1 << 27)) || (_xgetbv(0) & 0x6) != 0x6) // OSXSAVE, and the OS saves the XMM and YMM registers
+	{
+		return FALSE;
+	}
+	__cpuidex(regs, 7, 0);
+	return (regs[1] & (1 << 5)) ? TRUE : FALSE;
+#else
+	return __builtin_cpu_supports("avx2") ? TRUE : FALSE;
+#endif
+}
+#endif
+
+/****************************************************************************
+* MovingAverageFiveBuffer
+*
+* - Applies MovingAverageFive to a whole range of points at once, with the
+* fastest version the CPU supports (AVX2, SSE2 or plain C++, picked the
+* first time it's called), all of which give exactly the same results
+*
+* Parameters
+* - dataBuffer : the samples to smooth, dataBuffer[start - 2] to
+*	dataBuffer[end + 1] are read
+* - smoothBuffer : on exit, smoothBuffer[start, end) holds the averages
+* - start, end : the range of points to average, start must be at least 2
+*
+* Returns
+* - none
+****************************************************************************/
+void MovingAverageFiveBuffer(const int16_t* dataBuffer, int16_t* smoothBuffer, uint32_t start, uint32_t end)
+{
+#ifdef SIMD_X86
+	static const MOVING_AVERAGE_KERNEL kernel = CpuHasAvx2() ? MovingAverageFiveAvx2 : MovingAverageFiveSse2; // SSE2 is always there on x86-64
+#else
+	static const MOVING_AVERAGE_KERNEL kernel = MovingAverageFiveScalar;
+#endif
+
+	kernel(dataBuffer, smoothBuffer, start, end);
+}
+
+/*
+* Finds the first sample below a threshold, see ThresholdPrescan
+*/
+typedef uint32_t (*THRESHOLD_PRESCAN_KERNEL)(const int16_t* dataBuffer, uint32_t start, uint32_t end, int16_t thresh);
+
+/****************************************************************************
+* ThresholdPrescanScalar
+*
+* - Plain C++ version of ThresholdPrescan, for CPUs without SSE2/ AVX2 and
+* for the samples left over at the end by the SIMD versions
+*
+* Parameters
+* - dataBuffer : the samples to search
+* - start, end : the range of samples to search
+* - thresh : the threshold in ADC counts
+*
+* Returns
+* - uint32_t : index of the first sample in [start, end) below thresh, end
+* if there isn't one
+****************************************************************************/
+uint32_t ThresholdPrescanScalar(const int16_t* dataBuffer, uint32_t start, uint32_t end, int16_t thresh)
+{
+	for (uint32_t i = start; i < end; i++)
+	{
+		if (dataBuffer[i] < thresh)
+		{
+			return i;
+		}
+	}
+	return end;
+}
+
+#ifdef SIMD_X86
+/****************************************************************************
+* LowestSetBit
+*
+* - Position of the lowest set bit of a (non-zero) compare mask
+*
+* Parameters
+* - mask : the mask, from one of the movemask intrinsics
+*
+* Returns
+* - uint32_t : the bit's position, 0 for the lowest
+****************************************************************************/
+inline uint32_t LowestSetBit(uint32_t mask)
+{
+#ifdef _MSC_VER
+	unsigned long bit;
+
+	_BitScanForward(&bit, mask);
+	return (uint32_t)bit;
+#else
+	return (uint32_t)__builtin_ctz(mask);
+#endif
+}
+
+/****************************************************************************
+* ThresholdPrescanSse2
+*
+* - SSE2 version of ThresholdPrescan, compares 8 samples at a time and
+* only looks at them one by one once the movemask says one is below
+*
+* Parameters
+* - same as ThresholdPrescanScalar
+*
+* Returns
+* - same as ThresholdPrescanScalar
+****************************************************************************/
+uint32_t ThresholdPrescanSse2(const int16_t* dataBuffer, uint32_t start, uint32_t end, int16_t thresh)
+{
+	const __m128i threshold = _mm_set1_epi16(thresh);
+	uint32_t i = start;
+
+	for (; i + 8 <= end; i += 8)
+	{
+		uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_cmplt_epi16(_mm_loadu_si128((const __m128i*)(dataBuffer + i)), threshold));
+
+		if (mask != 0)
+		{
+			return i + LowestSetBit(mask) / 2; // two mask bits per sample
+		}
+	}
+	return ThresholdPrescanScalar(dataBuffer, i, end, thresh);
+}
+
+/****************************************************************************
+* ThresholdPrescanAvx2
+*
+* - AVX2 version of ThresholdPrescan, 16 samples at a time
+*
+* Parameters
+* - same as ThresholdPrescanScalar
+*
+* Returns
+* - same as ThresholdPrescanScalar
+****************************************************************************/
+TARGET_AVX2 uint32_t ThresholdPrescanAvx2(const int16_t* dataBuffer, uint32_t start, uint32_t end, int16_t thresh)
+{
+	const __m256i threshold = _mm256_set1_epi16(thresh);
+	uint32_t i = start;
+
+	for (; i + 16 <= end; i += 16)
+	{
+		uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpgt_epi16(threshold, _mm256_loadu_si256((const __m256i*)(dataBuffer + i))));
+
+		if (mask != 0)
+		{
+			return i + LowestSetBit(mask) / 2; // two mask bits per sample
+		}
+	}
+	return ThresholdPrescanScalar(dataBuffer, i, end, thresh);
+}
+#endif
+
+/****************************************************************************
+* ThresholdPrescan
+*
+* - Finds the next raw sample below the peak detection threshold, with the
+* fastest version the CPU supports (picked the first time it's called)
+* - the smoothed signal can only get below the threshold within two samples
+* of a raw sample that's below it, so BlockPeakFinding uses this to skip
+* over the flat stretches between pulses without smoothing them
+*
+* Parameters
+* - dataBuffer : the samples to search
+* - start, end : the range of samples to search
+* - thresh : the threshold in ADC counts
+*
+* Returns
+* - uint32_t : index of the first sample in [start, end) below thresh, end
+* if there isn't one
+****************************************************************************/
+uint32_t ThresholdPrescan(const int16_t* dataBuffer, uint32_t start, uint32_t end, int16_t thresh)
+{
+#ifdef SIMD_X86
+	static const THRESHOLD_PRESCAN_KERNEL kernel = CpuHasAvx2() ? ThresholdPrescanAvx2 : ThresholdPrescanSse2;
+#else
+	static const THRESHOLD_PRESCAN_KERNEL kernel = ThresholdPrescanScalar;
+#endif
+
+	return kernel(dataBuffer, start, end, thresh);
+}
+
+/****************************************************************************
+* ArrayAvg :
+*
+* - Used for data processing with the peak finding routines
+* - returns the average of all the points in the buffer of int16_t's as a
+* float_t
+* - the sum is kept in 64 bits, a waveform of millions of samples sitting a
+* few hundred counts off zero overflows 32
+*
+* Parameters
+* - buffer : pointer to the start of the the buffer/array of int16_t's to
+* be averaged
+* - sampleCount : the number of entries in the buffer
+*
+* Returns
+* - float_t : contains the average of the first sampleCount entries in the
+* buffer
+****************************************************************************/
+// something something use a template?
+float_t ArrayAvg(int16_t* buffer, uint32_t sampleCount)
+{
+	int64_t accumulator = 0;
+
+	for (uint32_t i = 0; i < sampleCount; i++)
+	{
+		accumulator += (int64_t)buffer[i]; // casting to a wider type to avoid potential overflows
+	}
+
+	return (float_t)((double)accumulator / (double)sampleCount);
+}
+
+/****************************************************************************
+* BaselineWindow
+*
+* - Works out which pre-trigger samples the unit's baseline is taken from
+* and forgets any baseline carried over so far
+* - the last BASELINE_GUARD_SAMPLES before the trigger are left out, and at
+* most BASELINE_MAX_SAMPLES before those are used
+*
+* Parameters
+* - unit : pointer to the UNIT structure, whose baseline state is set up
+* - pretriggersampleCount : number of samples before the trigger
+*
+* Returns
+* - none
+****************************************************************************/
+void BaselineWindow(UNIT* unit, int32_t pretriggersampleCount)
+{
+	uint32_t end = (pretriggersampleCount > BASELINE_GUARD_SAMPLES) ? (uint32_t)(pretriggersampleCount - BASELINE_GUARD_SAMPLES) : 0;
+
+	unit->baseline.samples = (std::min)(end, (uint32_t)BASELINE_MAX_SAMPLES);
+	unit->baseline.start = end - unit->baseline.samples;
+	for (int16_t i = 0; i < PS2000A_MAX_CHANNELS; i++)
+	{
+		unit->baseline.primed[i] = FALSE;
+		unit->baseline.average[i] = 0;
+	}
+}
+
+/****************************************************************************
+* BaselineEstimate
+*
+* - Works out the baseline of a waveform the way g_baselinemode says to:
+* the mean of the whole waveform, which is what was always done, or from
+* the pre-trigger samples only (mean, trimmed mean or median), which is
+* quicker and isn't pulled down by the pulses
+* - the pre-trigger estimates are folded into a moving average carried
+* from one event to the next, which follows slow drifts but not the noise
+* of a single short window. With several analysis workers the events are
+* folded in in the order they finish, which a drift doesn't notice
+* - falls back to the mean of the whole waveform without a pre-trigger
+* window
+*
+* Parameters
+* - unit : pointer to the UNIT structure, for its baseline state
+* - channel : the channel the waveform was captured on
+* - buffer : the waveform
+* - sampleCount : the number of samples in the buffer
+*
+* Returns
+* - float_t : the baseline in ADC counts
+****************************************************************************/
+float_t BaselineEstimate(UNIT* unit, int16_t channel, int16_t* buffer, uint32_t sampleCount)
+{
+	BASELINE_STATE* state = &unit->baseline;
+	uint32_t samples = (state->start + state->samples <= sampleCount) ? state->samples : 0;
+	int16_t sorted[BASELINE_MAX_SAMPLES];
+	float_t estimate;
+
+	if (g_baselinemode == BASELINE_MODE::FULL || samples == 0)
+	{
+		return ArrayAvg(buffer, sampleCount);
+	}
+
+	if (g_baselinemode == BASELINE_MODE::MEAN)
+	{
+		estimate = ArrayAvg(buffer + state->start, samples);
+	}
+	else
+	{
+		memcpy(sorted, buffer + state->start, samples * sizeof(int16_t));
+		if (g_baselinemode == BASELINE_MODE::MEDIAN)
+		{
+			std::nth_element(sorted, sorted + samples / 2, sorted + samples);
+			estimate = sorted[samples / 2];
+			if (samples % 2 == 0) // average the two middle samples, the lower one is the biggest of the lower half
+			{
+				estimate = (estimate + *std::max_element(sorted, sorted + samples / 2)) / (float_t)2.0;
+			}
+		}
+		else
+		{
+			uint32_t trim = (uint32_t)(samples * BASELINE_TRIM_FRACTION);
+
+			std::sort(sorted, sorted + samples);
+			estimate = ArrayAvg(sorted + trim, samples - 2 * trim);
+		}
+	}
+
+	std::lock_guard<std::mutex> guard(state->lock);
+	if (!state->primed[channel])
+	{
+		state->average[channel] = estimate;
+		state->primed[channel] = TRUE;
+	}
+	else
+	{
+		state->average[channel] += (float_t)BASELINE_EWMA_WEIGHT * (estimate - state->average[channel]);
+	}
+	return state->average[channel];
+}
+
+/****************************************************************************
+* PastLevel
+*
+* - Whether a sample has gone past a level in the direction the pulses go,
+* below it for NEGATIVE polarity and above it for POSITIVE
+* - the polarity is a template parameter so the comparison is settled at
+* compile time, there's no branch on it per sample
+*
+* Parameters
+* - value : the sample (or smoothed sample)
+* - level : the threshold or baseline it's compared with
+*
+* Returns
+* - bool : true if value is past level
+****************************************************************************/
+template <POLARITY P, typename T, typename U>
+inline bool PastLevel(T value, U level)
+{
+	return (P == POLARITY::NEGATIVE) ? (value < level) : (value > level);
+}
+
+/****************************************************************************
+* MovingAverage
+*
+* - WIDTH-point moving average of SAMPLEs, the general version of
+* MovingAverageFiveBuffer with the same truncating division
+* - WIDTH is known at compile time, so the sum over the window is unrolled
+* and the loop over the points can be vectorized by the compiler
+* - the 5-point average of int16_t's is specialized below to use
+* MovingAverageFiveBuffer's hand written kernels
+*
+* Parameters
+* - dataBuffer : the samples to smooth, dataBuffer[start - WIDTH / 2] to
+*	dataBuffer[end - 1 + WIDTH / 2] are read
+* - smoothBuffer : on exit, smoothBuffer[start, end) holds the averages
+* - start, end : the range of points to average, start must be at least
+*	WIDTH / 2
+*
+* Returns
+* - none
+****************************************************************************/
+template <uint32_t WIDTH, typename SAMPLE>
+struct MovingAverage
+{
+	static void Buffer(const SAMPLE* dataBuffer, int16_t* smoothBuffer, uint32_t start, uint32_t end)
+	{
+		for (uint32_t i = start; i < end; i++)
+		{
+			int32_t sum = 0;
+
+			for (uint32_t k = 0; k < WIDTH; k++)
+			{
+				sum += dataBuffer[i - WIDTH / 2 + k];
+			}
+			smoothBuffer[i] = (int16_t)(sum / (int32_t)WIDTH);
+		}
+	}
+};
+
+template <>
+struct MovingAverage<5, int16_t>
+{
+	static void Buffer(const int16_t* dataBuffer, int16_t* smoothBuffer, uint32_t start, uint32_t end)
+	{
+		MovingAverageFiveBuffer(dataBuffer, smoothBuffer, start, end);
+	}
+};
+
+/****************************************************************************
+* Prescan
+*
+* - Finds the first sample past a threshold in the direction P, the general
+* version of ThresholdPrescan
+* - downward int16_t pulses are specialized below to use ThresholdPrescan's
+* SIMD kernels
+*
+* Parameters
+* - dataBuffer : the samples to search
+* - start, end : the range of samples to search
+* - thresh : the threshold, in the same units as the samples
+*
+* Returns
+* - uint32_t : index of the first sample in [start, end) past thresh, end
+* if there isn't one
+****************************************************************************/
+template <POLARITY P, typename SAMPLE>
+struct Prescan
+{
+	static uint32_t Find(const SAMPLE* dataBuffer, uint32_t start, uint32_t end, int32_t thresh)
+	{
+		for (uint32_t i = start; i < end; i++)
+		{
+			if (PastLevel<P>(dataBuffer[i], thresh))
+			{
+				return i;
+			}
+		}
+		return end;
+	}
+};
+
+template <>
+struct Prescan<POLARITY::NEGATIVE, int16_t>
+{
+	static uint32_t Find(const int16_t* dataBuffer, uint32_t start, uint32_t end, int32_t thresh)
+	{
+		return ThresholdPrescan(dataBuffer, start, end, (int16_t)thresh);
+	}
+};
+
+/****************************************************************************
+* PeakSearchRange
+*
+* - PeakSearch's search, started part way through a waveform with no peak
+* open, for splitting a long waveform between threads
+* - searches from the point at from on, up to to and past it until the first
+* point that isn't past the baseline. Whether a peak is open there doesn't
+* depend on anything before it (it's closed either way), so another search
+* can take over right after it and find exactly the peaks a single search
+* over the whole waveform would
+* - with from at 0 and to at sampleCount, this is the search over the whole
+* waveform
+*
+* Parameters
+* - dataBuffer : the waveform
+* - sampleCount : the number of samples in the buffer
+* - from : the first point searched, taken as WIDTH / 2 if it's less
+* - to : where the search can stop, see above
+* - thresh, baseline, indices, maxnumpeaks : see PeakSearch
+*
+* Returns
+* - uint16_t : the number of peaks found, maxnumpeaks if the search stopped
+* early
+****************************************************************************/
+template <typename SAMPLE, uint32_t WIDTH, POLARITY P>
+uint16_t PeakSearchRange(const SAMPLE* dataBuffer, uint32_t sampleCount, uint32_t from, uint32_t to, int32_t thresh, float_t baseline, uint32_t* indices, uint16_t maxnumpeaks)
+{
+	const uint32_t half = WIDTH / 2; // points either side of the one being averaged
+	int16_t peakValue = std::numeric_limits<int16_t>::infinity();
+	uint16_t numpeaks = 0;
+	int16_t tile[PEAK_TILE_SAMPLES + half]; // smoothed samples of the stretch being searched, from tile[half] on (the moving average reads half samples back)
+	int32_t peakIndex = -1;
+
+	for (uint32_t start = (std::max)(from, half); start + 1 < sampleCount; start += PEAK_TILE_SAMPLES)
+	{
+		uint32_t count, smoothed;
+
+		// past to, every point is looked at until the signal gets back to the baseline
+		if (peakIndex == -1 && start < to)
+		{
+			// the point at start averages the samples from start - half on, so that's where to look from, and
+			// anything past to + half can only start a peak past to
+			uint32_t bound = (std::min)(sampleCount, to + half);
+			uint32_t past = Prescan<P, SAMPLE>::Find(dataBuffer, start - half, bound, thresh);
+
+			if (past >= sampleCount)
+			{
+				break;
+			}
+			if (past >= bound)
+			{
+				start = to;
+			}
+			else if (past > start + half)
+			{
+				start = past - half;
+			}
+		}
+		count = (std::min)((uint32_t)PEAK_TILE_SAMPLES, sampleCount - 1 - start);
+		smoothed = (start + half < sampleCount) ? (std::min)(count, sampleCount - half - start) : 0;
+
+		MovingAverage<WIDTH, SAMPLE>::Buffer(dataBuffer + start - half, tile, half, half + smoothed);
+		for (uint32_t k = smoothed; k < count; k++)
+		{
+			tile[half + k] = dataBuffer[start + k];
+		}
+
+		for (uint32_t k = 0; k < count; k++)
+		{
+			int16_t smooth = tile[half + k];
+
+			if (PastLevel<P>(smooth, baseline))
+			{
+				if (PastLevel<P>(smooth, peakValue) && PastLevel<P>(smooth, thresh))
+				{
+					peakIndex = start + k;
+					peakValue = smooth;
+				}
+			}
+			else
+			{
+				if (peakIndex != -1) // a pre-trigger baseline is usually an exact ADC level, which the signal settles back onto
+				{
+					indices[0] = ++numpeaks; // store number of found peaks in the array's first entry
+					indices[numpeaks] = peakIndex; // all the other peak index values follow in the array
+					peakIndex = -1; // reset this so we can find the next one (if there is one)
+					peakValue = std::numeric_limits<int16_t>::infinity(); // reset this too
+				}
+				if (start + k >= to) // the search from here on doesn't depend on anything before
+				{
+					return numpeaks;
+				}
+			}
+			if (numpeaks >= maxnumpeaks) // in practice we shouldn't need to find more than 2 peaks
+			{
+				return numpeaks;
+			}
+		}
+	}
+
+	if (peakIndex != -1)
+	{
+		indices[0] = ++numpeaks;
+		indices[numpeaks] = peakIndex;
+	}
+
+	return numpeaks;
+}
+
+/****************************************************************************
+* PeakSearch
+*
+* - smooths the input signal using a WIDTH-point moving average, then finds
+* the indices of the peaks in the buffer array, the detector behind
+* BlockPeakFinding
+* - the sample type, the width of the moving average and the polarity of the
+* pulses are template parameters, so each combination gets its own inner
+* loop with no runtime checks on them. The common ones are instantiated
+* below: int16_t samples as the driver hands them over, and int8_t for
+* samples packed down to the 8 bits the ADC actually has
+* - the first WIDTH / 2 points can't be averaged and aren't searched, the
+* ones up to the second to last can't be averaged either so they're
+* searched as they are, and the last one isn't searched
+* - the smoothing and the search are done together, PEAK_TILE_SAMPLES at a
+* time, so the smoothed signal never has to be stored in full
+* - while no peak is open, Prescan skips ahead to the next sample past the
+* threshold, nothing before it could start a peak, so only the stretches
+* around the pulses get smoothed (the results are the same as smoothing and
+* searching the whole waveform)
+* - a peak is the furthest point past thresh in the direction P, and ends
+* when the signal gets back to the baseline
+* - the search itself is PeakSearchRange over the whole waveform
+* - Based off of a combination of the smoothing algorithm and multiple peak
+* finding algorithm from https://www.baeldung.com/cs/signal-peak-detection
+*
+* Parameters
+* - dataBuffer : the waveform
+* - sampleCount : the number of samples in the buffer
+* - thresh : the peak detection threshold, in the same units as the samples
+* - baseline : the waveform's baseline, in the same units as the samples
+* - indices : maxnumpeaks + 1 zeroed entries, filled in as described for
+*	BlockPeakFinding
+* - maxnumpeaks : the maximum number of peaks the function will search for
+* before stopping the search and returning
+*
+* Returns
+* - uint16_t : the number of peaks found, maxnumpeaks if the search stopped
+* early
+****************************************************************************/
+template <typename SAMPLE, uint32_t WIDTH, POLARITY P>
+uint16_t PeakSearch(const SAMPLE* dataBuffer, uint32_t sampleCount, int32_t thresh, float_t baseline, uint32_t* indices, uint16_t maxnumpeaks)
+{
+	return PeakSearchRange<SAMPLE, WIDTH, P>(dataBuffer, sampleCount, 0, sampleCount, thresh, baseline, indices, maxnumpeaks);
+}
+
+template uint16_t PeakSearch<int16_t, 5, POLARITY::NEGATIVE>(const int16_t*, uint32_t, int32_t, float_t, uint32_t*, uint16_t);
+template uint16_t PeakSearch<int16_t, 5, POLARITY::POSITIVE>(const int16_t*, uint32_t, int32_t, float_t, uint32_t*, uint16_t);
+template uint16_t PeakSearch<int16_t, 3, POLARITY::NEGATIVE>(const int16_t*, uint32_t, int32_t, float_t, uint32_t*, uint16_t);
+template uint16_t PeakSearch<int16_t, 3, POLARITY::POSITIVE>(const int16_t*, uint32_t, int32_t, float_t, uint32_t*, uint16_t);
+template uint16_t PeakSearch<int8_t, 5, POLARITY::NEGATIVE>(const int8_t*, uint32_t, int32_t, float_t, uint32_t*, uint16_t);
+template uint16_t PeakSearch<int8_t, 5, POLARITY::POSITIVE>(const int8_t*, uint32_t, int32_t, float_t, uint32_t*, uint16_t);
+
+/****************************************************************************
+* PeakSyncPoint
+*
+* - Finds the first point of a stretch whose (smoothed) value isn't past the
+* baseline, where a PeakSearchRange over the stretch before it stops and
+* the search of the rest of the waveform can take over
+*
+* Parameters
+* - dataBuffer : the waveform
+* - sampleCount : the number of samples in the buffer
+* - from, to : the stretch of points to look through
+* - baseline : the waveform's baseline, in the same units as the samples
+*
+* Returns
+* - uint32_t : the point, to if there isn't one
+****************************************************************************/
+template <typename SAMPLE, uint32_t WIDTH, POLARITY P>
+uint32_t PeakSyncPoint(const SAMPLE* dataBuffer, uint32_t sampleCount, uint32_t from, uint32_t to, float_t baseline)
+{
+	const uint32_t half = WIDTH / 2;
+
+	// the same points and values as PeakSearchRange's, the last few taken as they are
+	for (uint32_t i = (std::max)(from, half); i < to && i + 1 < sampleCount; i++)
+	{
+		int16_t smooth = (int16_t)dataBuffer[i];
+
+		if (i + half < sampleCount)
+		{
+			int32_t sum = 0;
+
+			for (uint32_t k = 0; k < WIDTH; k++)
+			{
+				sum += dataBuffer[i - half + k];
+			}
+			smooth = (int16_t)(sum / (int32_t)WIDTH);
+		}
+		if (!PastLevel<P>(smooth, baseline))
+		{
+			return i;
+		}
+	}
+	return to;
+}
+
+/****************************************************************************
+* SearchPoolDrain
+*
+* - Takes chunks of the pool's job and searches them until there are none
+* left
+*
+* Parameters
+* - pool : the search pool
+*
+* Returns
+* - none
+****************************************************************************/
+void SearchPoolDrain(SEARCH_POOL* pool)
+{
+	uint32_t chunk;
+
+	while ((chunk = pool->nextchunk.fetch_add(1)) < pool->numchunks)
+	{
+		pool->work(pool->context, chunk);
+	}
+}
+
+/****************************************************************************
+* SearchPoolThread
+*
+* - One of the search pool's threads: waits for a job, helps with it and
+* checks back in, for as long as the program runs
+*
+* Parameters
+* - pool : the search pool
+*
+* Returns
+* - none
+****************************************************************************/
+void SearchPoolThread(SEARCH_POOL* pool)
+{
+	ThreadPlace(THREAD_ROLE::WORKER, 0);
+
+	std::unique_lock<std::mutex> lk(pool->lock);
+	uint64_t seen = 0; // the pool starts at generation 0, so a job posted before this thread got going still gets done
+
+	while (TRUE)
+	{
+		pool->wake.wait(lk, [pool, &seen] { return pool->generation != seen; });
+		seen = pool->generation;
+		lk.unlock();
+		SearchPoolDrain(pool);
+		lk.lock();
+		if (--pool->busy == 0)
+		{
+			pool->idle.notify_all();
+		}
+	}
+}
+
+/****************************************************************************
+* SearchPoolGet
+*
+* - Returns the search pool, starting its threads the first time: one per
+* core but the one doing the analysis, up to SEARCH_MAX_THREADS
+* - the pool lasts as long as the program, its threads are detached so
+* they don't hold up the exit
+*
+* Parameters
+* - none
+*
+* Returns
+* - SEARCH_POOL* : the search pool
+****************************************************************************/
+SEARCH_POOL* SearchPoolGet()
+{
+	static SEARCH_POOL* pool = []
+	{
+		SEARCH_POOL* created = new SEARCH_POOL();
+		uint32_t cores = std::thread::hardware_concurrency();
+
+		created->numthreads = (cores > 1) ? (std::min)(cores - 1, (uint32_t)SEARCH_MAX_THREADS) : 0;
+		created->generation = 0;
+		created->busy = 0;
+		created->numchunks = 0;
+		created->nextchunk = 0;
+		for (uint32_t i = 0; i < created->numthreads; i++)
+		{
+			std::thread(SearchPoolThread, created).detach();
+		}
+		return created;
+	}();
+
+	return pool;
+}
+
+/****************************************************************************
+* SearchPoolRun
+*
+* - Runs a job on the search pool: wakes its threads, searches chunks
+* alongside them and returns once they've all checked back in
+* - doesn't wait if another analysis worker has the pool, the caller
+* searches the waveform by itself instead
+*
+* Parameters
+* - pool : the search pool
+* - work : searches one chunk
+* - context : passed on to work
+* - numchunks : the number of chunks
+*
+* Returns
+* - BOOL : TRUE if the job was run, FALSE if the pool was busy or has no
+* threads
+****************************************************************************/
+BOOL SearchPoolRun(SEARCH_POOL* pool, void (*work)(void* context, uint32_t chunk), void* context, uint32_t numchunks)
+{
+	if (pool->numthreads == 0 || !pool->job.try_lock())
+	{
+		return FALSE;
+	}
+
+	{
+		std::lock_guard<std::mutex> lk(pool->lock);
+
+		pool->work = work;
+		pool->context = context;
+		pool->numchunks = numchunks;
+		pool->nextchunk = 0;
+		pool->busy = pool->numthreads; // every thread checks in, so none of them is still looking at this job when the next one is posted
+		pool->generation++;
+	}
+	pool->wake.notify_all();
+
+	SearchPoolDrain(pool);
+
+	{
+		std::unique_lock<std::mutex> lk(pool->lock);
+
+		pool->idle.wait(lk, [pool] { return pool->busy == 0; });
+	}
+	pool->job.unlock();
+	return TRUE;
+}
+
+/****************************************************************************
+* PeakSearchChunk
+*
+* - Searches one chunk of a split waveform for the moving average detector
+* - the chunk before searches on past this one's start until the signal is
+* back at the baseline (see PeakSearchRange), this one starts right after
+* that point, so together they find exactly the peaks of a single search
+*
+* Parameters
+* - context : the SEARCH_CHUNKS
+* - chunk : which chunk to search
+*
+* Returns
+* - none
+****************************************************************************/
+template <POLARITY P>
+void PeakSearchChunk(void* context, uint32_t chunk)
+{
+	SEARCH_CHUNKS* chunks = (SEARCH_CHUNKS*)context;
+	uint32_t from = chunk * chunks->chunkSamples;
+	uint32_t to = (std::min)(from + chunks->chunkSamples, chunks->sampleCount);
+	uint32_t* indices = chunks->results + (size_t)chunk * (chunks->maxnumpeaks + 1);
+
+	indices[0] = 0; // the results are reused from one waveform to the next
+	if (chunk > 0)
+	{
+		uint32_t sync = PeakSyncPoint<int16_t, 5, P>(chunks->dataBuffer, chunks->sampleCount, from, to, chunks->baseline);
+
+		if (sync >= to) // the chunk before covers all of this one
+		{
+			return;
+		}
+		from = sync + 1;
+	}
+	PeakSearchRange<int16_t, 5, P>(chunks->dataBuffer, chunks->sampleCount, from, to, chunks->thresh, chunks->baseline, indices, chunks->maxnumpeaks);
+}
+
+/****************************************************************************
+* ParallelPeakSearch
+*
+* - PeakSearch for long waveforms: splits the waveform into chunks, searches
+* them on the search pool and joins their peaks back up in order, the same
+* peaks a single PeakSearch finds
+* - searches the waveform by itself if the pool is busy or has no threads,
+* or the chunks' results can't be allocated
+*
+* Parameters
+* - dataBuffer : the waveform
+* - sampleCount : the number of samples in the buffer
+* - thresh, baseline, indices, maxnumpeaks : see PeakSearch
+* - chunkSamples : samples per chunk
+*
+* Returns
+* - uint16_t : the number of peaks found
+****************************************************************************/
+template <POLARITY P>
+uint16_t ParallelPeakSearch(const int16_t* dataBuffer, uint32_t sampleCount, int32_t thresh, float_t baseline, uint32_t* indices, uint16_t maxnumpeaks, uint32_t chunkSamples)
+{
+	uint32_t numchunks = (sampleCount + chunkSamples - 1) / chunkSamples;
+	uint16_t numpeaks = 0;
+	SEARCH_CHUNKS chunks;
+	static thread_local std::vector<uint32_t> results; // grows to the longest waveform's chunks and stays there
+
+	chunks.dataBuffer = dataBuffer;
+	chunks.sampleCount = sampleCount;
+	chunks.chunkSamples = chunkSamples;
+	chunks.thresh = thresh;
+	chunks.baseline = baseline;
+	chunks.maxnumpeaks = maxnumpeaks;
+	if (results.size() < (size_t)numchunks * (maxnumpeaks + 1))
+	{
+		results.resize((size_t)numchunks * (maxnumpeaks + 1));
+	}
+	chunks.results = results.data();
+
+	if (numchunks <= 1 || !SearchPoolRun(SearchPoolGet(), PeakSearchChunk<P>, &chunks, numchunks))
+	{
+		return PeakSearch<int16_t, 5, P>(dataBuffer, sampleCount, thresh, baseline, indices, maxnumpeaks);
+	}
+
+	// the chunks' peaks in order, up to the first maxnumpeaks like the single search stops at
+	for (uint32_t c = 0; c < numchunks; c++)
+	{
+		const uint32_t* found = chunks.results + (size_t)c * (maxnumpeaks + 1);
+
+		for (uint32_t i = 1; i <= found[0] && numpeaks < maxnumpeaks; i++)
+		{
+			indices[0] = ++numpeaks;
+			indices[numpeaks] = found[i];
+		}
+	}
+	return numpeaks;
+}
+
+/****************************************************************************
+* MovingAverageDetector
+*
+* - PEAK_DETECTOR_RUN for the moving average detector, PeakSearch on the
+* driver's int16_t samples with the original 5-point average
+* - waveforms of PARALLEL_SEARCH_SAMPLES or more are split between the
+* search pool's threads by ParallelPeakSearch
+*
+* Parameters
+* - detector : the configured detector
+* - dataBuffer : the waveform
+* - sampleCount : the number of samples in the buffer
+* - baseline : the waveform's baseline in ADC counts
+* - indices : maxnumpeaks + 1 zeroed entries, see BlockPeakFinding
+* - maxnumpeaks : the most peaks searched for
+*
+* Returns
+* - uint16_t : the number of peaks found
+****************************************************************************/
+template <POLARITY P>
+uint16_t MovingAverageDetector(const PEAK_DETECTOR* detector, const int16_t* dataBuffer, uint32_t sampleCount, float_t baseline, uint32_t* indices, uint16_t maxnumpeaks)
+{
+	if (sampleCount >= PARALLEL_SEARCH_SAMPLES)
+	{
+		return ParallelPeakSearch<P>(dataBuffer, sampleCount, detector->thresh, baseline, indices, maxnumpeaks, PARALLEL_CHUNK_SAMPLES);
+	}
+	return PeakSearch<int16_t, 5, P>(dataBuffer, sampleCount, detector->thresh, baseline, indices, maxnumpeaks);
+}
+
+/****************************************************************************
+* DerivativeDetector
+*
+* - PEAK_DETECTOR_RUN for the derivative detector: finds where the first
+* derivative of the 5-point moving average crosses zero, i.e. where the
+* signal turns back, and takes the turning points past the threshold as
+* peaks
+* - a turn only counts once the signal has gone back by detector->hysteresis,
+* so the noise on a pulse doesn't split it into several peaks
+* - unlike PeakSearch, the signal doesn't have to get back to the baseline
+* between two peaks, so a decay on the tail of the muon pulse is still found
+*
+* Parameters
+* - detector : the configured detector
+* - dataBuffer : the waveform
+* - sampleCount : the number of samples in the buffer
+* - baseline : the waveform's baseline in ADC counts
+* - indices : maxnumpeaks + 1 zeroed entries, see BlockPeakFinding
+* - maxnumpeaks : the most peaks searched for
+*
+* Returns
+* - uint16_t : the number of peaks found
+****************************************************************************/
+template <POLARITY P>
+uint16_t DerivativeDetector(const PEAK_DETECTOR* detector, const int16_t* dataBuffer, uint32_t sampleCount, float_t baseline, uint32_t* indices, uint16_t maxnumpeaks)
+{
+	const float_t hysteresis = (float_t)((P == POLARITY::NEGATIVE) ? detector->hysteresis : -detector->hysteresis); // back towards the baseline
+	int16_t tile[PEAK_TILE_SAMPLES + 2];
+	uint16_t numpeaks = 0;
+	BOOL outward = TRUE; // heading away from the baseline (towards a peak), otherwise heading back after one
+	float_t extreme = baseline; // furthest point so far in the direction we're heading
+	int32_t extremeIndex = -1;
+
+	// the first and last two points can't be averaged and aren't searched
+	for (uint32_t start = 2; start + 2 < sampleCount; start += PEAK_TILE_SAMPLES)
+	{
+		uint32_t count = (std::min)((uint32_t)PEAK_TILE_SAMPLES, sampleCount - 2 - start);
+
+		MovingAverageFiveBuffer(dataBuffer + start - 2, tile, 2, 2 + count);
+		for (uint32_t k = 0; k < count; k++)
+		{
+			int16_t smooth = tile[2 + k];
+
+			if (outward)
+			{
+				if (PastLevel<P>(smooth, extreme))
+				{
+					extreme = smooth;
+					extremeIndex = start + k;
+				}
+				else if (!PastLevel<P>(smooth, extreme + hysteresis)) // turned back
+				{
+					if (extremeIndex != -1 && PastLevel<P>(extreme, detector->thresh))
+					{
+						indices[0] = ++numpeaks;
+						indices[numpeaks] = extremeIndex;
+						if (numpeaks >= maxnumpeaks)
+						{
+							return numpeaks;
+						}
+					}
+					outward = FALSE;
+					extreme = smooth;
+				}
+			}
+			else
+			{
+				if (PastLevel<P>(extreme, smooth))
+				{
+					extreme = smooth;
+				}
+				else if (!PastLevel<P>(extreme, smooth + hysteresis)) // turned outwards again
+				{
+					outward = TRUE;
+					extreme = smooth;
+					extremeIndex = start + k;
+				}
+			}
+		}
+	}
+
+	if (outward && extremeIndex != -1 && PastLevel<P>(extreme, detector->thresh))
+	{
+		indices[0] = ++numpeaks;
+		indices[numpeaks] = extremeIndex;
+	}
+
+	return numpeaks;
+}
+
+/****************************************************************************
+* Fft
+*
+* - In place radix-2 FFT (decimation in time), for the matched filter's
+* overlap-save correlation
+* - the inverse isn't scaled, the matched filter folds the 1 / size into the
+* template's spectrum
+*
+* Parameters
+* - data : size complex values, transformed in place
+* - size : a power of 2
+* - twiddles : e^(-2 pi i k / size) for k < size / 2
+* - inverse : TRUE for the inverse transform
+*
+* Returns
+* - none
+****************************************************************************/
+void Fft(std::complex<float_t>* data, uint32_t size, const std::complex<float_t>* twiddles, BOOL inverse)
+{
+	// bit reversed order first
+	for (uint32_t i = 1, j = 0; i < size; i++)
+	{
+		uint32_t bit = size >> 1;
+
+		for (; j & bit; bit >>= 1)
+		{
+			j ^= bit;
+		}
+		j ^= bit;
+		if (i < j)
+		{
+			std::swap(data[i], data[j]);
+		}
+	}
+
+	// the multiplies are written out, std::complex's operator* checks for infinities and NaNs the slow way
+	for (uint32_t length = 2; length <= size; length <<= 1)
+	{
+		uint32_t half = length / 2;
+		uint32_t stride = size / length;
+
+		for (uint32_t i = 0; i < size; i += length)
+		{
+			for (uint32_t k = 0; k < half; k++)
+			{
+				std::complex<float_t> w = twiddles[k * stride];
+				std::complex<float_t> a = data[i + k];
+				std::complex<float_t> b = data[i + k + half];
+				float_t wi = inverse ? -w.imag() : w.imag();
+				std::complex<float_t> odd(w.real() * b.real() - wi * b.imag(), w.real() * b.imag() + wi * b.real());
+
+				data[i + k] = std::complex<float_t>(a.real() + odd.real(), a.imag() + odd.imag());
+				data[i + k + half] = std::complex<float_t>(a.real() - odd.real(), a.imag() - odd.imag());
+			}
+		}
+	}
+}
+
+/****************************************************************************
+* MatchedFilterFft
+*
+* - Works out the next stretch of the matched filter's output with
+* overlap-save FFT convolution, O(log fftsize) per sample whatever the
+* template length
+* - each segment of fftsize samples gives fftsize - taps + 1 outputs, and
+* two segments go through each pair of FFTs, one as the real part and the
+* next as the imaginary part (the template is real, so their outputs come
+* back out in the same parts)
+*
+* Parameters
+* - detector : the configured detector, with its template's spectrum
+* - dataBuffer : the waveform
+* - sampleCount : the number of samples in the buffer
+* - start : the first output to work out, output i lines the template up
+*	with samples i to i + taps - 1
+* - offset : added to every output, see MatchedFilterDetector
+* - buffer : the FFTs' work space, detector->fftsize entries
+* - filtered : on exit, holds the outputs, room for 2 * (fftsize - taps + 1)
+*
+* Returns
+* - uint32_t : the number of outputs written to filtered
+****************************************************************************/
+uint32_t MatchedFilterFft(const PEAK_DETECTOR* detector, const int16_t* dataBuffer, uint32_t sampleCount, uint32_t start, float_t offset, std::complex<float_t>* buffer, float_t* filtered)
+{
+	const uint32_t size = detector->fftsize;
+	const uint32_t taps = detector->taps;
+	const uint32_t hop = size - taps + 1; // outputs each segment gives
+	const uint32_t count = (std::min)(2 * hop, sampleCount - taps + 1 - start);
+
+	for (uint32_t n = 0; n < size; n++)
+	{
+		uint32_t a = start + n;
+		uint32_t b = start + hop + n;
+
+		buffer[n] = std::complex<float_t>((a < sampleCount) ? dataBuffer[a] : (float_t)0.0, (b < sampleCount) ? dataBuffer[b] : (float_t)0.0);
+	}
+	Fft(buffer, size, detector->twiddles, FALSE);
+	for (uint32_t n = 0; n < size; n++)
+	{
+		std::complex<float_t> x = buffer[n];
+		std::complex<float_t> h = detector->spectrum[n];
+
+		buffer[n] = std::complex<float_t>(x.real() * h.real() - x.imag() * h.imag(), x.real() * h.imag() + x.imag() * h.real());
+	}
+	Fft(buffer, size, detector->twiddles, TRUE);
+
+	// the first taps - 1 points of each segment wrapped around and are thrown away
+	for (uint32_t i = 0; i < count; i++)
+	{
+		filtered[i] = offset + ((i < hop) ? buffer[i + taps - 1].real() : buffer[i - hop + taps - 1].imag());
+	}
+	return count;
+}
+
+/****************************************************************************
+* MatchedFilterDirect
+*
+* - Works out the next stretch of the matched filter's output directly,
+* detector->taps multiply-adds per sample, for short templates
+*
+* Parameters
+* - detector : the configured detector
+* - dataBuffer : the waveform
+* - start : the first output to work out, see MatchedFilterFft
+* - count : the number of outputs to work out
+* - offset : added to every output, see MatchedFilterDetector
+* - filtered : on exit, holds the count outputs
+*
+* Returns
+* - none
+****************************************************************************/
+void MatchedFilterDirect(const PEAK_DETECTOR* detector, const int16_t* dataBuffer, uint32_t start, uint32_t count, float_t offset, float_t* filtered)
+{
+	// one tap at a time over all the outputs, so the inner loop runs across independent outputs and vectorizes
+	for (uint32_t k = 0; k < count; k++)
+	{
+		filtered[k] = offset;
+	}
+	for (uint32_t j = 0; j < detector->taps; j++)
+	{
+		const int16_t* window = dataBuffer + start + j;
+		const float_t weight = detector->weights[j];
+
+		for (uint32_t k = 0; k < count; k++)
+		{
+			filtered[k] += weight * window[k];
+		}
+	}
+}
+
+/****************************************************************************
+* MatchedFilterDetector
+*
+* - PEAK_DETECTOR_RUN for the matched filter detector: correlates the
+* waveform with the pulse template DetectorConfigure built, then searches
+* the filtered signal like PeakSearch does the smoothed one
+* - the template is as long as a pulse, so it averages the noise away much
+* better than the 5-point moving average and small pulses stand out more
+* - the filtered signal is worked out by MatchedFilterFft if the detector
+* has an FFT size, which keeps long records and long templates at
+* O(N log N), otherwise by MatchedFilterDirect PEAK_TILE_SAMPLES at a time
+* - the detector is shared by the analysis workers, so each thread keeps its
+* own FFT work space, allocated the first time it's needed
+* - the peak indices are where the pulses peak, same as BlockPeakFinding's
+*
+* Parameters
+* - detector : the configured detector
+* - dataBuffer : the waveform
+* - sampleCount : the number of samples in the buffer
+* - baseline : the waveform's baseline in ADC counts
+* - indices : maxnumpeaks + 1 zeroed entries, see BlockPeakFinding
+* - maxnumpeaks : the most peaks searched for
+*
+* Returns
+* - uint16_t : the number of peaks found
+****************************************************************************/
+template <POLARITY P>
+uint16_t MatchedFilterDetector(const PEAK_DETECTOR* detector, const int16_t* dataBuffer, uint32_t sampleCount, float_t baseline, uint32_t* indices, uint16_t maxnumpeaks)
+{
+	const uint32_t taps = detector->taps;
+	const float_t offset = baseline * ((float_t)1.0 - detector->weightsum); // puts the baseline back in, so the output is on the same scale as the samples
+	const float_t thresh = (float_t)detector->thresh;
+	float_t tile[PEAK_TILE_SAMPLES];
+	static thread_local std::vector<std::complex<float_t>> fftbuffer;
+	static thread_local std::vector<float_t> fftfiltered;
+	const float_t* output = tile;
+	uint32_t count;
+	float_t peakValue = thresh;
+	uint16_t numpeaks = 0;
+	int32_t peakIndex = -1;
+
+	if (sampleCount < taps)
+	{
+		return 0;
+	}
+	if (detector->fftsize != 0)
+	{
+		if (fftbuffer.size() < detector->fftsize)
+		{
+			fftbuffer.resize(detector->fftsize);
+		}
+		if (fftfiltered.size() < 2 * ((size_t)detector->fftsize - taps + 1))
+		{
+			fftfiltered.resize(2 * ((size_t)detector->fftsize - taps + 1));
+		}
+		output = fftfiltered.data();
+	}
+
+	// output i lines the template up with samples i to i + taps - 1
+	for (uint32_t start = 0; start + taps <= sampleCount; start += count)
+	{
+		if (detector->fftsize != 0)
+		{
+			count = MatchedFilterFft(detector, dataBuffer, sampleCount, start, offset, fftbuffer.data(), fftfiltered.data());
+		}
+		else
+		{
+			count = (std::min)((uint32_t)PEAK_TILE_SAMPLES, sampleCount - taps + 1 - start);
+			MatchedFilterDirect(detector, dataBuffer, start, count, offset, tile);
+		}
+
+		for (uint32_t k = 0; k < count; k++)
+		{
+			float_t filtered = output[k];
+
+			if (PastLevel<P>(filtered, baseline))
+			{
+				if (PastLevel<P>(filtered, peakValue))
+				{
+					peakIndex = start + k + detector->lag;
+					peakValue = filtered;
+				}
+			}
+			else if (peakIndex != -1)
+			{
+				indices[0] = ++numpeaks;
+				indices[numpeaks] = peakIndex;
+				peakIndex = -1;
+				peakValue = thresh;
+				if (numpeaks >= maxnumpeaks)
+				{
+					return numpeaks;
+				}
+			}
+		}
+	}
+
+	if (peakIndex != -1)
+	{
+		indices[0] = ++numpeaks;
+		indices[numpeaks] = peakIndex;
+	}
+
+	return numpeaks;
+}
+
+/****************************************************************************
+* PulseShape
+*
+* - Height of a PMT pulse t ns after it starts, relative to its peak: a
+* PULSE_RISE_NS rise and PULSE_FALL_NS fall (difference of exponentials)
+*
+* Parameters
+* - t : time since the pulse started in ns
+*
+* Returns
+* - float_t : the pulse height, 1 at the peak, 0 before the pulse starts
+****************************************************************************/
+float_t PulseShape(double t)
+{
+	static const double peak = std::log(PULSE_FALL_NS / PULSE_RISE_NS) * PULSE_RISE_NS * PULSE_FALL_NS / (PULSE_FALL_NS - PULSE_RISE_NS);
+	static const double height = std::exp(-peak / PULSE_FALL_NS) - std::exp(-peak / PULSE_RISE_NS);
+
+	return (t <= 0) ? (float_t)0.0 : (float_t)((std::exp(-t / PULSE_FALL_NS) - std::exp(-t / PULSE_RISE_NS)) / height);
+}
+
+/****************************************************************************
+* DetectorSelect
+*
+* - Points a configured detector at one of the detector routines, the
+* version for the detector's polarity
+*
+* Parameters
+* - detector : the detector, configured by DetectorConfigure
+* - kind : which detector to run, not DETECTOR_KIND::AUTO
+*
+* Returns
+* - none
+****************************************************************************/
+void DetectorSelect(PEAK_DETECTOR* detector, DETECTOR_KIND kind)
+{
+	BOOL positive = (detector->polarity == POLARITY::POSITIVE) ? TRUE : FALSE;
+
+	detector->kind = kind;
+	switch (kind)
+	{
+	case DETECTOR_KIND::DERIVATIVE:
+		detector->name = "derivative";
+		detector->run = positive ? DerivativeDetector<POLARITY::POSITIVE> : DerivativeDetector<POLARITY::NEGATIVE>;
+		break;
+	case DETECTOR_KIND::MATCHED_FILTER:
+		detector->name = "matched filter";
+		detector->run = positive ? MatchedFilterDetector<POLARITY::POSITIVE> : MatchedFilterDetector<POLARITY::NEGATIVE>;
+		break;
+	default:
+		detector->kind = DETECTOR_KIND::MOVING_AVERAGE;
+		detector->name = "moving average";
+		detector->run = positive ? MovingAverageDetector<POLARITY::POSITIVE> : MovingAverageDetector<POLARITY::NEGATIVE>;
+		break;
+	}
+}
+
+/****************************************************************************
+* DetectorBenchmark
+*
+* - Runs every detector on the same simulated waveforms and picks the
+* fastest one that finds at least DETECTOR_MIN_EFFICIENCY of the decays
+* (or the one that finds the most, if none of them do)
+* - each waveform has a muon pulse at the trigger and, if it decays inside
+* the window, a smaller decay pulse after it, on a baseline of gaussian noise
+* rounded to the ADC's 8 bit steps. The pulse heights and the noise are
+* scaled to the peak detection threshold
+* - a detector finds a decay if it returns a peak within
+* DETECTOR_BENCH_TOLERANCE_NS of both pulses, any other peaks it returns
+* are counted as false
+*
+* Parameters
+* - detector : the configured detector, with the threshold and template
+* - timeIntervalNanoseconds : the sample interval
+* - pretriggersampleCount : where the trigger is in the waveforms
+* - sampleCount : length of the waveforms
+*
+* Returns
+* - DETECTOR_KIND : the detector picked
+****************************************************************************/
+DETECTOR_KIND DetectorBenchmark(const PEAK_DETECTOR* detector, int32_t timeIntervalNanoseconds, int32_t pretriggersampleCount, uint32_t sampleCount)
+{
+	const int32_t numkinds = (int32_t)DETECTOR_KIND::AUTO;
+	const uint16_t maxnumpeaks = 9;
+	const float_t scale = (float_t)(std::max)(std::abs(detector->thresh), 256); // the pulses and the noise are sized to the threshold
+	const float_t sign = (detector->polarity == POLARITY::POSITIVE) ? (float_t)1.0 : (float_t)-1.0;
+	const uint32_t tolerance = (std::max)((uint32_t)(DETECTOR_BENCH_TOLERANCE_NS / timeIntervalNanoseconds), (uint32_t)1);
+	PEAK_DETECTOR candidates[(int32_t)DETECTOR_KIND::AUTO];
+	uint32_t found[(int32_t)DETECTOR_KIND::AUTO] = { 0 };
+	uint32_t falsepeaks[(int32_t)DETECTOR_KIND::AUTO] = { 0 };
+	int64_t elapsedns[(int32_t)DETECTOR_KIND::AUTO] = { 0 };
+	uint32_t indices[10];
+	uint32_t decays = 0;
+	int32_t best = -1;
+	int16_t* waveform = (int16_t*)malloc((size_t)sampleCount * sizeof(int16_t));
+	std::mt19937 rng(1);
+	std::normal_distribution<float_t> noise((float_t)0.0, scale / 4);
+	std::uniform_real_distribution<float_t> uniform((float_t)0.0, (float_t)1.0);
+	std::exponential_distribution<double> lifetime(1.0 / MUON_LIFETIME_NS);
+
+	if (waveform == NULL)
+	{
+		printf("%s\n[%d] %s::%s ------ MEMORY ALLOCATION ERROR (non-pico)\n", timeInfotoString().c_str(), __LINE__, __func__, "malloc");
+		if (g_errorfp != NULL)
+		{
+			fprintf(g_errorfp, "%s\n[%d] %s::%s ------ MEMORY ALLOCATION ERROR (non-pico)\n\n", timeInfotoString().c_str(), __LINE__, __func__, "malloc");
+		}
+		return DETECTOR_KIND::MOVING_AVERAGE;
+	}
+
+	for (int32_t d = 0; d < numkinds; d++)
+	{
+		candidates[d] = *detector;
+		DetectorSelect(&candidates[d], (DETECTOR_KIND)d);
+	}
+
+	printf("\nBenchmarking the peak detectors on %d simulated waveforms...\n", DETECTOR_BENCH_WAVEFORMS);
+	for (uint32_t w = 0; w < DETECTOR_BENCH_WAVEFORMS; w++)
+	{
+		double muonns = (pretriggersampleCount - uniform(rng)) * timeIntervalNanoseconds; // starts just before the trigger sample
+		double decayns = muonns + lifetime(rng);
+		float_t muonheight = scale * (2 + 2 * uniform(rng));
+		float_t decayheight = scale * (1 + 2 * uniform(rng));
+		uint32_t muonpeak = (uint32_t)((muonns + std::log(PULSE_FALL_NS / PULSE_RISE_NS) * PULSE_RISE_NS * PULSE_FALL_NS / (PULSE_FALL_NS - PULSE_RISE_NS)) / timeIntervalNanoseconds + 0.5);
+		uint32_t decaypeak = muonpeak + (uint32_t)((decayns - muonns) / timeIntervalNanoseconds + 0.5);
+		BOOL decayed = (decaypeak + 8 * tolerance < sampleCount && decaypeak > muonpeak + 2 * tolerance) ? TRUE : FALSE;
+
+		for (uint32_t i = 0; i < sampleCount; i++)
+		{
+			double t = (double)i * timeIntervalNanoseconds;
+			float_t value = noise(rng) + sign * muonheight * PulseShape(t - muonns);
+
+			value += decayed ? sign * decayheight * PulseShape(t - decayns) : (float_t)0.0;
+			value = (std::max)((std::min)(value, (float_t)32512), (float_t)-32512);
+			waveform[i] = (int16_t)(256 * std::lround(value / 256));
+		}
+		decays += decayed;
+
+		for (int32_t d = 0; d < numkinds; d++)
+		{
+			int64_t startns;
+			uint16_t numpeaks;
+			uint16_t matched = 0;
+			BOOL muonfound = FALSE, decayfound = FALSE;
+
+			memset(indices, 0, sizeof(indices));
+			startns = HostTimeNs();
+			numpeaks = candidates[d].run(&candidates[d], waveform, sampleCount, 0, indices, maxnumpeaks);
+			elapsedns[d] += HostTimeNs() - startns;
+
+			for (uint16_t i = 1; i <= numpeaks; i++)
+			{
+				if (!muonfound && indices[i] + tolerance >= muonpeak && indices[i] <= muonpeak + tolerance)
+				{
+					muonfound = TRUE;
+					matched++;
+				}
+				else if (decayed && !decayfound && indices[i] + tolerance >= decaypeak && indices[i] <= decaypeak + tolerance)
+				{
+					decayfound = TRUE;
+					matched++;
+				}
+			}
+			found[d] += (muonfound && decayfound) ? 1 : 0;
+			falsepeaks[d] += numpeaks - matched;
+		}
+	}
+	free(waveform);
+
+	printf("Detector          Efficiency  False peaks  Time per waveform (us)\n");
+	for (int32_t d = 0; d < numkinds; d++)
+	{
+		float_t efficiency = decays ? (float_t)found[d] / decays : (float_t)0.0;
+
+		printf("%-16s  %9.1f%%  %11u  %22.2f\n", candidates[d].name, 100 * efficiency, falsepeaks[d],
+			elapsedns[d] / 1000.0 / DETECTOR_BENCH_WAVEFORMS);
+	}
+
+	// the fastest of the ones that are efficient enough, or the most efficient if none of them are
+	for (int32_t d = 0; d < numkinds; d++)
+	{
+		BOOL efficient = (found[d] >= DETECTOR_MIN_EFFICIENCY * decays) ? TRUE : FALSE;
+		BOOL bestefficient = (best != -1 && found[best] >= DETECTOR_MIN_EFFICIENCY * decays) ? TRUE : FALSE;
+
+		if (best == -1
+			|| (efficient && (!bestefficient || elapsedns[d] < elapsedns[best]))
+			|| (!efficient && !bestefficient && found[d] > found[best]))
+		{
+			best = d;
+		}
+	}
+	printf("Picked the %s detector, %s\n", candidates[best].name, (found[best] >= DETECTOR_MIN_EFFICIENCY * decays) ?
+		"the fastest that was efficient enough" : "none of them were efficient enough so it's the most efficient one");
+
+	return (DETECTOR_KIND)best;
+}
+
+/****************************************************************************
+* DetectorFree
+*
+* - Frees the matched filter's FFT buffers, the detector goes back to
+* correlating directly
+*
+* Parameters
+* - detector : the detector
+*
+* Returns
+* - none
+****************************************************************************/
+void DetectorFree(PEAK_DETECTOR* detector)
+{
+	free(detector->spectrum);
+	free(detector->twiddles);
+	detector->spectrum = NULL;
+	detector->twiddles = NULL;
+	detector->fftsize = 0;
+}
+
+/****************************************************************************
+* DetectorConfigure
+*
+* - Sets up the unit's peak detector from the settings the user picked: the
+* threshold and polarity, the derivative detector's hysteresis and the
+* matched filter's template (sampled at the capture's sample interval)
+* - templates of MATCHED_FILTER_FFT_TAPS or more also get the buffers and
+* spectrum for MatchedFilterFft
+* - then selects g_detectorkind, benchmarking them with DetectorBenchmark
+* first if it's DETECTOR_KIND::AUTO
+* - called once the sample interval and window are known, before the first
+* waveform is searched
+*
+* Parameters
+* - unit : pointer to the UNIT structure, whose detector is set up
+* - timeIntervalNanoseconds : the sample interval
+* - pretriggersampleCount : number of samples before the trigger
+* - sampleCount : length of the waveforms
+*
+* Returns
+* - none
+****************************************************************************/
+void DetectorConfigure(UNIT* unit, int32_t timeIntervalNanoseconds, int32_t pretriggersampleCount, uint32_t sampleCount)
+{
+	PEAK_DETECTOR* detector = &unit->detector;
+	DETECTOR_KIND kind = g_detectorkind;
+	double energy = 0;
+	float_t highest = 0;
+
+	detector->polarity = g_polarity;
+	detector->thresh = mv_to_adc(g_peakthresh, unit->channelSettings[PS2000A_CHANNEL_A].range, unit);
+	detector->hysteresis = (std::max)((int32_t)(std::abs(detector->thresh) * DERIVATIVE_HYSTERESIS), 1);
+
+	// matched filter template, the pulse sampled from its start
+	detector->taps = (uint32_t)std::ceil(MATCHED_FILTER_LENGTH * PULSE_FALL_NS / (std::max)(timeIntervalNanoseconds, 1));
+	detector->taps = (std::min)((std::max)(detector->taps, (uint32_t)2), (uint32_t)MATCHED_FILTER_MAX_TAPS);
+	detector->lag = 0;
+	for (uint32_t k = 0; k < detector->taps; k++)
+	{
+		detector->weights[k] = PulseShape((double)k * timeIntervalNanoseconds);
+		energy += (double)detector->weights[k] * detector->weights[k];
+		if (detector->weights[k] > highest)
+		{
+			highest = detector->weights[k];
+			detector->lag = k;
+		}
+	}
+	detector->weightsum = 0;
+	for (uint32_t k = 0; k < detector->taps; k++)
+	{
+		detector->weights[k] = (float_t)(detector->weights[k] * highest / energy); // a pulse peaking at A comes out at A
+		detector->weightsum += detector->weights[k];
+	}
+
+	DetectorFree(detector);
+	if (detector->taps >= MATCHED_FILTER_FFT_TAPS)
+	{
+		uint32_t size = 1;
+
+		while (size < MATCHED_FILTER_FFT_FACTOR * detector->taps)
+		{
+			size <<= 1;
+		}
+		detector->spectrum = (std::complex<float_t>*)calloc(size, sizeof(std::complex<float_t>));
+		detector->twiddles = (std::complex<float_t>*)calloc(size / 2, sizeof(std::complex<float_t>));
+		if (detector->spectrum == NULL || detector->twiddles == NULL)
+		{
+			printf("%s\n[%d] %s::%s ------ MEMORY ALLOCATION ERROR (non-pico)\n", timeInfotoString().c_str(), __LINE__, __func__, "calloc");
+			if (g_errorfp != NULL)
+			{
+				fprintf(g_errorfp, "%s\n[%d] %s::%s ------ MEMORY ALLOCATION ERROR (non-pico)\n\n", timeInfotoString().c_str(), __LINE__, __func__, "calloc");
+			}
+			DetectorFree(detector); // correlates directly instead
+		}
+		else
+		{
+			const double pi = 3.14159265358979323846;
+
+			detector->fftsize = size;
+			for (uint32_t k = 0; k < size / 2; k++)
+			{
+				detector->twiddles[k] = std::complex<float_t>((float_t)std::cos(2 * pi * k / size), (float_t)-std::sin(2 * pi * k / size));
+			}
+			// correlating with the template is convolving with it backwards, and the inverse FFT's 1 / size goes in here
+			for (uint32_t k = 0; k < detector->taps; k++)
+			{
+				detector->spectrum[k] = std::complex<float_t>(detector->weights[detector->taps - 1 - k] / size, 0);
+			}
+			Fft(detector->spectrum, size, detector->twiddles, FALSE);
+		}
+	}
+
+	if (kind == DETECTOR_KIND::AUTO)
+	{
+		kind = DetectorBenchmark(detector, timeIntervalNanoseconds, pretriggersampleCount, sampleCount);
+	}
+	DetectorSelect(detector, kind);
+	printf("Using the %s peak detector\n", detector->name);
+}
+
+/****************************************************************************
+* BlockPeakFinding
+*
+* - smooths the input signal using a 5-point moving average technique, then
+* finds and returns the indices of the found peaks in the buffer array
+* - the search itself is done by the unit's PEAK_DETECTOR, the moving
+* average detector (PeakSearch) unless another one was picked
+* - works out the baseline with BaselineEstimate
+*
+* Parameters
+* - unit : pointer to the UNIT structure, where the handle is stored
+* - databuffer : the buffer array where the device stores its data
+* - sampleCount : the number of samples in the buffer
+* - maxnumpeaks : the maximum number of peaks the function will search for
+* before stopping the search and returning, default at 9 arbitrarily
+*
+* Returns
+* - uint32_t* : pointer to buffer with 10 uint32_t's. The first entry in the
+* buffer contains the number of peaks found by the algorithm (1,2,3,...)
+* The remaining entries either contain the index of the detected peak
+* (peak 1's index is stored in buffer[1], the second peak in buffer[2], etc.)
+* or are left blank
+****************************************************************************/
+uint32_t* BlockPeakFinding(UNIT* unit, int16_t* dataBuffer, uint32_t sampleCount, uint16_t maxnumpeaks = 9)
+{
+	uint32_t* indices = NULL;
+	indices = (uint32_t*)BufferPoolGet(&g_bufferpool, (size_t)maxnumpeaks + 1, sizeof(uint32_t)); // first entry gets numpeaks, subsequent ones get index (in the buffer) of the peak from the waveform
+	float_t baseline;
+	uint16_t numpeaks;
+
+	if (indices == NULL) // no reason to look for peaks if we can't pass along the information...
+	{
+		printf("Failed to allocate the necessary memory for the peak-detection algorithm.(BlockPeakFinding)\n");
+		printf("Requested %zu bytes.(indices)\n", (size_t)10 * sizeof(uint32_t));
+		printf("The program will throw away this run and continue to collect more data.\n");
+		printf("%s\n[%d] %s::%s ------ MEMORY ALLOCATION ERROR (non-pico)\n", timeInfotoString().c_str(), __LINE__, __func__, "calloc");
+		//fprintf(stderr, "%s\n[%d] %s::%s ------ MEMORY ALLOCATION ERROR (non-pico)\n", timeInfotoString().c_str(), __LINE__, __func__, "calloc");
+		if (g_errorfp != NULL)
+		{
+			fprintf(g_errorfp, "%s\n[%d] %s::%s ------ MEMORY ALLOCATION ERROR (non-pico)\n\n", timeInfotoString().c_str(), __LINE__, __func__, "calloc");
+		}
+		return (uint32_t*)NULL;
+	}
+	// ...otherwise we're good :)
+
+	printf("Searching for peaks within the most recent sample...");
+
+	baseline = BaselineEstimate(unit, PS2000A_CHANNEL_A, dataBuffer, sampleCount);
+
+	numpeaks = unit->detector.run(&unit->detector, dataBuffer, sampleCount, baseline, indices, maxnumpeaks);
+
+	if (numpeaks >= maxnumpeaks) // in practice we shouldn't need to find more than 2 peaks
+	{
+		printf("\nMaximum number of peaks (%d) detected! Stopping the search now.\n", maxnumpeaks);
+		printf("If this search is classifying \"noise\" as peaks, consider either raising the peak detection threshold.\n");
+		return indices;
+	}
+
+	printf((numpeaks == 1) ? "%d peak detected.\n" : "%d peaks detected.\n", numpeaks);
+	return indices;
+}
+
+/****************************************************************************
+* CoincidencePeakFinding
+*
+* - Coincidence mode version of BlockPeakFinding: runs the same moving
+* average and peak search on channels A and B of a waveform at once, in one
+* pass over the two channels' samples (which sit next to each other in the
+* driver buffer) instead of one pass each
+* - works the moving average out as it goes, the first two and last two
+* points are taken as they are like BlockPeakFinding's ends
+* - ONLY WORKS FOR DOWNWARD PEAKS (concave up)
+*
+* Parameters
+* - unit : pointer to the UNIT structure, where the handle is stored
+* - bufferA : channel A's samples
+* - bufferB : channel B's samples
+* - sampleCount : the number of samples in each buffer
+* - maxnumpeaks : the maximum number of peaks searched for on each channel,
+* default at 9 like BlockPeakFinding
+*
+* Returns
+* - uint32_t* : pointer to 2 * (maxnumpeaks + 1) uint32_t's, channel A's
+* results laid out like BlockPeakFinding's followed by channel B's, NULL if
+* the memory couldn't be allocated
+****************************************************************************/
+uint32_t* CoincidencePeakFinding(UNIT* unit, int16_t* bufferA, int16_t* bufferB, uint32_t sampleCount, uint16_t maxnumpeaks = 9)
+{
+	int16_t* buffers[2] = { bufferA, bufferB };
+	uint32_t* indices = (uint32_t*)BufferPoolGet(&g_bufferpool, 2 * ((size_t)maxnumpeaks + 1), sizeof(uint32_t)); // channel A's numpeaks and peak indices, then channel B's
+	int16_t thresh[2];
+	float_t baseline[2];
+	int32_t peakIndex[2] = { -1, -1 };
+	int16_t peakValue[2];
+	BOOL done[2] = { FALSE, FALSE }; // the channel has had maxnumpeaks peaks
+	uint32_t* found[2];
+
+	if (indices == NULL) // no reason to look for peaks if we can't pass along the information...
+	{
+		printf("Failed to allocate the necessary memory for the peak-detection algorithm.(CoincidencePeakFinding)\n");
+		printf("Requested %zu bytes.(indices)\n", 2 * ((size_t)maxnumpeaks + 1) * sizeof(uint32_t));
+		printf("The program will throw away this run and continue to collect more data.\n");
+		printf("%s\n[%d] %s::%s ------ MEMORY ALLOCATION ERROR (non-pico)\n", timeInfotoString().c_str(), __LINE__, __func__, "calloc");
+		if (g_errorfp != NULL)
+		{
+			fprintf(g_errorfp, "%s\n[%d] %s::%s ------ MEMORY ALLOCATION ERROR (non-pico)\n\n", timeInfotoString().c_str(), __LINE__, __func__, "calloc");
+		}
+		return (uint32_t*)NULL;
+	}
+
+	printf("Searching for peaks on channels A and B within the most recent sample...");
+
+	for (int16_t c = 0; c < 2; c++)
+	{
+		thresh[c] = mv_to_adc(g_peakthresh, unit->channelSettings[PS2000A_CHANNEL_A + c].range, unit);
+		peakValue[c] = std::numeric_limits<int16_t>::infinity();
+		found[c] = indices + c * ((size_t)maxnumpeaks + 1);
+	}
+
+	baseline[0] = BaselineEstimate(unit, PS2000A_CHANNEL_A, bufferA, sampleCount);
+	baseline[1] = BaselineEstimate(unit, PS2000A_CHANNEL_B, bufferB, sampleCount);
+
+	for (uint32_t i = 2; i < sampleCount - 1 && !(done[0] && done[1]); i++)
+	{
+		for (int16_t c = 0; c < 2; c++)
+		{
+			int16_t* data = buffers[c];
+			int16_t smoothed;
+
+			if (done[c])
+			{
+				continue;
+			}
+			smoothed = (i < sampleCount - 2) ? MovingAverageFive(data[i - 2], data[i - 1], data[i], data[i + 1], data[i + 2]) : data[i];
+			if (smoothed < baseline[c])
+			{
+				if (smoothed < peakValue[c] && smoothed < thresh[c])
+				{
+					peakIndex[c] = i;
+					peakValue[c] = smoothed;
+				}
+			}
+			else if (smoothed >= baseline[c] && peakIndex[c] != -1) // see BlockPeakFinding
+			{
+				found[c][0]++;
+				found[c][found[c][0]] = peakIndex[c];
+				peakIndex[c] = -1;
+				peakValue[c] = std::numeric_limits<int16_t>::infinity();
+			}
+			if (found[c][0] >= maxnumpeaks)
+			{
+				printf("\nMaximum number of peaks (%d) detected on channel %c! Stopping its search now.\n", maxnumpeaks, 'A' + c);
+				printf("If this search is classifying \"noise\" as peaks, consider either raising the peak detection threshold.\n");
+				done[c] = TRUE;
+			}
+		}
+	}
+
+	for (int16_t c = 0; c < 2; c++)
+	{
+		if (peakIndex[c] != -1 && !done[c])
+		{
+			found[c][0]++;
+			found[c][found[c][0]] = peakIndex[c];
+		}
+	}
+
+	printf("%u on channel A and %u on channel B.\n", found[0][0], found[1][0]);
+	return indices;
+}
+
+/****************************************************************************
+* BlockPeaktoPeak
+*
+* - Calls BlockPeakFinding to find peaks in a block of data, then finds
+* the peak to peak times for the returned peaks
+* - Assumes a downwards peak characteristic of the scintillating bar
+* - If speed is a concern this function could be eliminated and
+* BlockPeakFinding could return the indices array directly to BlockDataHandler
+*
+* Parameters
+* - buffer : the buffer array where the data is stored
+* - sampleCount : the number of samples in the buffer
+* - sampleInterval : the amount of time (in ns) per sample
+* - downsampleratio : downsample ratio for data collection, see programmer's
+*	guide
+*
+* Returns
+* - uint32_t* : pointer to a buffer of 10 uint32_t's. See comments for
+* BlockPeakFinding
+****************************************************************************/
+uint32_t* BlockPeaktoPeak(UNIT* unit, int16_t* buffer, uint32_t sampleCount, uint32_t sampleInterval, uint32_t downsampleratio)
+{
+	uint16_t numpeaks;
+	uint32_t* indices = NULL;
+
+	indices = BlockPeakFinding(unit, buffer, sampleCount); // get the results from the peak finding algorithm
+	if (indices == NULL) // if the peak detection algorithm had allocation issues...
+	{
+		printf("Error allocating memory, no peaks could be detected.\n");
+		printf("%s\n[%d] %s::%s ------ MEMORY ALLOCATION ERROR (non-pico)\n", timeInfotoString().c_str(), __LINE__, __func__, "BlockPeakFinding");
+		//fprintf(stderr, "%s\n[%d] %s::%s ------ MEMORY ALLOCATION ERROR (non-pico)\n", timeInfotoString().c_str(), __LINE__, __func__, "BlockPeakFinding");
+		if (g_errorfp != NULL)
+		{
+			fprintf(g_errorfp, "%s\n[%d] %s::%s ------ MEMORY ALLOCATION ERROR (non-pico)\n\n", timeInfotoString().c_str(), __LINE__, __func__, "BlockPeakFinding");
+		}
+		return (uint32_t*)NULL;
+	} // ...otherwise we're fine to proceed
+	numpeaks = indices[0]; // first entry is numpeaks
+
+	printf(numpeaks > 1 ? "Calculating peak to peak values...\n" : "");
+
+	// Can leave prints in for easy checking of data taking process, shouldn't slow down program too much
+	printf("Peak #, Time (ns), ADC Count, Voltage (mV)\n");
+	for (uint16_t i = 1; i < numpeaks + 1; i++)
+	{
+		// prints with a different number of spaces depending on the ADC value so
+		// that the mV value properly aligns with its column label
+		// casting down sampleInterval and downsampleratio shouldn't be a huge deal, 
+		// should be a relatively small number
+		printf((std::abs(buffer[indices[i]] * (int16_t)sampleInterval * (int16_t)downsampleratio) >= 10000) ?
+			"%d       %u        %d     %d\n" : "%d       %u        %d      %d\n",
+			i, indices[i] * sampleInterval, buffer[indices[i]], adc_to_mv(buffer[indices[i]], unit->channelSettings[PS2000A_CHANNEL_A].range, unit));
+	}
+
+	for (uint16_t i = 1; i < numpeaks + 1; i++)
+	{
+		for (uint16_t j = i + 1; j < numpeaks + 1; j++)
+		{
+			printf("Peak %d to Peak %d: %d ns\n", i, j, (indices[j] - indices[i]) * sampleInterval * downsampleratio);
+		}
+	}
+
+	return indices;
+}
+
+/****************************************************************************
+* CaptureWindowSamples
+*
+* - Works out the pre/post-trigger sample counts for the g_pretriggerns and
+* g_posttriggerns capture window, using the sample interval of the current
+* timebase (moving on to a slower timebase if need be, like the block data
+* routines always have)
+* - shortens the window after the trigger if it doesn't fit in maxSamples
+*
+* Parameters
+* - unit : pointer to the UNIT structure, where the handle is stored
+* - maxSamples : the most samples a single capture can hold
+* - timeIntervalNanoseconds : on exit, the amount of time (in ns) per sample
+* - pretriggersampleCount : on exit, the number of samples before the trigger
+* - posttriggersampleCount : on exit, the number of samples after the trigger
+*
+* Returns
+* - PICO_STATUS : to indicate success, or if an error occurred
+****************************************************************************/
+PICO_STATUS CaptureWindowSamples(UNIT* unit, int32_t maxSamples, int32_t* timeIntervalNanoseconds, int32_t* pretriggersampleCount, int32_t* posttriggersampleCount)
+{
+	PICO_STATUS status;
+	int32_t available;
+
+	// Validate the current timebase index and find the time interval (in nanoseconds), the sample counts depend on it
+	while ((status = ps2000aGetTimebase(unit->handle, g_timebase, 1, timeIntervalNanoseconds, g_oversample, &available, 0)) != PICO_OK)
+	{
+		if (status == PICO_INVALID_TIMEBASE) // not an actual error, just need to try a different (slower) time base (see Programmer's Guide for explanation)
+		{
+			g_timebase++; // we shouldn't reach this spot, this should just stay at 0 (so long as we're using single channel block mode)
+		}
+		else // something actually went wrong
+		{
+			picoerrorLog(g_errorfp, status, __LINE__, __func__, "ps2000aGetTimebase");
+			return status;
+		}
+	}
+
+	// round up, so the window is at least as long as asked for
+	*pretriggersampleCount = (int32_t)((g_pretriggerns + *timeIntervalNanoseconds - 1) / *timeIntervalNanoseconds);
+	*posttriggersampleCount = (int32_t)((g_posttriggerns + *timeIntervalNanoseconds - 1) / *timeIntervalNanoseconds);
+	printf("Capture window: %d samples before and %d samples after the trigger (%d ns per sample).\n",
+		*pretriggersampleCount, *posttriggersampleCount, *timeIntervalNanoseconds);
+
+	available = (std::min)(available, maxSamples);
+	if (*pretriggersampleCount + *posttriggersampleCount > available)
+	{
+		*pretriggersampleCount = (std::min)(*pretriggersampleCount, available / 10);
+		*posttriggersampleCount = available - *pretriggersampleCount;
+		printf("Space needed to fulfill the requested capture window exceeds the device's memory (%d samples).\n", available);
+		printf("Setting pretriggersampleCount to %d and posttriggersampleCount to %d.\n", *pretriggersampleCount, *posttriggersampleCount);
+	}
+
+	// and make sure the device is happy with the final sample count
+	if ((status = ps2000aGetTimebase(unit->handle, g_timebase, *pretriggersampleCount + *posttriggersampleCount, timeIntervalNanoseconds, g_oversample, &available, 0)) != PICO_OK)
+	{
+		picoerrorLog(g_errorfp, status, __LINE__, __func__, "ps2000aGetTimebase");
+	}
+
+	return status;
+}
+
+/****************************************************************************
+* AdaptiveWindowRecord
+*
+* - Adds the decay time of a two-peak event to the histogram the adaptive
+* capture window is based on
+* - Called from whichever thread records the events
+*
+* Parameters
+* - adaptive : pointer to the ADAPTIVE_WINDOW struct
+* - decayns : time between the two peaks (in ns)
+*
+* Returns
+* - none
+****************************************************************************/
+inline void AdaptiveWindowRecord(ADAPTIVE_WINDOW* adaptive, uint32_t decayns)
+{
+	uint64_t bin = ((uint64_t)decayns * ADAPTIVE_BINS) / g_posttriggerns;
+
+	adaptive->histogram[(std::min)(bin, (uint64_t)ADAPTIVE_BINS - 1)].fetch_add(1, std::memory_order_relaxed);
+	adaptive->events.fetch_add(1, std::memory_order_relaxed);
+}
+
+/****************************************************************************
+* AdaptiveWindowShrink
+*
+* - Shrinks the capture window after the trigger once ADAPTIVE_MIN_EVENTS
+* two-peak events have been recorded: the cutoff is the shortest decay time
+* with no more than ADAPTIVE_TAIL_FRACTION of the events past it, and the
+* new window is ADAPTIVE_MARGIN times that. A shorter window loses
+* (practically) no decays but makes for shorter transfers and a higher
+* event rate
+* - The window only shrinks once: events past the end of it can't be seen
+* anymore, so from then on the histogram's tail is cut short and there's no
+* evidence to grow it back (or to shrink it any further) with
+*
+* Parameters
+* - adaptive : pointer to the ADAPTIVE_WINDOW struct
+* - shrunk : whether the unit's window has already been shrunk, set once it
+*	has
+* - timeIntervalNanoseconds : the amount of time (in ns) per sample
+* - posttriggersampleCount : the current number of samples after the trigger,
+*	updated if the window shrinks
+*
+* Returns
+* - BOOL : TRUE if the window shrunk, FALSE otherwise
+****************************************************************************/
+BOOL AdaptiveWindowShrink(ADAPTIVE_WINDOW* adaptive, BOOL* shrunk, int32_t timeIntervalNanoseconds, int32_t* posttriggersampleCount)
+{
+	uint64_t events = adaptive->events.load(std::memory_order_relaxed);
+	uint64_t tail = 0;
+	uint32_t cutoff = ADAPTIVE_BINS; // in bins
+	int32_t shrunkCount;
+
+	if (!g_adaptivewindow || *shrunk || events < ADAPTIVE_MIN_EVENTS)
+	{
+		return FALSE;
+	}
+
+	// walk in from the end of the histogram for as long as the tail stays small enough to cut off
+	while (cutoff > 1 && tail + adaptive->histogram[cutoff - 1].load(std::memory_order_relaxed) <= events * ADAPTIVE_TAIL_FRACTION)
+	{
+		tail += adaptive->histogram[--cutoff].load(std::memory_order_relaxed);
+	}
+
+	// the first peak sits a few samples after the trigger, leave some room for that
+	shrunkCount = (int32_t)(((double)cutoff * g_posttriggerns * ADAPTIVE_MARGIN) / ((double)ADAPTIVE_BINS * timeIntervalNanoseconds)) + ADAPTIVE_SLACK_SAMPLES;
+	if (shrunkCount >= *posttriggersampleCount * 0.9) // not worth it for less than 10%
+	{
+		return FALSE;
+	}
+
+	printf("\n%" PRIu64 " of %" PRIu64 " two-peak events had decay times over %u ns, shrinking the capture window after the trigger from %d ns to %d ns.\n\n",
+		tail, events, cutoff * (g_posttriggerns / ADAPTIVE_BINS), *posttriggersampleCount * timeIntervalNanoseconds, shrunkCount * timeIntervalNanoseconds);
+	*posttriggersampleCount = shrunkCount;
+	*shrunk = TRUE;
+	return TRUE;
+}
+
+/****************************************************************************
+* RecordPeakInfo
+*
+* - Records the result of the peak detection on one waveform: two-peak events
+* get their peak info written to the peak file, and the raw waveform written
+* to its own .csv file (if specified by g_numwavestosaved)
+* - Used by both the block and streaming data routines
+*
+* Parameters
+* - unit : pointer to the UNIT structure, where the handle is stored
+* - channel : the channel the waveform came from
+* - buffer : the buffer array holding the waveform
+* - sampleCount : the number of samples in the buffer
+* - indices : the number of peaks and their indices in buffer, see comments
+*	for BlockPeakFinding
+* - timeIntervalNanoseconds : the amount of time (in ns) per sample
+* - downsampleratio : downsample ratio for data collection, see programmer's
+*	guide
+* - time : when the event happened, written to the peak file with it
+*
+* Returns
+* - PICO_STATUS : to indicate success, or if an error occurred
+****************************************************************************/
+PICO_STATUS RecordPeakInfo(UNIT* unit, int16_t channel, int16_t* buffer, uint32_t sampleCount, uint32_t* indices, int32_t timeIntervalNanoseconds, uint32_t downsampleratio, EVENT_TIME* time)
+{
+	PICO_STATUS status = PICO_OK;
+	uint16_t numpeaks = indices[0]; // numpeaks stored in the first array entry
+	BOOL lasttosave = FALSE; // indicates if the waveform just saved was the last one to be saved
+	FILE* wavefp = NULL;
+
+	// might want to make this "== 2" since 3-peak events seem to throw a wrench in the data analysis
+	// if this change is made we can get rid of the 'T' delimiter for the peak info file and add column headers
+	if (numpeaks == 2) // no reason to record 1-peak events
+	{
+		// the peak file, the waveform files and wavefilename are shared by all the units
+		std::lock_guard<std::mutex> guard(g_recordlock);
+
+		g_nummultipeakevents++; // keep track of how many events we've recorded
+		AdaptiveWindowRecord(&g_adaptive, (indices[2] - indices[1]) * timeIntervalNanoseconds * downsampleratio);
+		if ((g_numwavestosaved > 0) || (g_numwavestosaved == -1)) // if we're still saving waveforms
+		{
+			// give the file a time-dependent name to avoid file name collisions
+			wavefilename = "RAW_WAVEFORM_"; // reset the filename from the last block of multi-peak data
+			wavefilename += timeInfotoString();
+			wavefilename += ".csv";
+			fopen_s(&wavefp, wavefilename.c_str(), "w");
+
+			if (wavefp != NULL)
+			{
+				printf("Writing the raw data to the disk file(%s)\n...", wavefilename.c_str());
+				fprintf(wavefp, "Block Data Log:\n\nTime (ns), ADC Count, mV\n");
+
+				for (uint32_t i = 0; i < sampleCount; i++)
+				{
+					// Times printed in ns
+					fprintf(wavefp,
+						"%d, %d, %d\n",
+						(int32_t)(i * timeIntervalNanoseconds * downsampleratio),
+						buffer[i],
+						adc_to_mv(buffer[i], unit->channelSettings[channel].range, unit));
+				}
+				printf("done.\n");
+				// update the number of waveforms to be saved
+				if (g_numwavestosaved > 0)
+				{
+					g_numwavestosaved--;
+					lasttosave = g_numwavestosaved ? FALSE : TRUE; // If we just saved the last waveform to be saved, set this flag to TRUE
+				}
+			}
+			else
+			{
+				printf("Cannot open the file \n%s\n for writing.\n"
+					"Please ensure that you have permission to access and/ or the file isn't currently open.\n", wavefilename.c_str());
+			}
+		}
+		else
+		{
+			printf("The maximum number of waveforms to be recorded has been reached.\n");
+			printf("Peak information for this waveform will still be saved. (%s)\n", peakfilename.c_str());
+		}
+		if (g_peakfp != NULL)
+		{
+			for (uint16_t i = 1; i <= numpeaks; i++)
+			{
+				fprintf(g_peakfp, "%d,%d,", // print peak depths 
+					buffer[indices[i]], // as ADC Counts...
+					adc_to_mv(buffer[indices[i]], unit->channelSettings[channel].range, unit)); // ...and in mV
+			}
+			fprintf(g_peakfp, "T,"); // some arbitrary deliminating character to separate peak depths and time differences
+			// print time differences (in ns) between the first peak and other peaks
+			for (uint16_t i = 2; i <= numpeaks; i++)
+			{
+				fprintf(g_peakfp, "%d,", (indices[i] - indices[1]) * timeIntervalNanoseconds * downsampleratio);
+			}
+			// if the program wrote a waveform file, its name gets written to the peak file
+			fprintf(g_peakfp, (g_numwavestosaved || lasttosave) ? "%s," : "No file,", wavefilename.c_str());
+			// then when the event happened, the host time (in ns) and the trigger time offset (in ps)...
+			fprintf(g_peakfp, "%" PRId64 ",%" PRId64 ",", time->hostns, time->triggeroffsetps);
+			// and which unit and channel it came from
+			fprintf(g_peakfp, "%s,%c\n", (char*)unit->serial, 'A' + channel);
+		}
+		else
+		{
+			printf("Cannot open the file \n(%s)\n for writing.\n"
+				"Please ensure that you have permission to access and/ or the file isn't currently open.\n", peakfilename.c_str());
+		}
+	}
+	else
+	{
+		printf("Not recording 1-peak events.\n");
+		printf((g_numwavestosaved == -1) ? "" : "Remaining Number of Waveforms to Record: %" PRId64 "\n", g_numwavestosaved);
+	}
+
+	if (wavefp != NULL)
+	{
+		fclose(wavefp);
+	}
+
+	return status;
+}
+
+/****************************************************************************
+* BlockAnalyseEvent
+*
+* - Runs the peak detection on a single captured waveform, the first half of
+* BlockRecordEvent
+* - In coincidence mode both channels go through CoincidencePeakFinding
+* together
+* - Safe to run on several waveforms of the same unit at once, it's what
+* the block mode pipeline's workers run
+*
+* Parameters
+* - unit : pointer to the UNIT structure, where the handle is stored
+* - buffer : the buffer array holding the waveform
+* - bufferB : channel B's samples of the same waveform, NULL unless in
+*	coincidence mode
+* - sampleCount : the number of samples in the buffer
+* - timeIntervalNanoseconds : the amount of time (in ns) per sample
+* - downsampleratio : downsample ratio for data collection, see programmer's
+*	guide
+*
+* Returns
+* - uint32_t* : the peak indices, laid out like BlockPeaktoPeak's or
+* CoincidencePeakFinding's, NULL if the memory couldn't be allocated
+****************************************************************************/
+uint32_t* BlockAnalyseEvent(UNIT* unit, int16_t* buffer, int16_t* bufferB, uint32_t sampleCount, int32_t timeIntervalNanoseconds, uint32_t downsampleratio)
+{
+	uint32_t* indices = NULL; // array to hold numpeaks and the indices of such peaks
+	int64_t stagens = HostTimeNs();
+
+	g_numwaveforms++;
+
+	if (bufferB != NULL)
+	{
+		indices = CoincidencePeakFinding(unit, buffer, bufferB, sampleCount, BLOCK_MAX_PEAKS);
+		TimingStage(&g_timing, STAGE_ANALYSIS, stagens, HostTimeNs());
+		if (indices == NULL)
+		{
+			printf("%s\n[%d] %s::%s ------ MEMORY ALLOCATION ERROR (non-pico)\n\n", timeInfotoString().c_str(), __LINE__, __func__, "CoincidencePeakFinding");
+			if (g_errorfp != NULL)
+			{
+				fprintf(g_errorfp, "%s\n[%d] %s::%s ------ MEMORY ALLOCATION ERROR (non-pico)\n\n", timeInfotoString().c_str(), __LINE__, __func__, "CoincidencePeakFinding");
+			}
+		}
+		return indices;
+	}
+
+	indices = BlockPeaktoPeak(unit, buffer, sampleCount, timeIntervalNanoseconds, downsampleratio);
+	TimingStage(&g_timing, STAGE_ANALYSIS, stagens, HostTimeNs());
+
+	if (indices == NULL) // if there were memory allocation issues with the peak detection algorithm...
+	{
+		printf("%s\n[%d] %s::%s ------ MEMORY ALLOCATION ERROR (non-pico)\n\n", timeInfotoString().c_str(), __LINE__, __func__, "BlockPeaktoPeak");
+		//fprintf(stderr, "%s\n[%d] %s::%s ------ MEMORY ALLOCATION ERROR (non-pico)\n\n", timeInfotoString().c_str(), __LINE__, __func__, "BlockPeaktoPeak");
+		if (g_errorfp != NULL)
+		{
+			fprintf(g_errorfp, "%s\n[%d] %s::%s ------ MEMORY ALLOCATION ERROR (non-pico)\n\n", timeInfotoString().c_str(), __LINE__, __func__, "BlockPeaktoPeak");
+		}
+	} // ...otherwise we're good to go
+
+	return indices;
+}
+
+/****************************************************************************
+* BlockRecordPeaks
+*
+* - Records the peaks BlockAnalyseEvent found through RecordPeakInfo, the
+* second half of BlockRecordEvent, and frees them
+* - In coincidence mode each channel's two-peak events are recorded
+*
+* Parameters
+* - unit : pointer to the UNIT structure, where the handle is stored
+* - buffer : the buffer array holding the waveform
+* - bufferB : channel B's samples of the same waveform, NULL unless in
+*	coincidence mode
+* - indices : BlockAnalyseEvent's results, given back to the buffer pool here
+* - sampleCount : the number of samples in the buffer
+* - timeIntervalNanoseconds : the amount of time (in ns) per sample
+* - downsampleratio : downsample ratio for data collection, see programmer's
+*	guide
+* - time : when the event happened
+*
+* Returns
+* - PICO_STATUS : to indicate success, or if an error occurred
+****************************************************************************/
+PICO_STATUS BlockRecordPeaks(UNIT* unit, int16_t* buffer, int16_t* bufferB, uint32_t* indices, uint32_t sampleCount, int32_t timeIntervalNanoseconds, uint32_t downsampleratio, EVENT_TIME* time)
+{
+	PICO_STATUS status = PICO_OK;
+	int64_t stagens = HostTimeNs();
+
+	if (bufferB != NULL)
+	{
+		// the muon goes through both paddles, the decay shows up in whichever one it stopped in
+		for (int16_t channel = PS2000A_CHANNEL_A; channel <= PS2000A_CHANNEL_B; channel++)
+		{
+			PICO_STATUS recorded = RecordPeakInfo(unit, channel, (channel == PS2000A_CHANNEL_A) ? buffer : bufferB, sampleCount,
+				indices + channel * (BLOCK_MAX_PEAKS + 1), timeIntervalNanoseconds, downsampleratio, time);
+			status = (status == PICO_OK) ? recorded : status;
+		}
+	}
+	else
+	{
+		status = RecordPeakInfo(unit, PS2000A_CHANNEL_A, buffer, sampleCount, indices, timeIntervalNanoseconds, downsampleratio, time);
+	}
+	TimingStage(&g_timing, STAGE_RECORD, stagens, HostTimeNs());
+
+	BufferPoolPut(&g_bufferpool, indices);
+
+	return status;
+}
+
+/****************************************************************************
+* BlockRecordEvent
+*
+* - Runs the peak detection on a single captured waveform and records the
+* result through RecordPeakInfo, BlockAnalyseEvent then BlockRecordPeaks
+* - Used by the block data routines that analyse each waveform as soon as
+* it's read out, the block mode pipeline runs the two halves separately
+*
+* Parameters
+* - unit : pointer to the UNIT structure, where the handle is stored
+* - buffer : the buffer array holding the waveform
+* - bufferB : channel B's samples of the same waveform, NULL unless in
+*	coincidence mode
+* - sampleCount : the number of samples in the buffer
+* - timeIntervalNanoseconds : the amount of time (in ns) per sample
+* - downsampleratio : downsample ratio for data collection, see programmer's
+*	guide
+* - time : when the event happened
+*
+* Returns
+* - PICO_STATUS : to indicate success, or if an error occurred
+****************************************************************************/
+PICO_STATUS BlockRecordEvent(UNIT* unit, int16_t* buffer, int16_t* bufferB, uint32_t sampleCount, int32_t timeIntervalNanoseconds, uint32_t downsampleratio, EVENT_TIME* time)
+{
+	uint32_t* indices = BlockAnalyseEvent(unit, buffer, bufferB, sampleCount, timeIntervalNanoseconds, downsampleratio);
+
+	if (indices == NULL) // nothing to record, BlockAnalyseEvent has logged why
+	{
+		return PICO_OK;
+	}
+
+	return BlockRecordPeaks(unit, buffer, bufferB, indices, sampleCount, timeIntervalNanoseconds, downsampleratio, time);
+}
+
+/****************************************************************************
+* AggregateCandidateRegions
+*
+* - First stage of the two-stage readout: looks through the min/max summary
+* of a waveform for bins that dip below the peak detection threshold and
+* merges them into the regions that need to be read at full resolution
+* - each region gets a bin either side of it, enough for the moving average
+* and for the smoothed signal to come back up above the baseline
+* - also estimates the baseline from the middle of each bin, which stands in
+* for the mean of the whole waveform (BASELINE_MODE::FULL)
+*
+* Parameters
+* - maxBuffer, minBuffer : the aggregated maxima and minima
+* - numBins : the number of min/max pairs
+* - sampleCount : the number of samples in the full waveform
+* - thresh : the peak detection threshold in ADC counts
+* - regions : on exit, holds the start and end (exclusive) sample index of
+*	each region, back to back
+* - baseline : on exit, the estimated baseline
+*
+* Returns
+* - uint32_t : the number of regions, MAX_REGIONS + 1 if there were too many
+* candidates for the two-stage readout to be worth it
+****************************************************************************/
+uint32_t AggregateCandidateRegions(int16_t* maxBuffer, int16_t* minBuffer, uint32_t numBins, uint32_t sampleCount, int16_t thresh, uint32_t* regions, float_t* baseline)
+{
+	uint32_t numRegions = 0;
+	uint32_t regionSamples = 0;
+	int32_t accumulator = 0;
+
+	for (uint32_t i = 0; i < numBins; i++)
+	{
+		accumulator += ((int32_t)maxBuffer[i] + (int32_t)minBuffer[i]) / 2;
+	}
+	*baseline = (numBins > 0) ? (float_t)accumulator / (float_t)numBins : 0;
+
+	for (uint32_t i = 0; i < numBins; i++)
+	{
+		uint32_t start;
+		uint32_t end;
+
+		if (minBuffer[i] >= thresh)
+		{
+			continue;
+		}
+		start = (i > 0) ? (i - 1) * AGGREGATE_RATIO : 0;
+		end = (std::min)((i + 2) * AGGREGATE_RATIO, sampleCount);
+		if (numRegions > 0 && start <= regions[2 * numRegions - 1]) // overlaps the last one, just extend it
+		{
+			regionSamples += end - regions[2 * numRegions - 1];
+			regions[2 * numRegions - 1] = end;
+			continue;
+		}
+		if (numRegions == MAX_REGIONS)
+		{
+			return MAX_REGIONS + 1;
+		}
+		regions[2 * numRegions] = start;
+		regions[2 * numRegions + 1] = end;
+		regionSamples += end - start;
+		numRegions++;
+	}
+
+	// the summary leaves out whatever doesn't fill a whole bin at the end, so read that too
+	if (numBins * AGGREGATE_RATIO < sampleCount)
+	{
+		uint32_t start = numBins * AGGREGATE_RATIO;
+
+		if (numRegions > 0 && start <= regions[2 * numRegions - 1])
+		{
+			regionSamples += sampleCount - regions[2 * numRegions - 1];
+			regions[2 * numRegions - 1] = sampleCount;
+		}
+		else if (numRegions == MAX_REGIONS)
+		{
+			return MAX_REGIONS + 1;
+		}
+		else
+		{
+			regions[2 * numRegions] = start;
+			regions[2 * numRegions + 1] = sampleCount;
+			regionSamples += sampleCount - start;
+			numRegions++;
+		}
+	}
+
+	// past a quarter of the waveform the extra transfers cost more than they save
+	return (regionSamples > sampleCount / 4) ? MAX_REGIONS + 1 : numRegions;
+}
+
+/****************************************************************************
+* RegionPeakFinding
+*
+* - Version of BlockPeakFinding for the two-stage readout, which only has
+* parts of the waveform at full resolution: runs the same smoothing and
+* peak search over just those regions
+* - a peak still in progress at the end of a region is closed there, the
+* signal in between regions never gets near the threshold
+*
+* Parameters
+* - unit : pointer to the UNIT structure, where the handle is stored
+* - dataBuffer : the buffer array holding the waveform, only valid inside
+*	the regions
+* - sampleCount : the number of samples in the waveform
+* - regions : start and end (exclusive) sample index of each region
+* - numRegions : the number of regions
+* - baseline : the baseline, see TwoStageReadout
+* - maxnumpeaks : the maximum number of peaks the function will search for
+*
+* Returns
+* - uint32_t* : pointer to a buffer laid out like BlockPeakFinding's return
+* value, NULL if it couldn't be allocated
+****************************************************************************/
+uint32_t* RegionPeakFinding(UNIT* unit, int16_t* dataBuffer, uint32_t sampleCount, uint32_t* regions, uint32_t numRegions, float_t baseline, uint16_t maxnumpeaks = 9)
+{
+	uint32_t* indices = (uint32_t*)BufferPoolGet(&g_bufferpool, (size_t)maxnumpeaks + 1, sizeof(uint32_t));
+	int16_t thresh = mv_to_adc(g_peakthresh, unit->channelSettings[PS2000A_CHANNEL_A].range, unit);
 	uint16_t numpeaks = 0;
-	int16_t* smoothbuffer = NULL;
-	smoothbuffer = globalBuffer ? workBuffer : (int16_t*)calloc(sampleCount, sizeof(int16_t)); // either use the passed in buffer or allocate our own
-	/*
-	* Quick note here:
-	*	Initially tried making smoothbuffer of type float_t to avoid
-	*	some of the truncation that would come with the averaging, but doing this
-	*	caused all kinds of memory exceptions down the line, think it might have
-	*	something to do with not getting all the memory we asked for and then trying
-	*	to free it? Not sure sure, but the program works just fine using int16_t's
-	*	here so it's not really an issue.
-	*/
-	int32_t peakIndex = -1;
+
+	if (indices == NULL)
+	{
+		printf("%s\n[%d] %s::%s ------ MEMORY ALLOCATION ERROR (non-pico)\n", timeInfotoString().c_str(), __LINE__, __func__, "calloc");
+		if (g_errorfp != NULL)
+		{
+			fprintf(g_errorfp, "%s\n[%d] %s::%s ------ MEMORY ALLOCATION ERROR (non-pico)\n\n", timeInfotoString().c_str(), __LINE__, __func__, "calloc");
+		}
+		return (uint32_t*)NULL;
+	}
+
+	for (uint32_t r = 0; r < numRegions && numpeaks < maxnumpeaks; r++)
+	{
+		int32_t peakIndex = -1;
+		int16_t peakValue = (std::numeric_limits<int16_t>::max)();
+
+		// the moving average needs 2 points either side, so the first and last 2 of each region are skipped
+		for (uint32_t i = regions[2 * r] + 2; i + 2 < regions[2 * r + 1]; i++)
+		{
+			int16_t smooth = MovingAverageFive(dataBuffer[i - 2], dataBuffer[i - 1], dataBuffer[i], dataBuffer[i + 1], dataBuffer[i + 2]);
+
+			if (smooth < baseline)
+			{
+				if (smooth < peakValue && smooth < thresh)
+				{
+					peakIndex = i;
+					peakValue = smooth;
+				}
+			}
+			else if (peakIndex != -1) // closes on the baseline itself, a pre-trigger baseline is usually an exact ADC level
+			{
+				indices[0] = ++numpeaks;
+				indices[numpeaks] = peakIndex;
+				peakIndex = -1;
+				peakValue = (std::numeric_limits<int16_t>::max)();
+				if (numpeaks >= maxnumpeaks)
+				{
+					break;
+				}
+			}
+		}
+		if (peakIndex != -1 && numpeaks < maxnumpeaks)
+		{
+			indices[0] = ++numpeaks;
+			indices[numpeaks] = peakIndex;
+		}
+	}
+
+	printf((numpeaks == 1) ? "%d peak detected.\n" : "%d peaks detected.\n", numpeaks);
+	return indices;
+}
+
+/****************************************************************************
+* TwoStageReadout
+*
+* - Reads a captured waveform off of the scope in two stages: first a min/max
+* summary (AGGREGATE_RATIO samples per pair), then only the regions of it
+* that could hold a peak at full resolution, and runs the peak detection on
+* those
+* - the whole waveform is only read when the summary is too busy for this to
+* pay off, or when the event is going to have its waveform saved
+* - the baseline follows g_baselinemode: the summary's for FULL, otherwise the
+* pre-trigger window is read at full resolution too and goes through
+* BaselineEstimate like the full readout's
+*
+* Parameters
+* - info : pointer to the unit's BUFFER_INFO, for its handle and min/max
+*	summary buffer
+* - buffer : the buffer for the full resolution data, sampleCount long
+* - sampleCount : the number of samples in the waveform
+* - timeIntervalNanoseconds : the amount of time (in ns) per sample
+* - time : when the event happened
+*
+* Returns
+* - PICO_STATUS : to indicate success, or if an error occurred
+****************************************************************************/
+PICO_STATUS TwoStageReadout(BUFFER_INFO* info, int16_t* buffer, uint32_t sampleCount, int32_t timeIntervalNanoseconds, EVENT_TIME* time)
+{
+	UNIT* unit = info->unit;
+	PICO_STATUS status;
+	uint32_t numBins = (sampleCount + AGGREGATE_RATIO - 1) / AGGREGATE_RATIO;
+	uint32_t regions[2 * MAX_REGIONS];
+	uint32_t numRegions;
+	uint32_t* indices = NULL;
 	float_t baseline;
+	int16_t thresh = mv_to_adc(g_peakthresh, unit->channelSettings[PS2000A_CHANNEL_A].range, unit);
+
+	// stage 1, the min/max summary (registered with the driver in BlockDataHandler)
+	if ((status = ps2000aGetValues(unit->handle, 0, &numBins, AGGREGATE_RATIO, PS2000A_RATIO_MODE_AGGREGATE, 0, NULL)) != PICO_OK)
+	{
+		picoerrorLog(g_errorfp, status, __LINE__, __func__, "ps2000aGetValues");
+		return status;
+	}
+	numRegions = AggregateCandidateRegions(info->aggregateBuffer, info->aggregateBuffer + info->aggregatebins,
+		numBins, sampleCount, thresh, regions, &baseline);
+
+	if (numRegions > MAX_REGIONS) // too busy, fall back to reading the whole thing
+	{
+		if ((status = ps2000aGetValues(unit->handle, 0, &sampleCount, 1, PS2000A_RATIO_MODE_NONE, 0, NULL)) != PICO_OK)
+		{
+			picoerrorLog(g_errorfp, status, __LINE__, __func__, "ps2000aGetValues");
+			return status;
+		}
+		status = BlockRecordEvent(unit, buffer, NULL, sampleCount, timeIntervalNanoseconds, 1, time);
+		printf("Total Number of Multi-Peak Events Recorded: %" PRIu64 "\n", g_nummultipeakevents.load());
+		return status;
+	}
+
+	// the pre-trigger baseline window, read the same way as the regions below
+	if (g_baselinemode != BASELINE_MODE::FULL && unit->baseline.samples > 0 && unit->baseline.start + unit->baseline.samples <= sampleCount)
+	{
+		uint32_t count = unit->baseline.samples;
+
+		if ((status = ps2000aSetDataBuffer(unit->handle, PS2000A_CHANNEL_A, buffer + unit->baseline.start, count, 0, PS2000A_RATIO_MODE_NONE)) != PICO_OK)
+		{
+			picoerrorLog(g_errorfp, status, __LINE__, __func__, "ps2000aSetDataBuffer");
+			return status;
+		}
+		if ((status = ps2000aGetValues(unit->handle, unit->baseline.start, &count, 1, PS2000A_RATIO_MODE_NONE, 0, NULL)) != PICO_OK)
+		{
+			picoerrorLog(g_errorfp, status, __LINE__, __func__, "ps2000aGetValues");
+			return status;
+		}
+		baseline = BaselineEstimate(unit, PS2000A_CHANNEL_A, buffer, sampleCount);
+	}
+
+	// stage 2, each region at full resolution, the driver writes to the start of the buffer it's
+	// given so point it at the region's spot in buffer to keep the indices lined up
+	for (uint32_t r = 0; r < numRegions; r++)
+	{
+		uint32_t count = regions[2 * r + 1] - regions[2 * r];
+
+		if ((status = ps2000aSetDataBuffer(unit->handle, PS2000A_CHANNEL_A, buffer + regions[2 * r], count, 0, PS2000A_RATIO_MODE_NONE)) != PICO_OK)
+		{
+			picoerrorLog(g_errorfp, status, __LINE__, __func__, "ps2000aSetDataBuffer");
+			return status;
+		}
+		if ((status = ps2000aGetValues(unit->handle, regions[2 * r], &count, 1, PS2000A_RATIO_MODE_NONE, 0, NULL)) != PICO_OK)
+		{
+			picoerrorLog(g_errorfp, status, __LINE__, __func__, "ps2000aGetValues");
+			return status;
+		}
+	}
+
+	g_numwaveforms++;
+	indices = RegionPeakFinding(unit, buffer, sampleCount, regions, numRegions, baseline);
+	if (indices == NULL)
+	{
+		return PICO_MEMORY_FAIL;
+	}
+
+	// an event that gets its waveform written out needs all of it
+	if (indices[0] == 2 && g_numwavestosaved != 0)
+	{
+		if ((status = ps2000aSetDataBuffer(unit->handle, PS2000A_CHANNEL_A, buffer, sampleCount, 0, PS2000A_RATIO_MODE_NONE)) != PICO_OK
+			|| (status = ps2000aGetValues(unit->handle, 0, &sampleCount, 1, PS2000A_RATIO_MODE_NONE, 0, NULL)) != PICO_OK)
+		{
+			picoerrorLog(g_errorfp, status, __LINE__, __func__, "ps2000aGetValues");
+			BufferPoolPut(&g_bufferpool, indices);
+			return status;
+		}
+	}
+
+	status = RecordPeakInfo(unit, PS2000A_CHANNEL_A, buffer, sampleCount, indices, timeIntervalNanoseconds, 1, time);
+	printf("Total Number of Multi-Peak Events Recorded: %" PRIu64 "\n", g_nummultipeakevents.load());
+
+	BufferPoolPut(&g_bufferpool, indices);
+	return status;
+}
+
+/****************************************************************************
+* BufferQueueInit
+*
+* - Empties a BUFFER_QUEUE, every cell is ready to be pushed into on the
+* first lap
+*
+* Parameters
+* - queue : the queue
+*
+* Returns
+* - none
+****************************************************************************/
+void BufferQueueInit(BUFFER_QUEUE* queue)
+{
+	for (uint32_t i = 0; i < NUM_DRIVER_BUFFERS; i++)
+	{
+		queue->sequence[i].store(i, std::memory_order_relaxed);
+	}
+	queue->head.store(0, std::memory_order_relaxed);
+	queue->tail.store(0, std::memory_order_relaxed);
+}
+
+/****************************************************************************
+* BufferQueuePush
+*
+* - Adds a buffer index to the back of a BUFFER_QUEUE without taking a lock,
+* safe with any number of threads pushing and popping at once
+* - a cell can be pushed into once its sequence has come round to the
+* position being pushed, the push claims the position then publishes the
+* value by moving the sequence on by one
+*
+* Parameters
+* - queue : the queue
+* - value : the buffer index
+*
+* Returns
+* - BOOL : FALSE if the queue was full
+****************************************************************************/
+BOOL BufferQueuePush(BUFFER_QUEUE* queue, uint32_t value)
+{
+	uint64_t position = queue->tail.load(std::memory_order_relaxed);
+
+	for (;;)
+	{
+		std::atomic<uint64_t>* sequence = &queue->sequence[position % NUM_DRIVER_BUFFERS];
+		int64_t lap = (int64_t)(sequence->load(std::memory_order_acquire) - position);
+
+		if (lap == 0)
+		{
+			if (queue->tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+			{
+				queue->value[position % NUM_DRIVER_BUFFERS] = value;
+				sequence->store(position + 1, std::memory_order_release);
+				return TRUE;
+			}
+		}
+		else if (lap < 0) // the cell's last value hasn't been popped yet
+		{
+			return FALSE;
+		}
+		else // another thread got there first
+		{
+			position = queue->tail.load(std::memory_order_relaxed);
+		}
+	}
+}
+
+/****************************************************************************
+* BufferQueuePop
+*
+* - Takes the buffer index off the front of a BUFFER_QUEUE without taking a
+* lock, the other half of BufferQueuePush
+* - popping frees the cell up for the next lap by moving its sequence on by
+* NUM_DRIVER_BUFFERS
+*
+* Parameters
+* - queue : the queue
+* - value : on exit, the buffer index if there was one
+*
+* Returns
+* - BOOL : FALSE if the queue was empty
+****************************************************************************/
+BOOL BufferQueuePop(BUFFER_QUEUE* queue, uint32_t* value)
+{
+	uint64_t position = queue->head.load(std::memory_order_relaxed);
+
+	for (;;)
+	{
+		std::atomic<uint64_t>* sequence = &queue->sequence[position % NUM_DRIVER_BUFFERS];
+		int64_t lap = (int64_t)(sequence->load(std::memory_order_acquire) - (position + 1));
+
+		if (lap == 0)
+		{
+			if (queue->head.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+			{
+				*value = queue->value[position % NUM_DRIVER_BUFFERS];
+				sequence->store(position + NUM_DRIVER_BUFFERS, std::memory_order_release);
+				return TRUE;
+			}
+		}
+		else if (lap < 0) // nothing pushed into the cell yet
+		{
+			return FALSE;
+		}
+		else
+		{
+			position = queue->head.load(std::memory_order_relaxed);
+		}
+	}
+}
+
+/****************************************************************************
+* AnalysisPipelineNext
+*
+* - Gets a worker the next filled buffer, parking it until there is one
+* - the acquisition thread only takes the lock to wake a worker up if one
+* has said it's parking, the fences make sure either the worker sees the
+* buffer or the acquisition thread sees the worker
+*
+* Parameters
+* - pipeline : pointer to the ANALYSIS_PIPELINE
+* - whichbuffer : on exit, index of the buffer in pipeline->buffers
+*
+* Returns
+* - BOOL : FALSE once the pipeline has been stopped and there's nothing
+* left in the queue
+****************************************************************************/
+BOOL AnalysisPipelineNext(ANALYSIS_PIPELINE* pipeline, uint32_t* whichbuffer)
+{
+	BOOL popped = FALSE;
+
+	if (BufferQueuePop(&pipeline->filled, whichbuffer))
+	{
+		return TRUE;
+	}
+
+	std::unique_lock<std::mutex> lk(pipeline->lock);
+	pipeline->parkedworkers++;
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	pipeline->workready.wait(lk, [pipeline, whichbuffer, &popped]
+		{
+			popped = BufferQueuePop(&pipeline->filled, whichbuffer);
+			return popped || !pipeline->running.load();
+		});
+	pipeline->parkedworkers--;
+	return popped;
+}
+
+/****************************************************************************
+* AnalysisPipelineRecycle
+*
+* - Hands a buffer whose peaks have been recorded back to the acquisition
+* thread, waking it if it's parked waiting for one
+*
+* Parameters
+* - pipeline : pointer to the ANALYSIS_PIPELINE
+* - whichbuffer : index of the buffer in pipeline->buffers
+*
+* Returns
+* - none
+****************************************************************************/
+void AnalysisPipelineRecycle(ANALYSIS_PIPELINE* pipeline, uint32_t whichbuffer)
+{
+	BufferQueuePush(&pipeline->recycled, whichbuffer); // can't be full, there's a cell for every buffer
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (pipeline->acquirerparked.load())
+	{
+		{
+			std::lock_guard<std::mutex> guard(pipeline->lock); // it's either still checking the queue or already asleep
+		}
+		pipeline->bufferfree.notify_one();
+	}
+}
+
+/****************************************************************************
+* AnalysisPipelineRecord
+*
+* - Writes out the peaks of every analysed buffer whose turn it is, in the
+* order the buffers were captured, and recycles the buffers
+* - called by each worker once it's analysed a buffer: the first one to see
+* the next buffer in line is done takes the recording flag and keeps going
+* until it comes to one that isn't, the others carry on analysing. Whoever
+* drops the flag looks again, in case a buffer was finished in between
+*
+* Parameters
+* - pipeline : pointer to the ANALYSIS_PIPELINE
+*
+* Returns
+* - none
+****************************************************************************/
+void AnalysisPipelineRecord(ANALYSIS_PIPELINE* pipeline)
+{
+	for (;;)
+	{
+		uint64_t next = pipeline->nextrecord.load();
+
+		if (pipeline->analysed[next % NUM_DRIVER_BUFFERS].load() == 0 || pipeline->recording.exchange(TRUE))
+		{
+			return; // not its turn yet, or whoever's recording will get to it
+		}
+
+		for (;;)
+		{
+			std::atomic<uint32_t>* slot = &pipeline->analysed[pipeline->nextrecord.load() % NUM_DRIVER_BUFFERS];
+			uint32_t whichbuffer = slot->load();
+			PICO_STATUS status;
+
+			if (whichbuffer-- == 0)
+			{
+				break;
+			}
+			if (pipeline->indices[whichbuffer] != NULL)
+			{
+				int16_t* buffer = pipeline->buffers[whichbuffer];
+
+				if ((status = BlockRecordPeaks(pipeline->unit, buffer, (pipeline->numChannels > 1) ? buffer + pipeline->bufferSamples : NULL, pipeline->indices[whichbuffer],
+					pipeline->sampleCounts[whichbuffer], pipeline->timeIntervalNanoseconds, pipeline->downsampleratio, &pipeline->times[whichbuffer])) != PICO_OK)
+				{
+					picoerrorLog(g_errorfp, status, __LINE__, __func__, "BlockRecordPeaks");
+				}
+				pipeline->indices[whichbuffer] = NULL;
+			}
+			printf("Total Number of Multi-Peak Events Recorded: %" PRIu64 "\n", g_nummultipeakevents.load());
+			slot->store(0);
+			pipeline->nextrecord++;
+			AnalysisPipelineRecycle(pipeline, whichbuffer);
+		}
+		pipeline->recording.store(FALSE);
+	}
+}
+
+/****************************************************************************
+* AnalysisPipelineWorker
+*
+* - Body of a block mode analysis worker: takes filled driver buffers off of
+* the pipeline's queue in the order they were captured, runs the peak
+* finding on them and gets them recorded in that same order
+* - Keeps going until told to stop and the queue has been emptied
+*
+* Parameters
+* - pipeline : pointer to the ANALYSIS_PIPELINE to work through
+*
+* Returns
+* - none
+****************************************************************************/
+void AnalysisPipelineWorker(ANALYSIS_PIPELINE* pipeline)
+{
+	uint32_t whichbuffer;
+
+	ThreadPlace(THREAD_ROLE::WORKER, 0);
+	while (AnalysisPipelineNext(pipeline, &whichbuffer))
+	{
+		int16_t* buffer = pipeline->buffers[whichbuffer];
+
+		TimingStage(&g_timing, STAGE_QUEUE, pipeline->submitns[whichbuffer], HostTimeNs());
+		pipeline->indices[whichbuffer] = BlockAnalyseEvent(pipeline->unit, buffer, (pipeline->numChannels > 1) ? buffer + pipeline->bufferSamples : NULL,
+			pipeline->sampleCounts[whichbuffer], pipeline->timeIntervalNanoseconds, pipeline->downsampleratio);
+		pipeline->analysed[pipeline->sequence[whichbuffer] % NUM_DRIVER_BUFFERS].store(whichbuffer + 1);
+		AnalysisPipelineRecord(pipeline);
+	}
+}
+
+/****************************************************************************
+* AnalysisPipelineStart
+*
+* - Splits an allocation into the pipeline's driver buffers and starts the
+* analysis workers, one for every core the acquisition thread leaves free
+* up to ANALYSIS_MAX_THREADS (and at least one)
+*
+* Parameters
+* - pipeline : pointer to the ANALYSIS_PIPELINE to set up
+* - unit : pointer to the UNIT structure, where the handle is stored
+* - driverBuffer : allocation of NUM_DRIVER_BUFFERS * numChannels *
+*	sampleCount samples
+* - sampleCount : the number of samples per channel in each driver buffer
+* - numChannels : the number of channels in each driver buffer, channel B's
+*	samples follow channel A's
+* - timeIntervalNanoseconds : the amount of time (in ns) per sample
+* - downsampleratio : downsample ratio for data collection, see programmer's
+*	guide
+*
+* Returns
+* - none
+****************************************************************************/
+void AnalysisPipelineStart(ANALYSIS_PIPELINE* pipeline, UNIT* unit, int16_t* driverBuffer, uint32_t sampleCount, uint32_t numChannels, int32_t timeIntervalNanoseconds, uint32_t downsampleratio)
+{
+	uint32_t cores = std::thread::hardware_concurrency() / (std::max)(g_numunits, (int16_t)1); // shared out between the units' acquisition threads
+
+	pipeline->unit = unit;
+	BufferQueueInit(&pipeline->filled);
+	BufferQueueInit(&pipeline->recycled);
+	for (uint32_t i = 0; i < NUM_DRIVER_BUFFERS; i++)
+	{
+		pipeline->buffers[i] = driverBuffer + (size_t)i * sampleCount * numChannels;
+		pipeline->indices[i] = NULL;
+		pipeline->analysed[i].store(0);
+		BufferQueuePush(&pipeline->recycled, i);
+	}
+	pipeline->bufferSamples = sampleCount;
+	pipeline->numChannels = numChannels;
+	pipeline->timeIntervalNanoseconds = timeIntervalNanoseconds;
+	pipeline->downsampleratio = downsampleratio;
+	pipeline->parkedworkers.store(0);
+	pipeline->acquirerparked.store(FALSE);
+	pipeline->recording.store(FALSE);
+	pipeline->nextrecord.store(0);
+	pipeline->nextsubmit = 0;
+	pipeline->running.store(TRUE);
+	pipeline->numworkers = (std::min)((uint32_t)ANALYSIS_MAX_THREADS, (cores > 1) ? cores - 1 : 1);
+	for (uint32_t i = 0; i < pipeline->numworkers; i++)
+	{
+		pipeline->workers[i] = std::thread(AnalysisPipelineWorker, pipeline);
+	}
+	printf("Analysing with %u worker thread%s.\n", pipeline->numworkers, (pipeline->numworkers > 1) ? "s" : "");
+}
+
+/****************************************************************************
+* AnalysisPipelineAcquire
+*
+* - Gets a driver buffer that's free to be filled, parking until the
+* workers recycle one if they're all taken
+*
+* Parameters
+* - pipeline : pointer to the ANALYSIS_PIPELINE
+*
+* Returns
+* - uint32_t : index of the buffer in pipeline->buffers
+****************************************************************************/
+uint32_t AnalysisPipelineAcquire(ANALYSIS_PIPELINE* pipeline)
+{
+	uint32_t whichbuffer = 0;
 
-	// in the unlikely event we didn't get the memory we asked for...
-	if (smoothbuffer == NULL) // can't go through the peak detection alg without the smoothbuffer...
+	if (BufferQueuePop(&pipeline->recycled, &whichbuffer))
 	{
-		printf("Failed to allocate the necessary memory for the peak-detection algorithm.(BlockPeakFinding)\n");
-		printf("Requested %zu bytes. (smoothbuffer)\n", (size_t)sampleCount * sizeof(int16_t));
-		printf("The program will throw away this run and continue to collect more data.\n");
-		printf("%s\n[%d] %s::%s ------ MEMORY ALLOCATION ERROR (non-pico)\n", timeInfotoString().c_str(), __LINE__, __func__, "calloc");
-		//fprintf(stderr, "%s\n[%d] %s::%s ------ MEMORY ALLOCATION ERROR (non-pico)\n", timeInfotoString().c_str(), __LINE__, __func__, "calloc");
-		if (g_errorfp != NULL)
-		{
-			fprintf(g_errorfp, "%s\n[%d] %s::%s ------ MEMORY ALLOCATION ERROR (non-pico)\n\n", timeInfotoString().c_str(), __LINE__, __func__, "calloc");
-		}
-		if (indices != NULL)
-		{
-			free(indices);
-		}
-		return (uint32_t*)NULL;
+		return whichbuffer;
 	}
-	if (indices == NULL) // no reason to look for peaks if we can't pass along the information...
+
+	std::unique_lock<std::mutex> lk(pipeline->lock);
+	pipeline->acquirerparked.store(TRUE);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	pipeline->bufferfree.wait(lk, [pipeline, &whichbuffer] { return BufferQueuePop(&pipeline->recycled, &whichbuffer) == TRUE; });
+	pipeline->acquirerparked.store(FALSE);
+	return whichbuffer;
+}
+
+/****************************************************************************
+* AnalysisPipelineSubmit
+*
+* - Queues up a filled driver buffer for the analysis workers, waking one
+* if they're all parked
+*
+* Parameters
+* - pipeline : pointer to the ANALYSIS_PIPELINE
+* - whichbuffer : index of the buffer (from AnalysisPipelineAcquire)
+* - sampleCount : the number of samples the driver put in the buffer
+* - time : when the buffer's event happened
+*
+* Returns
+* - none
+****************************************************************************/
+void AnalysisPipelineSubmit(ANALYSIS_PIPELINE* pipeline, uint32_t whichbuffer, uint32_t sampleCount, EVENT_TIME* time)
+{
+	pipeline->sequence[whichbuffer] = pipeline->nextsubmit++;
+	pipeline->sampleCounts[whichbuffer] = sampleCount;
+	pipeline->times[whichbuffer] = *time;
+	pipeline->submitns[whichbuffer] = HostTimeNs();
+	BufferQueuePush(&pipeline->filled, whichbuffer); // can't be full, there's a cell for every buffer
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (pipeline->parkedworkers.load() > 0)
 	{
-		printf("Failed to allocate the necessary memory for the peak-detection algorithm.(BlockPeakFinding)\n");
-		printf("Requested %zu bytes.(indices)\n", (size_t)10 * sizeof(uint32_t));
-		printf("The program will throw away this run and continue to collect more data.\n");
-		printf("%s\n[%d] %s::%s ------ MEMORY ALLOCATION ERROR (non-pico)\n", timeInfotoString().c_str(), __LINE__, __func__, "calloc");
-		//fprintf(stderr, "%s\n[%d] %s::%s ------ MEMORY ALLOCATION ERROR (non-pico)\n", timeInfotoString().c_str(), __LINE__, __func__, "calloc");
-		if (g_errorfp != NULL)
 		{
-			fprintf(g_errorfp, "%s\n[%d] %s::%s ------ MEMORY ALLOCATION ERROR (non-pico)\n\n", timeInfotoString().c_str(), __LINE__, __func__, "calloc");
-		}
-		if ((smoothbuffer != NULL) && !globalBuffer) // free up the work buffer if it was locally allocated, if global leave it alone for the next run
-		{
-			free(smoothbuffer);
-		}
-		else // if we are using a global work buffer then wipe it clean for the next run
-		{
-			memset(smoothbuffer, 0, sizeof(int16_t) * sampleCount);
+			std::lock_guard<std::mutex> guard(pipeline->lock);
 		}
-		return (uint32_t*)NULL;
+		pipeline->workready.notify_one();
 	}
-	// ...otherwise we're good :)
-
-	// just copy the ends in since we can't average on both sides of them
-	smoothbuffer[0] = dataBuffer[0];
-	smoothbuffer[1] = dataBuffer[1];
-	smoothbuffer[sampleCount] = dataBuffer[sampleCount];
-	smoothbuffer[sampleCount - 1] = dataBuffer[sampleCount - 1];
-
-	printf("Searching for peaks within the most recent sample...");
+}
 
-	// now average out the rest of the points
-	for (uint32_t i = 2; i < sampleCount - 1; i++)
+/****************************************************************************
+* AnalysisPipelineStop
+*
+* - Lets the workers finish whatever's still queued up, then waits for them
+* to exit. Safe to call if the pipeline was never started
+*
+* Parameters
+* - pipeline : pointer to the ANALYSIS_PIPELINE
+*
+* Returns
+* - none
+****************************************************************************/
+void AnalysisPipelineStop(ANALYSIS_PIPELINE* pipeline)
+{
+	if (!pipeline->workers[0].joinable())
 	{
-		smoothbuffer[i] = MovingAverageFive(dataBuffer[i - 2], dataBuffer[i - 1], dataBuffer[i], dataBuffer[i + 1], dataBuffer[i + 2]);
+		return;
 	}
+	{
+		std::lock_guard<std::mutex> guard(pipeline->lock);
+		pipeline->running.store(FALSE);
+	}
+	pipeline->workready.notify_all();
+	for (uint32_t i = 0; i < pipeline->numworkers; i++)
+	{
+		pipeline->workers[i].join();
+	}
+}
 
-	baseline = ArrayAvg(dataBuffer, sampleCount); // do we want this average or the average of the smoothed signal-> Probably not a huge difference
-	//baseline = ArrayAvg(smoothbuffer, sampleCount); // in case we want to test this out instead
-
-	for (uint32_t i = 2; i < sampleCount - 1; i++)
+/****************************************************************************
+* TriggerWidthRecord
+*
+* - Measures how long the trigger pulse of a waveform stayed past the
+* trigger threshold, and counts it as a narrow (noise) trigger if that's
+* shorter than the pulse width qualifier
+* - With the qualifier on, the scope shouldn't let any narrow triggers
+* through, with it off they're the transfers it would have saved
+* - The trigger point is the start of the pulse for a plain level trigger
+* and its end with the qualifier, so this looks both ways from it
+*
+* Parameters
+* - info : pointer to the unit's BUFFER_INFO, where the counts are kept
+* - buffer : the buffer array holding the waveform
+* - sampleCount : the number of samples in the buffer
+*
+* Returns
+* - none
+****************************************************************************/
+void TriggerWidthRecord(BUFFER_INFO* info, int16_t* buffer, uint32_t sampleCount)
+{
+	int16_t threshold = mv_to_adc(g_trigthresh, info->unit->channelSettings[PS2000A_CHANNEL_A].range, info->unit);
+	int32_t sign = (g_polarity == POLARITY::POSITIVE) ? -1 : 1; // flips upward pulses over so past the threshold is always below it
+	int32_t level = sign * threshold;
+	uint32_t trigger = (std::min)((uint32_t)info->pretriggersampleCount, sampleCount);
+	uint32_t start = trigger;
+	uint32_t end = trigger;
+
+	// noise can move the crossing a sample or so off the trigger point, so if neither sample either side of
+	// it is past the threshold start from the closest one that is
+	for (uint32_t i = 1; i <= TRIGGER_JITTER_SAMPLES; i++)
 	{
-		if (smoothbuffer[i] < baseline)
+		if ((trigger > 0 && sign * buffer[trigger - 1] < level) || (trigger < sampleCount && sign * buffer[trigger] < level))
 		{
-			if (smoothbuffer[i] < peakValue && smoothbuffer[i] < thresh)
-			{
-				peakIndex = i;
-				peakValue = smoothbuffer[i];
-			}
+			break;
 		}
-		else if (smoothbuffer[i] > baseline && peakIndex != -1)
+		if (trigger > i && sign * buffer[trigger - i - 1] < level)
 		{
-			indices[0] = ++numpeaks; // store number of found peaks in the array's first entry
-			indices[numpeaks] = peakIndex; // all the other peak index values follow in the array
-			peakIndex = -1; // reset this so we can find the next one (if there is one)
-			peakValue = std::numeric_limits<int16_t>::infinity(); // reset this too
+			start = end = trigger - i;
+			break;
 		}
-		if (numpeaks >= maxnumpeaks) // in practice we shouldn't need to find more than 2 peaks
+		if (trigger + i < sampleCount && sign * buffer[trigger + i] < level)
 		{
-			printf("\nMaximum number of peaks (%d) detected! Stopping the search now.\n", maxnumpeaks);
-			printf("If this search is classifying \"noise\" as peaks, consider either raising the peak detection threshold.\n");
-			if (!globalBuffer)
-			{
-				free(smoothbuffer);
-			}
-			else
-			{
-				memset(smoothbuffer, 0, sizeof(int16_t) * sampleCount); // clear the work buffer before the next run just to be sure
-			}
-			return indices;
+			start = end = trigger + i;
+			break;
 		}
 	}
-
-	if (peakIndex != -1 && indices != NULL)
+	while (start > 0 && sign * buffer[start - 1] < level)
 	{
-		indices[0] = ++numpeaks;
-		indices[numpeaks] = peakIndex;
+		start--;
 	}
-
-	printf((numpeaks == 1) ? "%d peak detected.\n" : "%d peaks detected.\n", numpeaks);
-	if (!globalBuffer) // if the smoothbuffer was only allocated for a single call to this function then free it
+	while (end < sampleCount && sign * buffer[end] < level)
 	{
-		free(smoothbuffer);
+		end++;
 	}
-	else
+	info->numtriggers++;
+	if ((end - start) * (uint32_t)info->timeIntervalNanoseconds < (g_pwqns ? g_pwqns : PWQ_REFERENCE_NS))
 	{
-		memset(smoothbuffer, 0, sizeof(int16_t) * sampleCount); // clear the work buffer before the next run just to be sure
+		info->numnarrowtriggers++;
 	}
-	return indices;
 }
 
 /****************************************************************************
-* ConcurrentBlockPeaktoPeak
+* SetCaptureBuffers
 *
-* - Version of BlockPeaktoPeak written to support use of multple threads
-* - Calls BlockPeakFinding to find peaks in a block of data, then finds
-* the peak to peak times for the returned peaks
-* - Assumes a downwards peak characteristic of the scintillating bar
+* - Registers the driver buffer for one waveform: channel A's samples at the
+* start and, in coincidence mode, channel B's straight after them, so both
+* channels of a waveform sit next to each other in memory
 *
 * Parameters
-* - buffer : the buffer array where the data is stored
-* - sampleCount : the number of samples in the buffer
-* - sampleInterval : the amount of time (in ns) per sample
-* - downsampleratio : downsample ratio for data collection, see programmer's
-*	guide
+* - info : pointer to the unit's BUFFER_INFO
+* - buffer : where the waveform goes
+* - channelSamples : room each channel has, channel B starts this far in
+* - sampleCount : the number of samples the driver should fill per channel
+* - segmentIndex : the memory segment the buffers are for
+* - ratioMode : downsampling mode, see programmer's guide
 *
 * Returns
-* - uint32_t* : pointer to a buffer of 10 uint32_t's. See comments for
-* BlockPeakFinding
+* - PICO_STATUS : to indicate success, or if an error occurred
 ****************************************************************************/
-/*PICO_STATUS ConcurrentBlockPeaktoPeak(UNIT* unit, int16_t* buffer, uint32_t sampleCount, uint32_t sampleInterval, uint32_t downsampleratio)
+PICO_STATUS SetCaptureBuffers(BUFFER_INFO* info, int16_t* buffer, uint32_t channelSamples, int32_t sampleCount, uint32_t segmentIndex, PS2000A_RATIO_MODE ratioMode)
 {
 	PICO_STATUS status = PICO_OK;
-	uint16_t numpeaks;
-	uint32_t* indices = NULL;
-	BOOL globalBufferIndicator = FALSE;
-	int32_t whichbuffer;
 
-	whichbuffer = tThreadBuffersUseNextFree(&g_threadBuffers);
-	if (g_threadBuffers.workBuffers[whichbuffer] != NULL) // if it's been allocated let's assume we're using it...
-	{
-		globalBufferIndicator = TRUE;
-	}
-	// spawn off thread here
-	indices = BlockPeakFinding(unit, g_threadBuffers.driverBuffers[whichbuffer], g_threadBuffers.workBuffers[whichbuffer], sampleCount, globalBufferIndicator); // get the results from the peak finding algorithm
-	if (indices == NULL) // if the peak detection algorithm had allocation issues...
+	for (uint32_t c = 0; c < info->numChannels; c++)
 	{
-		printf("Error allocating memory, no peaks could be detected.\n");
-		printf("%s\n[%d] %s::%s ------ MEMORY ALLOCATION ERROR (non-pico)\n", timeInfotoString().c_str(), __LINE__, __func__, "BlockPeakFinding");
-		//fprintf(stderr, "%s\n[%d] %s::%s ------ MEMORY ALLOCATION ERROR (non-pico)\n", timeInfotoString().c_str(), __LINE__, __func__, "BlockPeakFinding");
-		if (g_errorfp != NULL)
+		if ((status = ps2000aSetDataBuffer(info->unit->handle, (PS2000A_CHANNEL)(PS2000A_CHANNEL_A + c), buffer + (size_t)c * channelSamples, sampleCount, segmentIndex, ratioMode)) != PICO_OK)
 		{
-			fprintf(g_errorfp, "%s\n[%d] %s::%s ------ MEMORY ALLOCATION ERROR (non-pico)\n\n", timeInfotoString().c_str(), __LINE__, __func__, "BlockPeakFinding");
+			picoerrorLog(g_errorfp, status, __LINE__, __func__, "ps2000aSetDataBuffer");
+			return status;
 		}
-		return PICO_MEMORY_FAIL;
-	} // ...otherwise we're fine to proceed
-	numpeaks = indices[0]; // first entry is numpeaks
+	}
 
-	printf(numpeaks > 1 ? "Calculating peak to peak values...\n" : "");
+	return status;
+}
 
-	// Can leave prints in for easy checking of data taking process, shouldn't slow down program too much
-	printf("Peak #, Time (ns), ADC Count, Voltage (mV)\n");
-	for (uint16_t i = 1; i < numpeaks + 1; i++)
-	{
-		// prints with a different number of spaces depending on the ADC value so
-		// that the mV value properly aligns with its column label
-		// casting down sampleInterval and downsampleratio shouldn't be a huge deal,
-		// should be a relatively small number
-		printf((std::abs(buffer[indices[i]] * (int16_t)sampleInterval * (int16_t)downsampleratio) >= 10000) ?
-			"%d       %u        %d     %d\n" : "%d       %u        %d      %d\n",
-			i, indices[i] * sampleInterval, buffer[indices[i]], adc_to_mv(buffer[indices[i]], unit->channelSettings[PS2000A_CHANNEL_A].range, unit));
-	}
+/****************************************************************************
+* BlockDataHandler
+*
+* - Used by all block data routines
+* - acquires data (user sets trigger mode before calling),
+*   and saves all to a .csv file (if specified by g_numwavestosaved)
+*
+* Parameters
+* - info : pointer to the unit's BUFFER_INFO, which holds its handle, buffers
+*	and the settings carried over from the first run
+* - offset : the offset into the data buffer to start the display's slice. (normally 0)
+* - mode : ANALOGUE, DIGITAL, AGGREGATED, MIXED - just used ANALOGUE here
+* - etsModeSet: whether or not ETS Mode (see programmer's guide) is
+*	turned on (turned off for our application)
+*
+* Returns
+* - PICO_STATUS : to indicate success, or if an error occurred
+****************************************************************************/
+PICO_STATUS BlockDataHandler(BUFFER_INFO* info, int32_t offset, MODE mode, int16_t etsModeSet)
+{
+	UNIT* unit = info->unit;
+	PICO_STATUS status;
+	uint32_t segmentIndex = 0;
+	uint32_t downsampleratio = 1;
+	uint32_t bufferSamples; // room for each channel in a driver buffer, sampleCount rounded up to a whole number of cache lines
+	uint64_t arm; // this run's arming, see CaptureRingArm
+	CAPTURE_DESCRIPTOR capture; // what the callback said about it
+	BOOL captured = FALSE;
+	EVENT_TIME time;
+	int64_t stagens; // when the stage being timed started
+	PS2000A_RATIO_MODE ratioMode = PS2000A_RATIO_MODE_NONE; // Don't want any downsampling
 
-	for (uint16_t i = 1; i < numpeaks + 1; i++)
+	if (info->firstRun == TRUE) // only need to set this stuff up once
 	{
-		for (uint16_t j = i + 1; j < numpeaks + 1; j++)
+		if ((status = ps2000aMemorySegments(unit->handle, (uint32_t)1, &info->maxSamples)) != PICO_OK)
 		{
-			printf("Peak %d to Peak %d: %d ns\n", i, j, (indices[j] - indices[i]) * sampleInterval * downsampleratio);
+			picoerrorLog(g_errorfp, status, __LINE__, __func__, "ps2000aMemorySegments");
+			return status;
 		}
-	}
 
-	numpeaks = indices[0]; // numpeaks stored in the first array entry
-
-	// might want to make this "== 2" since 3-peak events seem to throw a wrench in the data analysis
-	// if this change is made we can get rid of the 'T' delimiter for the peak info file and add column headers
-	if (numpeaks == 2) // no reason to record 1-peak events
-	{
-		// mutex right here
-		g_nummultipeakevents++; // keep track of how many events we've recorded
-		if ((g_numwavestosaved > 0) || (g_numwavestosaved == -1)) // if we're still saving waveforms
+		// Max sample count for the device is 2^{25} = 33,554,342
+		if ((status = CaptureWindowSamples(unit, info->maxSamples, &info->timeIntervalNanoseconds, &info->pretriggersampleCount, &info->posttriggersampleCount)) != PICO_OK)
 		{
-			// give the file a time-dependent name to avoid file name collisions
-			wavefilename = "RAW_WAVEFORM_"; // reset the filename from the last block of multi-peak data
-			wavefilename += timeInfotoString();
-			wavefilename += ".csv";
-			fopen_s(&wavefp, wavefilename.c_str(), "w");
-
-			if (wavefp != NULL)
-			{
-				printf("Writing the raw data to the disk file(%s)\n...", wavefilename.c_str());
-				fprintf(wavefp, "Block Data Log:\n\nTime (ns), ADC Count, mV\n");
-
-				for (int32_t i = 0; i < sampleCount; i++)
-				{
-					// Times printed in ns
-					fprintf(wavefp,
-						"%d, %d, %d\n",
-						(int32_t)(i * timeIntervalNanoseconds * downsampleratio),
-						g_BufferInfo.driverBuffer[i],
-						adc_to_mv(g_BufferInfo.driverBuffer[i], unit->channelSettings[PS2000A_CHANNEL_A].range, unit));
-				}
-				printf("done.\n");
-				// mutex here too
-				// update the number of waveforms to be saved
-				if (g_numwavestosaved > 0)
-				{
-					g_numwavestosaved--;
-					lasttosave = g_numwavestosaved ? FALSE : TRUE; // If we just saved the last waveform to be saved, set this flag to TRUE
-				}
-			}
-			else
-			{
-				printf("Cannot open the file \n%s\n for writing.\n"
-					"Please ensure that you have permission to access and/ or the file isn't currently open.\n", wavefilename.c_str());
-			}
+			return status;
 		}
-		else
+		info->sampleCount = info->pretriggersampleCount + info->posttriggersampleCount;
+		BaselineWindow(unit, info->pretriggersampleCount);
+		DetectorConfigure(unit, info->timeIntervalNanoseconds, info->pretriggersampleCount, info->sampleCount);
+
+		info->mode = mode;
+		info->numSegments = 1;
+		info->numChannels = g_coincidence ? 2 : 1;
+		// one allocation split into the pipeline's NUM_DRIVER_BUFFERS driver buffers, each with room for every channel,
+		// every channel's samples start on a cache line
+		bufferSamples = (info->sampleCount + CACHE_LINE_BYTES / sizeof(int16_t) - 1) / (CACHE_LINE_BYTES / sizeof(int16_t)) * (CACHE_LINE_BYTES / sizeof(int16_t));
+		info->driverBuffer = (int16_t*)AlignedAlloc((size_t)bufferSamples * NUM_DRIVER_BUFFERS * info->numChannels * sizeof(int16_t));
+		//tGlobalPointersAddPointer(g_pointers, info->driverBuffer, REG_POINTER);
+		if (info->driverBuffer == NULL)
 		{
-			printf("The maximum number of waveforms to be recorded has been reached.\n");
-			printf("Peak information for this waveform will still be saved. (%s)\n", peakfilename.c_str());
+			printf("Failed to allocate the driver buffers.\n");
+			printf("Requested %zu bytes.\n", (size_t)bufferSamples * NUM_DRIVER_BUFFERS * info->numChannels * sizeof(int16_t));
+			printf("%s\n[%d] %s::%s ------ MEMORY ALLOCATION ERROR (non-pico)\n", timeInfotoString().c_str(), __LINE__, __func__, "AlignedAlloc");
+			if (g_errorfp != NULL)
+			{
+				fprintf(g_errorfp, "%s\n[%d] %s::%s ------ MEMORY ALLOCATION ERROR (non-pico)\n\n", timeInfotoString().c_str(), __LINE__, __func__, "AlignedAlloc");
+			}
+			return PICO_MEMORY_FAIL;
 		}
-		// mutex here for writing to peak file
-		if (g_peakfp != NULL)
+
+		// the two-stage readout's min/max summary goes into its own pair of buffers
+		if (g_twostagereadout)
 		{
-			// access to the buffer here too, so a thread specific mutex is prolly the way to go
-			for (uint16_t i = 1; i <= numpeaks; i++)
+			uint32_t numBins = (info->sampleCount + AGGREGATE_RATIO - 1) / AGGREGATE_RATIO;
+
+			info->aggregatebins = numBins; // the minima start here, even if the capture window shrinks later
+			info->aggregateBuffer = (int16_t*)calloc((size_t)numBins * 2, sizeof(int16_t));
+			if (info->aggregateBuffer == NULL)
 			{
-				fprintf(g_peakfp, "%d,%d,", // print peak depths
-					g_BufferInfo.driverBuffer[indices[i]], // as ADC Counts...
-					adc_to_mv(g_BufferInfo.driverBuffer[indices[i]], unit->channelSettings[PS2000A_CHANNEL_A].range, unit)); // ...and in mV
+				printf("%s\n[%d] %s::%s ------ MEMORY ALLOCATION ERROR (non-pico)\n", timeInfotoString().c_str(), __LINE__, __func__, "calloc");
+				if (g_errorfp != NULL)
+				{
+					fprintf(g_errorfp, "%s\n[%d] %s::%s ------ MEMORY ALLOCATION ERROR (non-pico)\n\n", timeInfotoString().c_str(), __LINE__, __func__, "calloc");
+				}
+				return PICO_MEMORY_FAIL;
 			}
-			fprintf(g_peakfp, "T,"); // some arbitrary deliminating character to separate peak depths and time differences
-			// print time differences (in ns) between the first peak and other peaks
-			for (uint16_t i = 2; i <= numpeaks; i++)
+			if ((status = ps2000aSetDataBuffers(unit->handle, PS2000A_CHANNEL_A, info->aggregateBuffer, info->aggregateBuffer + numBins, numBins, segmentIndex, PS2000A_RATIO_MODE_AGGREGATE)) != PICO_OK)
 			{
-				fprintf(g_peakfp, "%d,", (indices[i] - indices[1]) * timeIntervalNanoseconds * downsampleratio);
+				picoerrorLog(g_errorfp, status, __LINE__, __func__, "ps2000aSetDataBuffers");
+				return status;
 			}
-			// if the program wrote a waveform file, its name gets written to the peak file
-			fprintf(g_peakfp, (g_numwavestosaved || lasttosave) ? "%s\n" : "No file\n", wavefilename.c_str());
 		}
-		else
+
+		// start up the analysis workers and give the driver the first buffer to fill
+		AnalysisPipelineStart(&info->pipeline, unit, info->driverBuffer, bufferSamples, info->numChannels, info->timeIntervalNanoseconds, downsampleratio);
+		info->currentbuffer = AnalysisPipelineAcquire(&info->pipeline);
+		if ((status = SetCaptureBuffers(info, info->pipeline.buffers[info->currentbuffer], info->pipeline.bufferSamples, info->sampleCount, segmentIndex, ratioMode)) != PICO_OK)
 		{
-			printf("Cannot open the file \n(%s)\n for writing.\n"
-				"Please ensure that you have permission to access and/ or the file isn't currently open.\n", peakfilename.c_str());
+			picoerrorLog(g_errorfp, status, __LINE__, __func__, "SetCaptureBuffers");
+			return status;
 		}
+		info->firstRun = FALSE;
 	}
-	else
+	else if (AdaptiveWindowShrink(&g_adaptive, &info->windowshrunk, info->timeIntervalNanoseconds, &info->posttriggersampleCount))
 	{
-		printf("Not recording 1-peak events.\n");
-		printf((g_numwavestosaved == -1) ? "" : "Remaining Number of Waveforms to Record: %d\n", g_numwavestosaved);
+		// the buffers stay where they are, the driver just gets told to fill less of them
+		info->sampleCount = info->pretriggersampleCount + info->posttriggersampleCount;
+		if ((status = SetCaptureBuffers(info, info->pipeline.buffers[info->currentbuffer], info->pipeline.bufferSamples, info->sampleCount, segmentIndex, ratioMode)) != PICO_OK)
+		{
+			picoerrorLog(g_errorfp, status, __LINE__, __func__, "SetCaptureBuffers");
+			return status;
+		}
 	}
 
-	if ((status = ps2000aStop(unit->handle)) != PICO_OK)
+	// Start it collecting, then wait for completion
+	arm = CaptureRingArm(&info->captures, segmentIndex, 1, info->pretriggersampleCount + info->posttriggersampleCount);
+	stagens = HostTimeNs();
+	if ((status = ps2000aRunBlock(unit->handle, info->pretriggersampleCount, info->posttriggersampleCount, g_timebase, g_oversample, NULL, 0, CallBackBlock, info)) != PICO_OK)
 	{
-		picoerrorLog(g_errorfp, status, __LINE__, __func__, "ps2000aStop");
+		picoerrorLog(g_errorfp, status, __LINE__, __func__, "ps2000aRunBlock");
+		return status;
 	}
+	TimingStage(&g_timing, STAGE_ARM, stagens, HostTimeNs());
+	TimingRearm(&g_timing, info, HostTimeNs());
 
-	if (wavefp != NULL)
-	{
-		fclose(wavefp);
-	}
-	if (indices != NULL)
+	printf("Waiting for trigger...Press \'Q\' to abort...");
+
+	// sleep until the callback fires, waking up every READY_WAIT_MS to check the stop token
+	while (!(captured = CaptureRingWait(&info->captures, arm, &capture, READY_WAIT_MS)) && !StopRequested(&g_watchdog));
+
+	if (captured)
 	{
-		free(indices);
-	}
+		stagens = HostTimeNs();
+		TimingCapture(&g_timing, info, capture.readyns);
+		TimingStage(&g_timing, STAGE_WAKE, capture.readyns, stagens);
+		printf("Triggered!\n");
+		info->sampleCount = capture.sampleCount; // sampleCount's value can be changed by call to ps2000aGetValues, resetting here with what the run was armed for just to be safe
+		time.hostns = capture.readyns;
+		TriggerTimeOffsetPs(unit, segmentIndex, &time.triggeroffsetps); // logs its own errors, the event is still worth keeping without it
+		if (g_twostagereadout)
+		{
+			// only a small part of the waveform comes over and the analysis is done by the time it has,
+			// so this skips the pipeline and keeps using the same buffer
+			if ((status = TwoStageReadout(info, info->pipeline.buffers[info->currentbuffer], info->sampleCount, info->timeIntervalNanoseconds, &time)) != PICO_OK)
+			{
+				picoerrorLog(g_errorfp, status, __LINE__, __func__, "TwoStageReadout");
+			}
+			TimingStage(&g_timing, STAGE_READOUT, stagens, HostTimeNs());
+			stagens = HostTimeNs();
+			if ((status = ps2000aStop(unit->handle)) != PICO_OK)
+			{
+				picoerrorLog(g_errorfp, status, __LINE__, __func__, "ps2000aStop");
+			}
+			TimingStage(&g_timing, STAGE_STOP, stagens, HostTimeNs());
+			// TwoStageReadout moves the buffer around to read the regions, so put it back for the next run
+			if ((status = ps2000aSetDataBuffer(unit->handle, PS2000A_CHANNEL_A, info->pipeline.buffers[info->currentbuffer], info->sampleCount, segmentIndex, ratioMode)) != PICO_OK)
+			{
+				picoerrorLog(g_errorfp, status, __LINE__, __func__, "ps2000aSetDataBuffer");
+			}
+			return status;
+		}
+		if ((status = ps2000aGetValues(unit->handle, 0, (uint32_t*)&info->sampleCount, downsampleratio, ratioMode, 0, NULL)) != PICO_OK)
+		{
+			picoerrorLog(g_errorfp, status, __LINE__, __func__, "ps2000aGetValues");
+			return status;
+		}
+		TimingStage(&g_timing, STAGE_READOUT, stagens, HostTimeNs());
 
-	// clear the driver buffer for the next run, not strictly necessary
-	// using pre/posttriggersampleCount here because they can't be modified by the pico library functions
-	memset(g_BufferInfo.driverBuffer, (int16_t)0, ((int64_t)pretriggersampleCount + (int64_t)posttriggersampleCount) * sizeof(int16_t));
+		stagens = HostTimeNs();
+		if ((status = ps2000aStop(unit->handle)) != PICO_OK)
+		{
+			picoerrorLog(g_errorfp, status, __LINE__, __func__, "ps2000aStop");
+		}
+		TimingStage(&g_timing, STAGE_STOP, stagens, HostTimeNs());
 
-	printf("Total Number of Multi-Peak Events Recorded: %I64d\n", g_nummultipeakevents);
+		stagens = HostTimeNs();
+		TriggerWidthRecord(info, info->pipeline.buffers[info->currentbuffer], info->sampleCount);
 
-	// need to do some work with this, either multiple work buffers or just allocate each time we need one locally
-	// make the work buffer thread specific along with the device buffer
-	if (g_workBuffer != NULL) // if it's been allocated let's assume we're using it...
+		// hand the filled buffer over to the analysis workers and give the driver a free one,
+		// so the scope can be re-armed as soon as we return instead of after the analysis
+		AnalysisPipelineSubmit(&info->pipeline, info->currentbuffer, info->sampleCount, &time);
+		info->currentbuffer = AnalysisPipelineAcquire(&info->pipeline);
+		if ((status = SetCaptureBuffers(info, info->pipeline.buffers[info->currentbuffer], info->pipeline.bufferSamples, info->pretriggersampleCount + info->posttriggersampleCount, segmentIndex, ratioMode)) != PICO_OK)
+		{
+			picoerrorLog(g_errorfp, status, __LINE__, __func__, "SetCaptureBuffers");
+			return status;
+		}
+		TimingStage(&g_timing, STAGE_HANDOFF, stagens, HostTimeNs());
+	}
+	else
 	{
-		globalBufferIndicator = TRUE;
+		TimingCapture(&g_timing, info, HostTimeNs()); // still live right up until it was stopped
+		printf("Aborted.\n");
+		if ((status = ps2000aStop(unit->handle)) != PICO_OK)
+		{
+			picoerrorLog(g_errorfp, status, __LINE__, __func__, "ps2000aStop");
+		}
 	}
 
 	return status;
-}*/
+}
 
 /****************************************************************************
-* BlockPeaktoPeak
+* CollectBlockTriggered
 *
-* - Calls BlockPeakFinding to find peaks in a block of data, then finds
-* the peak to peak times for the returned peaks
-* - Assumes a downwards peak characteristic of the scintillating bar
-* - If speed is a concern this function could be eliminated and
-* BlockPeakFinding could return the indices array directly to BlockDataHandler
+*  - This function collects a single block of data from the
+*  unit, when a trigger event occurs.
 *
 * Parameters
-* - buffer : the buffer array where the data is stored
-* - sampleCount : the number of samples in the buffer
-* - sampleInterval : the amount of time (in ns) per sample
-* - downsampleratio : downsample ratio for data collection, see programmer's
-*	guide
+* - info : pointer to the unit's BUFFER_INFO
 *
 * Returns
-* - uint32_t* : pointer to a buffer of 10 uint32_t's. See comments for
-* BlockPeakFinding
+* - PICO_STATUS : to indicate success, or if an error occurred
 ****************************************************************************/
-uint32_t* BlockPeaktoPeak(UNIT* unit, int16_t* buffer, uint32_t sampleCount, uint32_t sampleInterval, uint32_t downsampleratio)
+PICO_STATUS CollectBlockTriggered(BUFFER_INFO* info)
 {
-	uint16_t numpeaks;
-	uint32_t* indices = NULL;
-	BOOL globalBufferIndicator = FALSE;
-
-	// need to do some work with this, either multiple work buffers or just allocate each time we need one locally
-	// make the work buffer thread specific along with the device buffer
-	if (g_workBuffer != NULL) // if it's been allocated let's assume we're using it...
-	{
-		globalBufferIndicator = TRUE;
-	}
-
-	indices = BlockPeakFinding(unit, buffer, g_workBuffer, sampleCount, globalBufferIndicator); // get the results from the peak finding algorithm
-	if (indices == NULL) // if the peak detection algorithm had allocation issues...
-	{
-		printf("Error allocating memory, no peaks could be detected.\n");
-		printf("%s\n[%d] %s::%s ------ MEMORY ALLOCATION ERROR (non-pico)\n", timeInfotoString().c_str(), __LINE__, __func__, "BlockPeakFinding");
-		//fprintf(stderr, "%s\n[%d] %s::%s ------ MEMORY ALLOCATION ERROR (non-pico)\n", timeInfotoString().c_str(), __LINE__, __func__, "BlockPeakFinding");
-		if (g_errorfp != NULL)
-		{
-			fprintf(g_errorfp, "%s\n[%d] %s::%s ------ MEMORY ALLOCATION ERROR (non-pico)\n\n", timeInfotoString().c_str(), __LINE__, __func__, "BlockPeakFinding");
-		}
-		return (uint32_t*)NULL;
-	} // ...otherwise we're fine to proceed
-	numpeaks = indices[0]; // first entry is numpeaks
-
-	printf(numpeaks > 1 ? "Calculating peak to peak values...\n" : "");
+	PICO_STATUS status;
 
-	// Can leave prints in for easy checking of data taking process, shouldn't slow down program too much
-	printf("Peak #, Time (ns), ADC Count, Voltage (mV)\n");
-	for (uint16_t i = 1; i < numpeaks + 1; i++)
-	{
-		// prints with a different number of spaces depending on the ADC value so
-		// that the mV value properly aligns with its column label
-		// casting down sampleInterval and downsampleratio shouldn't be a huge deal, 
-		// should be a relatively small number
-		printf((std::abs(buffer[indices[i]] * (int16_t)sampleInterval * (int16_t)downsampleratio) >= 10000) ?
-			"%d       %u        %d     %d\n" : "%d       %u        %d      %d\n",
-			i, indices[i] * sampleInterval, buffer[indices[i]], adc_to_mv(buffer[indices[i]], unit->channelSettings[PS2000A_CHANNEL_A].range, unit));
-	}
+	// this function did a lot more work with how it was originally written by the author in the example
+	// I moved the trigger setting code to the OpenDevice() function because it made more logical sense 
+	// there for this specific application
+	// This function doesn't do much anymore, but it helps the program logically flow and leaves room 
+	// for easy modifications by someone else down the line so I'll leave it in
 
-	for (uint16_t i = 1; i < numpeaks + 1; i++)
+	// set up the scope for data collection and collect it
+	if ((status = BlockDataHandler(info, 0, MODE::ANALOGUE, FALSE)) != PICO_OK)
 	{
-		for (uint16_t j = i + 1; j < numpeaks + 1; j++)
-		{
-			printf("Peak %d to Peak %d: %d ns\n", i, j, (indices[j] - indices[i]) * sampleInterval * downsampleratio);
-		}
+		picoerrorLog(g_errorfp, status, __LINE__, __func__, "BlockDataHandler");
+		return status;
 	}
 
-	return indices;
+	return status;
 }
 
 /****************************************************************************
-* ConcurrentBlockDataHandler
+* RapidBlockDataHandler
 *
-* - Version of BlockDataHandler written to support utilization of multiple
-* threads
-* - acquires data (user sets trigger mode before calling), spawns off a thread
-* to perform data analysis and file writing
+* - Rapid block version of BlockDataHandler
+* - splits the scope's memory into g_numsegments segments and captures that
+* many triggers back-to-back in hardware, without the PC having to re-arm
+* the scope in between, then pulls all of them over in one
+* ps2000aGetValuesBulk call and runs each through the peak detection
 *
 * Parameters
-* - unit : pointer to the UNIT structure, where the handle is stored
-* - feakfp : pointer to the file where peak info (not waveforms) are written to
+* - info : pointer to the unit's BUFFER_INFO, which holds its handle, buffers
+*	and the settings carried over from the first run
 * - offset : the offset into the data buffer to start the display's slice. (normally 0)
 * - mode : ANALOGUE, DIGITAL, AGGREGATED, MIXED - just used ANALOGUE here
 * - etsModeSet: whether or not ETS Mode (see programmer's guide) is
@@ -3016,406 +7405,701 @@ uint32_t* BlockPeaktoPeak(UNIT* unit, int16_t* buffer, uint32_t sampleCount, uin
 * Returns
 * - PICO_STATUS : to indicate success, or if an error occurred
 ****************************************************************************/
-/*PICO_STATUS ConcurrentBlockDataHandler(UNIT* unit, int32_t offset, MODE mode, int16_t etsModeSet)
+PICO_STATUS RapidBlockDataHandler(BUFFER_INFO* info, int32_t offset, MODE mode, int16_t etsModeSet)
 {
+	UNIT* unit = info->unit;
 	PICO_STATUS status;
-	uint16_t numpeaks;
-	static int32_t timeIntervalNanoseconds, posttriggersampleCount, pretriggersampleCount, sampleCount, maxSamples; // vars get set on first call to function, retain value for subsequent runs because static
-	int32_t currentbuffer;
-	uint32_t segmentIndex = 0;
+	uint32_t sampleCount;
+	uint32_t numCaptures = 0; // how many segments actually got filled this run
 	uint32_t downsampleratio = 1;
-	uint32_t* indices = NULL; // array to hold numpeaks and the indices of such peaks
-	BOOL lasttosave = FALSE; // indicates if the waveform just saved was the last one to be saved
-	FILE* wavefp = NULL;
+	uint64_t arm; // this run's arming, see CaptureRingArm
+	CAPTURE_DESCRIPTOR capture; // what the callback said about it
+	BOOL captured = FALSE;
+	EVENT_TIME time;
+	int64_t stagens; // when the stage being timed started
 	PS2000A_RATIO_MODE ratioMode = PS2000A_RATIO_MODE_NONE; // Don't want any downsampling
 
-	if (g_firstRun == TRUE) // only need to set this stuff up once
+	if (info->firstRun == TRUE) // only need to set this stuff up once
 	{
-		if ((status = ps2000aMemorySegments(unit->handle, (uint32_t)1, &maxSamples)) != PICO_OK)
+		// maxSamples comes back as the number of samples per segment
+		if ((status = ps2000aMemorySegments(unit->handle, g_numsegments, &info->maxSamples)) != PICO_OK)
 		{
 			picoerrorLog(g_errorfp, status, __LINE__, __func__, "ps2000aMemorySegments");
 			return status;
 		}
 
-		// Allow user input to determine this?
-		// Max sample count for the device is 2^{25} = 33,554,342
-		pretriggersampleCount = 100;
-		posttriggersampleCount = 50000;
-		sampleCount = pretriggersampleCount + posttriggersampleCount;
-		if (sampleCount > maxSamples)
+		if ((status = ps2000aSetNoOfCaptures(unit->handle, g_numsegments)) != PICO_OK)
 		{
-			sampleCount = maxSamples;
-			pretriggersampleCount = 1000;
-			posttriggersampleCount = maxSamples - 1000;
-			printf("Spaced needed to fulfill requested sampleCount exceeds the device's internal memory.\n");
-			printf("Setting posttriggersampleCount to %d - 1000, and pretriggersampleCount to 1000.\n", maxSamples);
+			picoerrorLog(g_errorfp, status, __LINE__, __func__, "ps2000aSetNoOfCaptures");
+			return status;
 		}
 
-		g_BufferInfo.mode = mode;
-		g_BufferInfo.unit = unit;
-
-		if (!tThreadBuffersInit(&g_threadBuffers, NUM_THREADS, sampleCount))
+		// same window as regular block mode, unless the segments are too small to fit it (use fewer segments for a longer one)
+		if ((status = CaptureWindowSamples(unit, info->maxSamples, &info->timeIntervalNanoseconds, &info->pretriggersampleCount, &info->posttriggersampleCount)) != PICO_OK)
 		{
-			// put in print statement
-			return PICO_MEMORY_FAIL;
+			return status;
 		}
-		// set of threads initialization here, then assign one to the driver buffer
-
-		g_BufferInfo.driverBuffer = NULL;
-
-		// same deal with the work buffer?
-		// put them all (3) in a struct?
-			// pointer to thread, driver buffer, work buffer
-			// allocate x many depending on function call here?
-			// going to need free routines, maybe do this in main or globally?
-
-		g_workBuffer = NULL;
-		// how to get next free set of buffers?
-		currentbuffer = tThreadBuffersUseNextFree(&g_threadBuffers);
-		// this needs to happen each run for the multithreaded case, so move out of this if block?
-		if ((status = ps2000aSetDataBuffer(unit->handle, PS2000A_CHANNEL_A, g_threadBuffers.driverBuffers[currentbuffer], sampleCount, segmentIndex, ratioMode)) != PICO_OK)
+		info->segmentSamples = info->pretriggersampleCount + info->posttriggersampleCount;
+		BaselineWindow(unit, info->pretriggersampleCount);
+		DetectorConfigure(unit, info->timeIntervalNanoseconds, info->pretriggersampleCount, info->segmentSamples);
+
+		info->mode = mode;
+		info->numSegments = g_numsegments;
+		info->numChannels = g_coincidence ? 2 : 1;
+		// one allocation for all the segments, segment i starts at driverBuffer + i * numChannels * segmentSamples
+		// with channel B's samples (in coincidence mode) segmentSamples after channel A's
+		info->driverBuffer = (int16_t*)AlignedAlloc((size_t)info->segmentSamples * g_numsegments * info->numChannels * sizeof(int16_t));
+		info->overflow = (int16_t*)calloc(g_numsegments, sizeof(int16_t));
+		if (info->driverBuffer == NULL || info->overflow == NULL)
 		{
-			// any allocation errors regarding BufferInfo.driverBuffer will (hopefully) get caught by the pico library function
-			picoerrorLog(g_errorfp, status, __LINE__, __func__, "ps2000aSetDataBuffer");
-			return status;
+			printf("Failed to allocate the driver buffer for %u segments.\n", g_numsegments);
+			printf("Requested %zu bytes.\n", (size_t)info->segmentSamples * g_numsegments * info->numChannels * sizeof(int16_t));
+			printf("%s\n[%d] %s::%s ------ MEMORY ALLOCATION ERROR (non-pico)\n", timeInfotoString().c_str(), __LINE__, __func__, "AlignedAlloc");
+			if (g_errorfp != NULL)
+			{
+				fprintf(g_errorfp, "%s\n[%d] %s::%s ------ MEMORY ALLOCATION ERROR (non-pico)\n\n", timeInfotoString().c_str(), __LINE__, __func__, "AlignedAlloc");
+			}
+			return PICO_MEMORY_FAIL;
 		}
 
-		// Validate the current timebase index, and find the maximum number of samples and the time interval (in nanoseconds)
-		while ((status = ps2000aGetTimebase(unit->handle, g_timebase, sampleCount, &timeIntervalNanoseconds, g_oversample, &maxSamples, 0)) != PICO_OK)
+		for (uint32_t i = 0; i < g_numsegments; i++)
 		{
-			if (status == PICO_INVALID_TIMEBASE) // not an actual error, just need to try a different (slower) time base (see Programmer's Guide for explanation)
+			if ((status = SetCaptureBuffers(info, info->driverBuffer + (size_t)i * info->numChannels * info->segmentSamples, info->segmentSamples, info->segmentSamples, i, ratioMode)) != PICO_OK)
 			{
-				g_timebase++; // we shouldn't reach this spot, this should just stay at 0 (so long as we're using single channel block mode)
+				picoerrorLog(g_errorfp, status, __LINE__, __func__, "SetCaptureBuffers");
+				return status;
 			}
-			else // something actually went wrong
+		}
+		info->firstRun = FALSE;
+	}
+	else if (AdaptiveWindowShrink(&g_adaptive, &info->windowshrunk, info->timeIntervalNanoseconds, &info->posttriggersampleCount))
+	{
+		// segments still start segmentSamples apart, only the first part of each one gets filled now
+		for (uint32_t i = 0; i < g_numsegments; i++)
+		{
+			if ((status = SetCaptureBuffers(info, info->driverBuffer + (size_t)i * info->numChannels * info->segmentSamples, info->segmentSamples, info->pretriggersampleCount + info->posttriggersampleCount, i, ratioMode)) != PICO_OK)
 			{
-				picoerrorLog(g_errorfp, status, __LINE__, __func__, "ps2000aGetTimebase");
+				picoerrorLog(g_errorfp, status, __LINE__, __func__, "SetCaptureBuffers");
 				return status;
 			}
 		}
-		g_firstRun = FALSE;
 	}
 
-	// switch buffer associated with device here
-
-	// buffer mutex up here-> if not thread-specific buffer
-	// Start it collecting, then wait for completion
-	g_ready = FALSE;
-	if ((status = ps2000aRunBlock(unit->handle, pretriggersampleCount, posttriggersampleCount, g_timebase, g_oversample, NULL, 0, CallBackBlock, NULL)) != PICO_OK)
+	// Start it collecting, then wait for all the segments to fill
+	arm = CaptureRingArm(&info->captures, 0, g_numsegments, info->pretriggersampleCount + info->posttriggersampleCount);
+	stagens = HostTimeNs();
+	if ((status = ps2000aRunBlock(unit->handle, info->pretriggersampleCount, info->posttriggersampleCount, g_timebase, g_oversample, NULL, 0, CallBackBlock, info)) != PICO_OK)
 	{
 		picoerrorLog(g_errorfp, status, __LINE__, __func__, "ps2000aRunBlock");
 		return status;
 	}
+	TimingStage(&g_timing, STAGE_ARM, stagens, HostTimeNs());
+	TimingRearm(&g_timing, info, HostTimeNs());
+
+	printf("Waiting for %u triggers...Press \'Q\' to abort...", g_numsegments);
+
+	// sleep until the callback fires, waking up every READY_WAIT_MS to check the stop token
+	while (!(captured = CaptureRingWait(&info->captures, arm, &capture, READY_WAIT_MS)) && !StopRequested(&g_watchdog));
 
-	printf("Waiting for trigger...Press \'Q\' to abort following the trigger...");
+	stagens = HostTimeNs();
+	if (!captured)
+	{
+		// aborted partway through the run, stop it so the segments that did fill can still be read
+		TimingCapture(&g_timing, info, stagens);
+		if ((status = ps2000aStop(unit->handle)) != PICO_OK)
+		{
+			picoerrorLog(g_errorfp, status, __LINE__, __func__, "ps2000aStop");
+		}
+	}
+	else
+	{
+		TimingCapture(&g_timing, info, capture.readyns);
+		TimingStage(&g_timing, STAGE_WAKE, capture.readyns, stagens);
+	}
 
-	// way to use q key press to quit within this loop without messing up quitting in main?
-	while (!g_ready)
+	// normally every segment, fewer if the run was cut short
+	stagens = HostTimeNs();
+	if ((status = ps2000aGetNoOfCaptures(unit->handle, &numCaptures)) != PICO_OK)
 	{
-		Sleep(0);
+		picoerrorLog(g_errorfp, status, __LINE__, __func__, "ps2000aGetNoOfCaptures");
 	}
+	printf("%u captured!\n", numCaptures);
 
-	if (g_ready)
+	if (numCaptures > 0)
 	{
-		printf("Triggered!\n");
-		sampleCount = pretriggersampleCount + posttriggersampleCount; // sampleCount's value can be changed by call to ps2000aGetValues, resetting here with pre/posttriggersampleCount (which aren't changed) just to be safe
-		// buffer mutex here?
-		// or just change the buffer associated with the device each time?->overhead, how likely is it that that would be necessary
-		if ((status = ps2000aGetValues(unit->handle, 0, (uint32_t*)&sampleCount, downsampleratio, ratioMode, 0, NULL)) != PICO_OK)
+		sampleCount = (uint32_t)(info->pretriggersampleCount + info->posttriggersampleCount);
+		if ((status = ps2000aGetValuesBulk(unit->handle, &sampleCount, 0, numCaptures - 1, downsampleratio, ratioMode, info->overflow)) != PICO_OK)
 		{
-			picoerrorLog(g_errorfp, status, __LINE__, __func__, "ps2000aGetValues");
-			return status;
+			picoerrorLog(g_errorfp, status, __LINE__, __func__, "ps2000aGetValuesBulk");
+			numCaptures = 0;
 		}
+	}
+	TimingStage(&g_timing, STAGE_READOUT, stagens, HostTimeNs());
+
+	// the data has been copied into our buffers, the scope can be stopped before doing the analysis
+	stagens = HostTimeNs();
+	if ((status = ps2000aStop(unit->handle)) != PICO_OK)
+	{
+		picoerrorLog(g_errorfp, status, __LINE__, __func__, "ps2000aStop");
+	}
+	TimingStage(&g_timing, STAGE_STOP, stagens, HostTimeNs());
 
-		status = ConcurrentBlockPeaktoPeak(unit, g_BufferInfo.driverBuffer, sampleCount, timeIntervalNanoseconds, downsampleratio); // placeholder call, fix later
+	// the host only hears about the run once every segment has filled, so its events all share that
+	// timestamp, the trigger time offsets are still per segment
+	time.hostns = captured ? capture.readyns : stagens;
+	for (uint32_t i = 0; i < numCaptures; i++)
+	{
+		int16_t* segment = info->driverBuffer + (size_t)i * info->numChannels * info->segmentSamples;
+
+		printf("Segment %u%s\n", i, info->overflow[i] ? " (over range)" : "");
+		TriggerTimeOffsetPs(unit, i, &time.triggeroffsetps);
+		TriggerWidthRecord(info, segment, sampleCount);
+		status = BlockRecordEvent(unit, segment, (info->numChannels > 1) ? segment + info->segmentSamples : NULL, sampleCount, info->timeIntervalNanoseconds, downsampleratio, &time);
 	}
 
+	printf("Total Number of Multi-Peak Events Recorded: %" PRIu64 "\n", g_nummultipeakevents.load());
+
 	return status;
-}*/
+}
 
 /****************************************************************************
-* BlockDataHandler
+* CollectRapidBlock
 *
-* - Used by all block data routines
-* - acquires data (user sets trigger mode before calling),
-*   and saves all to a .csv file (if specified by g_numwavestosaved)
+*  - This function collects g_numsegments blocks of data from the unit in
+*  rapid block mode, one per trigger event
 *
 * Parameters
-* - unit : pointer to the UNIT structure, where the handle is stored
-* - feakfp : pointer to the file where peak info (not waveforms) are written to
-* - offset : the offset into the data buffer to start the display's slice. (normally 0)
-* - mode : ANALOGUE, DIGITAL, AGGREGATED, MIXED - just used ANALOGUE here
-* - etsModeSet: whether or not ETS Mode (see programmer's guide) is
-*	turned on (turned off for our application)
+* - info : pointer to the unit's BUFFER_INFO
 *
 * Returns
 * - PICO_STATUS : to indicate success, or if an error occurred
 ****************************************************************************/
-PICO_STATUS BlockDataHandler(UNIT* unit, int32_t offset, MODE mode, int16_t etsModeSet)
+PICO_STATUS CollectRapidBlock(BUFFER_INFO* info)
 {
 	PICO_STATUS status;
-	uint16_t numpeaks;
-	static int32_t timeIntervalNanoseconds, posttriggersampleCount, pretriggersampleCount, sampleCount, maxSamples; // vars get set on first call to function, retain value for subsequent runs because static
-	uint32_t segmentIndex = 0;
-	uint32_t downsampleratio = 1;
-	uint32_t* indices = NULL; // array to hold numpeaks and the indices of such peaks
-	BOOL lasttosave = FALSE; // indicates if the waveform just saved was the last one to be saved
-	FILE* wavefp = NULL;
-	PS2000A_RATIO_MODE ratioMode = PS2000A_RATIO_MODE_NONE; // Don't want any downsampling
 
-	if (g_firstRun == TRUE) // only need to set this stuff up once
+	// set up the scope for data collection and collect it
+	if ((status = RapidBlockDataHandler(info, 0, MODE::ANALOGUE, FALSE)) != PICO_OK)
 	{
-		if ((status = ps2000aMemorySegments(unit->handle, (uint32_t)1, &maxSamples)) != PICO_OK)
-		{
-			picoerrorLog(g_errorfp, status, __LINE__, __func__, "ps2000aMemorySegments");
-			return status;
-		}
+		picoerrorLog(g_errorfp, status, __LINE__, __func__, "RapidBlockDataHandler");
+		return status;
+	}
 
-		// Allow user input to determine this?
-		// Max sample count for the device is 2^{25} = 33,554,342
-		pretriggersampleCount = 100;
-		posttriggersampleCount = 50000;
-		sampleCount = pretriggersampleCount + posttriggersampleCount;
-		if (sampleCount > maxSamples)
-		{
-			sampleCount = maxSamples;
-			pretriggersampleCount = 1000;
-			posttriggersampleCount = maxSamples - 1000;
-			printf("Spaced needed to fulfill requested sampleCount exceeds the device's internal memory.\n");
-			printf("Setting posttriggersampleCount to %d - 1000, and pretriggersampleCount to 1000.\n", maxSamples);
-		}
-
-		g_BufferInfo.mode = mode;
-		g_BufferInfo.unit = unit;
-		g_BufferInfo.driverBuffer = (int16_t*)calloc(sampleCount, sizeof(int16_t));
-		g_workBuffer = (int16_t*)calloc(sampleCount, sizeof(int16_t));
-		//tGlobalPointersAddPointer(g_pointers, g_BufferInfo.driverBuffer, REG_POINTER);
-		//tGlobalPointersAddPointer(g_pointers, g_workBuffer, REG_POINTER);
-		if ((status = ps2000aSetDataBuffer(unit->handle, PS2000A_CHANNEL_A, g_BufferInfo.driverBuffer, sampleCount, segmentIndex, ratioMode)) != PICO_OK)
-		{
-			// any allocation errors regarding BufferInfo.driverBuffer will (hopefully) get caught by the pico library function
-			picoerrorLog(g_errorfp, status, __LINE__, __func__, "ps2000aSetDataBuffer");
-			return status;
-		}
+	return status;
+}
 
-		// Validate the current timebase index, and find the maximum number of samples and the time interval (in nanoseconds)
-		while ((status = ps2000aGetTimebase(unit->handle, g_timebase, sampleCount, &timeIntervalNanoseconds, g_oversample, &maxSamples, 0)) != PICO_OK)
+/****************************************************************************
+* StreamPeakStateInit
+*
+* - Sets up a STREAM_PEAK_STATE for a new streaming run, allocating the
+* history ring buffer big enough to hold a whole event window
+*
+* Parameters
+* - state : pointer to the STREAM_PEAK_STATE to set up
+* - unit : pointer to the UNIT structure, where the handle is stored
+* - sampleInterval : the amount of time (in ns) per sample
+*
+* Returns
+* - PICO_STATUS : PICO_OK, or PICO_MEMORY_FAIL if the buffers couldn't be
+* allocated
+****************************************************************************/
+PICO_STATUS StreamPeakStateInit(STREAM_PEAK_STATE* state, UNIT* unit, uint32_t sampleInterval)
+{
+	uint64_t historySize = 1;
+
+	state->unit = unit;
+	state->windowPos = 0;
+	state->sampleIndex = 0;
+	state->baseline = 0;
+	state->baselineWeight = 0;
+	state->thresh = mv_to_adc(g_peakthresh, unit->channelSettings[PS2000A_CHANNEL_A].range, unit);
+	state->trigger = mv_to_adc(g_trigthresh, unit->channelSettings[PS2000A_CHANNEL_A].range, unit);
+	state->triggered = FALSE;
+	state->closedmidpulse = FALSE;
+	state->peakIndex = -1;
+	state->peakValue = (std::numeric_limits<int16_t>::max)();
+	state->numpeaks = 0;
+	state->sampleInterval = sampleInterval;
+	state->eventSamples = (g_eventwindow + sampleInterval - 1) / sampleInterval;
+
+	// an event gets written out once the smoothing has caught up to the end of its window,
+	// by then history has to reach back to STREAM_PRE_SAMPLES before its first peak
+	while (historySize < state->eventSamples + STREAM_PRE_SAMPLES + 5)
+	{
+		historySize <<= 1;
+	}
+	state->historyMask = historySize - 1;
+	state->history = (int16_t*)calloc((size_t)historySize, sizeof(int16_t));
+	state->eventBuffer = (int16_t*)calloc((size_t)(state->eventSamples + STREAM_PRE_SAMPLES), sizeof(int16_t));
+	state->indices = (uint32_t*)calloc(STREAM_MAX_PEAKS + 1, sizeof(uint32_t));
+	if (state->history == NULL || state->eventBuffer == NULL || state->indices == NULL)
+	{
+		printf("Failed to allocate the buffers for the streaming peak detection.\n");
+		printf("Requested %zu bytes.\n", (size_t)(historySize + state->eventSamples + STREAM_PRE_SAMPLES) * sizeof(int16_t));
+		printf("%s\n[%d] %s::%s ------ MEMORY ALLOCATION ERROR (non-pico)\n", timeInfotoString().c_str(), __LINE__, __func__, "calloc");
+		if (g_errorfp != NULL)
 		{
-			if (status == PICO_INVALID_TIMEBASE) // not an actual error, just need to try a different (slower) time base (see Programmer's Guide for explanation)
-			{
-				g_timebase++; // we shouldn't reach this spot, this should just stay at 0 (so long as we're using single channel block mode)
-			}
-			else // something actually went wrong
-			{
-				picoerrorLog(g_errorfp, status, __LINE__, __func__, "ps2000aGetTimebase");
-				return status;
-			}
+			fprintf(g_errorfp, "%s\n[%d] %s::%s ------ MEMORY ALLOCATION ERROR (non-pico)\n\n", timeInfotoString().c_str(), __LINE__, __func__, "calloc");
 		}
-		g_firstRun = FALSE;
+		return PICO_MEMORY_FAIL;
 	}
 
-	// switch buffer associated with device here
+	return PICO_OK;
+}
 
-	// buffer mutex up here-> if not thread-specific buffer
-	// Start it collecting, then wait for completion
-	g_ready = FALSE;
-	if ((status = ps2000aRunBlock(unit->handle, pretriggersampleCount, posttriggersampleCount, g_timebase, g_oversample, NULL, 0, CallBackBlock, NULL)) != PICO_OK)
+/****************************************************************************
+* StreamPeakStateFree
+*
+* - Frees the buffers allocated by StreamPeakStateInit
+*
+* Parameters
+* - state : pointer to the STREAM_PEAK_STATE to clean up
+*
+* Returns
+* - none
+****************************************************************************/
+void StreamPeakStateFree(STREAM_PEAK_STATE* state)
+{
+	free(state->history);
+	free(state->eventBuffer);
+	free(state->indices);
+	state->history = NULL;
+	state->eventBuffer = NULL;
+	state->indices = NULL;
+}
+
+/****************************************************************************
+* StreamAddPeak
+*
+* - Adds the peak in progress to the current event, or starts a new event
+* with it if it's big enough to have triggered the scope in block mode
+* - Peaks beyond STREAM_MAX_PEAKS are dropped
+*
+* Parameters
+* - state : pointer to the STREAM_PEAK_STATE
+*
+* Returns
+* - none
+****************************************************************************/
+inline void StreamAddPeak(STREAM_PEAK_STATE* state)
+{
+	if ((state->numpeaks > 0 || state->triggered) && state->numpeaks < STREAM_MAX_PEAKS)
 	{
-		picoerrorLog(g_errorfp, status, __LINE__, __func__, "ps2000aRunBlock");
-		return status;
+		state->peaks[state->numpeaks++] = (uint64_t)state->peakIndex;
+	}
+	state->peakIndex = -1; // reset this so we can find the next one (if there is one)
+	state->peakValue = (std::numeric_limits<int16_t>::max)(); // reset this too
+}
+
+/****************************************************************************
+* StreamRecordEvent
+*
+* - Closes the event in progress once its window is over: copies its
+* waveform out of the history buffer and records it through RecordPeakInfo
+* the same way a block mode waveform would be
+*
+* Parameters
+* - state : pointer to the STREAM_PEAK_STATE
+*
+* Returns
+* - none
+****************************************************************************/
+void StreamRecordEvent(STREAM_PEAK_STATE* state)
+{
+	uint64_t start = (state->peaks[0] > STREAM_PRE_SAMPLES) ? state->peaks[0] - STREAM_PRE_SAMPLES : 0;
+	uint32_t sampleCount = (uint32_t)(state->peaks[0] + state->eventSamples - start);
+	uint32_t first = (uint32_t)(start & state->historyMask);
+	uint32_t part = (std::min)(sampleCount, (uint32_t)(state->historyMask + 1 - first)); // samples before history wraps around
+	EVENT_TIME time;
+
+	// a peak still in progress at the end of the window counts, like one at the end of a block mode waveform,
+	// unless it only just started on the sample past the window, then it's left for the next event
+	if (state->peakIndex != -1 && (uint64_t)state->peakIndex < state->peaks[0] + state->eventSamples)
+	{
+		StreamAddPeak(state);
+		state->closedmidpulse = TRUE; // or what's left of the pulse would start a new event
+	}
+
+	memcpy(state->eventBuffer, state->history + first, (size_t)part * sizeof(int16_t));
+	memcpy(state->eventBuffer + part, state->history, (size_t)(sampleCount - part) * sizeof(int16_t));
+	state->indices[0] = state->numpeaks;
+	for (uint16_t i = 0; i < state->numpeaks; i++)
+	{
+		state->indices[i + 1] = (uint32_t)(state->peaks[i] - start);
 	}
 
-	printf("Waiting for trigger...Press \'Q\' to abort following the trigger...");
+	// no trigger to take an offset from, the host time is counted back from when the current chunk arrived
+	time.hostns = state->chunkns - (int64_t)(state->chunkEnd - state->peaks[0]) * state->sampleInterval;
+	time.triggeroffsetps = 0;
 
-	// way to use q key press to quit within this loop without messing up quitting in main?
-	while (!g_ready)
+	g_numwaveforms++;
+	printf((state->numpeaks == 1) ? "%d peak detected.\n" : "%d peaks detected.\n", state->numpeaks);
+	RecordPeakInfo(state->unit, PS2000A_CHANNEL_A, state->eventBuffer, sampleCount, state->indices, state->sampleInterval, 1, &time);
+	printf("Total Number of Multi-Peak Events Recorded: %" PRIu64 "\n", g_nummultipeakevents.load());
+
+	state->numpeaks = 0;
+}
+
+/****************************************************************************
+* StreamPeakFinding
+*
+* - Streaming version of BlockPeakFinding: smooths the signal with the same
+* 5-point moving average and finds downward peaks below the baseline and
+* g_peakthresh, but works through the stream one chunk at a time
+* - A peak that passes the trigger level opens an event, peaks up to
+* g_eventwindow ns after it are added to the event, and the event is
+* recorded once its window is over
+* - The baseline is a running average over the most recent
+* STREAM_BASELINE_SAMPLES samples, updated once per chunk
+*
+* Parameters
+* - state : pointer to the STREAM_PEAK_STATE carried over from the last chunk
+* - chunk : the new samples
+* - sampleCount : the number of samples in chunk
+*
+* Returns
+* - none
+****************************************************************************/
+void StreamPeakFinding(STREAM_PEAK_STATE* state, int16_t* chunk, uint32_t sampleCount)
+{
+	int64_t accumulator = 0;
+	uint64_t weight;
+
+	if (sampleCount == 0)
 	{
-		Sleep(0);
+		return;
 	}
 
-	if (g_ready)
+	// the chunk just came off the driver, events in it get their host time counted back from here
+	state->chunkns = HostTimeNs();
+	state->chunkEnd = state->sampleIndex + sampleCount;
+
+	// fold the chunk into the baseline, weighted by its length so a short chunk can't swing it
+	for (uint32_t i = 0; i < sampleCount; i++)
 	{
-		printf("Triggered!\n");
-		sampleCount = pretriggersampleCount + posttriggersampleCount; // sampleCount's value can be changed by call to ps2000aGetValues, resetting here with pre/posttriggersampleCount (which aren't changed) just to be safe
-		// buffer mutex here?
-		// or just change the buffer associated with the device each time?->overhead, how likely is it that that would be necessary
-		if ((status = ps2000aGetValues(unit->handle, 0, (uint32_t*)&sampleCount, downsampleratio, ratioMode, 0, NULL)) != PICO_OK)
+		accumulator += chunk[i];
+	}
+	weight = (std::min)(state->baselineWeight, (sampleCount < STREAM_BASELINE_SAMPLES) ? (uint64_t)(STREAM_BASELINE_SAMPLES - sampleCount) : (uint64_t)0);
+	state->baseline = (float_t)((state->baseline * (double)weight + (double)accumulator) / (double)(weight + sampleCount));
+	state->baselineWeight = weight + sampleCount;
+
+	for (uint32_t i = 0; i < sampleCount; i++)
+	{
+		uint64_t center; // the sample the moving average is centred on, 2 behind the newest
+		int16_t smooth;
+		int16_t raw;
+
+		state->history[state->sampleIndex & state->historyMask] = chunk[i];
+		state->window[state->windowPos] = chunk[i];
+		state->windowPos = (state->windowPos == 4) ? 0 : state->windowPos + 1;
+		if (++state->sampleIndex < 5) // can't average the first couple points, same as in block mode
 		{
-			picoerrorLog(g_errorfp, status, __LINE__, __func__, "ps2000aGetValues");
-			return status;
+			continue;
+		}
+		center = state->sampleIndex - 3;
+		smooth = MovingAverageFive(state->window[0], state->window[1], state->window[2], state->window[3], state->window[4]);
+		raw = state->history[center & state->historyMask];
+
+		if (smooth < state->baseline)
+		{
+			if (state->closedmidpulse) // the rest of a pulse whose peak went into the last event, not a new one (and no event's open)
+			{
+				continue;
+			}
+			if (raw < state->trigger)
+			{
+				state->triggered = TRUE;
+			}
+			if (smooth < state->peakValue && smooth < state->thresh)
+			{
+				state->peakIndex = (int64_t)center;
+				state->peakValue = smooth;
+			}
+		}
+		else // back at the baseline or above it, same as the block modes' search
+		{
+			if (state->peakIndex != -1)
+			{
+				StreamAddPeak(state);
+			}
+			state->triggered = FALSE;
+			state->closedmidpulse = FALSE;
 		}
 
-		// spawn off a worker thread here
-			// either use a mutex so we don't overwrite the buffer while we're still reading from it
-			// or still use a mutex, but copy over to a thread-specific buffer so decrease likelihood of blocking the main thread
-				// thread-specific buffer would scale well with larger waveforms
-			// will need to put a mutex around incrementing global counters, beyond that anything else?
-			// probably make the number of threads a global #define, this machine has 8 cores so prolly optimize around that
-		indices = BlockPeaktoPeak(unit, g_BufferInfo.driverBuffer, sampleCount, timeIntervalNanoseconds, downsampleratio);
+		if (state->numpeaks > 0 && center >= state->peaks[0] + state->eventSamples)
+		{
+			StreamRecordEvent(state);
+		}
+	}
+}
 
-		// need to put the code below in some function (rearrange some things) so that the main thread can continue on 
-		// to the next run while this does data analysis
-		// maybe just write a multi-threaded version of the function that fits in well with everything else being single-threaded
-		// can do something like #define MULTITHREAD up top, use an #ifdef for the function calls?
+/****************************************************************************
+* StreamingDataHandler
+*
+* - Streaming version of BlockDataHandler
+* - starts the scope streaming on the first call, then every call fetches
+* whatever data the driver has collected since the last one and runs it
+* through StreamPeakFinding. There's no re-arming between waveforms, so no
+* dead time as long as the program keeps up with the data
+*
+* Parameters
+* - info : pointer to the unit's BUFFER_INFO, which holds its handle, buffers
+*	and the settings carried over from the first run
+* - offset : the offset into the data buffer to start the display's slice. (normally 0)
+* - mode : ANALOGUE, DIGITAL, AGGREGATED, MIXED - just used ANALOGUE here
+* - etsModeSet: whether or not ETS Mode (see programmer's guide) is
+*	turned on (turned off for our application)
+*
+* Returns
+* - PICO_STATUS : to indicate success, or if an error occurred
+****************************************************************************/
+PICO_STATUS StreamingDataHandler(BUFFER_INFO* info, int32_t offset, MODE mode, int16_t etsModeSet)
+{
+	UNIT* unit = info->unit;
+	PICO_STATUS status = PICO_OK;
+	PS2000A_RATIO_MODE ratioMode = PS2000A_RATIO_MODE_NONE; // Don't want any downsampling
 
-		if (indices == NULL) // if there were memory allocation issues with the peak detection algorithm...
+	if (info->firstRun == TRUE) // only need to set this stuff up once
+	{
+		info->mode = mode;
+		info->numSegments = 1;
+		info->driverBuffer = (int16_t*)AlignedAlloc(STREAM_BUFFER_SAMPLES * sizeof(int16_t));
+		info->stream.driverBuffer = info->driverBuffer;
+		info->stream.appBuffer = (int16_t*)calloc(STREAM_BUFFER_SAMPLES, sizeof(int16_t));
+		info->stream.appSamples = 0;
+		info->stream.overflow = 0;
+		info->stream.totalSamples = 0;
+		if (info->stream.driverBuffer == NULL || info->stream.appBuffer == NULL)
 		{
-			printf("%s\n[%d] %s::%s ------ MEMORY ALLOCATION ERROR (non-pico)\n\n", timeInfotoString().c_str(), __LINE__, __func__, "BlockPeaktoPeak");
-			//fprintf(stderr, "%s\n[%d] %s::%s ------ MEMORY ALLOCATION ERROR (non-pico)\n\n", timeInfotoString().c_str(), __LINE__, __func__, "BlockPeaktoPeak");
+			printf("Failed to allocate the streaming buffers.\n");
+			printf("Requested %zu bytes.\n", (size_t)STREAM_BUFFER_SAMPLES * 2 * sizeof(int16_t));
+			printf("%s\n[%d] %s::%s ------ MEMORY ALLOCATION ERROR (non-pico)\n", timeInfotoString().c_str(), __LINE__, __func__, "calloc");
 			if (g_errorfp != NULL)
 			{
-				fprintf(g_errorfp, "%s\n[%d] %s::%s ------ MEMORY ALLOCATION ERROR (non-pico)\n\n", timeInfotoString().c_str(), __LINE__, __func__, "BlockPeaktoPeak");
+				fprintf(g_errorfp, "%s\n[%d] %s::%s ------ MEMORY ALLOCATION ERROR (non-pico)\n\n", timeInfotoString().c_str(), __LINE__, __func__, "calloc");
 			}
-			return status;
-		} // ...otherwise we're good to go
-		numpeaks = indices[0]; // numpeaks stored in the first array entry
+			return PICO_MEMORY_FAIL;
+		}
 
-		// might want to make this "== 2" since 3-peak events seem to throw a wrench in the data analysis
-		// if this change is made we can get rid of the 'T' delimiter for the peak info file and add column headers
-		if (numpeaks == 2) // no reason to record 1-peak events
+		if ((status = ps2000aSetDataBuffer(unit->handle, PS2000A_CHANNEL_A, info->stream.driverBuffer, STREAM_BUFFER_SAMPLES, 0, ratioMode)) != PICO_OK)
 		{
-			// mutex right here
-			g_nummultipeakevents++; // keep track of how many events we've recorded
-			if ((g_numwavestosaved > 0) || (g_numwavestosaved == -1)) // if we're still saving waveforms
-			{
-				// give the file a time-dependent name to avoid file name collisions
-				wavefilename = "RAW_WAVEFORM_"; // reset the filename from the last block of multi-peak data
-				wavefilename += timeInfotoString();
-				wavefilename += ".csv";
-				fopen_s(&wavefp, wavefilename.c_str(), "w");
-
-				if (wavefp != NULL)
-				{
-					printf("Writing the raw data to the disk file(%s)\n...", wavefilename.c_str());
-					fprintf(wavefp, "Block Data Log:\n\nTime (ns), ADC Count, mV\n");
+			picoerrorLog(g_errorfp, status, __LINE__, __func__, "ps2000aSetDataBuffer");
+			return status;
+		}
 
-					for (int32_t i = 0; i < sampleCount; i++)
-					{
-						// Times printed in ns
-						fprintf(wavefp,
-							"%d, %d, %d\n",
-							(int32_t)(i * timeIntervalNanoseconds * downsampleratio),
-							g_BufferInfo.driverBuffer[i],
-							adc_to_mv(g_BufferInfo.driverBuffer[i], unit->channelSettings[PS2000A_CHANNEL_A].range, unit));
-					}
-					printf("done.\n");
-					// mutex here too
-					// update the number of waveforms to be saved
-					if (g_numwavestosaved > 0)
-					{
-						g_numwavestosaved--;
-						lasttosave = g_numwavestosaved ? FALSE : TRUE; // If we just saved the last waveform to be saved, set this flag to TRUE
-					}
-				}
-				else
-				{
-					printf("Cannot open the file \n%s\n for writing.\n"
-						"Please ensure that you have permission to access and/ or the file isn't currently open.\n", wavefilename.c_str());
-				}
-			}
-			else
-			{
-				printf("The maximum number of waveforms to be recorded has been reached.\n");
-				printf("Peak information for this waveform will still be saved. (%s)\n", peakfilename.c_str());
-			}
-			// mutex here for writing to peak file
-			if (g_peakfp != NULL)
-			{
-				// access to the buffer here too, so a thread specific mutex is prolly the way to go
-				for (uint16_t i = 1; i <= numpeaks; i++)
-				{
-					fprintf(g_peakfp, "%d,%d,", // print peak depths 
-						g_BufferInfo.driverBuffer[indices[i]], // as ADC Counts...
-						adc_to_mv(g_BufferInfo.driverBuffer[indices[i]], unit->channelSettings[PS2000A_CHANNEL_A].range, unit)); // ...and in mV
-				}
-				fprintf(g_peakfp, "T,"); // some arbitrary deliminating character to separate peak depths and time differences
-				// print time differences (in ns) between the first peak and other peaks
-				for (uint16_t i = 2; i <= numpeaks; i++)
-				{
-					fprintf(g_peakfp, "%d,", (indices[i] - indices[1]) * timeIntervalNanoseconds * downsampleratio);
-				}
-				// if the program wrote a waveform file, its name gets written to the peak file
-				fprintf(g_peakfp, (g_numwavestosaved || lasttosave) ? "%s\n" : "No file\n", wavefilename.c_str());
-			}
-			else
-			{
-				printf("Cannot open the file \n(%s)\n for writing.\n"
-					"Please ensure that you have permission to access and/ or the file isn't currently open.\n", peakfilename.c_str());
-			}
+		// the trigger set up in OpenDevice doesn't hold streaming back, and with autoStop off the
+		// driver keeps going indefinitely, using its buffer as a FIFO
+		info->stream.sampleInterval = g_streaminterval;
+		if ((status = ps2000aRunStreaming(unit->handle, &info->stream.sampleInterval, PS2000A_NS, 0, STREAM_BUFFER_SAMPLES, FALSE, 1, ratioMode, STREAM_BUFFER_SAMPLES)) != PICO_OK)
+		{
+			picoerrorLog(g_errorfp, status, __LINE__, __func__, "ps2000aRunStreaming");
+			return status;
 		}
-		else
+		info->stream.running = TRUE;
+		printf("Streaming at %u ns per sample.\n", info->stream.sampleInterval);
+
+		if ((status = StreamPeakStateInit(&info->streamPeaks, unit, info->stream.sampleInterval)) != PICO_OK)
 		{
-			printf("Not recording 1-peak events.\n");
-			printf((g_numwavestosaved == -1) ? "" : "Remaining Number of Waveforms to Record: %d\n", g_numwavestosaved);
+			return status;
 		}
+		info->firstRun = FALSE;
 	}
 
-	if ((status = ps2000aStop(unit->handle)) != PICO_OK)
+	if ((status = ps2000aGetStreamingLatestValues(unit->handle, CallBackStreaming, &info->stream)) != PICO_OK)
 	{
-		picoerrorLog(g_errorfp, status, __LINE__, __func__, "ps2000aStop");
+		picoerrorLog(g_errorfp, status, __LINE__, __func__, "ps2000aGetStreamingLatestValues");
+		return status;
 	}
 
-	if (wavefp != NULL)
+	if (info->stream.appSamples == 0)
 	{
-		fclose(wavefp);
+		// nothing new yet, give the driver a moment rather than spinning on it
+		// (its buffer holds far more than a millisecond of data)
+		Sleep(1);
+		return status;
 	}
-	if (indices != NULL)
+
+	if (info->stream.overflow)
 	{
-		free(indices);
+		printf("Channel A went over range.\n");
+		info->stream.overflow = 0;
 	}
+	StreamPeakFinding(&info->streamPeaks, info->stream.appBuffer, info->stream.appSamples);
+	info->stream.totalSamples += info->stream.appSamples;
+	info->stream.appSamples = 0;
+
+	return status;
+}
 
-	// clear the driver buffer for the next run, not strictly necessary
-	// using pre/posttriggersampleCount here because they can't be modified by the pico library functions
-	memset(g_BufferInfo.driverBuffer, (int16_t)0, ((int64_t)pretriggersampleCount + (int64_t)posttriggersampleCount) * sizeof(int16_t));
+/****************************************************************************
+* CollectStreaming
+*
+*  - This function collects data from the unit in streaming mode, running
+*  the peak detection on the stream as it comes in
+*
+* Parameters
+* - info : pointer to the unit's BUFFER_INFO
+*
+* Returns
+* - PICO_STATUS : to indicate success, or if an error occurred
+****************************************************************************/
+PICO_STATUS CollectStreaming(BUFFER_INFO* info)
+{
+	PICO_STATUS status;
 
-	printf("Total Number of Multi-Peak Events Recorded: %I64d\n", g_nummultipeakevents);
+	// set up the scope for data collection and collect it
+	if ((status = StreamingDataHandler(info, 0, MODE::ANALOGUE, FALSE)) != PICO_OK)
+	{
+		picoerrorLog(g_errorfp, status, __LINE__, __func__, "StreamingDataHandler");
+		return status;
+	}
 
 	return status;
 }
 
 /****************************************************************************
-* CollectBlockTriggered
+* StreamingStop
 *
-*  - This function collects a single block of data from the
-*  unit, when a trigger event occurs.
+* - Stops the scope streaming and frees the streaming mode buffers (except
+* for the driver buffer, which BufferInfoFree takes care of)
+* - Safe to call if streaming was never started
 *
 * Parameters
-* - unit : pointer to the UNIT structure, where the handle is stored
+* - info : pointer to the unit's BUFFER_INFO
 *
 * Returns
-* - PICO_STATUS : to indicate success, or if an error occurred
+* - none
 ****************************************************************************/
-PICO_STATUS CollectBlockTriggered(UNIT* unit)
+void StreamingStop(BUFFER_INFO* info)
 {
 	PICO_STATUS status;
 
-	// this function did a lot more work with how it was originally written by the author in the example
-	// I moved the trigger setting code to the OpenDevice() function because it made more logical sense 
-	// there for this specific application
-	// This function doesn't do much anymore, but it helps the program logically flow and leaves room 
-	// for easy modifications by someone else down the line so I'll leave it in
+	if (info->stream.running)
+	{
+		if ((status = ps2000aStop(info->unit->handle)) != PICO_OK)
+		{
+			picoerrorLog(g_errorfp, status, __LINE__, __func__, "ps2000aStop");
+		}
+		info->stream.running = FALSE;
+	}
+	if (info->stream.appBuffer != NULL)
+	{
+		free(info->stream.appBuffer);
+		info->stream.appBuffer = NULL;
+	}
+	StreamPeakStateFree(&info->streamPeaks);
+}
+
+/****************************************************************************
+* BufferInfoFree
+*
+* - Frees the buffers the data handlers allocated for a unit
+* - Safe to call on a unit that never got as far as allocating them
+*
+* Parameters
+* - info : pointer to the unit's BUFFER_INFO
+*
+* Returns
+* - none
+****************************************************************************/
+void BufferInfoFree(BUFFER_INFO* info)
+{
+	if (info->unit != NULL)
+	{
+		DetectorFree(&info->unit->detector); // set up in the same first run as the buffers
+	}
+	if (info->driverBuffer != NULL)
+	{
+		AlignedFree(info->driverBuffer); // free the space allocated for the driver buffer
+		info->driverBuffer = NULL;
+	}
+	if (info->overflow != NULL)
+	{
+		free(info->overflow);
+		info->overflow = NULL;
+	}
+	if (info->aggregateBuffer != NULL)
+	{
+		free(info->aggregateBuffer);
+		info->aggregateBuffer = NULL;
+	}
+}
 
-	if (g_firstRun == TRUE) // only need to display this stuff once at the beginning
+/****************************************************************************
+* CollectionIntro
+*
+* - Displays what the selected data collection routine is going to do and
+* waits for the user to start it
+* - Shown once for all the units, before their acquisition threads start
+*
+* Parameters
+* - unit : pointer to the first unit's UNIT structure
+* - mode : the selected operation, 'B', 'R' or 'S'
+*
+* Returns
+* - none
+****************************************************************************/
+void CollectionIntro(UNIT* unit, char mode)
+{
+	if (mode == 'R')
+	{
+		printf("\nCollect rapid block triggered\n");
+		printf("Collects %u waveforms per run, each when value falls past %d", g_numsegments, g_scaleVoltages ?
+			g_trigthresh : mv_to_adc(g_trigthresh, PS2000A_CHANNEL_A, unit)); // If scaleVoltages, print mV value, else print ADC Count
+		printf(g_scaleVoltages ? "mV\n" : "ADC Counts\n");
+	}
+	else if (mode == 'S')
+	{
+		printf("\nCollect streaming\n");
+		printf("Streams continuously, an event starts when a peak falls past %d", g_scaleVoltages ?
+			g_trigthresh : mv_to_adc(g_trigthresh, PS2000A_CHANNEL_A, unit)); // If scaleVoltages, print mV value, else print ADC Count
+		printf(g_scaleVoltages ? "mV\n" : "ADC Counts\n");
+		printf("and collects the peaks in the %u ns after it.\n", g_eventwindow);
+	}
+	else
 	{
 		printf("\nCollect block triggered\n");
 		printf("Collects when value falls past %d", g_scaleVoltages ?
 			g_trigthresh : mv_to_adc(g_trigthresh, PS2000A_CHANNEL_A, unit)); // If scaleVoltages, print mV value, else print ADC Count
 		printf(g_scaleVoltages ? "mV\n" : "ADC Counts\n");
-		printf("\n\nPress \'Q\' once to stop data collection at any point.\n\n");
-		printf("Errors returned by calls to Pico Technology's library functions will be displayed in the following format:\n");
-		printf("[Line Number in Source File] CallingScope::FunctionThatReturnedError ------ Error (Error Code)\n");
-		printf("Press a key to start...\n");
-		_getch();
 	}
+	printf((mode != 'S' && g_coincidence) ? "on channels A and B at the same time.\n" : "");
+	printf((g_numunits > 1) ? "Collecting from %d scopes at once, each in its own thread.\n" : "", g_numunits);
+	printf("\n\nPress \'Q\' once to stop data collection at any point.\n\n");
+	printf("Errors returned by calls to Pico Technology's library functions will be displayed in the following format:\n");
+	printf("[Line Number in Source File] CallingScope::FunctionThatReturnedError ------ Error (Error Code)\n");
+	printf("Press a key to start...\n");
+	_getch();
+}
 
-	// set up the scope for data collection and collect it
-	if ((status = BlockDataHandler(unit, 0, MODE::ANALOGUE, FALSE)) != PICO_OK)
+/****************************************************************************
+* AcquisitionThread
+*
+* - Data collection loop for one unit, run in its own thread so each unit
+* is re-armed as soon as it's ready rather than waiting on the others
+* - Runs until the watchdog says to stop
+*
+* Parameters
+* - info : pointer to the unit's BUFFER_INFO
+* - mode : the selected operation, 'B', 'R' or 'S'
+*
+* Returns
+* - none
+****************************************************************************/
+void AcquisitionThread(BUFFER_INFO* info, char mode)
+{
+	PICO_STATUS status;
+
+	ThreadPlace(THREAD_ROLE::ACQUISITION, (int16_t)(info - g_BufferInfo));
+	while (!StopRequested(&g_watchdog))
 	{
-		picoerrorLog(g_errorfp, status, __LINE__, __func__, "BlockDataHandler");
-		return status;
+		// call the data collection routine
+		// if it returns an error we can just run again for another try-> don't return the error code, just log it
+		if ((status = ((mode == 'R') ? CollectRapidBlock(info) : (mode == 'S') ? CollectStreaming(info) : CollectBlockTriggered(info))) != PICO_OK)
+		{
+			picoerrorLog(g_errorfp, status, __LINE__, __func__, (mode == 'R') ? "CollectRapidBlock" : (mode == 'S') ? "CollectStreaming" : "CollectBlockTriggered");
+		}
 	}
-
-	return status;
 }
 
 /****************************************************************************
@@ -3477,23 +8161,220 @@ PICO_STATUS get_info(UNIT* unit)
 					unit->channelCount = QUAD_SCOPE;
 				}
 
-				// Set first range for voltage if device is a 2206/7/8, 2206/7/8A or 2205 MSO
-				if (numChannels == DUAL_SCOPE)
-				{
-					if (strlen((const char*)line) == 4 || (strlen((const char*)line) == 5 && _strcmpi((const char*)&line[4], "A") == 0) || (_strcmpi((const char*)line, "2205MSO")) == 0)
-					{
-						unit->firstRange = PS2000A_50MV;
-					}
-				}
+				// Set first range for voltage if device is a 2206/7/8, 2206/7/8A or 2205 MSO
+				if (numChannels == DUAL_SCOPE)
+				{
+					if (strlen((const char*)line) == 4 || (strlen((const char*)line) == 5 && _strcmpi((const char*)&line[4], "A") == 0) || (_strcmpi((const char*)line, "2205MSO")) == 0)
+					{
+						unit->firstRange = PS2000A_50MV;
+					}
+				}
+
+				// Check if device is an MSO 
+				if (strstr((const char*)line, "MSO"))
+				{
+					unit->digitalPorts = 2;
+				}
+			}
+			printf("%s: %s\n", description[i], line);
+		}
+	}
+
+	return status;
+}
+
+/****************************************************************************
+* FindDevices
+* - Lists the serial numbers of the scopes plugged in, so each of them can
+* be opened, up to MAX_UNITS of them
+*
+* Parameters
+* - serials : array to hold the serial numbers
+*
+* Returns
+* - int16_t : the number of scopes found, 0 if the enumeration failed (the
+* first scope found gets opened in that case)
+***************************************************************************/
+int16_t FindDevices(int8_t serials[MAX_UNITS][UNIT_SERIAL_LENGTH])
+{
+	PICO_STATUS status;
+	int16_t count = 0; // number of scopes plugged in
+	int16_t found = 0; // number of serial numbers copied into serials
+	char list[MAX_UNITS * UNIT_SERIAL_LENGTH]; // comma separated serial numbers
+	int16_t listLength = sizeof(list);
+	char* next = NULL;
+
+	printf("Looking for devices...");
+	if ((status = ps2000aEnumerateUnits(&count, (int8_t*)list, &listLength)) != PICO_OK)
+	{
+		printf("failed.\n");
+		picoerrorLog(g_errorfp, status, __LINE__, __func__, "ps2000aEnumerateUnits");
+		return 0;
+	}
+	printf("%d found.\n", count);
+
+	for (char* serial = strtok_s(list, ",", &next); serial != NULL && found < MAX_UNITS; serial = strtok_s(NULL, ",", &next))
+	{
+		snprintf((char*)serials[found++], UNIT_SERIAL_LENGTH, "%s", serial);
+	}
+	if (count > MAX_UNITS)
+	{
+		printf("Only the first %d will be used.\n", MAX_UNITS);
+	}
+
+	return found;
+}
+
+/****************************************************************************
+* TriggerSetup
+*
+* - Sets the unit's trigger up from the settings the user picked: a level
+* trigger on channel A falling past g_trigthresh (rising for upward pulses,
+* see g_polarity), ANDed with channel B doing the same in coincidence mode,
+* and pulse width qualified if g_pwqns is set
+* - Needs the channels set up first, the pulse width is counted in samples
+*
+* Parameters
+* - unit : pointer to the UNIT structure, where the handle is stored
+*
+* Returns
+* - PICO_STATUS : to indicate success, or if an error occurred
+****************************************************************************/
+PICO_STATUS TriggerSetup(UNIT* unit)
+{
+	PICO_STATUS status;
+
+	// convert desired trigger threshold from mV to ADC count
+	int16_t	triggerVoltage = mv_to_adc(g_trigthresh, unit->channelSettings[PS2000A_CHANNEL_A].range, unit);
+	int16_t	triggerVoltageB = mv_to_adc(g_trigthresh, unit->channelSettings[PS2000A_CHANNEL_B].range, unit);
+
+	// some of the author's/ SDK's defined structs used to set up the trigger
+	// Only triggering once so hyteresis doesn't matter, but may be better to set to 0 for clarity
+	// channel B's properties are only passed on in coincidence mode
+	PS2000A_TRIGGER_CHANNEL_PROPERTIES sourceDetails[2] = {
+		{ triggerVoltage,
+		0,
+		triggerVoltage,
+		0,
+		PS2000A_CHANNEL_A,
+		PS2000A_LEVEL },
+		{ triggerVoltageB,
+		0,
+		triggerVoltageB,
+		0,
+		PS2000A_CHANNEL_B,
+		PS2000A_LEVEL } };
+
+	// the conditions in one struct are ANDed together, so in coincidence mode both channels have to be past
+	// the threshold at the same time
+	PS2000A_TRIGGER_CONDITIONS conditions = {
+		PS2000A_CONDITION_TRUE,				// Channel A
+		g_coincidence ? PS2000A_CONDITION_TRUE : PS2000A_CONDITION_DONT_CARE, // Channel B
+		PS2000A_CONDITION_DONT_CARE,		// Channel C
+		PS2000A_CONDITION_DONT_CARE,		// Channel D
+		PS2000A_CONDITION_DONT_CARE,		// external
+		PS2000A_CONDITION_DONT_CARE,		// aux
+		g_pwqns ? PS2000A_CONDITION_TRUE : PS2000A_CONDITION_DONT_CARE, // PWQ
+		PS2000A_CONDITION_DONT_CARE };		// digital
+
+	// do we want PS2000A_FALLING or PS2000A_FALLING_LOWER?-> PS2000A_FALLING seems to be working
+	PS2000A_THRESHOLD_DIRECTION edge = (g_polarity == POLARITY::POSITIVE) ? PS2000A_RISING : PS2000A_FALLING;
+	TRIGGER_DIRECTIONS directions = {
+		edge,					// Channel A
+		g_coincidence ? edge : PS2000A_NONE, // Channel B
+		PS2000A_NONE,			// Channel C
+		PS2000A_NONE,			// Channel D
+		PS2000A_NONE,			// ext
+		PS2000A_NONE };			// aux
+
+	// the pulse width qualifier counts how long channel A stays past the (lower) threshold, the level
+	// trigger already uses the upper one and the driver won't let them share
+	PS2000A_PWQ_CONDITIONS pwqConditions = {
+		PS2000A_CONDITION_TRUE,				// Channel A
+		PS2000A_CONDITION_DONT_CARE,		// Channel B
+		PS2000A_CONDITION_DONT_CARE,		// Channel C
+		PS2000A_CONDITION_DONT_CARE,		// Channel D
+		PS2000A_CONDITION_DONT_CARE,		// external
+		PS2000A_CONDITION_DONT_CARE,		// aux
+		PS2000A_CONDITION_DONT_CARE };		// digital
+
+	// don't need any info from this struct unless the pulse width qualifier is on, filled in below
+	PWQ pulseWidth;
+	memset(&pulseWidth, 0, sizeof(PWQ));
+
+	// the pulse width is counted in samples, so this waits until the channels are set up and the
+	// sample interval is known
+	if (g_pwqns > 0)
+	{
+		int32_t timeIntervalNanoseconds = 0;
+		int32_t available = 0;
+
+		if ((status = ps2000aGetTimebase(unit->handle, g_timebase, 1, &timeIntervalNanoseconds, g_oversample, &available, 0)) != PICO_OK)
+		{
+			picoerrorLog(g_errorfp, status, __LINE__, __func__, "ps2000aGetTimebase");
+			return status;
+		}
+		pulseWidth.conditions = &pwqConditions;
+		pulseWidth.nConditions = 1;
+		pulseWidth.direction = (g_polarity == POLARITY::POSITIVE) ? PS2000A_RISING_LOWER : PS2000A_FALLING_LOWER; // the pulse starts when the signal crosses the threshold
+		pulseWidth.lower = (g_pwqns + timeIntervalNanoseconds - 1) / timeIntervalNanoseconds; // in samples
+		pulseWidth.upper = 0; // not used with PS2000A_PW_TYPE_GREATER_THAN
+		pulseWidth.type = PS2000A_PW_TYPE_GREATER_THAN;
+	}
+
+	// Trigger setup/ enabled per settings detailed in the above structs
+	if ((status = SetTrigger(unit, sourceDetails, g_coincidence ? 2 : 1, &conditions, 1, &directions, &pulseWidth, 0, 0, 0, 0, 0)) != PICO_OK)
+	{
+		picoerrorLog(g_errorfp, status, __LINE__, __func__, "SetTrigger");
+		return status;
+	}
+
+	return status;
+}
+
+/****************************************************************************
+* CoincidenceSetup
+*
+* - Switches a unit over to coincidence mode: enables channel B with the
+* same settings as channel A and triggers on the two of them together
+* - With both channels on, the scope's fastest timebase isn't available,
+* so g_timebase moves on to the fastest one that is
+*
+* Parameters
+* - unit : pointer to the UNIT structure, where the handle is stored
+*
+* Returns
+* - PICO_STATUS : to indicate success, or if an error occurred
+****************************************************************************/
+PICO_STATUS CoincidenceSetup(UNIT* unit)
+{
+	PICO_STATUS status;
+	int32_t timeIntervalNanoseconds = 0;
+	int32_t available = 0;
+
+	unit->channelSettings[PS2000A_CHANNEL_B].enabled = TRUE;
+	unit->channelSettings[PS2000A_CHANNEL_B].DCcoupled = TRUE;
+	unit->channelSettings[PS2000A_CHANNEL_B].range = unit->channelSettings[PS2000A_CHANNEL_A].range;
+	if ((status = SetDefaults(unit)) != PICO_OK)
+	{
+		picoerrorLog(g_errorfp, status, __LINE__, __func__, "SetDefaults");
+		return status;
+	}
 
-				// Check if device is an MSO 
-				if (strstr((const char*)line, "MSO"))
-				{
-					unit->digitalPorts = 2;
-				}
-			}
-			printf("%s: %s\n", description[i], line);
-		}
+	while ((status = ps2000aGetTimebase(unit->handle, g_timebase, 1, &timeIntervalNanoseconds, g_oversample, &available, 0)) == PICO_INVALID_TIMEBASE)
+	{
+		g_timebase++; // the two channels share the sample rate
+	}
+	if (status != PICO_OK)
+	{
+		picoerrorLog(g_errorfp, status, __LINE__, __func__, "ps2000aGetTimebase");
+		return status;
+	}
+
+	if ((status = TriggerSetup(unit)) != PICO_OK)
+	{
+		picoerrorLog(g_errorfp, status, __LINE__, __func__, "TriggerSetup");
+		return status;
 	}
 
 	return status;
@@ -3504,22 +8385,27 @@ PICO_STATUS get_info(UNIT* unit)
 * - Opens the scope and takes in some user input to set several parameters,
 * including the scope range, trigger level, peak detection algorithm
 * threshold, as well as some other settings
+* - With more than one scope, only the first one asks for the settings,
+* the rest are set up the same way
 *
 * Parameters
 * - unit : pointer to the UNIT structure, where the handle will be stored
+* - serial : serial number of the scope to open, NULL for the first one found
+* - first : pointer to the first unit's UNIT structure to copy the settings
+*	from, NULL if this is the first unit
 *
 * Returns
 * - PICO_STATUS : to indicate success, or if an error occurred
 ***************************************************************************/
-PICO_STATUS OpenDevice(UNIT* unit)
+PICO_STATUS OpenDevice(UNIT* unit, int8_t* serial, UNIT* first)
 {
 	PICO_STATUS status; // keep track of success/ failure of calls to pico library functions
 	int16_t maxvalue, rangeselect; // max ADC count the scope will return, scope range selected by user mV (index in inputRanges[])
 	PS2000A_RANGE scoperange = PS2000A_2V; // scope range, typically want PS2000A_2V for this application
 	BOOL cinflag = FALSE; // flag used to keep track of cin's error status after taking in user input, FALSE (no flag raised) if ok, TRUE if error indicated by cin
 
-	printf("Opening device...");
-	if ((status = ps2000aOpenUnit(&(unit->handle), NULL)) != PICO_OK)
+	printf("Opening device %s...", (serial != NULL) ? (char*)serial : "");
+	if ((status = ps2000aOpenUnit(&(unit->handle), serial)) != PICO_OK)
 	{
 		printf("Error opening the device! Ensure it is plugged in.\n");
 		printf("If this is your first time attempting to run the program, try restarting your computer.\n");
@@ -3532,6 +8418,13 @@ PICO_STATUS OpenDevice(UNIT* unit)
 	// gather device-specific information
 	get_info(unit);
 
+	// keep the serial number around to tell the units apart in the peak file
+	if ((status = ps2000aGetUnitInfo(unit->handle, unit->serial, UNIT_SERIAL_LENGTH, NULL, PICO_BATCH_AND_SERIAL)) != PICO_OK)
+	{
+		picoerrorLog(g_errorfp, status, __LINE__, __func__, "ps2000aGetUnitInfo");
+		snprintf((char*)unit->serial, UNIT_SERIAL_LENGTH, "%s", (serial != NULL) ? (char*)serial : "Unknown");
+	}
+
 	// max value needed for conversion between adc and mv
 	if ((status = ps2000aMaximumValue(unit->handle, &maxvalue)) != PICO_OK)
 	{
@@ -3543,31 +8436,38 @@ PICO_STATUS OpenDevice(UNIT* unit)
 	/*
 	* Scope Range Select
 	*/
-	std::cin.clear(); // flush the input buffer
-	do
+	if (first == NULL)
 	{
-		printf("\n\nPlease select the scope's operational voltage range:\n");
-		printf("The recommended value is 2000mV.\n");
-
-		for (uint16_t i = unit->firstRange, j = 0; i <= (unit->lastRange - unit->firstRange); i++, j++)
+		std::cin.clear(); // flush the input buffer
+		do
 		{
-			printf("[%d] %d mV\n", j, inputRanges[i]);
-		}
+			printf("\n\nPlease select the scope's operational voltage range:\n");
+			printf("The recommended value is 2000mV.\n");
+
+			for (uint16_t i = unit->firstRange, j = 0; i <= (unit->lastRange - unit->firstRange); i++, j++)
+			{
+				printf("[%d] %d mV\n", j, inputRanges[i]);
+			}
 
-		printf("Range: ");
+			printf("Range: ");
 
-		std::cin >> rangeselect; // take in index
-		/*
-		* offset needed because the first range supported by our device
-		* isn't the first range in input ranges data type, which lists all
-		* supported ranges by all picoscope devices
-		*/
-		rangeselect += unit->firstRange;
-		scoperange = (PS2000A_RANGE)inputRanges[rangeselect];
-		cinflag = (std::cin.bad() || std::cin.fail()) ? TRUE : FALSE; // check if cin's error flags were set
-		cinReset(); // flush the input buffer for future inputs
-	} while (!(rangeselect > unit->firstRange && rangeselect < unit->lastRange) // make sure input falls in an acceptable range
-		|| cinflag); // and there were no errors while taking in input
+			std::cin >> rangeselect; // take in index
+			/*
+			* offset needed because the first range supported by our device
+			* isn't the first range in input ranges data type, which lists all
+			* supported ranges by all picoscope devices
+			*/
+			rangeselect += unit->firstRange;
+			scoperange = (PS2000A_RANGE)inputRanges[rangeselect];
+			cinflag = (std::cin.bad() || std::cin.fail()) ? TRUE : FALSE; // check if cin's error flags were set
+			cinReset(); // flush the input buffer for future inputs
+		} while (!(rangeselect > unit->firstRange && rangeselect < unit->lastRange) // make sure input falls in an acceptable range
+			|| cinflag); // and there were no errors while taking in input
+	}
+	else // same range as the first unit
+	{
+		rangeselect = first->channelSettings[PS2000A_CHANNEL_A].range;
+	}
 
 	for (int16_t i = 0; i < unit->channelCount; i++)
 	{
@@ -3593,90 +8493,81 @@ PICO_STATUS OpenDevice(UNIT* unit)
 	/*
 	* Scope Trigger Level Select
 	*/
-	std::cin.clear(); // flush the input buffer
-	do
+	if (first == NULL) // the rest of the units use the first one's trigger threshold
 	{
-		printf("\n\nPlease enter the scope's trigger threshold (%d mV to %d mV):\nA value of -400mV is recommended.\n",
-			-inputRanges[unit->channelSettings[PS2000A_CHANNEL_A].range],
-			inputRanges[unit->channelSettings[PS2000A_CHANNEL_A].range]);
-		printf("Trigger Threshold (mV): ");
+		std::cin.clear(); // flush the input buffer
+		do
+		{
+			printf("\n\nPlease enter the scope's trigger threshold (%d mV to %d mV):\nA value of -400mV is recommended.\n",
+				-inputRanges[unit->channelSettings[PS2000A_CHANNEL_A].range],
+				inputRanges[unit->channelSettings[PS2000A_CHANNEL_A].range]);
+			printf("Trigger Threshold (mV): ");
 
-		std::cin >> g_trigthresh;
-		cinflag = (std::cin.bad() || std::cin.fail()) ? TRUE : FALSE; // check if cin's error flags were set
-		cinReset(); // flush the input buffer for future inputs
-	} while (!(g_trigthresh > -inputRanges[unit->channelSettings[PS2000A_CHANNEL_A].range] // make sure input falls in an acceptable range
-		&& g_trigthresh < inputRanges[unit->channelSettings[PS2000A_CHANNEL_A].range]) // ^
-		|| cinflag); // and there were no errors while taking in input
+			std::cin >> g_trigthresh;
+			cinflag = (std::cin.bad() || std::cin.fail()) ? TRUE : FALSE; // check if cin's error flags were set
+			cinReset(); // flush the input buffer for future inputs
+		} while (!(g_trigthresh > -inputRanges[unit->channelSettings[PS2000A_CHANNEL_A].range] // make sure input falls in an acceptable range
+			&& g_trigthresh < inputRanges[unit->channelSettings[PS2000A_CHANNEL_A].range]) // ^
+			|| cinflag); // and there were no errors while taking in input
+	}
 
 	printf("Selected Trigger Threshold: %d", g_scaleVoltages ? // if scale voltages
 		g_trigthresh : // print value in mV
 		mv_to_adc(g_trigthresh, PS2000A_CHANNEL_A, unit)); // else print in ADC Counts
 	printf(g_scaleVoltages ? "mV\n" : " ADC Counts\n");
 
-	// convert desired trigger threshold from mV to ADC count
-	int16_t	triggerVoltage = mv_to_adc(g_trigthresh, unit->channelSettings[PS2000A_CHANNEL_A].range, unit);
-
-	// some of the author's/ SDK's defined structs used to set up the trigger
-	// Only triggering once so hyteresis doesn't matter, but may be better to set to 0 for clarity
-	PS2000A_TRIGGER_CHANNEL_PROPERTIES sourceDetails = {
-		triggerVoltage,
-		0,
-		triggerVoltage,
-		0,
-		PS2000A_CHANNEL_A,
-		PS2000A_LEVEL };
-
-	PS2000A_TRIGGER_CONDITIONS conditions = {
-		PS2000A_CONDITION_TRUE,				// Channel A
-		PS2000A_CONDITION_DONT_CARE,		// Channel B 
-		PS2000A_CONDITION_DONT_CARE,		// Channel C
-		PS2000A_CONDITION_DONT_CARE,		// Channel D
-		PS2000A_CONDITION_DONT_CARE,		// external
-		PS2000A_CONDITION_DONT_CARE,		// aux
-		PS2000A_CONDITION_DONT_CARE,		// PWQ
-		PS2000A_CONDITION_DONT_CARE };		// digital
-
-	// do we want PS2000A_FALLING or PS2000A_FALLING_LOWER?-> PS2000A_FALLING seems to be working
-	TRIGGER_DIRECTIONS directions = {
-		PS2000A_FALLING,		// Channel A
-		PS2000A_NONE,			// Channel B
-		PS2000A_NONE,			// Channel C
-		PS2000A_NONE,			// Channel D
-		PS2000A_NONE,			// ext
-		PS2000A_NONE };			// aux
+	/*
+	* Trigger Pulse Width Select
+	*/
+	if (first == NULL) // the rest of the units use the first one's pulse width too
+	{
+		std::cin.clear(); // flush the input buffer
+		do
+		{
+			printf("\n\nPlease enter how long the signal has to stay past the trigger threshold for the scope to trigger (0-1000 ns).\n");
+			printf("Noise spikes are only a few ns wide, so they get rejected by the scope before any data is transferred.\n");
+			printf("Enter 0 to trigger on every crossing. A value of 8ns is recommended.\n");
+			printf("Minimum Trigger Pulse Width (ns): ");
 
-	// don't need any info from this struct
-	PWQ pulseWidth;
-	memset(&pulseWidth, 0, sizeof(PWQ));
+			std::cin >> g_pwqns;
+			cinflag = (std::cin.bad() || std::cin.fail()) ? TRUE : FALSE; // check if cin's error flags were set
+			cinReset(); // flush the input buffer for future inputs
+		} while (!(g_pwqns <= 1000) // make sure input falls in an acceptable range
+			|| cinflag); // and there were no errors while taking in input
 
-	// Trigger setup/ enabled per settings detailed in the above structs
-	if ((status = SetTrigger(unit, &sourceDetails, 1, &conditions, 1, &directions, &pulseWidth, 0, 0, 0, 0, 0)) != PICO_OK)
-	{
-		picoerrorLog(g_errorfp, status, __LINE__, __func__, "SetTrigger");
-		return status;
+		printf("Selected Minimum Trigger Pulse Width: %u ns\n", g_pwqns);
 	}
 
 	/*
 	* Peak Detection Threshold Select
 	*/
-	std::cin.clear(); // flush the input buffer
-	do
+	if (first == NULL) // and its peak detection threshold
 	{
-		printf("\n\nPlease enter the threshold for the peak detection algorithm(-%d mV to 0 mV):\nA value of -200mV is recommended.\n\n",
-			inputRanges[unit->channelSettings[PS2000A_CHANNEL_A].range]);
-		printf("Peak Detection Threshold (mV): ");
+		std::cin.clear(); // flush the input buffer
+		do
+		{
+			printf("\n\nPlease enter the threshold for the peak detection algorithm(-%d mV to %d mV):\n",
+				inputRanges[unit->channelSettings[PS2000A_CHANNEL_A].range],
+				inputRanges[unit->channelSettings[PS2000A_CHANNEL_A].range]);
+			printf("A negative threshold looks for downward pulses, a positive one for upward pulses (block modes only).\n");
+			printf("The trigger threshold should have the same sign. A value of -200mV is recommended.\n\n");
+			printf("Peak Detection Threshold (mV): ");
+
+			std::cin >> g_peakthresh; // take in the input
+			cinflag = (std::cin.bad() || std::cin.fail()) ? TRUE : FALSE; // check if cin's error flags were set
+			cinReset(); // flush the input buffer for future inputs
+		} while (!(g_peakthresh >= -inputRanges[unit->channelSettings[PS2000A_CHANNEL_A].range] // make sure input falls in an acceptable range
+			&& g_peakthresh <= inputRanges[unit->channelSettings[PS2000A_CHANNEL_A].range]) // ^
+			|| cinflag); // and there were no errors while taking in input
 
-		std::cin >> g_peakthresh; // take in the input
-		cinflag = (std::cin.bad() || std::cin.fail()) ? TRUE : FALSE; // check if cin's error flags were set
-		cinReset(); // flush the input buffer for future inputs
-	} while (!(g_peakthresh >= -inputRanges[unit->channelSettings[PS2000A_CHANNEL_A].range] // make sure input falls in an acceptable range
-		&& g_peakthresh <= 0) // ^
-		|| cinflag); // and there were no errors while taking in input
+		g_polarity = (g_peakthresh > 0) ? POLARITY::POSITIVE : POLARITY::NEGATIVE;
+	}
 
 	printf("Selected Peak Detection Threshold: %d", g_scaleVoltages ? // if scale voltages
 		g_peakthresh : // print value in mV
 		mv_to_adc(g_peakthresh, PS2000A_CHANNEL_A, unit)); // else print in ADC Counts
 	printf(g_scaleVoltages ? "mV\n" : " ADC Counts\n");
+	printf((g_polarity == POLARITY::POSITIVE) ? "Looking for upward pulses\n" : "Looking for downward pulses\n");
 
 	/*
 	* Set Defaults on other settings
@@ -3687,6 +8578,13 @@ PICO_STATUS OpenDevice(UNIT* unit)
 		return status;
 	}
 
+	// Trigger setup/ enabled per the settings above
+	if ((status = TriggerSetup(unit)) != PICO_OK)
+	{
+		picoerrorLog(g_errorfp, status, __LINE__, __func__, "TriggerSetup");
+		return status;
+	}
+
 	return status;
 }
 
@@ -3714,13 +8612,9 @@ void CloseDevice(UNIT* unit)
 		picoerrorLog(g_errorfp, status, __LINE__, __func__, "ps2000aCloseUnit");
 		// close the files and free the memory in the case of a failure on device closure
 		//tGlobalPointersFreePointers(g_pointers);
-		if (g_BufferInfo.driverBuffer != NULL)
-		{
-			free(g_BufferInfo.driverBuffer); // free the space allocated for the driver buffer
-		}
-		if (g_workBuffer != NULL)
+		for (int16_t i = 0; i < g_numunits; i++)
 		{
-			free(g_workBuffer);
+			BufferInfoFree(&g_BufferInfo[i]);
 		}
 		if (g_peakfp != NULL)
 		{
@@ -3753,11 +8647,15 @@ void CloseDevice(UNIT* unit)
 int main()
 {
 	PICO_STATUS status; // to receive PICO_OK (success) or other various error codes from various function calls
-	UNIT unit; // the UNIT structure, where the handle will be stored
+	UNIT units[MAX_UNITS] = {}; // the UNIT structures, where the handles will be stored (zeroed, so nothing's allocated yet)
+	int8_t serials[MAX_UNITS][UNIT_SERIAL_LENGTH]; // serial numbers of the scopes plugged in
+	int16_t numfound; // how many of them there are
 	char ch; // program selection choice
 	SHORT qinit; // Initialize state of Q key so that we can quit later on in the program (for connection checks between runs)
 	std::string starttimeinfo; // holds time info for file naming purposes
 	BOOL cinflag = FALSE; // flag used to keep track of cin's error status after taking in user input, FALSE (no flag raised) if ok, TRUE if error indicated by cin
+	double collectionseconds; // how long the data collection loop ran for
+	uint64_t totalSamples = 0; // streaming mode, samples streamed by all the units
 	//uint32_t numgpointers = 2; // number of global non-file pointers
 	//uint32_t numgfilepointers = 2; // number of global file pointers
 	//g_pointers = (GLOBAL_POINTERS*)malloc(sizeof(GLOBAL_POINTERS) + (sizeof(void*) * (numgpointers + numgfilepointers)));
@@ -3767,6 +8665,7 @@ int main()
 	//g_pointers->maxnumfilepointers = numgfilepointers;
 
 	g_qinit = _kbhitinit(); // Initialize state of Q key so that we can quit later on in the program (global)
+	BufferPoolInit(&g_bufferpool);
 
 	// give the error log file a unique (time dependent) name so we don't overwrite anything
 	starttimeinfo = timeInfotoString();
@@ -3788,21 +8687,35 @@ int main()
 		printf("The program will continue, but errors will not be logged.\n");
 	}
 
-	// open the device, get its handle for the UNIT struct
-	if ((status = OpenDevice(&unit)) != PICO_OK)
+	// open the devices, get their handles for the UNIT structs
+	numfound = FindDevices(serials);
+	for (g_numunits = 0; g_numunits < (std::max)(numfound, (int16_t)1); g_numunits++)
 	{
-		picoerrorLog(g_errorfp, status, __LINE__, __func__, "OpenDevice");
-		//tGlobalPointersFreePointers(g_pointers);
-		if (g_errorfp != NULL)
+		if ((status = OpenDevice(&units[g_numunits], numfound ? serials[g_numunits] : NULL, g_numunits ? &units[0] : NULL)) != PICO_OK)
 		{
-			fclose(g_errorfp);
+			picoerrorLog(g_errorfp, status, __LINE__, __func__, "OpenDevice");
+			for (int16_t i = 0; i < g_numunits; i++)
+			{
+				CloseDevice(&units[i]);
+			}
+			//tGlobalPointersFreePointers(g_pointers);
+			if (g_errorfp != NULL)
+			{
+				fclose(g_errorfp);
+			}
+			return -1;
 		}
-		return -1;
+		g_BufferInfo[g_numunits].unit = &units[g_numunits];
+		g_BufferInfo[g_numunits].firstRun = TRUE;
+		g_BufferInfo[g_numunits].lastreadyns = -1;
 	}
 
 	if (_kbhitpoll(g_qinit))
 	{
-		CloseDevice(&unit);
+		for (int16_t i = 0; i < g_numunits; i++)
+		{
+			CloseDevice(&units[i]);
+		}
 		return 0;
 	}
 
@@ -3811,23 +8724,28 @@ int main()
 	{
 		// display choices
 		printf("\n");
-		printf("B - Triggered Block                          X - Exit\n\n");
+		printf("B - Triggered Block                          R - Rapid Block\n");
+		printf("S - Streaming                                X - Exit\n\n");
+		printf((g_polarity == POLARITY::POSITIVE) ? "Streaming only looks for downward pulses.\n\n" : "");
 		printf("Operation:");
 
 		std::cin >> ch; // get the user's choice
 		ch = toupper(ch);
 		cinflag = (std::cin.bad() || std::cin.fail()) ? TRUE : FALSE; // check if cin's error flags were set
 		cinReset(); // flush the input buffer for future inputs
-	} while (cinflag);
+	} while ((ch == 'S' && g_polarity == POLARITY::POSITIVE)
+		|| cinflag);
 
 	printf("\n\n");
 
 	switch (ch)
 	{
 	case 'B': // collect block triggered
+	case 'R': // collect rapid block triggered
+	case 'S': // collect streaming
 	{
-		printf("Selected B- Triggered Block\n");
-		printf("This routine is written for use only with Channel A.\n\n");
+		printf((ch == 'B') ? "Selected B- Triggered Block\n" : (ch == 'R') ? "Selected R- Rapid Block\n" : "Selected S- Streaming\n");
+		printf((ch == 'S') ? "This routine is written for use only with Channel A.\n\n" : "This routine uses Channel A, and Channel B too if triggering on a coincidence.\n\n");
 
 		// give the peak info file a unique (time dependent) name so we don't overwrite anything
 		// want this name matching with the error to make checking stuff later easier
@@ -3862,7 +8780,7 @@ int main()
 		std::cin.clear();
 		do
 		{
-			printf("Please enter the number of multi-peak waveforms you'd like to save. (0-%I64d)\n", (std::numeric_limits<int64_t>::max)());
+			printf("Please enter the number of multi-peak waveforms you'd like to save. (0-%" PRId64 ")\n", (std::numeric_limits<int64_t>::max)());
 			printf("Enter -1 if you wish to save every multi-peak waveform the scope records.\n");
 			printf("Number of Waveforms: ");
 
@@ -3872,49 +8790,414 @@ int main()
 		} while (!(g_numwavestosaved >= -1 && g_numwavestosaved <= (std::numeric_limits<int64_t>::max)()) // make sure input falls in an acceptable range
 			|| cinflag); // and there were no errors while taking in input
 
-		printf("Selected number of multi-peak waveforms to save: %I64d\n", g_numwavestosaved);
+		printf("Selected number of multi-peak waveforms to save: %" PRId64 "\n", g_numwavestosaved);
 
 		/*
-		* Ensure the device is still connected and collect some data
+		* Select number of memory segments (waveforms per run) for rapid block mode
 		*/
-		g_qinit = _kbhitinit(); // can't hurt to reset this
-		while (!_kbhitpoll(g_qinit)) // main data collection loop
+		if (ch == 'R')
 		{
-			// make sure the device is still connected
-			if ((status = ps2000aPingUnit(unit.handle)) != PICO_OK)
+			uint32_t maxsegments = 1;
+
+			if ((status = ps2000aGetMaxSegments(units[0].handle, &maxsegments)) != PICO_OK)
+			{
+				picoerrorLog(g_errorfp, status, __LINE__, __func__, "ps2000aGetMaxSegments");
+			}
+
+			std::cin.clear();
+			do
+			{
+				printf("\nPlease enter the number of waveforms to capture per run (1-%u).\n", maxsegments);
+				printf("The scope's memory is split evenly between them, a value of 64 is recommended.\n");
+				printf("Waveforms per Run: ");
+
+				std::cin >> g_numsegments; // take in the user input
+				cinflag = (std::cin.bad() || std::cin.fail()) ? TRUE : FALSE; // check if cin's error flags were set
+				cinReset(); // flush the input buffer for future inputs
+			} while (!(g_numsegments >= 1 && g_numsegments <= maxsegments) // make sure input falls in an acceptable range
+				|| cinflag); // and there were no errors while taking in input
+
+			printf("Selected number of waveforms per run: %u\n", g_numsegments);
+		}
+
+		/*
+		* Select the capture window for the block modes
+		*/
+		if (ch == 'B' || ch == 'R')
+		{
+			char adaptive;
+
+			std::cin.clear();
+			do
+			{
+				printf("\nPlease enter how much of the waveform to capture before the trigger (0-1000000 ns).\n");
+				printf("A value of 200 is recommended.\n");
+				printf("Pre-Trigger Window (ns): ");
+
+				std::cin >> g_pretriggerns; // take in the user input
+				cinflag = (std::cin.bad() || std::cin.fail()) ? TRUE : FALSE; // check if cin's error flags were set
+				cinReset(); // flush the input buffer for future inputs
+			} while (!(g_pretriggerns <= 1000000) // make sure input falls in an acceptable range
+				|| cinflag); // and there were no errors while taking in input
+
+			printf("Selected pre-trigger window: %u ns\n", g_pretriggerns);
+
+			std::cin.clear();
+			do
+			{
+				printf("\nPlease enter how much of the waveform to capture after the trigger (1000-10000000 ns).\n");
+				printf("It should be several decay lifetimes long, a value of 100000 is recommended.\n");
+				printf("Post-Trigger Window (ns): ");
+
+				std::cin >> g_posttriggerns; // take in the user input
+				cinflag = (std::cin.bad() || std::cin.fail()) ? TRUE : FALSE; // check if cin's error flags were set
+				cinReset(); // flush the input buffer for future inputs
+			} while (!(g_posttriggerns >= 1000 && g_posttriggerns <= 10000000) // make sure input falls in an acceptable range
+				|| cinflag); // and there were no errors while taking in input
+
+			printf("Selected post-trigger window: %u ns\n", g_posttriggerns);
+
+			std::cin.clear();
+			do
+			{
+				printf("\nWould you like the post-trigger window to shrink to fit the decay times seen? (Y/N)\n");
+				printf("After %d two-peak events it is cut down to %.2f times the decay time only %.0f%% of them are longer than.\n", ADAPTIVE_MIN_EVENTS, ADAPTIVE_MARGIN, ADAPTIVE_TAIL_FRACTION * 100);
+				printf("N is recommended unless the event rate matters more than the longest decays.\n");
+				printf("Adaptive Window: ");
+
+				std::cin >> adaptive; // take in the user input
+				adaptive = toupper(adaptive);
+				cinflag = (std::cin.bad() || std::cin.fail()) ? TRUE : FALSE; // check if cin's error flags were set
+				cinReset(); // flush the input buffer for future inputs
+			} while (!(adaptive == 'Y' || adaptive == 'N') // make sure input falls in an acceptable range
+				|| cinflag); // and there were no errors while taking in input
+
+			g_adaptivewindow = (adaptive == 'Y') ? TRUE : FALSE;
+			printf(g_adaptivewindow ? "Selected the adaptive window\n" : "Selected the fixed window\n");
+
+			// the other estimates need something before the trigger to work with
+			if (g_pretriggerns > 0)
 			{
-				printf("Issue with USB connection to device!\n");
-				picoerrorLog(g_errorfp, status, __LINE__, __func__, "ps2000aPingUnit");
-				//tGlobalPointersFreePointers(g_pointers);
-				if (g_workBuffer != NULL)
+				char baseline;
+
+				std::cin.clear();
+				do
 				{
-					free(g_workBuffer);
-				}
-				if (g_BufferInfo.driverBuffer != NULL)
+					printf("\nHow would you like the baseline the peaks are measured from to be worked out?\n");
+					printf("F: mean of the whole waveform (the original method, pulled down by the pulses)\n");
+					printf("P: mean of the pre-trigger samples\n");
+					printf("T: trimmed mean of the pre-trigger samples (the highest and lowest %.0f%% are dropped)\n", BASELINE_TRIM_FRACTION * 100);
+					printf("M: median of the pre-trigger samples\n");
+					printf("The pre-trigger ones are averaged over events to follow slow drifts. T is recommended.\n");
+					printf("Baseline: ");
+
+					std::cin >> baseline; // take in the user input
+					baseline = toupper(baseline);
+					cinflag = (std::cin.bad() || std::cin.fail()) ? TRUE : FALSE; // check if cin's error flags were set
+					cinReset(); // flush the input buffer for future inputs
+				} while (!(baseline == 'F' || baseline == 'P' || baseline == 'T' || baseline == 'M') // make sure input falls in an acceptable range
+					|| cinflag); // and there were no errors while taking in input
+
+				g_baselinemode = (baseline == 'P') ? BASELINE_MODE::MEAN : (baseline == 'T') ? BASELINE_MODE::TRIMMED : (baseline == 'M') ? BASELINE_MODE::MEDIAN : BASELINE_MODE::FULL;
+				printf((baseline == 'P') ? "Selected the pre-trigger mean\n" : (baseline == 'T') ? "Selected the pre-trigger trimmed mean\n" :
+					(baseline == 'M') ? "Selected the pre-trigger median\n" : "Selected the whole waveform mean\n");
+			}
+		}
+
+		/*
+		* Select the trigger channels for the block modes
+		*/
+		if ((ch == 'B' || ch == 'R') && g_polarity == POLARITY::POSITIVE)
+		{
+			printf("\nCoincidence mode only looks for downward pulses, so upward ones use the channel A trigger.\n");
+		}
+		else if (ch == 'B' || ch == 'R')
+		{
+			char coincidence;
+
+			std::cin.clear();
+			do
+			{
+				printf("\nWould you like to trigger on a coincidence between channels A and B? (Y/N)\n");
+				printf("With a paddle on each channel, only muons going through both of them trigger the scope, most of the background doesn't.\n");
+				printf("Both channels are read out and searched for peaks, at half the sample rate.\n");
+				printf("N is recommended unless a second paddle is plugged into channel B.\n");
+				printf("Coincidence Trigger: ");
+
+				std::cin >> coincidence; // take in the user input
+				coincidence = toupper(coincidence);
+				cinflag = (std::cin.bad() || std::cin.fail()) ? TRUE : FALSE; // check if cin's error flags were set
+				cinReset(); // flush the input buffer for future inputs
+			} while (!(coincidence == 'Y' || coincidence == 'N') // make sure input falls in an acceptable range
+				|| cinflag); // and there were no errors while taking in input
+
+			g_coincidence = (coincidence == 'Y') ? TRUE : FALSE;
+			printf(g_coincidence ? "Selected the A AND B coincidence trigger\n" : "Selected the channel A trigger\n");
+
+			for (int16_t i = 0; i < g_numunits && g_coincidence; i++)
+			{
+				if ((status = CoincidenceSetup(&units[i])) != PICO_OK)
 				{
-					free(g_BufferInfo.driverBuffer); // free the space allocated for the driver buffer
+					picoerrorLog(g_errorfp, status, __LINE__, __func__, "CoincidenceSetup");
+					for (int16_t j = 0; j < g_numunits; j++)
+					{
+						CloseDevice(&units[j]);
+					}
+					if (g_peakfp != NULL)
+					{
+						fclose(g_peakfp);
+					}
+					if (g_errorfp != NULL)
+					{
+						fclose(g_errorfp);
+					}
+					return -1;
 				}
-				if (g_peakfp != NULL)
+			}
+		}
+
+		/*
+		* Select the readout for block mode
+		*/
+		if (ch == 'B' && g_coincidence)
+		{
+			printf("\nThe two-stage readout only looks at channel A, so coincidence mode uses the full readout.\n");
+		}
+		else if (ch == 'B' && g_polarity == POLARITY::POSITIVE)
+		{
+			printf("\nThe two-stage readout only looks for downward pulses, so upward ones use the full readout.\n");
+		}
+		else if (ch == 'B')
+		{
+			char readout;
+
+			std::cin.clear();
+			do
+			{
+				printf("\nWould you like to use the two-stage readout? (Y/N)\n");
+				printf("It reads a min/max summary of each waveform first, then only the parts that could hold a peak.\n");
+				printf("Y is recommended unless you need every waveform saved.\n");
+				printf("Two-Stage Readout: ");
+
+				std::cin >> readout; // take in the user input
+				readout = toupper(readout);
+				cinflag = (std::cin.bad() || std::cin.fail()) ? TRUE : FALSE; // check if cin's error flags were set
+				cinReset(); // flush the input buffer for future inputs
+			} while (!(readout == 'Y' || readout == 'N') // make sure input falls in an acceptable range
+				|| cinflag); // and there were no errors while taking in input
+
+			g_twostagereadout = (readout == 'Y') ? TRUE : FALSE;
+			printf(g_twostagereadout ? "Selected the two-stage readout\n" : "Selected the full readout\n");
+		}
+
+		/*
+		* Select the peak detector for the full readout
+		*/
+		if ((ch == 'B' || ch == 'R') && !g_coincidence)
+		{
+			char detector;
+
+			std::cin.clear();
+			do
+			{
+				printf("\nWhich peak detector would you like to use on the waveforms?\n");
+				printf("M - 5-point moving average and threshold, the original detector\n");
+				printf("D - turning points of the moving average, also finds decays on the tail of the muon pulse\n");
+				printf("F - matched filter, correlates the waveform with the pulse shape to pull small pulses out of the noise\n");
+				printf("A - benchmark all three on simulated waveforms and use the fastest that finds %.0f%% of the decays\n", 100 * DETECTOR_MIN_EFFICIENCY);
+				printf(g_twostagereadout ? "The two-stage readout only uses it on waveforms it reads in full.\n" : "");
+				printf("M is recommended.\n");
+				printf("Peak Detector: ");
+
+				std::cin >> detector; // take in the user input
+				detector = toupper(detector);
+				cinflag = (std::cin.bad() || std::cin.fail()) ? TRUE : FALSE; // check if cin's error flags were set
+				cinReset(); // flush the input buffer for future inputs
+			} while (!(detector == 'M' || detector == 'D' || detector == 'F' || detector == 'A') // make sure input falls in an acceptable range
+				|| cinflag); // and there were no errors while taking in input
+
+			g_detectorkind = (detector == 'D') ? DETECTOR_KIND::DERIVATIVE : (detector == 'F') ? DETECTOR_KIND::MATCHED_FILTER :
+				(detector == 'A') ? DETECTOR_KIND::AUTO : DETECTOR_KIND::MOVING_AVERAGE;
+			printf((detector == 'D') ? "Selected the derivative detector\n" : (detector == 'F') ? "Selected the matched filter detector\n" :
+				(detector == 'A') ? "Selected the benchmarked detector\n" : "Selected the moving average detector\n");
+		}
+
+		/*
+		* Select the sample interval and event window for streaming mode
+		*/
+		if (ch == 'S')
+		{
+			std::cin.clear();
+			do
+			{
+				printf("\nPlease enter the sample interval for streaming (16-1000000 ns).\n");
+				printf("Shorter intervals resolve the peaks better but need more USB bandwidth, a value of 32 is recommended.\n");
+				printf("Sample Interval (ns): ");
+
+				std::cin >> g_streaminterval; // take in the user input
+				cinflag = (std::cin.bad() || std::cin.fail()) ? TRUE : FALSE; // check if cin's error flags were set
+				cinReset(); // flush the input buffer for future inputs
+			} while (!(g_streaminterval >= 16 && g_streaminterval <= 1000000) // make sure input falls in an acceptable range
+				|| cinflag); // and there were no errors while taking in input
+
+			printf("Selected sample interval: %u ns\n", g_streaminterval);
+
+			std::cin.clear();
+			do
+			{
+				printf("\nPlease enter how long after the first peak of an event to keep looking for more peaks (1000-10000000 ns).\n");
+				printf("A value of 100000 is recommended (the length of a block mode waveform).\n");
+				printf("Event Window (ns): ");
+
+				std::cin >> g_eventwindow; // take in the user input
+				cinflag = (std::cin.bad() || std::cin.fail()) ? TRUE : FALSE; // check if cin's error flags were set
+				cinReset(); // flush the input buffer for future inputs
+			} while (!(g_eventwindow >= 1000 && g_eventwindow <= 10000000) // make sure input falls in an acceptable range
+				|| cinflag); // and there were no errors while taking in input
+
+			printf("Selected event window: %u ns\n", g_eventwindow);
+		}
+
+		/*
+		* Select whether the acquisition threads get cores to themselves at real-time priority
+		*/
+		{
+			char realtime;
+			uint32_t cores = ThreadCoresInit(&g_cores); // before any of the collection threads narrow their masks down
+
+			std::cin.clear();
+			do
+			{
+				printf("\nWould you like to pin each scope's acquisition thread to a core of its own and run it at real-time priority? (Y/N)\n");
+				printf("It keeps disk writes, console output and the rest of the system from delaying the re-arm. Works best with those cores\n");
+				printf("isolated (isolcpus= on Linux) and needs root or CAP_SYS_NICE for the real-time priority.\n");
+				printf("N is recommended unless triggers are being lost to stalls.\n");
+				printf("Real-Time Acquisition: ");
+
+				std::cin >> realtime; // take in the user input
+				realtime = toupper(realtime);
+				cinflag = (std::cin.bad() || std::cin.fail()) ? TRUE : FALSE; // check if cin's error flags were set
+				cinReset(); // flush the input buffer for future inputs
+			} while (!(realtime == 'Y' || realtime == 'N') // make sure input falls in an acceptable range
+				|| cinflag); // and there were no errors while taking in input
+
+			g_realtime = (realtime == 'Y') ? TRUE : FALSE;
+			if (g_realtime && cores <= (uint32_t)g_numunits)
+			{
+				printf("Only %u allowed core(s) for %d scope(s), leaving the threads where they are\n", cores, g_numunits);
+				g_realtime = FALSE;
+			}
+			else if (g_realtime)
+			{
+				printf("Acquisition at real-time priority on core(s)");
+				for (uint32_t i = cores - g_numunits; i < cores; i++)
 				{
-					fclose(g_peakfp); // close the peak info file
+					printf(" %u", g_cores.cores[i]);
 				}
-				if (g_errorfp != NULL)
+				printf(", everything else on the other %u allowed core(s)\n", cores - g_numunits);
+#ifndef _WIN32
+				// keep the pages the acquisition touches from being swapped out under it
+				if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
 				{
-					fclose(g_errorfp); // close the error log file
+					int error = errno; // before the printf can change it
+
+					printf("%s\n[%d] %s::%s ------ THREAD PLACEMENT ERROR (non-pico): %d\n\n", timeInfotoString().c_str(), __LINE__, __func__, "mlockall", error);
+					if (g_errorfp != NULL)
+					{
+						fprintf(g_errorfp, "%s\n[%d] %s::%s ------ THREAD PLACEMENT ERROR (non-pico): %d\n\n", timeInfotoString().c_str(), __LINE__, __func__, "mlockall", error);
+					}
 				}
-				qinit = _kbhitinit();
-				printf("Press the \'Q\' key to exit the program.\n");
-				while (!_kbhitpoll(qinit));
-				return -1;
+#endif
+			}
+			else
+			{
+				printf("Selected default thread placement\n");
+			}
+		}
+
+		/*
+		* Ensure the devices are still connected and collect some data
+		*/
+		CollectionIntro(&units[0], ch);
+		g_qinit = _kbhitinit(); // can't hurt to reset this
+		g_collectionstart = std::chrono::steady_clock::now();
+		WatchdogStart(&g_watchdog, units, g_numunits, g_qinit); // keeps an eye on the devices and the 'Q' key from here on
+		for (int16_t i = 0; i < g_numunits; i++)
+		{
+			// each unit gets its own data collection loop, with its own buffers
+			g_BufferInfo[i].thread = std::thread(AcquisitionThread, &g_BufferInfo[i], ch);
+		}
+		for (int16_t i = 0; i < g_numunits; i++)
+		{
+			g_BufferInfo[i].thread.join();
+		}
+
+		// the watchdog already logged the failed ping if that's what stopped the loop
+		if (WatchdogStop(&g_watchdog) != PICO_OK)
+		{
+			for (int16_t i = 0; i < g_numunits; i++)
+			{
+				AnalysisPipelineStop(&g_BufferInfo[i].pipeline); // done with the buffers once whatever's queued up has been analysed
+				StreamingStop(&g_BufferInfo[i]);
+				BufferInfoFree(&g_BufferInfo[i]);
+			}
+			//tGlobalPointersFreePointers(g_pointers);
+			if (g_peakfp != NULL)
+			{
+				fclose(g_peakfp); // close the peak info file
+			}
+			if (g_errorfp != NULL)
+			{
+				fclose(g_errorfp); // close the error log file
 			}
+			qinit = _kbhitinit();
+			printf("Press the \'Q\' key to exit the program.\n");
+			while (!_kbhitpoll(qinit));
+			return -1;
+		}
+
+		for (int16_t i = 0; i < g_numunits; i++)
+		{
+			AnalysisPipelineStop(&g_BufferInfo[i].pipeline); // let the analysis threads catch up before the summary and cleanup
+			StreamingStop(&g_BufferInfo[i]);
+			totalSamples += g_BufferInfo[i].stream.totalSamples;
+		}
+
+		// throughput summary, mostly useful for benchmarking against the simulated device
+		collectionseconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - g_collectionstart).count();
+		printf("\nCollected %" PRIu64 " waveforms in %.2f s (%.1f waveforms/s)\n", g_numwaveforms.load(), collectionseconds,
+			(collectionseconds > 0.0) ? g_numwaveforms.load() / collectionseconds : 0.0);
+		if (ch == 'B' || ch == 'R')
+		{
+			uint64_t numtriggers = 0;
+			uint64_t numnarrowtriggers = 0;
 
-			// call the data collection routine
-			// if it returns an error we can just run again for another try-> don't return the error code, just log it
-			if ((status = CollectBlockTriggered(&unit)) != PICO_OK)
+			for (int16_t i = 0; i < g_numunits; i++)
+			{
+				numtriggers += g_BufferInfo[i].numtriggers;
+				numnarrowtriggers += g_BufferInfo[i].numnarrowtriggers;
+			}
+			// the scope doesn't say how many triggers the qualifier turned down, only how many it let through
+			printf("%" PRIu64 " of the %" PRIu64 " waveforms read out in full had a trigger pulse narrower than %u ns (%s)\n", numnarrowtriggers, numtriggers,
+				g_pwqns ? g_pwqns : PWQ_REFERENCE_NS, g_pwqns ? "let through by the pulse width qualifier" : "transfers the pulse width qualifier would have saved");
+			TimingSummary(&g_timing, g_numwaveforms.load(), g_numunits);
+			printf((g_bufferpool.misses.load() > 0) ? "The buffer pool ran dry %" PRIu64 " times, consider raising POOL_BLOCKS\n" : "", g_bufferpool.misses.load());
+			for (int16_t i = 0; i < g_numunits; i++)
 			{
-				picoerrorLog(g_errorfp, status, __LINE__, __func__, "CollectBlockTriggered");
+				CAPTURE_RING* captures = &g_BufferInfo[i].captures;
+
+				printf((captures->dropped.load() + captures->stale.load() > 0) ? "Unit %d: %" PRIu64 " captures dropped (capture ring full), %" PRIu64 " came in after their run was given up on\n" : "",
+					i, captures->dropped.load(), captures->stale.load());
 			}
 		}
+		if (ch == 'S')
+		{
+			// live time is however much signal made it through, anything the driver had to drop is dead time
+			// (all the units stream at the same interval, so the live fraction is over all of them)
+			double liveseconds = totalSamples * (double)g_BufferInfo[0].stream.sampleInterval * 1e-9;
+			printf("Streamed %" PRIu64 " samples, %.2f s of signal (%.1f%% live)\n", totalSamples, liveseconds,
+				(collectionseconds > 0.0) ? 100.0 * liveseconds / (collectionseconds * g_numunits) : 0.0);
+		}
 	}
 	break;
 
@@ -3931,16 +9214,15 @@ int main()
 	break;
 	}
 
-	CloseDevice(&unit); // close the device now that we're done
-
-	//tGlobalPointersFreePointers(g_pointers); // free the pointers held in g_pointers as well as the struct itself
-	if (g_BufferInfo.driverBuffer != NULL)
+	for (int16_t i = 0; i < g_numunits; i++)
 	{
-		free(g_BufferInfo.driverBuffer); // free the space allocated for the driver buffer
+		CloseDevice(&units[i]); // close the devices now that we're done
 	}
-	if (g_workBuffer != NULL)
+
+	//tGlobalPointersFreePointers(g_pointers); // free the pointers held in g_pointers as well as the struct itself
+	for (int16_t i = 0; i < g_numunits; i++)
 	{
-		free(g_workBuffer);
+		BufferInfoFree(&g_BufferInfo[i]);
 	}
 	if (g_peakfp != NULL)
 	{